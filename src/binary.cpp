@@ -1,7 +1,19 @@
-#include <sstream>
 #include <iostream>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
 #include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
 
 #include "clickhouse/columns/date.h"
 #include "clickhouse/columns/ip4.h"
@@ -9,6 +21,7 @@
 #include "clickhouse/columns/nullable.h"
 #include "clickhouse/columns/factory.h"
 #include <clickhouse/client.h>
+#include <clickhouse/exceptions.h>
 #include <clickhouse/query.h>
 #include <clickhouse/types/types.h>
 
@@ -35,6 +48,7 @@ extern "C" {
 #include "utils/timestamp.h"
 #include "utils/uuid.h"
 #include "binary.hh"
+#include "decimal.h"
 #include "internal.h"
 
 using namespace clickhouse;
@@ -118,7 +132,24 @@ ch_binary_connection_t * ch_binary_connect(ch_connection_details * details, char
 	try
 	{
 		options = new ClientOptions();
-		options->SetPingBeforeQuery(true);
+
+		/*
+		 * Without the ping a query may find the connection gone, in which
+		 * case it reconnects and runs again, see stream_reader().
+		 */
+		options->SetPingBeforeQuery(details->ping);
+		if (details->compression && strcmp(details->compression, "lz4") == 0)
+			options->SetCompressionMethod(CompressionMethod::LZ4);
+		else if (details->compression && strcmp(details->compression, "zstd") == 0)
+			options->SetCompressionMethod(CompressionMethod::ZSTD);
+		if (details->keepalive)
+			options->TcpKeepAlive(true);
+		if (details->connect_timeout)
+			options->SetConnectionConnectTimeout(std::chrono::seconds(details->connect_timeout));
+		if (details->send_timeout)
+			options->SetConnectionSendTimeout(std::chrono::seconds(details->send_timeout));
+		if (details->receive_timeout)
+			options->SetConnectionRecvTimeout(std::chrono::seconds(details->receive_timeout));
 
 		if (details->host) {
 			options->SetHost(std::string(details->host));
@@ -192,6 +223,27 @@ static QuerySettings ch_binary_settings(const ch_query *query)
    return res;
 }
 
+/*
+ * Query parameters named p1, p2, etc., with std::nullopt for NULL.
+ */
+typedef std::vector<std::pair<std::string, std::optional<std::string>>> ch_binary_params;
+
+/*
+ * Converts query->param_values to ch_binary_params.
+ */
+static ch_binary_params ch_binary_query_params(const ch_query *query)
+{
+	auto res = ch_binary_params{};
+	for (int i = 0; i < query->num_params; i++)
+	{
+		const char * value = query->param_values[i];
+		res.emplace_back("p" + std::to_string(i + 1),
+						 value ? std::optional<std::string>(value) : std::nullopt);
+	}
+
+	return res;
+}
+
 static void set_state_error(ch_binary_read_state_t * state, const char * str)
 {
 	assert(state->error == NULL);
@@ -199,66 +251,453 @@ static void set_state_error(ch_binary_read_state_t * state, const char * str)
 	strcpy(state->error, str);
 }
 
-ch_binary_response_t * ch_binary_simple_query(
-	ch_binary_connection_t * conn, const ch_query * query, bool (*check_cancel)(void))
+/*
+ * A column of the current block decoded into Datums all at once, see
+ * decode_column().
+ */
+struct ch_binary_column_batch
 {
-	Client * client = (Client *)conn->client;
-	ch_binary_response_t * resp;
-	std::vector<std::vector<clickhouse::ColumnRef>> * values;
+	bool decoded = false;
+	Oid type = InvalidOid;
+	std::vector<Datum> values;
+	std::vector<uint8_t> nulls;
+	std::vector<pg_uuid_t> uuids;	/* storage for UUID values */
+};
+
+/*
+ * A SELECT result being streamed from the server. A reader thread runs
+ * Client::Select() and queues blocks as they arrive, while the backend
+ * consumes them through ch_binary_read_row(). The reader waits once
+ * max_blocks blocks are queued (zero means no limit), so that a scan holds a
+ * bounded number of blocks in memory no matter how large the result is.
+ *
+ * The reader thread never calls into Postgres. Everything below the mutex is
+ * shared between the threads; the current block belongs to the backend.
+ *
+ * The reader also writes a byte to the notify pipe whenever it makes
+ * progress, so that the backend can wait for the stream together with other
+ * sockets, see ch_binary_response_socket().
+ */
+struct ch_binary_stream
+{
+	std::mutex lock;
+	std::condition_variable cond;
+	std::deque<std::vector<clickhouse::ColumnRef>> blocks;
+	size_t max_blocks;
+	size_t columns_count = 0;
+	bool header = false;	/* columns_count is known */
+	bool finished = false;	/* the reader thread is done */
+	bool canceled = false;	/* the backend wants no more blocks */
+	bool receiving = false;	/* the server has the query, see stream_cancel() */
+	bool cancel_sent = false;	/* the server was asked to cancel the query */
+	std::string error;
+	bool unsent = false;	/* the error came before the query was sent */
+
+	std::thread reader;
+	ch_binary_connection_t * conn;
+	bool (*check_cancel)(void);
+	std::vector<clickhouse::ColumnRef> current;
+	std::vector<ch_binary_column_batch> batches;	/* decoded columns of current */
+	int notify[2] = {-1, -1};	/* read and write ends of the notify pipe */
+
+	ch_binary_stream(ch_binary_connection_t * c, size_t max, bool (*cancel)(void))
+		: max_blocks(max), conn(c), check_cancel(cancel)
+	{
+		/* without the pipe the backend just waits on the condition */
+		if (pipe(notify) == 0)
+		{
+			for (int fd : notify)
+			{
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+				fcntl(fd, F_SETFD, FD_CLOEXEC);
+			}
+		}
+		else
+			notify[0] = notify[1] = -1;
+	}
+
+	~ch_binary_stream()
+	{
+		for (int fd : notify)
+			if (fd >= 0)
+				close(fd);
+	}
+
+	/* Wakes up the backend, the caller holds the lock. */
+	void wakeup()
+	{
+		cond.notify_all();
+		if (notify[1] >= 0)
+		{
+			/* a full pipe is readable already */
+			ssize_t rc = write(notify[1], "", 1);
+			(void) rc;
+		}
+	}
+};
 
+/* How long the backend waits for the reader before checking for cancel. */
+#define STREAM_POLL_INTERVAL std::chrono::milliseconds(100)
+
+/*
+ * Discards the rest of the result of a stream; the caller holds the lock.
+ * Once the server has the query, ask it to cancel the query too, so that a
+ * reader waiting for blocks that are slow to come, or never come, returns
+ * without them. By then the reader only reads from the socket, and
+ * Client::Cancel() only writes to it. A stream canceled before that is
+ * stopped by the reader, see stream_discard().
+ */
+static void stream_cancel(ch_binary_stream * stream)
+{
+	stream->canceled = true;
+	stream->cond.notify_all();
+
+	if (stream->receiving && !stream->cancel_sent && stream->conn)
+	{
+		stream->cancel_sent = true;
+		try
+		{
+			((Client *)stream->conn->client)->Cancel();
+		}
+		catch (const std::exception &)
+		{
+			/* the reader fails on the broken connection as well */
+		}
+	}
+}
+
+/*
+ * Returns what the block callback of the reader returns for a canceled
+ * stream, with the lock held: false for clickhouse-cpp to ask the server to
+ * cancel the query, unless stream_cancel() has already, and true to read on
+ * to the end of the result, dropping the blocks.
+ */
+static bool stream_discard(ch_binary_stream * stream)
+{
+	if (stream->cancel_sent)
+		return true;
+
+	stream->cancel_sent = true;
+	return false;
+}
+
+/*
+ * Resets the connection after a failed query, returning false if that
+ * failed too.
+ */
+static bool reset_connection(Client * client)
+{
 	try
 	{
-		resp = new ch_binary_response_t();
-		values = new std::vector<std::vector<clickhouse::ColumnRef>>();
-		client->Select(
-			clickhouse::Query(query->sql).SetQuerySettings(
-				ch_binary_settings(query)
-			).OnDataCancelable([&resp, &values, &check_cancel](const Block & block) {
-				if (check_cancel && check_cancel())
-				{
-					set_resp_error(resp, "query was canceled");
-					return false;
-				}
+		client->ResetConnection();
+		return true;
+	}
+	catch (const std::exception &)
+	{
+		/* the next query will report the broken connection */
+		return false;
+	}
+}
 
-				/* some empty block */
-				if (block.GetColumnCount() == 0)
-					return true;
+/*
+ * Whether the query failed with e before the server got it, so that it is
+ * safe to send again: only a failure to connect or to send the query, which
+ * is how a stale connection fails. A timeout never qualifies, since the
+ * server may still be working on the query.
+ */
+static bool query_unsent(const std::exception & e)
+{
+	auto se = dynamic_cast<const std::system_error *>(&e);
 
-				auto vec = std::vector<clickhouse::ColumnRef>();
+	if (se == NULL)
+		return false;
 
-				if (resp->columns_count && block.GetColumnCount() != resp->columns_count)
-				{
-					set_resp_error(resp, "columns mismatch in blocks");
-					return false;
-				}
+	switch (se->code().value())
+	{
+		case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+		case EWOULDBLOCK:
+#endif
+		case ETIMEDOUT:
+		case EINPROGRESS:
+			return false;
+	}
+
+	/* the messages of the socket errors of clickhouse-cpp */
+	return strncmp(se->what(), "fail to send", 12) == 0 ||
+		strncmp(se->what(), "fail to connect", 15) == 0;
+}
+
+/*
+ * Whether a query that failed with e may run again on a fresh connection:
+ * only if it was never sent, nothing was received, and the connection skips
+ * the ping before each query.
+ */
+static bool retry_query(ch_binary_connection_t * conn, const std::exception & e,
+						bool received)
+{
+	if (received || ((ClientOptions *)conn->options)->ping_before_query)
+		return false;
 
-				resp->columns_count = block.GetColumnCount();
-				resp->blocks_count++;
+	if (!query_unsent(e))
+		return false;
+
+	return reset_connection((Client *)conn->client);
+}
+
+static void stream_reader(Client * client, std::string sql, QuerySettings settings,
+						  ch_binary_params params, ch_binary_stream * stream)
+{
+	bool retried = false;
 
-				for (size_t i = 0; i < resp->columns_count; ++i)
-					vec.push_back(block[i]);
+retry:
+	try
+	{
+		clickhouse::Query query(sql);
+
+		query.SetQuerySettings(settings);
+		for (const auto & param : params)
+			query.SetParam(param.first, param.second);
 
-				values->push_back(std::move(vec));
-				return true;
-			})
-		);
+		client->Select(
+			query.OnDataCancelable(
+				[stream](const Block & block) {
+					std::unique_lock<std::mutex> lock(stream->lock);
+
+					stream->receiving = true;
+					if (stream->canceled)
+						return stream_discard(stream);
+
+					/* some empty block */
+					if (block.GetColumnCount() == 0)
+						return true;
+
+					if (stream->header && block.GetColumnCount() != stream->columns_count)
+					{
+						stream->error = "columns mismatch in blocks";
+						return false;
+					}
+
+					if (!stream->header)
+					{
+						stream->columns_count = block.GetColumnCount();
+						stream->header = true;
+						stream->wakeup();
+					}
+
+					/* the header block has no rows */
+					if (block.GetRowCount() == 0)
+						return true;
+
+					/* wait for the backend to catch up */
+					while (stream->max_blocks && !stream->canceled
+						   && stream->blocks.size() >= stream->max_blocks)
+						stream->cond.wait(lock);
+
+					if (stream->canceled)
+						return stream_discard(stream);
+
+					auto vec = std::vector<clickhouse::ColumnRef>();
+					for (size_t i = 0; i < stream->columns_count; ++i)
+						vec.push_back(block[i]);
+
+					stream->blocks.push_back(std::move(vec));
+					stream->wakeup();
+					return true;
+				}));
 
-		resp->values = (void *)values;
+		std::lock_guard<std::mutex> lock(stream->lock);
+		stream->receiving = false;
 	}
 	catch (const std::exception & e)
 	{
-        client->ResetConnection();
+		bool received;
 
-		values->clear();
+		{
+			std::lock_guard<std::mutex> lock(stream->lock);
+			stream->receiving = false;
+			received = stream->header || stream->canceled || !stream->error.empty();
+		}
+
+		if (!retried && retry_query(stream->conn, e, received))
+		{
+			retried = true;
+			goto retry;
+		}
+
+		std::lock_guard<std::mutex> lock(stream->lock);
+		if (stream->error.empty())
+		{
+			stream->error = e.what();
+			stream->unsent = !received && query_unsent(e);
+		}
+
+		reset_connection(client);
+	}
+
+	std::lock_guard<std::mutex> lock(stream->lock);
+	stream->finished = true;
+	stream->wakeup();
+}
+
+/*
+ * Stops the reader thread of a stream. With cancel the remaining result is
+ * discarded, otherwise the whole of it is buffered so that the connection can
+ * run another query while the stream is still being read.
+ */
+static void stream_stop(ch_binary_stream * stream, bool cancel)
+{
+	{
+		std::lock_guard<std::mutex> lock(stream->lock);
+		if (cancel)
+			stream_cancel(stream);
+		else
+		{
+			stream->max_blocks = 0;
+			stream->cond.notify_all();
+		}
+	}
+
+	if (stream->reader.joinable())
+		stream->reader.join();
+
+	if (stream->conn && stream->conn->stream == stream)
+		stream->conn->stream = NULL;
+	stream->conn = NULL;
+}
+
+/*
+ * Buffers the rest of the result currently streaming over the connection, if
+ * any, so that the connection is free for another query.
+ */
+static void finish_active_stream(ch_binary_connection_t * conn)
+{
+	if (conn->stream)
+		stream_stop((ch_binary_stream *)conn->stream, false);
+}
+
+/*
+ * Sends the query and returns while the reader thread waits for the result.
+ * Call ch_binary_response_await() before reading the response.
+ */
+ch_binary_response_t * ch_binary_start_query(
+	ch_binary_connection_t * conn, const ch_query * query, size_t max_blocks,
+	bool (*check_cancel)(void))
+{
+	Client * client = (Client *)conn->client;
+	ch_binary_response_t * resp;
+	ch_binary_stream * stream;
+
+	resp = new ch_binary_response_t();
+	try
+	{
+		finish_active_stream(conn);
+
+		stream = new ch_binary_stream(conn, max_blocks, check_cancel);
+		resp->values = (void *)stream;
+
+		/*
+		 * Block all signals in the reader thread so that the Postgres signal
+		 * handlers only ever run in the backend thread.
+		 */
+		sigset_t	sigs, oldsigs;
+		sigfillset(&sigs);
+		pthread_sigmask(SIG_SETMASK, &sigs, &oldsigs);
+		try
+		{
+			stream->reader = std::thread(stream_reader, client, std::string(query->sql),
+										 ch_binary_settings(query),
+										 ch_binary_query_params(query), stream);
+		}
+		catch (...)
+		{
+			pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+			throw;
+		}
+		pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+		conn->stream = stream;
+	}
+	catch (const std::exception & e)
+	{
 		set_resp_error(resp, e.what());
-		delete values;
-		values = NULL;
 	}
 
 	resp->success = (resp->error == NULL);
 	return resp;
 }
 
+/*
+ * Waits for the header of the result of a started query so that errors
+ * surface right away.
+ */
+void ch_binary_response_await(ch_binary_response_t * resp)
+{
+	auto stream = (ch_binary_stream *)resp->values;
+
+	if (!resp->success || stream == NULL)
+		return;
+
+	std::unique_lock<std::mutex> lock(stream->lock);
+	while (!stream->header && !stream->finished)
+	{
+		stream->cond.wait_for(lock, STREAM_POLL_INTERVAL);
+		if (stream->check_cancel && stream->check_cancel())
+		{
+			stream_cancel(stream);
+			set_resp_error(resp, "query was canceled");
+			break;
+		}
+	}
+
+	if (!stream->error.empty())
+	{
+		set_resp_error(resp, stream->error.c_str());
+		resp->unsent = stream->unsent;
+	}
+	resp->columns_count = stream->columns_count;
+	resp->success = (resp->error == NULL);
+}
+
+ch_binary_response_t * ch_binary_simple_query(
+	ch_binary_connection_t * conn, const ch_query * query, size_t max_blocks,
+	bool (*check_cancel)(void))
+{
+	ch_binary_response_t * resp = ch_binary_start_query(conn, query, max_blocks,
+														check_cancel);
+
+	ch_binary_response_await(resp);
+	return resp;
+}
+
+/*
+ * Returns a file descriptor that becomes readable once the reader thread has
+ * made progress, or -1 if the next row (or the end of the result) can be read
+ * without waiting. Pass the read state once the response has been awaited,
+ * and NULL before.
+ */
+int ch_binary_response_socket(ch_binary_response_t * resp, ch_binary_read_state_t * state)
+{
+	auto stream = (ch_binary_stream *)resp->values;
+	char buf[64];
+
+	if (!resp->success || stream == NULL || stream->notify[0] < 0)
+		return -1;
+
+	if (state && (state->done || state->error
+				  || (!stream->current.empty() && state->row < stream->current[0]->Size())))
+		return -1;
+
+	/* Drain the pipe before checking, so no wakeup can get lost. */
+	while (read(stream->notify[0], buf, sizeof(buf)) > 0)
+		;
+
+	std::lock_guard<std::mutex> lock(stream->lock);
+	if (stream->finished || (state ? !stream->blocks.empty() : stream->header))
+		return -1;
+
+	return stream->notify[0];
+}
+
 static Oid get_corr_postgres_type(const TypeRef & type)
 {
 	switch (type->GetCode())
@@ -345,7 +784,17 @@ void ch_binary_prepare_insert(void * conn, const ch_query * query, ch_binary_ins
 	Client * client = (Client *)((ch_binary_connection_t *)conn)->client;
 	try
 	{
-		block = new Block(client->BeginInsert(std::string(query->sql) + " VALUES"));
+		finish_active_stream((ch_binary_connection_t *)conn);
+		try
+		{
+			block = new Block(client->BeginInsert(std::string(query->sql) + " VALUES"));
+		}
+		catch (const std::exception & e)
+		{
+			if (!retry_query((ch_binary_connection_t *)conn, e, false))
+				throw;
+			block = new Block(client->BeginInsert(std::string(query->sql) + " VALUES"));
+		}
 		/* XXX https://github.com/ClickHouse/clickhouse-cpp/pull/453/
 		block = new Block(client->BeginInsert(
 			clickhouse::Query(std::string(query->sql)+ " VALUES").SetQuerySettings(
@@ -484,20 +933,35 @@ static void column_append(clickhouse::ColumnRef col, Datum val, Oid valtype, boo
 			break;
 		}
 		case NUMERICOID: {
-			/* Convert numeric to string and let ColumnDecimal parse it. */
-			char *s = DatumGetCString(DirectFunctionCall1(numeric_out, val));
 			switch (col->Type()->GetCode())
 			{
 				case Type::Code::Decimal128:
 				case Type::Code::Decimal64:
 				case Type::Code::Decimal32:
 				case Type::Code::Decimal:
-					col->As<ColumnDecimal>()->Append(std::string(s));
+				{
+					/*
+					 * Scale the numeric to an integer as wide as the precision
+					 * of the column allows, and sign-extend it to 128 bits.
+					 */
+					auto decCol = col->As<ColumnDecimal>();
+					size_t precision = decCol->GetPrecision();
+					int nlimbs = precision <= 9 ? 1 : precision <= 18 ? 2 : 4;
+					uint32 limbs[4];
+
+					ch_decimal_from_numeric(DatumGetNumeric(val), precision,
+											decCol->GetScale(), limbs, nlimbs);
+					for (int i = nlimbs; i < 4; i++)
+						limbs[i] = (limbs[nlimbs - 1] & 0x80000000) ? 0xFFFFFFFF : 0;
+
+					decCol->Append(absl::MakeInt128(
+						static_cast<int64_t>((static_cast<uint64_t>(limbs[3]) << 32) | limbs[2]),
+						(static_cast<uint64_t>(limbs[1]) << 32) | limbs[0]));
 					break;
+				}
 				default:
 					THROW_UNEXPECTED_COLUMN("NUMERIC", col);
 			}
-			pfree(s);
 			break;
 		}
 		case TEXTOID: {
@@ -590,18 +1054,20 @@ static void column_append(clickhouse::ColumnRef col, Datum val, Oid valtype, boo
 	}
 }
 
-void ch_binary_column_append_data(ch_binary_insert_state * state, size_t colidx)
+void ch_binary_column_append_data(ch_binary_insert_state * state, size_t colidx,
+								  size_t nrows)
 {
 	try
 	{
 		auto block = (Block *)state->insert_block;
 		auto col = (*block)[colidx];
 
-		Datum val = state->values[colidx];
+		Datum * values = &state->values[colidx * state->batch_size];
+		bool * nulls = &state->nulls[colidx * state->batch_size];
 		Oid valtype = TupleDescAttr(state->outdesc, colidx)->atttypid;
-		bool isnull = state->nulls[colidx];
 
-		column_append(col, val, valtype, isnull);
+		for (size_t i = 0; i < nrows; i++)
+			column_append(col, values[i], valtype, nulls[i]);
 	}
 	catch (const std::exception & e)
 	{
@@ -623,12 +1089,15 @@ void ch_binary_insert_columns(ch_binary_insert_state * state)
 	{
 		client->ResetConnection();
 		delete block;
+		state->insert_block = NULL;
 		elog(ERROR, "pg_clickhouse: could not insert columns - %s", e.what());
 	}
 }
 
 void ch_binary_close(ch_binary_connection_t * conn)
 {
+	if (conn->stream)
+		stream_stop((ch_binary_stream *)conn->stream, true);
 	delete (Client *)conn->client;
 	delete (ClientOptions *)conn->options;
 }
@@ -637,9 +1106,9 @@ void ch_binary_response_free(ch_binary_response_t * resp)
 {
 	if (resp->values)
 	{
-		auto values = (std::vector<std::vector<clickhouse::ColumnRef>> *)resp->values;
-		values->clear();
-		delete values;
+		auto stream = (ch_binary_stream *)resp->values;
+		stream_stop(stream, true);
+		delete stream;
 	}
 
 	if (resp->error)
@@ -670,9 +1139,7 @@ void ch_binary_read_state_init(ch_binary_read_state_t * state, ch_binary_respons
 	try
 	{
 		assert(resp->values);
-		auto & values = *((std::vector<std::vector<clickhouse::ColumnRef>> *)resp->values);
-
-		if (resp->columns_count && values.size() > 0)
+		if (resp->columns_count)
 		{
 			state->coltypes = new Oid[resp->columns_count];
 			state->values = new Datum[resp->columns_count];
@@ -714,7 +1181,7 @@ nested_col:
 		}
 		break;
 		case Type::Code::UInt16: {
-			int16 val = col->As<ColumnUInt16>()->At(row);
+			int32 val = col->As<ColumnUInt16>()->At(row);
 			ret = (Datum)val;
 			*valtype = INT4OID;
 		}
@@ -779,51 +1246,16 @@ nested_col:
 		case Type::Code::Decimal:
 		{
 			auto decCol = col->As<ColumnDecimal>();
-			auto val = decCol->At(row);
-
-			/* Convert the Int128 to a string. */
-			std::stringstream ss;
-			ss << val;
-			std::string str = ss.str();
-
-			/* Start a destination string. */
-			std::stringstream res;
-			auto scale = decCol->GetScale();
-
-			/* Output a dash for negative values */
-			if (val < 0)
-			{
-				res << '-';
-				str.erase(0, 1);
-			}
-
-			if (scale == 0)
-			{
-				/* No decimal point, just output the entire value. */
-				res << str;
-			}
-			else if (str.length() <= scale)
-			{
-				/* Append the entire value prepended with zeros after the decimal. */
-				res << "0." << std::string(scale-str.length(), '0') << str;
-			}
-			else
-			{
-				/* There are digits before the decimal. */
-				auto decAt = str.length() - scale;
-				res << str.substr(0, decAt);
-
-				/* Append any digits after the decimal. */
-				if (decAt < str.length())
-				{
-					res << '.' << str.substr(decAt);
-				}
-			}
-
-			ret = DirectFunctionCall3(numeric_in,
-										CStringGetDatum(res.str().c_str()),
-										ObjectIdGetDatum(0),
-										Int32GetDatum(-1));
+			Int128 val = decCol->At(row);
+			uint64_t lo = absl::Int128Low64(val);
+			uint64_t hi = static_cast<uint64_t>(absl::Int128High64(val));
+			uint32 limbs[4] = {
+				static_cast<uint32>(lo), static_cast<uint32>(lo >> 32),
+				static_cast<uint32>(hi), static_cast<uint32>(hi >> 32),
+			};
+
+			/* Build the numeric from the scaled integer directly. */
+			ret = ch_decimal_to_numeric(limbs, 4, true, decCol->GetScale());
 			*valtype = NUMERICOID;
 		}
 		break;
@@ -1007,52 +1439,281 @@ nested_col:
 	return ret;
 }
 
-bool ch_binary_read_row(ch_binary_read_state_t * state)
+/*
+ * Column-at-a-time decoding. Columns of fixed-width types are converted into
+ * a Datum array once per block by type-specialized kernels, which avoids the
+ * per-value type dispatch and column casts of make_datum(). By-reference
+ * values (UUIDs) point into storage owned by the batch, which stays valid
+ * until the scan moves on to the next block. Other types still go through
+ * make_datum() row by row, because their values must be allocated in the
+ * per-tuple memory context.
+ */
+template <typename ColumnT, typename Convert>
+static void decode_values(const ColumnRef & col, size_t rows,
+						  ch_binary_column_batch & batch, Convert convert)
+{
+	auto typed = col->As<ColumnT>();
+	Datum * values = batch.values.data();
+	uint8_t * nulls = batch.nulls.data();
+
+	for (size_t i = 0; i < rows; i++)
+		values[i] = convert(typed->At(i), nulls[i]);
+}
+
+static inline Datum epoch_to_timestamp(int64 secs, uint8_t & isnull)
+{
+	/* zero is the ClickHouse default value, which we map to NULL */
+	if (secs == 0)
+	{
+		isnull = true;
+		return (Datum)0;
+	}
+
+	return TimestampGetDatum((Timestamp)time_t_to_timestamptz((pg_time_t)secs));
+}
+
+/*
+ * Decodes a column of the current block into the batch. Returns false if the
+ * column type has no kernel.
+ */
+static bool decode_column(ColumnRef col, size_t rows, ch_binary_column_batch & batch)
 {
-	/* coltypes is NULL means there are no blocks */
-	bool res = false;
+	std::shared_ptr<ColumnNullable> nullable;
+
+	if (col->Type()->GetCode() == Type::Code::Nullable)
+	{
+		nullable = col->As<ColumnNullable>();
+		col = nullable->Nested();
+	}
 
+	batch.decoded = false;
+	batch.values.resize(rows);
+	batch.nulls.assign(rows, 0);
+
+	switch (col->Type()->GetCode())
+	{
+		case Type::Code::Int8:
+			decode_values<ColumnInt8>(col, rows, batch,
+				[](int8_t v, uint8_t &) { return Int16GetDatum(v); });
+			batch.type = INT2OID;
+			break;
+		case Type::Code::UInt8:
+			decode_values<ColumnUInt8>(col, rows, batch,
+				[](uint8_t v, uint8_t &) { return Int16GetDatum(v); });
+			batch.type = INT2OID;
+			break;
+		case Type::Code::Int16:
+			decode_values<ColumnInt16>(col, rows, batch,
+				[](int16_t v, uint8_t &) { return Int16GetDatum(v); });
+			batch.type = INT2OID;
+			break;
+		case Type::Code::UInt16:
+			decode_values<ColumnUInt16>(col, rows, batch,
+				[](uint16_t v, uint8_t &) { return Int32GetDatum(v); });
+			batch.type = INT4OID;
+			break;
+		case Type::Code::Int32:
+			decode_values<ColumnInt32>(col, rows, batch,
+				[](int32_t v, uint8_t &) { return Int32GetDatum(v); });
+			batch.type = INT4OID;
+			break;
+		case Type::Code::UInt32:
+			decode_values<ColumnUInt32>(col, rows, batch,
+				[](uint32_t v, uint8_t &) { return Int64GetDatum(v); });
+			batch.type = INT8OID;
+			break;
+		case Type::Code::Int64:
+			decode_values<ColumnInt64>(col, rows, batch,
+				[](int64_t v, uint8_t &) { return Int64GetDatum(v); });
+			batch.type = INT8OID;
+			break;
+		case Type::Code::UInt64:
+		{
+			auto typed = col->As<ColumnUInt64>();
+			for (size_t i = 0; i < rows; i++)
+			{
+				uint64 val = typed->At(i);
+				/* XXX Consider using, e.g., https://pgxn.org/dist/uint128. */
+				if (val > LONG_MAX && !(nullable && nullable->IsNull(i)))
+					throw std::overflow_error(
+						"value " + std::to_string(val) + " is out of range of bigint"
+					);
+				batch.values[i] = Int64GetDatum((int64)val);
+			}
+			batch.type = INT8OID;
+			break;
+		}
+		case Type::Code::Float32:
+			decode_values<ColumnFloat32>(col, rows, batch,
+				[](float v, uint8_t &) { return Float4GetDatum(v); });
+			batch.type = FLOAT4OID;
+			break;
+		case Type::Code::Float64:
+			decode_values<ColumnFloat64>(col, rows, batch,
+				[](double v, uint8_t &) { return Float8GetDatum(v); });
+			batch.type = FLOAT8OID;
+			break;
+		case Type::Code::Date:
+			decode_values<ColumnDate>(col, rows, batch,
+				[](std::time_t v, uint8_t & isnull) { return epoch_to_timestamp(v, isnull); });
+			batch.type = DATEOID;
+			break;
+		case Type::Code::DateTime:
+			decode_values<ColumnDateTime>(col, rows, batch,
+				[](std::time_t v, uint8_t & isnull) { return epoch_to_timestamp(v, isnull); });
+			batch.type = TIMESTAMPOID;
+			break;
+		case Type::Code::DateTime64:
+		{
+			auto typed = col->As<ColumnDateTime64>();
+			size_t precision = typed->GetPrecision();
+			int64 scale = 1;
+			const int64 epoch = (int64)(POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY * USECS_PER_SEC;
+
+			for (size_t p = precision; p < 6; p++)
+				scale *= 10;
+			for (size_t p = 6; p < precision; p++)
+				scale *= 10;
+
+			for (size_t i = 0; i < rows; i++)
+			{
+				Int64 val = typed->At(i);
+				if (val == 0)
+				{
+					batch.nulls[i] = true;
+					continue;
+				}
+				/* convert to microseconds since the Postgres epoch */
+				val = precision <= 6 ? val * scale : val / scale;
+				batch.values[i] = TimestampGetDatum(val - epoch);
+			}
+			batch.type = TIMESTAMPOID;
+			break;
+		}
+		case Type::Code::UUID:
+		{
+			auto typed = col->As<ColumnUUID>();
+			batch.uuids.resize(rows);
+			for (size_t i = 0; i < rows; i++)
+			{
+				/* we form char[16] from two big endian uint64 numbers */
+				auto val = typed->At(i);
+				pg_uuid_t * uuid_val = &batch.uuids[i];
+
+				val.first = HOST_TO_BIG_ENDIAN_64(val.first);
+				val.second = HOST_TO_BIG_ENDIAN_64(val.second);
+				memcpy(uuid_val->data, &val.first, 8);
+				memcpy(uuid_val->data + 8, &val.second, 8);
+				batch.values[i] = UUIDPGetDatum(uuid_val);
+			}
+			batch.type = UUIDOID;
+			break;
+		}
+		default:
+			return false;
+	}
+
+	if (nullable)
+	{
+		for (size_t i = 0; i < rows; i++)
+		{
+			if (nullable->IsNull(i))
+				batch.nulls[i] = true;
+		}
+	}
+
+	batch.decoded = true;
+	return true;
+}
+
+/*
+ * Makes the next queued block of the stream current, waiting for the reader
+ * thread if needed. Returns false at the end of the result or on error.
+ */
+static bool next_block(ch_binary_read_state_t * state)
+{
+	auto stream = (ch_binary_stream *)state->resp->values;
+	std::unique_lock<std::mutex> lock(stream->lock);
+
+	while (stream->blocks.empty() && !stream->finished)
+	{
+		stream->cond.wait_for(lock, STREAM_POLL_INTERVAL);
+		if (stream->check_cancel && stream->check_cancel())
+		{
+			stream_cancel(stream);
+			set_state_error(state, "query was canceled");
+			return false;
+		}
+	}
+
+	if (stream->blocks.empty())
+	{
+		if (!stream->error.empty())
+			set_state_error(state, stream->error.c_str());
+		state->done = true;
+		return false;
+	}
+
+	stream->current = std::move(stream->blocks.front());
+	stream->blocks.pop_front();
+	state->resp->blocks_count++;
+	state->block++;
+	state->row = 0;
+
+	/* make room for the reader */
+	stream->cond.notify_all();
+	lock.unlock();
+
+	/* decode what we can of the new block column by column */
+	size_t rows = stream->current[0]->Size();
+
+	stream->batches.resize(stream->current.size());
+	for (size_t i = 0; i < stream->current.size(); i++)
+		decode_column(stream->current[i], rows, stream->batches[i]);
+
+	return true;
+}
+
+bool ch_binary_read_row(ch_binary_read_state_t * state)
+{
+	/* coltypes is NULL means there are no columns */
 	if (state->done || state->coltypes == NULL || state->error)
 		return false;
 
 	assert(state->resp->values);
-	auto & values = *((std::vector<std::vector<clickhouse::ColumnRef>> *)state->resp->values);
+	auto stream = (ch_binary_stream *)state->resp->values;
 	try
 	{
-	again:
-		assert(state->block < state->resp->blocks_count);
-		auto & block = values[state->block];
-		size_t row_count = block[0]->Size();
-
-		if (row_count == 0)
-			goto next_row;
+		/* blocks in the queue always have rows */
+		if ((stream->current.empty() || state->row >= stream->current[0]->Size())
+			&& !next_block(state))
+			return false;
 
+		auto & block = stream->current;
 		for (size_t i = 0; i < state->resp->columns_count; i++)
 		{
+			auto & batch = stream->batches[i];
+
 			/* fill value and null arrays */
-			state->values[i]
-				= make_datum(block[i], state->row, &state->coltypes[i], &state->nulls[i]);
+			if (batch.decoded)
+			{
+				state->values[i] = batch.values[state->row];
+				state->nulls[i] = batch.nulls[state->row];
+				state->coltypes[i] = batch.type;
+			}
+			else
+				state->values[i]
+					= make_datum(block[i], state->row, &state->coltypes[i], &state->nulls[i]);
 		}
-		res = true;
-
-	next_row:
 		state->row++;
-		if (state->row >= row_count)
-		{
-			state->row = 0;
-			state->block++;
-			if (state->block >= state->resp->blocks_count)
-				state->done = true;
-			else if (row_count == 0)
-				goto again;
-		}
 	}
 	catch (const std::exception & e)
 	{
 		set_state_error(state, e.what());
+		return false;
 	}
 
-	return res;
+	return true;
 }
 
 void ch_binary_read_state_free(ch_binary_read_state_t * state)
@@ -18,6 +18,9 @@
 #include "access/htup_details.h"
 #include "catalog/pg_user_mapping.h"
 #include "common/int.h"
+#if PG_VERSION_NUM >= 150000
+#include "common/pg_prng.h"
+#endif
 #include "access/xact.h"
 #include "mb/pg_wchar.h"
 #include "miscadmin.h"
@@ -28,6 +31,7 @@
 #include "utils/inval.h"
 #include "utils/memutils.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
 
 #include "fdw.h"
 
@@ -36,38 +40,438 @@
  */
 static HTAB * ConnectionHash = NULL;
 static void chfdw_inval_callback(Datum arg, int cacheid, uint32 hashvalue);
+static void chfdw_xact_callback(XactEvent event, void *arg);
 
+/*
+ * Health of a ClickHouse host, tracked by each backend across the servers
+ * naming it. A host that fails to connect is skipped until retry_at, which
+ * backs off exponentially with consecutive failures.
+ */
+typedef struct ChHostState
+{
+	char		key[CH_HOST_KEY_LEN];	/* "host:port", hash key */
+	int			failures;		/* consecutive failures */
+	TimestampTz retry_at;		/* skip the host until then */
+	double		latency;		/* smoothed connect time in ms, -1 unknown */
+}			ChHostState;
+
+typedef struct ChHost
+{
+	char	   *host;
+	int			port;
+	ChHostState *state;
+}			ChHost;
+
+#define CH_HOST_BACKOFF_MIN_MS 1000
+#define CH_HOST_BACKOFF_MAX_MS 60000
+
+static HTAB * HostHash = NULL;
+static uint32 host_round_robin = 0;
+
+/*
+ * Parse a host option, a comma-separated list of hosts each optionally
+ * followed by a colon and a port, into a list of ChHost. IPv6 addresses with
+ * a port go in square brackets. Hosts without a port use port.
+ */
+static List *
+parse_hosts(const char *hosts, int port)
+{
+	List	   *result = NIL;
+	char	   *list = pstrdup(hosts ? hosts : "");
+	char	   *tok;
+	char	   *save;
+
+	for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+	{
+		ChHost	   *host = palloc0(sizeof(ChHost));
+		char	   *colon;
+
+		while (*tok == ' ')
+			tok++;
+		for (char *end = tok + strlen(tok); end > tok && end[-1] == ' '; end--)
+			end[-1] = '\0';
+
+		host->port = port;
+		if (*tok == '[' && (colon = strchr(tok, ']')) != NULL)
+		{
+			*colon++ = '\0';
+			host->host = tok + 1;
+			if (*colon == ':')
+				host->port = pg_strtoint32(colon + 1);
+		}
+		else if ((colon = strchr(tok, ':')) != NULL && strchr(colon + 1, ':') == NULL)
+		{
+			*colon = '\0';
+			host->host = tok;
+			host->port = pg_strtoint32(colon + 1);
+		}
+		else
+			host->host = tok;
+
+		result = lappend(result, host);
+	}
+
+	/* an empty option means the driver default */
+	if (result == NIL)
+	{
+		ChHost	   *host = palloc0(sizeof(ChHost));
+
+		host->host = list;
+		host->port = port;
+		result = lappend(result, host);
+	}
+
+	return result;
+}
+
+/*
+ * Find or add the health state of a host.
+ */
+static ChHostState *
+host_state(ChHost * host)
+{
+	char		key[CH_HOST_KEY_LEN];
+	ChHostState *state;
+	bool		found;
+
+	if (HostHash == NULL)
+	{
+		HASHCTL		ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = CH_HOST_KEY_LEN;
+		ctl.entrysize = sizeof(ChHostState);
+		HostHash = hash_create("pg_clickhouse hosts", 8, &ctl,
+							   HASH_ELEM | HASH_BLOBS);
+	}
+
+	/* a host without a port uses the default port of the driver */
+	memset(key, 0, sizeof(key));
+	if (host->port > 0)
+		snprintf(key, CH_HOST_KEY_LEN, "%s:%d", host->host, host->port);
+	else
+		strlcpy(key, host->host, CH_HOST_KEY_LEN);
+	state = hash_search(HostHash, key, HASH_ENTER, &found);
+	if (!found)
+	{
+		state->failures = 0;
+		state->retry_at = 0;
+		state->latency = -1;
+	}
+
+	return state;
+}
+
+/*
+ * Sort hosts by latency, unknown first so that every host gets measured.
+ */
+static int
+host_latency_cmp(const ListCell *a, const ListCell *b)
+{
+	double		la = ((ChHost *) lfirst(a))->state->latency;
+	double		lb = ((ChHost *) lfirst(b))->state->latency;
+
+	return la < lb ? -1 : la > lb ? 1 : 0;
+}
+
+/*
+ * Sort hosts backing off by when they may be tried again.
+ */
+static int
+host_retry_cmp(const ListCell *a, const ListCell *b)
+{
+	TimestampTz ra = ((ChHost *) lfirst(a))->state->retry_at;
+	TimestampTz rb = ((ChHost *) lfirst(b))->state->retry_at;
+
+	return ra < rb ? -1 : ra > rb ? 1 : 0;
+}
+
+/*
+ * Order the hosts of a server in which to try them: by the load balancing
+ * policy, except that hosts backing off after failures come last, in the
+ * order they will become available.
+ */
+static List *
+order_hosts(List * hosts, ChLoadBalance policy)
+{
+	TimestampTz now = GetCurrentTimestamp();
+	List	   *ready = NIL;
+	List	   *down = NIL;
+	int			n = list_length(hosts);
+	int			start = 0;
+	ListCell   *lc;
+
+	if (policy == CH_LOAD_BALANCE_ROUND_ROBIN)
+		start = host_round_robin++ % n;
+	else if (policy == CH_LOAD_BALANCE_RANDOM)
+#if PG_VERSION_NUM >= 150000
+		start = pg_prng_uint64_range(&pg_global_prng_state, 0, n - 1);
+#else
+		start = random() % n;
+#endif
+
+	for (int i = 0; i < n; i++)
+	{
+		ChHost	   *host = list_nth(hosts, (start + i) % n);
+
+		host->state = host_state(host);
+		if (host->state->retry_at > now)
+			down = lappend(down, host);
+		else
+			ready = lappend(ready, host);
+	}
+
+	if (policy == CH_LOAD_BALANCE_LEAST_LATENCY)
+		list_sort(ready, host_latency_cmp);
+
+	/* try the hosts that will be back soonest first */
+	list_sort(down, host_retry_cmp);
+
+	return list_concat(ready, down);
+}
+
+/*
+ * Whether a host is backing off after a failure.
+ */
+static bool
+host_is_down(const char *key)
+{
+	ChHostState *state;
+
+	if (HostHash == NULL)
+		return false;
+
+	state = hash_search(HostHash, key, HASH_FIND, NULL);
+	return state != NULL && state->retry_at > GetCurrentTimestamp();
+}
+
+/*
+ * Record a failure of a host, backing off exponentially.
+ */
+static void
+host_failed(ChHostState * state)
+{
+	int			delay = CH_HOST_BACKOFF_MAX_MS;
+
+	state->failures++;
+	if (state->failures <= 6)
+		delay = Min(CH_HOST_BACKOFF_MIN_MS << (state->failures - 1),
+					CH_HOST_BACKOFF_MAX_MS);
+	state->retry_at = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), delay);
+}
+
+/*
+ * Record a successful connection to a host in latency milliseconds.
+ */
+static void
+host_succeeded(ChHostState * state, double latency)
+{
+	state->failures = 0;
+	state->retry_at = 0;
+	if (state->latency < 0)
+		state->latency = latency;
+	else
+		state->latency = 0.8 * state->latency + 0.2 * latency;
+}
+
+/*
+ * Connect to a single host with the driver.
+ */
 static ch_connection
-clickhouse_connect(ForeignServer * server, UserMapping * user)
+connect_driver(const char *driver, ch_connection_details * details,
+			   List * server_options)
+{
+	if (strcmp(driver, "http") == 0)
+	{
+		ch_connection conn;
+
+		if (details->compression && strcmp(details->compression, "lz4") == 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+					 errmsg("pg_clickhouse: the http driver does not support compression \"%s\"",
+							details->compression)));
+
+		conn = chfdw_http_connect(details);
+		conn.format = chfdw_get_format(server_options);
+		return conn;
+	}
+	else if (strcmp(driver, "binary") == 0)
+	{
+		if (details->compression && strcmp(details->compression, "lz4") != 0 &&
+			strcmp(details->compression, "zstd") != 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+					 errmsg("pg_clickhouse: the binary driver does not support compression \"%s\"",
+							details->compression)));
+
+		return chfdw_binary_connect(details);
+	}
+	else
+		elog(ERROR, "invalid ClickHouse connection driver");
+}
+
+/*
+ * Connect to the server of a user mapping. With several hosts, try them in
+ * the order of the load_balance option until one accepts the connection, and
+ * store the "host:port" key of that host in slot. The http driver connects
+ * lazily, so it runs a trivial query to check the host.
+ */
+static ch_connection
+clickhouse_connect(ForeignServer * server, UserMapping * user,
+				   ConnPoolSlot * slot)
 {
 	char	   *driver = "http";
+	ChLoadBalance policy = chfdw_get_load_balance(server->options);
+	List	   *hosts;
+	ListCell   *lc;
 
 	/* default settings */
-	ch_connection_details details = {"127.0.0.1", 0, NULL, NULL, "default"};
+	ch_connection_details details = {"127.0.0.1", 0, NULL, NULL, "default", NULL};
 
 	chfdw_extract_options(server->options, &driver, &details.host,
 						  &details.port, &details.dbname, &details.username, &details.password);
+	chfdw_get_connection_options(server->options, &details);
 	chfdw_extract_options(user->options, &driver, &details.host,
 						  &details.port, &details.dbname, &details.username, &details.password);
 
-	if (strcmp(driver, "http") == 0)
+	hosts = parse_hosts(details.host, details.port);
+	slot->nhosts = list_length(hosts);
+	hosts = order_hosts(hosts, policy);
+
+	foreach(lc, hosts)
 	{
-		return chfdw_http_connect(&details);
+		ChHost	   *host = lfirst(lc);
+		MemoryContext oldcxt = CurrentMemoryContext;
+		TimestampTz start = GetCurrentTimestamp();
+		volatile ch_connection conn = {0};
+		long		secs;
+		int			usecs;
+
+		details.host = host->host;
+		details.port = host->port;
+		memcpy(slot->host, host->state->key, CH_HOST_KEY_LEN);
+
+		/* a single host fails like it always has */
+		if (slot->nhosts == 1)
+			return connect_driver(driver, &details, server->options);
+
+		PG_TRY();
+		{
+			conn = connect_driver(driver, &details, server->options);
+			if (!conn.is_binary)
+			{
+				ch_query	query = new_query("SELECT 1");
+				ch_cursor  *cursor = conn.methods->simple_query(conn.conn, &query);
+
+				MemoryContextDelete(cursor->memcxt);
+			}
+		}
+		PG_CATCH();
+		{
+			ErrorData  *edata;
+
+			MemoryContextSwitchTo(oldcxt);
+			edata = CopyErrorData();
+			FlushErrorState();
+
+			if (conn.conn != NULL)
+				conn.methods->disconnect(conn.conn);
+			host_failed(host->state);
+
+			/* report the error of the last host */
+			if (lnext_compat(hosts, lc) == NULL)
+				ReThrowError(edata);
+
+			ereport(LOG,
+					(errmsg("pg_clickhouse: could not connect to host \"%s\", trying the next one: %s",
+							host->state->key, edata->message)));
+			FreeErrorData(edata);
+			continue;
+		}
+		PG_END_TRY();
+
+		TimestampDifference(start, GetCurrentTimestamp(), &secs, &usecs);
+		host_succeeded(host->state, secs * 1000.0 + usecs / 1000.0);
+		return conn;
 	}
-	else if (strcmp(driver, "binary") == 0)
+
+	pg_unreachable();
+}
+
+/*
+ * Closes a pooled connection.
+ */
+static void
+pool_disconnect(ConnPoolSlot * slot)
+{
+	slot->gate.methods->disconnect(slot->gate.conn);
+	slot->gate.conn = NULL;
+	slot->users = 0;
+}
+
+/*
+ * Closes the idle connections of a pool that were invalidated, and those
+ * idle for longer than the idle timeout, except for the last open one.
+ */
+static void
+pool_sweep(ConnCacheEntry * entry)
+{
+	TimestampTz now = 0;
+	int			nopen = 0;
+	int			i;
+
+	for (i = 0; i < CH_POOL_MAX_SIZE; i++)
 	{
-		return chfdw_binary_connect(&details);
+		if (entry->slots[i].gate.conn != NULL)
+			nopen++;
+	}
+
+	for (i = CH_POOL_MAX_SIZE - 1; i >= 0; i--)
+	{
+		ConnPoolSlot *slot = &entry->slots[i];
+
+		if (slot->gate.conn == NULL || slot->users > 0)
+			continue;
+
+		if (slot->invalidated)
+		{
+			elog(LOG, "closing connection to ClickHouse due to invalidation");
+			pool_disconnect(slot);
+			nopen--;
+		}
+		else if (nopen > 1 && entry->idle_timeout > 0)
+		{
+			if (now == 0)
+				now = GetCurrentTimestamp();
+
+			if (TimestampDifferenceExceeds(slot->idle_since, now,
+										   entry->idle_timeout * 1000))
+			{
+				elog(DEBUG3, "closing idle pg_clickhouse connection %p",
+					 slot->gate.conn);
+				pool_disconnect(slot);
+				nopen--;
+			}
+		}
 	}
-	else
-		elog(ERROR, "invalid ClickHouse connection driver");
 }
 
+/*
+ * Hands out a connection to the server of a user mapping for a scan, insert
+ * or other remote work, which must return it with chfdw_release_connection()
+ * when done. An idle pooled connection is preferred, then a new one while
+ * fewer than pool_size are open. Beyond that the least used connection is
+ * shared.
+ */
 ch_connection
 chfdw_get_connection(UserMapping * user)
 {
 	bool		found;
 	ConnCacheEntry *entry;
 	ConnCacheKey key;
+	ConnPoolSlot *slot = NULL;
+	int			nopen = 0;
+	int			i;
 
 	/* First time through, initialize connection cache hashtable */
 	if (ConnectionHash == NULL)
@@ -91,6 +495,7 @@ chfdw_get_connection(UserMapping * user)
 									  chfdw_inval_callback, (Datum) 0);
 		CacheRegisterSyscacheCallback(USERMAPPINGOID,
 									  chfdw_inval_callback, (Datum) 0);
+		RegisterXactCallback(chfdw_xact_callback, NULL);
 	}
 
 	/* Create hash key for the entry. Assume no pad bytes in key struct */
@@ -103,56 +508,236 @@ chfdw_get_connection(UserMapping * user)
 	if (!found)
 	{
 		/*
-		 * We need only clear "conn" here; remaining fields will be filled
-		 * later when "conn" is set.
+		 * We need only clear the connections here; remaining fields will be
+		 * filled later when a connection is made.
 		 */
-		entry->gate.conn = NULL;
+		MemSet(entry->slots, 0, sizeof(entry->slots));
+		entry->idle_timeout = 0;
 	}
 
 	/*
-	 * If the connection needs to be remade due to invalidation, disconnect as
-	 * soon as we're out of all transactions.
+	 * If connections need to be remade due to invalidation, or have been idle
+	 * for too long, close them now that nothing uses them.
 	 */
-	if (entry->gate.conn != NULL && entry->invalidated)
-	{
-		elog(LOG, "closing connection to ClickHouse due to invalidation");
-		entry->gate.methods->disconnect(entry->gate.conn);
-		entry->gate.conn = NULL;
-	}
+	pool_sweep(entry);
 
 	/*
 	 * We don't check the health of cached connection here, because it would
 	 * require some overhead. Broken connection will be detected when the
 	 * connection is actually used.
 	 */
+	for (i = 0; i < CH_POOL_MAX_SIZE; i++)
+	{
+		ConnPoolSlot *s = &entry->slots[i];
+
+		if (s->gate.conn == NULL)
+			continue;
+
+		nopen++;
+		if (s->invalidated || host_is_down(s->host))
+			continue;
+		if (slot == NULL || s->users < slot->users)
+			slot = s;
+	}
 
 	/*
-	 * If cache entry doesn't have a connection, we have to establish a new
-	 * connection. (If clickhouse_connect throws an error, the cache entry
-	 * will remain in a valid empty state, ie conn == NULL.)
+	 * Without an idle connection, establish a new one unless the pool is
+	 * full. (If clickhouse_connect throws an error, the slot will remain in a
+	 * valid empty state, ie conn == NULL.)
 	 */
-	if (entry->gate.conn == NULL)
+	if (slot == NULL || slot->users > 0)
 	{
 		ForeignServer *server = GetForeignServer(user->serverid);
 
-		/* Reset all transient state fields, to be sure all are clean */
-		entry->invalidated = false;
-		entry->server_hashvalue =
-			GetSysCacheHashValue1(FOREIGNSERVEROID,
-								  ObjectIdGetDatum(server->serverid));
-		entry->mapping_hashvalue =
-			GetSysCacheHashValue1(USERMAPPINGOID,
-								  ObjectIdGetDatum(user->umid));
+		chfdw_get_pool_options(server->options, &entry->pool_size,
+							   &entry->idle_timeout);
+
+		if (nopen < entry->pool_size)
+		{
+			for (i = 0; entry->slots[i].gate.conn != NULL; i++)
+				;
+			slot = &entry->slots[i];
+
+			/* Reset all transient state fields, to be sure all are clean */
+			slot->users = 0;
+			slot->invalidated = false;
+			entry->server_hashvalue =
+				GetSysCacheHashValue1(FOREIGNSERVEROID,
+									  ObjectIdGetDatum(server->serverid));
+			entry->mapping_hashvalue =
+				GetSysCacheHashValue1(USERMAPPINGOID,
+									  ObjectIdGetDatum(user->umid));
+
+			/* Now try to make the connection */
+			slot->gate = clickhouse_connect(server, user, slot);
+
+			elog(DEBUG3,
+				 "new pg_clickhouse connection %p for server \"%s\" (user mapping oid %u, userid %u)",
+				 slot->gate.conn, server->servername, user->umid, user->userid);
+		}
+		else if (slot == NULL)
+		{
+			/* every connection is invalidated but still in use */
+			for (i = 0; entry->slots[i].gate.conn == NULL; i++)
+				;
+			slot = &entry->slots[i];
+		}
+	}
+
+	slot->users++;
+	return slot->gate;
+}
+
+/*
+ * Returns a connection handed out by chfdw_get_connection() to the pool.
+ */
+void
+chfdw_release_connection(ch_connection conn)
+{
+	HASH_SEQ_STATUS scan;
+	ConnCacheEntry *entry;
+
+	if (ConnectionHash == NULL || conn.conn == NULL)
+		return;
+
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+	{
+		int			i;
+
+		for (i = 0; i < CH_POOL_MAX_SIZE; i++)
+		{
+			ConnPoolSlot *slot = &entry->slots[i];
+
+			if (slot->gate.conn != conn.conn)
+				continue;
+
+			/* the transaction callback may have released it already */
+			if (slot->users > 0 && --slot->users == 0)
+			{
+				slot->idle_since = GetCurrentTimestamp();
+				if (slot->invalidated)
+				{
+					elog(LOG, "closing connection to ClickHouse due to invalidation");
+					pool_disconnect(slot);
+				}
+			}
+			hash_seq_term(&scan);
+			return;
+		}
+	}
+}
+
+/*
+ * Reports that a connection handed out by chfdw_get_connection() failed.
+ * Its host backs off, and the pooled connections to the host are closed
+ * once released. Returns true if the server has other hosts, on which the
+ * caller may retry a query that is safe to repeat.
+ */
+bool
+chfdw_connection_failed(ch_connection conn)
+{
+	HASH_SEQ_STATUS scan;
+	ConnCacheEntry *entry;
+
+	if (ConnectionHash == NULL || conn.conn == NULL)
+		return false;
+
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+	{
+		for (int i = 0; i < CH_POOL_MAX_SIZE; i++)
+		{
+			ConnPoolSlot *slot = &entry->slots[i];
+			ChHostState *state;
 
-		/* Now try to make the connection */
-		entry->gate = clickhouse_connect(server, user);
+			if (slot->gate.conn != conn.conn)
+				continue;
 
-		elog(DEBUG3,
-			 "new pg_clickhouse connection %p for server \"%s\" (user mapping oid %u, userid %u)",
-			 entry->gate.conn, server->servername, user->umid, user->userid);
+			state = hash_search(HostHash, slot->host, HASH_FIND, NULL);
+			if (state != NULL)
+				host_failed(state);
+
+			for (int j = 0; j < CH_POOL_MAX_SIZE; j++)
+			{
+				if (entry->slots[j].gate.conn != NULL &&
+					strcmp(entry->slots[j].host, slot->host) == 0)
+					entry->slots[j].invalidated = true;
+			}
+
+			hash_seq_term(&scan);
+			return slot->nhosts > 1;
+		}
 	}
 
-	return entry->gate;
+	return false;
+}
+
+/*
+ * Returns the "host:port" a connection handed out by chfdw_get_connection()
+ * is connected to, or NULL if the connection is not pooled.
+ */
+char *
+chfdw_connection_host(ch_connection conn)
+{
+	HASH_SEQ_STATUS scan;
+	ConnCacheEntry *entry;
+
+	if (ConnectionHash == NULL || conn.conn == NULL)
+		return NULL;
+
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+	{
+		for (int i = 0; i < CH_POOL_MAX_SIZE; i++)
+		{
+			if (entry->slots[i].gate.conn == conn.conn)
+			{
+				hash_seq_term(&scan);
+				return pstrdup(entry->slots[i].host);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Transaction callback function
+ *
+ * Scans and inserts release their connections when they end, but not when
+ * an error aborts them. Return every connection to the pool at the end of
+ * the transaction, when none of them can be in use anymore.
+ */
+static void
+chfdw_xact_callback(XactEvent event, void *arg)
+{
+	HASH_SEQ_STATUS scan;
+	ConnCacheEntry *entry;
+	TimestampTz now;
+
+	if (event != XACT_EVENT_COMMIT && event != XACT_EVENT_ABORT &&
+		event != XACT_EVENT_PARALLEL_COMMIT &&
+		event != XACT_EVENT_PARALLEL_ABORT)
+		return;
+
+	now = GetCurrentTimestamp();
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+	{
+		int			i;
+
+		for (i = 0; i < CH_POOL_MAX_SIZE; i++)
+		{
+			ConnPoolSlot *slot = &entry->slots[i];
+
+			if (slot->gate.conn != NULL && slot->users > 0)
+			{
+				slot->users = 0;
+				slot->idle_since = now;
+			}
+		}
+	}
 }
 
 /*
@@ -182,18 +767,21 @@ chfdw_inval_callback(Datum arg, int cacheid, uint32 hashvalue)
 	hash_seq_init(&scan, ConnectionHash);
 	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
 	{
-		/* Ignore empty entries */
-		if (entry->gate.conn == NULL)
-			continue;
+		int			i;
 
 		/* hashvalue == 0 means a cache reset, must clear all state */
-		if (hashvalue == 0 ||
-			(cacheid == FOREIGNSERVEROID &&
-			 entry->server_hashvalue == hashvalue) ||
-			(cacheid == USERMAPPINGOID &&
-			 entry->mapping_hashvalue == hashvalue))
+		if (hashvalue != 0 &&
+			!(cacheid == FOREIGNSERVEROID &&
+			  entry->server_hashvalue == hashvalue) &&
+			!(cacheid == USERMAPPINGOID &&
+			  entry->mapping_hashvalue == hashvalue))
+			continue;
+
+		/* Ignore empty slots */
+		for (i = 0; i < CH_POOL_MAX_SIZE; i++)
 		{
-			entry->invalidated = true;
+			if (entry->slots[i].gate.conn != NULL)
+				entry->slots[i].invalidated = true;
 		}
 	}
 }
@@ -205,6 +793,7 @@ connstring_parse(const char *connstring)
 	List	   *options = chfdw_parse_options(connstring, false, true);
 	ch_connection_details *details = palloc0(sizeof(ch_connection_details));
 
+	details->ping = true;
 	if (options == NIL)
 		return details;
 
@@ -234,6 +823,10 @@ connstring_parse(const char *connstring)
 		{
 			details->dbname = pval;
 		}
+		else if (strcmp(pname, "compression") == 0)
+		{
+			details->compression = pg_strcasecmp(pval, "none") == 0 ? NULL : pval;
+		}
 		else if (strcmp(pname, "") != 0)
 		{
 			ereport(ERROR,
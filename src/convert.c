@@ -464,24 +464,25 @@ ch_binary_make_tuple_map(TupleDesc indesc, TupleDesc outdesc)
 
 void
 ch_binary_do_output_convertion(ch_binary_insert_state * insert_state,
-							   TupleTableSlot * slot)
+							   TupleTableSlot * slot, size_t row)
 {
-	Datum	   *out_values = insert_state->values;
-	bool	   *out_nulls = insert_state->nulls;
-
 	for (size_t i = 0; i < insert_state->outdesc->natts; i++)
 	{
 		ch_convert_output_state *cstate = &((ch_convert_output_state *) insert_state->conversion_states)[i];
 		AttrNumber	attnum = cstate->attnum;
 
-		out_values[i] = slot_getattr(slot, attnum, &out_nulls[i]);
-		if (!out_nulls[i])
+		/* Values are stored by column, batch_size rows each */
+		Datum	   *out_values = &insert_state->values[i * insert_state->batch_size + row];
+		bool	   *out_nulls = &insert_state->nulls[i * insert_state->batch_size + row];
+
+		*out_values = slot_getattr(slot, attnum, out_nulls);
+		if (!*out_nulls)
 		{
 			if (cstate->func)
-				out_values[i] = cstate->func(cstate, out_values[i]);
+				*out_values = cstate->func(cstate, *out_values);
 			else if (cstate->outtype == ANYARRAYOID)
 			{
-				AnyArrayType *v = DatumGetAnyArrayP(out_values[i]);
+				AnyArrayType *v = DatumGetAnyArrayP(*out_values);
 				ch_binary_array_t *arr;
 				array_iter	iter;
 
@@ -500,7 +501,7 @@ ch_binary_do_output_convertion(ch_binary_insert_state * insert_state,
 					arr->datums[j] = array_iter_next(&iter, &arr->nulls[j], i,
 													 cstate->typlen, cstate->typbyval, cstate->typalign);
 				}
-				out_values[i] = PointerGetDatum(arr);
+				*out_values = PointerGetDatum(arr);
 
 				/* hack: mark as unified array */
 				TupleDescAttr(insert_state->outdesc, i)->atttypid = ANYARRAYOID;
@@ -16,6 +16,7 @@
 #include "utils/lsyscache.h"
 #include "utils/rel.h"
 #include "utils/syscache.h"
+#include "utils/varlena.h"
 
 #include "fdw.h"
 
@@ -537,6 +538,49 @@ chfdw_check_for_custom_operator(Oid opoid, Form_pg_operator form)
  *
  * New options might also require tweaking merge_fdw_options().
  */
+/*
+ * Deparse the parallel_key option of a foreign table, a comma-separated list
+ * of its columns, to the quoted remote names of the columns.
+ */
+static char *
+deparse_parallel_key(Relation rel, char *val)
+{
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	StringInfoData buf;
+	List	   *names;
+	ListCell   *lc;
+
+	/* clickhouse_fdw_validator() has checked the syntax */
+	if (!SplitIdentifierString(pstrdup(val), ',', &names))
+		elog(ERROR, "invalid parallel_key \"%s\"", val);
+
+	initStringInfo(&buf);
+	foreach(lc, names)
+	{
+		char	   *name = (char *) lfirst(lc);
+		int			attnum;
+
+		for (attnum = 1; attnum <= tupdesc->natts; attnum++)
+		{
+			Form_pg_attribute attr = TupleDescAttr(tupdesc, attnum - 1);
+
+			if (!attr->attisdropped && strcmp(NameStr(attr->attname), name) == 0)
+				break;
+		}
+
+		if (attnum > tupdesc->natts)
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_COLUMN),
+					 errmsg("column \"%s\" of parallel_key does not exist in foreign table \"%s\"",
+							name, RelationGetRelationName(rel))));
+
+		appendStringInfo(&buf, "%s%s", buf.len > 0 ? ", " : "",
+						 quote_identifier(chfdw_get_remote_column_name(rel, attnum)));
+	}
+
+	return buf.data;
+}
+
 void
 chfdw_apply_custom_table_options(CHFdwRelationInfo * fpinfo, Oid relid)
 {
@@ -545,6 +589,7 @@ chfdw_apply_custom_table_options(CHFdwRelationInfo * fpinfo, Oid relid)
 	int			attnum;
 	Relation	rel;
 	List	   *options;
+	char	   *parallel_key = NULL;
 
 	foreach(lc, fpinfo->table->options)
 	{
@@ -580,6 +625,10 @@ chfdw_apply_custom_table_options(CHFdwRelationInfo * fpinfo, Oid relid)
 				fpinfo->ch_table_engine = CH_AGGREGATING_MERGE_TREE;
 			}
 		}
+		else if (STR_EQUAL(def->defname, "parallel_key"))
+			parallel_key = defGetString(def);
+		else if (STR_EQUAL(def->defname, "parallel_workers"))
+			fpinfo->parallel_workers = atoi(defGetString(def));
 	}
 
 	if (custom_columns_cache == NULL)
@@ -643,6 +692,9 @@ chfdw_apply_custom_table_options(CHFdwRelationInfo * fpinfo, Oid relid)
 		if (cdef && cdef->cf_type == CF_ISTORE_TYPE)
 			entry->coltype = cf_type;
 	}
+
+	if (parallel_key)
+		fpinfo->parallel_key = deparse_parallel_key(rel, parallel_key);
 	table_close_compat(rel, NoLock);
 }
 
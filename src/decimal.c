@@ -0,0 +1,322 @@
+/*-------------------------------------------------------------------------
+ *
+ * decimal.c
+ *		  Conversion between ClickHouse Decimals and PostgreSQL numerics
+ *
+ * A ClickHouse Decimal is an integer of 32 to 256 bits scaled by a power of
+ * ten. A PostgreSQL numeric stores base-10000 digits with the weight of the
+ * first one, aligned to the decimal point. Both drivers convert between the
+ * two here, building and reading the numeric directly rather than
+ * formatting the value as text for numeric_in() or parsing numeric_out().
+ *
+ * The numeric layout mirrors the on-disk format defined in
+ * src/backend/utils/adt/numeric.c, which pg_upgrade keeps stable. Results
+ * are built the way make_result() builds them: leading and trailing zero
+ * digits stripped, and the short header whenever it fits.
+ *
+ * Copyright (c) 2025, ClickHouse, Inc.
+ *
+ * IDENTIFICATION
+ *		  github.com/clickhouse/pg_clickhouse/src/decimal.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "utils/builtins.h"
+#include "utils/numeric.h"
+
+#include "decimal.h"
+
+#define CH_NBASE 10000
+#define CH_DEC_DIGITS 4			/* decimal digits per base-10000 digit */
+
+/* header bits of a numeric, see numeric.c */
+#define CH_NUMERIC_SIGN_MASK 0xC000
+#define CH_NUMERIC_NEG 0x4000
+#define CH_NUMERIC_SHORT 0x8000
+#define CH_NUMERIC_SPECIAL 0xC000
+#define CH_NUMERIC_DSCALE_MASK 0x3FFF
+#define CH_NUMERIC_SHORT_SIGN_MASK 0x2000
+#define CH_NUMERIC_SHORT_DSCALE_MASK 0x1F80
+#define CH_NUMERIC_SHORT_DSCALE_SHIFT 7
+#define CH_NUMERIC_SHORT_DSCALE_MAX (CH_NUMERIC_SHORT_DSCALE_MASK >> CH_NUMERIC_SHORT_DSCALE_SHIFT)
+#define CH_NUMERIC_SHORT_WEIGHT_SIGN_MASK 0x0040
+#define CH_NUMERIC_SHORT_WEIGHT_MASK 0x003F
+#define CH_NUMERIC_SHORT_WEIGHT_MAX CH_NUMERIC_SHORT_WEIGHT_MASK
+#define CH_NUMERIC_SHORT_WEIGHT_MIN (-(CH_NUMERIC_SHORT_WEIGHT_MASK + 1))
+
+/* base-10000 digits of the largest Decimal, with room for aligning it */
+#define CH_DECIMAL_MAX_DIGITS 24
+
+static const int powers_of_ten[] = {1, 10, 100, 1000};
+
+/*
+ * Negates a little-endian two's complement integer in place.
+ */
+static void
+negate(uint32 *limbs, int nlimbs)
+{
+	uint64		carry = 1;
+
+	for (int i = 0; i < nlimbs; i++)
+	{
+		uint64		t = (uint64) (uint32) ~limbs[i] + carry;
+
+		limbs[i] = (uint32) t;
+		carry = t >> 32;
+	}
+}
+
+/*
+ * Divides a little-endian unsigned integer by divisor in place, returning
+ * the remainder.
+ */
+static uint32
+divide(uint32 *limbs, int nlimbs, uint32 divisor)
+{
+	uint64		rem = 0;
+
+	for (int i = nlimbs - 1; i >= 0; i--)
+	{
+		uint64		cur = (rem << 32) | limbs[i];
+
+		limbs[i] = (uint32) (cur / divisor);
+		rem = cur % divisor;
+	}
+
+	return (uint32) rem;
+}
+
+static void
+out_of_range(void)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+			 errmsg("pg_clickhouse: value out of range for ClickHouse type Decimal")));
+}
+
+/*
+ * Multiplies a little-endian Decimal by mul and adds add, raising an error
+ * if it no longer fits with the sign bit clear.
+ */
+static void
+mul_add(uint32 *limbs, int nlimbs, uint32 mul, uint32 add)
+{
+	uint64		carry = add;
+
+	for (int i = 0; i < nlimbs; i++)
+	{
+		uint64		t = (uint64) limbs[i] * mul + carry;
+
+		limbs[i] = (uint32) t;
+		carry = t >> 32;
+	}
+
+	if (carry || (limbs[nlimbs - 1] & 0x80000000))
+		out_of_range();
+}
+
+/*
+ * Converts a little-endian integer of nlimbs 32-bit limbs, two's complement
+ * if is_signed, with scale digits after the decimal point, to a numeric.
+ */
+Datum
+ch_decimal_to_numeric(const uint32 *src, int nlimbs, bool is_signed, int scale)
+{
+	uint32		limbs[CH_DECIMAL_MAX_LIMBS + 1];
+	int16		digits[CH_DECIMAL_MAX_DIGITS];
+	int			ndigits = 0;
+	int			first = 0;
+	int			pad = (CH_DEC_DIGITS - scale % CH_DEC_DIGITS) % CH_DEC_DIGITS;
+	bool		negative = is_signed && (src[nlimbs - 1] & 0x80000000);
+	bool		nonzero;
+	int			weight;
+	int			count;
+	Size		len;
+	Numeric		result;
+	uint16	   *header;
+	int16	   *data;
+
+	Assert(nlimbs <= CH_DECIMAL_MAX_LIMBS);
+
+	memcpy(limbs, src, nlimbs * sizeof(uint32));
+	if (negative)
+		negate(limbs, nlimbs);
+
+	/*
+	 * Scale up to a whole number of base-10000 digits after the point. The
+	 * extra limb keeps the largest Decimal256 from overflowing.
+	 */
+	limbs[nlimbs++] = 0;
+	if (pad > 0)
+	{
+		uint64		carry = 0;
+
+		for (int i = 0; i < nlimbs; i++)
+		{
+			uint64		t = (uint64) limbs[i] * powers_of_ten[pad] + carry;
+
+			limbs[i] = (uint32) t;
+			carry = t >> 32;
+		}
+	}
+
+	/* collect the digits two at a time, least significant first */
+	do
+	{
+		uint32		rem = divide(limbs, nlimbs, CH_NBASE * CH_NBASE);
+
+		digits[ndigits++] = rem % CH_NBASE;
+		digits[ndigits++] = rem / CH_NBASE;
+
+		nonzero = false;
+		for (int i = 0; i < nlimbs; i++)
+			nonzero |= limbs[i] != 0;
+	} while (nonzero);
+
+	/* strip zeros at both ends */
+	while (ndigits > 0 && digits[ndigits - 1] == 0)
+		ndigits--;
+	while (first < ndigits && digits[first] == 0)
+		first++;
+
+	count = ndigits - first;
+	weight = ndigits - 1 - (scale + pad) / CH_DEC_DIGITS;
+	if (count == 0)
+	{
+		weight = 0;
+		negative = false;
+	}
+
+	if (scale <= CH_NUMERIC_SHORT_DSCALE_MAX &&
+		weight <= CH_NUMERIC_SHORT_WEIGHT_MAX &&
+		weight >= CH_NUMERIC_SHORT_WEIGHT_MIN)
+	{
+		len = VARHDRSZ + sizeof(uint16) + count * sizeof(int16);
+		result = (Numeric) palloc(len);
+		header = (uint16 *) VARDATA(result);
+		header[0] = CH_NUMERIC_SHORT |
+			(negative ? CH_NUMERIC_SHORT_SIGN_MASK : 0) |
+			(scale << CH_NUMERIC_SHORT_DSCALE_SHIFT) |
+			(weight < 0 ? CH_NUMERIC_SHORT_WEIGHT_SIGN_MASK : 0) |
+			(weight & CH_NUMERIC_SHORT_WEIGHT_MASK);
+		data = (int16 *) (header + 1);
+	}
+	else
+	{
+		len = VARHDRSZ + sizeof(uint16) + sizeof(int16) + count * sizeof(int16);
+		result = (Numeric) palloc(len);
+		header = (uint16 *) VARDATA(result);
+		header[0] = (negative ? CH_NUMERIC_NEG : 0) |
+			(scale & CH_NUMERIC_DSCALE_MASK);
+		header[1] = (uint16) (int16) weight;
+		data = (int16 *) (header + 2);
+	}
+	SET_VARSIZE(result, len);
+
+	/* most significant digit first */
+	for (int i = 0; i < count; i++)
+		data[i] = digits[ndigits - 1 - i];
+
+	return NumericGetDatum(result);
+}
+
+/*
+ * Raises an error unless the unsigned integer in limbs is below
+ * 10^precision, so that it has at most precision digits.
+ */
+static void
+check_precision(const uint32 *limbs, int nlimbs, int precision)
+{
+	uint32		bound[CH_DECIMAL_MAX_LIMBS];
+
+	memset(bound, 0, nlimbs * sizeof(uint32));
+	bound[0] = 1;
+	for (int i = 0; i < precision; i++)
+		mul_add(bound, nlimbs, 10, 0);
+
+	for (int i = nlimbs - 1; i >= 0; i--)
+	{
+		if (limbs[i] < bound[i])
+			return;
+		if (limbs[i] > bound[i])
+			break;
+	}
+	out_of_range();
+}
+
+/*
+ * Converts a numeric, rounded to scale digits after the decimal point, to a
+ * little-endian two's complement integer of nlimbs 32-bit limbs. Raises an
+ * error if it has more than precision digits, or for NaN and infinity.
+ */
+void
+ch_decimal_from_numeric(Numeric num, int precision, int scale, uint32 *limbs,
+						int nlimbs)
+{
+	uint16	   *header = (uint16 *) VARDATA(num);
+	bool		is_short = (header[0] & CH_NUMERIC_SHORT) != 0;
+	bool		negative;
+	int			weight;
+	int16	   *digits;
+	int			ndigits;
+	int			pos;
+	int			round = 0;
+
+	if ((header[0] & CH_NUMERIC_SIGN_MASK) == CH_NUMERIC_SPECIAL)
+		ereport(ERROR,
+				(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+				 errmsg("pg_clickhouse: cannot insert %s into a Decimal column",
+						DatumGetCString(DirectFunctionCall1(numeric_out,
+															NumericGetDatum(num))))));
+
+	if (is_short)
+	{
+		negative = (header[0] & CH_NUMERIC_SHORT_SIGN_MASK) != 0;
+		weight = ((header[0] & CH_NUMERIC_SHORT_WEIGHT_SIGN_MASK) ?
+				  ~CH_NUMERIC_SHORT_WEIGHT_MASK : 0) |
+			(header[0] & CH_NUMERIC_SHORT_WEIGHT_MASK);
+		digits = (int16 *) (header + 1);
+	}
+	else
+	{
+		negative = (header[0] & CH_NUMERIC_SIGN_MASK) == CH_NUMERIC_NEG;
+		weight = (int16) header[1];
+		digits = (int16 *) (header + 2);
+	}
+	ndigits = (VARSIZE(num) - ((char *) digits - (char *) num)) / sizeof(int16);
+
+	memset(limbs, 0, nlimbs * sizeof(uint32));
+
+	/*
+	 * Take the decimal digits down to the scale, from the decimal position of
+	 * the first one, and keep the next one for rounding. Positions before the
+	 * first digit and after the last are zeros.
+	 */
+	pos = weight * CH_DEC_DIGITS + CH_DEC_DIGITS - 1;
+	for (int i = 0; i < ndigits && pos >= -scale - 1; i++)
+	{
+		for (int k = CH_DEC_DIGITS - 1; k >= 0 && pos >= -scale - 1; k--, pos--)
+		{
+			int			digit = (digits[i] / powers_of_ten[k]) % 10;
+
+			if (pos >= -scale)
+				mul_add(limbs, nlimbs, 10, digit);
+			else
+				round = digit;
+		}
+	}
+	for (; pos >= -scale; pos--)
+		mul_add(limbs, nlimbs, 10, 0);
+
+	/* round half away from zero, like numeric_round() */
+	if (round >= 5)
+		mul_add(limbs, nlimbs, 1, 1);
+
+	check_precision(limbs, nlimbs, precision);
+
+	if (negative)
+		negate(limbs, nlimbs);
+}
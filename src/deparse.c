@@ -129,8 +129,12 @@ static void deparseSubqueryTargetList(deparse_expr_cxt * context);
 static void deparseColumnRef(StringInfo buf, CustomObjectDef * cdef,
 							 int varno, int varattno, RangeTblEntry * rte, bool qualify_col);
 static void deparseRelation(StringInfo buf, Relation rel);
+static void deparseStringLiteral(StringInfo buf, const char *val, bool quote);
 static void deparseExpr(Expr * expr, deparse_expr_cxt * context);
 static void deparseVar(Var * node, deparse_expr_cxt * context);
+static void deparseParam(Param * node, deparse_expr_cxt * context);
+static void printRemoteParam(Node * node, Oid paramtype,
+							 deparse_expr_cxt * context);
 static void deparseConst(Const * node, deparse_expr_cxt * context, int showtype);
 static void deparseSubscriptingRef(SubscriptingRef * node, deparse_expr_cxt * context);
 static void deparseFuncExpr(FuncExpr * node, deparse_expr_cxt * context);
@@ -344,14 +348,26 @@ foreign_expr_walker(Node * node,
 					if (cinfo && cinfo->is_AggregateFunction == CF_AGGR_FUNC)
 						outer_cxt->found_AggregateFunction = true;
 				}
+				else if (chfdw_param_type_name(var->vartype) == NULL)
+				{
+					/*
+					 * Var belongs to some other table and will be sent as a
+					 * query parameter, so it must be of a supported type.
+					 */
+					return false;
+				}
 			}
 			break;
 		case T_Const:
 			break;
 		case T_Param:
 			{
-				/* We are not supporting param push down */
-				return false;
+				Param	   *p = (Param *) node;
+
+				/* Punt on MULTIEXPR Params and unsupported types */
+				if (p->paramkind == PARAM_MULTIEXPR ||
+					chfdw_param_type_name(p->paramtype) == NULL)
+					return false;
 			}
 			break;
 		case T_SubscriptingRef:
@@ -1767,20 +1783,248 @@ deparseColumnRef(StringInfo buf, CustomObjectDef * cdef,
 }
 
 /*
- * Append remote name of specified foreign table to buf.
+ * Construct a query fetching the size estimates of a remote scan: the number
+ * of parts and rows EXPLAIN ESTIMATE expects the given SELECT to read, the
+ * number of rows in the active parts of the table and the uncompressed size
+ * of the columns in attrs_used. All values are returned as strings.
+ */
+void
+chfdw_deparse_estimate_sql(StringInfo buf, Relation rel,
+						   Bitmapset * attrs_used, const char *sql)
+{
+	Oid			relid = RelationGetRelid(rel);
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	const char *relname;
+	char	   *dbname;
+	bool		have_wholerow;
+	bool		first = true;
+	int			i;
+
+	chfdw_get_remote_relation_name(rel, &dbname, &relname);
+
+	appendStringInfoString(buf, "SELECT toString(count()), toString(sum(rows)), ");
+
+	appendStringInfoString(buf, "(SELECT toString(sum(rows)) FROM system.parts"
+						   " WHERE active AND database = ");
+	deparseStringLiteral(buf, dbname, true);
+	appendStringInfoString(buf, " AND table = ");
+	deparseStringLiteral(buf, relname, true);
+
+	appendStringInfoString(buf, "), (SELECT toString(sum(data_uncompressed_bytes))"
+						   " FROM system.columns WHERE database = ");
+	deparseStringLiteral(buf, dbname, true);
+	appendStringInfoString(buf, " AND table = ");
+	deparseStringLiteral(buf, relname, true);
+
+	/* If there's a whole-row reference, we'll need all the columns. */
+	have_wholerow = bms_is_member(0 - FirstLowInvalidHeapAttributeNumber,
+								  attrs_used);
+	if (!have_wholerow)
+	{
+		appendStringInfoString(buf, " AND name IN (");
+		for (i = 1; i <= tupdesc->natts; i++)
+		{
+			Form_pg_attribute attr = TupleDescAttr(tupdesc, i - 1);
+			CustomColumnInfo *cinfo;
+			char	   *colname;
+
+			if (attr->attisdropped ||
+				!bms_is_member(i - FirstLowInvalidHeapAttributeNumber,
+							   attrs_used))
+				continue;
+
+			cinfo = chfdw_get_custom_column_info(relid, i);
+			colname = cinfo ? cinfo->colname : NameStr(attr->attname);
+
+			if (!first)
+				appendStringInfoString(buf, ", ");
+			first = false;
+
+			if (cinfo && cinfo->coltype == CF_ISTORE_ARR)
+			{
+				deparseStringLiteral(buf, psprintf("%s_keys", colname), true);
+				appendStringInfoString(buf, ", ");
+				deparseStringLiteral(buf, psprintf("%s_values", colname), true);
+			}
+			else
+				deparseStringLiteral(buf, colname, true);
+		}
+
+		/* Nothing to fetch, e.g. SELECT count(*) */
+		if (first)
+			appendStringInfoString(buf, "''");
+		appendStringInfoChar(buf, ')');
+	}
+
+	appendStringInfo(buf, ") FROM (EXPLAIN ESTIMATE %s)", sql);
+}
+
+/*
+ * Construct a query fetching what ANALYZE needs to know about the remote
+ * table: the number of rows in its active parts, its total_rows as reported
+ * by system.tables and its sampling key. All values are returned as strings.
+ */
+void
+chfdw_deparse_analyze_info_sql(StringInfo buf, Relation rel)
+{
+	const char *relname;
+	char	   *dbname;
+
+	chfdw_get_remote_relation_name(rel, &dbname, &relname);
+
+	appendStringInfoString(buf, "SELECT (SELECT toString(sum(rows)) FROM system.parts"
+						   " WHERE active AND database = ");
+	deparseStringLiteral(buf, dbname, true);
+	appendStringInfoString(buf, " AND table = ");
+	deparseStringLiteral(buf, relname, true);
+	appendStringInfoString(buf, "), ifNull(toString(total_rows), ''), sampling_key"
+						   " FROM system.tables WHERE database = ");
+	deparseStringLiteral(buf, dbname, true);
+	appendStringInfoString(buf, " AND name = ");
+	deparseStringLiteral(buf, relname, true);
+}
+
+/*
+ * Construct a query counting the rows of the remote table, for tables whose
+ * size system.parts and system.tables don't report, such as views and
+ * Distributed or Merge tables. The count is returned as a string.
+ */
+void
+chfdw_deparse_analyze_count_sql(StringInfo buf, Relation rel)
+{
+	appendStringInfoString(buf, "SELECT toString(count()) FROM ");
+	deparseRelation(buf, rel);
+}
+
+/*
+ * Construct a SELECT statement to acquire sample rows of given relation.
+ *
+ * CH_ANALYZE_SAMPLE_SAMPLE reads about targrows rows chosen by the table's
+ * sampling key, CH_ANALYZE_SAMPLE_RANDOM lets ClickHouse pick targrows random
+ * rows, and CH_ANALYZE_SAMPLE_OFF reads the whole table.
+ *
+ * We also create an integer List of the columns being retrieved, which is
+ * returned to *retrieved_attrs.
+ */
+void
+chfdw_deparse_analyze_sql(StringInfo buf, Relation rel,
+						  ChAnalyzeSampling method, int targrows,
+						  List * *retrieved_attrs)
+{
+	RangeTblEntry *rte = makeNode(RangeTblEntry);
+	Bitmapset  *attrs_used;
+
+	rte->rtekind = RTE_RELATION;
+	rte->relid = RelationGetRelid(rel);
+	rte->relkind = RELKIND_FOREIGN_TABLE;
+
+	/* Fetch all the columns, as for a whole-row reference */
+	attrs_used = bms_make_singleton(0 - FirstLowInvalidHeapAttributeNumber);
+
+	appendStringInfoString(buf, "SELECT ");
+	deparseTargetList(buf, rte, 1, rel, attrs_used, false, retrieved_attrs);
+	appendStringInfoString(buf, " FROM ");
+	deparseRelation(buf, rel);
+
+	switch (method)
+	{
+		case CH_ANALYZE_SAMPLE_SAMPLE:
+			appendStringInfo(buf, " SAMPLE %d", targrows);
+			break;
+		case CH_ANALYZE_SAMPLE_RANDOM:
+			appendStringInfo(buf, " ORDER BY rand() LIMIT %d", targrows);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Construct a query fetching the statistics of the remote table cached by
+ * stats.c: the name, type and uncompressed size of each column, and the
+ * number of rows in the active parts of the table.
+ */
+void
+chfdw_deparse_table_stats_sql(StringInfo buf, Relation rel)
+{
+	const char *relname;
+	char	   *dbname;
+
+	chfdw_get_remote_relation_name(rel, &dbname, &relname);
+
+	appendStringInfoString(buf, "SELECT name, type, toString(data_uncompressed_bytes), "
+						   "(SELECT toString(sum(rows)) FROM system.parts"
+						   " WHERE active AND database = ");
+	deparseStringLiteral(buf, dbname, true);
+	appendStringInfoString(buf, " AND table = ");
+	deparseStringLiteral(buf, relname, true);
+	appendStringInfoString(buf, ") FROM system.columns WHERE database = ");
+	deparseStringLiteral(buf, dbname, true);
+	appendStringInfoString(buf, " AND table = ");
+	deparseStringLiteral(buf, relname, true);
+	appendStringInfo(buf, " ORDER BY position LIMIT %d", CH_STATS_MAX_COLUMNS);
+}
+
+/*
+ * Construct a query counting the distinct values of the given remote columns
+ * in the first limit rows of the table. The first result column is the
+ * number of rows read. All values are returned as strings.
+ */
+void
+chfdw_deparse_uniq_sql(StringInfo buf, Relation rel, List * columns, int limit)
+{
+	ListCell   *lc;
+
+	appendStringInfoString(buf, "SELECT toString(count())");
+	foreach(lc, columns)
+		appendStringInfo(buf, ", toString(uniq(%s))",
+						 quote_identifier(strVal(lfirst(lc))));
+
+	appendStringInfoString(buf, " FROM (SELECT ");
+	foreach(lc, columns)
+	{
+		if (lc != list_head(columns))
+			appendStringInfoString(buf, ", ");
+		appendStringInfoString(buf, quote_identifier(strVal(lfirst(lc))));
+	}
+	if (columns == NIL)
+		appendStringInfoString(buf, "1");
+	appendStringInfoString(buf, " FROM ");
+	deparseRelation(buf, rel);
+	appendStringInfo(buf, " LIMIT %d)", limit);
+}
+
+/*
+ * Get the remote name of a column of specified foreign table, the value of
+ * its column_name option if any.
+ */
+char *
+chfdw_get_remote_column_name(Relation rel, int attnum)
+{
+	CustomColumnInfo *cinfo;
+
+	cinfo = chfdw_get_custom_column_info(RelationGetRelid(rel), attnum);
+	if (cinfo)
+		return cinfo->colname;
+
+	return NameStr(TupleDescAttr(RelationGetDescr(rel), attnum - 1)->attname);
+}
+
+/*
+ * Look up the remote database and table names of specified foreign table.
  * Use value of table_name FDW option (if any) instead of relation's name.
- * Similarly, schema_name FDW option overrides schema name.
+ * Similarly, database FDW option overrides the server's database.
  */
-static void
-deparseRelation(StringInfo buf, Relation rel)
+void
+chfdw_get_remote_relation_name(Relation rel, char **dbname, const char **relname)
 {
 	ForeignTable *table;
-	const char *relname = NULL;
-	char	   *dbname = "default";
 	ForeignServer *server = chfdw_get_foreign_server(rel);
 	ListCell   *lc;
 
-	chfdw_extract_options(server->options, NULL, NULL, NULL, &dbname, NULL, NULL);
+	*dbname = "default";
+	*relname = NULL;
+	chfdw_extract_options(server->options, NULL, NULL, NULL, dbname, NULL, NULL);
 
 	/* obtain additional catalog information. */
 	table = GetForeignTable(RelationGetRelid(rel));
@@ -1794,18 +2038,29 @@ deparseRelation(StringInfo buf, Relation rel)
 
 		if (strcmp(def->defname, "table_name") == 0)
 		{
-			relname = defGetString(def);
+			*relname = defGetString(def);
 		}
 		else if (strcmp(def->defname, "database") == 0)
 		{
-			dbname = defGetString(def);
+			*dbname = defGetString(def);
 		}
 	}
-	if (relname == NULL)
+	if (*relname == NULL)
 	{
-		relname = RelationGetRelationName(rel);
+		*relname = RelationGetRelationName(rel);
 	}
+}
 
+/*
+ * Append remote name of specified foreign table to buf.
+ */
+static void
+deparseRelation(StringInfo buf, Relation rel)
+{
+	const char *relname;
+	char	   *dbname;
+
+	chfdw_get_remote_relation_name(rel, &dbname, &relname);
 	appendStringInfo(buf, "%s.%s", quote_identifier(dbname),
 					 quote_identifier(relname));
 }
@@ -1860,6 +2115,9 @@ deparseExpr(Expr * node, deparse_expr_cxt * context)
 		case T_Const:
 			deparseConst((Const *) node, context, 0);
 			break;
+		case T_Param:
+			deparseParam((Param *) node, context);
+			break;
 		case T_SubscriptingRef:
 			deparseSubscriptingRef((SubscriptingRef *) node, context);
 			break;
@@ -1959,7 +2217,191 @@ deparseVar(Var * node, deparse_expr_cxt * context)
 						 planner_rt_fetch(node->varno, context->root),
 						 qualify_col);
 	else
-		elog(ERROR, "pg_clickhouse does not support params");
+		printRemoteParam((Node *) node, node->vartype, context);
+}
+
+/*
+ * Deparse given Param node.
+ */
+static void
+deparseParam(Param * node, deparse_expr_cxt * context)
+{
+	printRemoteParam((Node *) node, node->paramtype, context);
+}
+
+/*
+ * Print the representation of a parameter to be sent to the remote side.
+ *
+ * The parameter becomes a ClickHouse query parameter named after its
+ * position in context->params_list, where the node is added unless it's
+ * already there. The executor sends the values formatted by
+ * chfdw_format_param_value(). Without a params_list, we're generating the
+ * query for EXPLAIN or estimation purposes, so print a typed NULL instead.
+ */
+static void
+printRemoteParam(Node * node, Oid paramtype, deparse_expr_cxt * context)
+{
+	StringInfo	buf = context->buf;
+	const char *type_name = chfdw_param_type_name(paramtype);
+
+	if (type_name == NULL)
+		elog(ERROR, "pg_clickhouse: unsupported parameter type %s",
+			 format_type_be(paramtype));
+
+	if (context->params_list)
+	{
+		int			pindex = 0;
+		ListCell   *lc;
+
+		/* find its index in params_list */
+		foreach(lc, *context->params_list)
+		{
+			pindex++;
+			if (equal(node, (Node *) lfirst(lc)))
+				break;
+		}
+		if (lc == NULL)
+		{
+			/* not in list, so add it */
+			pindex++;
+			*context->params_list = lappend(*context->params_list, node);
+		}
+
+		appendStringInfo(buf, "{p%d:Nullable(%s)}", pindex, type_name);
+	}
+	else
+		appendStringInfo(buf, "CAST(NULL AS Nullable(%s))", type_name);
+}
+
+/*
+ * Returns the name of the ClickHouse type of a query parameter holding
+ * values of the given type, or NULL if such values can't be sent as
+ * parameters.
+ */
+const char *
+chfdw_param_type_name(Oid type)
+{
+	switch (type)
+	{
+		case BOOLOID:
+			return "Bool";
+		case INT2OID:
+			return "Int16";
+		case INT4OID:
+			return "Int32";
+		case INT8OID:
+			return "Int64";
+		case FLOAT4OID:
+			return "Float32";
+		case FLOAT8OID:
+			return "Float64";
+		case TEXTOID:
+		case VARCHAROID:
+		case BPCHAROID:
+		case NAMEOID:
+			return "String";
+		case DATEOID:
+			return "Date32";
+		case TIMESTAMPOID:
+			return "DateTime64(6)";
+		case TIMESTAMPTZOID:
+			return "DateTime64(6, 'UTC')";
+		case UUIDOID:
+			return "UUID";
+		default:
+			return NULL;
+	}
+}
+
+/*
+ * Format a timestamp with all six digits of its fractional seconds, as the
+ * text of a DateTime64(6) parameter.
+ */
+static char *
+format_param_timestamp(Timestamp timestamp)
+{
+	struct pg_tm tt,
+			   *tm = &tt;
+	fsec_t		fsec;
+
+	if (TIMESTAMP_NOT_FINITE(timestamp) ||
+		timestamp2tm(timestamp, NULL, tm, &fsec, NULL, NULL) != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+				 errmsg("timestamp out of range")));
+
+	return psprintf("%04d-%02d-%02d %02d:%02d:%02d.%06d",
+					tm->tm_year, tm->tm_mon, tm->tm_mday,
+					tm->tm_hour, tm->tm_min, tm->tm_sec, (int) fsec);
+}
+
+/*
+ * Format a value of a type supported by chfdw_param_type_name() as the
+ * escaped text ClickHouse expects for a query parameter.
+ */
+char *
+chfdw_format_param_value(Oid type, Datum value)
+{
+	switch (type)
+	{
+		case BOOLOID:
+			return pstrdup(DatumGetBool(value) ? "true" : "false");
+		case DATEOID:
+			return DatumGetCString(DirectFunctionCall1(ch_date_out, value));
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+
+			/*
+			 * A timestamptz is formatted in UTC, matching the 'UTC' zone of
+			 * its parameter type.
+			 */
+			return format_param_timestamp(DatumGetTimestamp(value));
+		case TEXTOID:
+		case VARCHAROID:
+		case BPCHAROID:
+		case NAMEOID:
+			{
+				Oid			typoutput;
+				bool		typIsVarlena;
+				StringInfoData buf;
+				char	   *str;
+
+				getTypeOutputInfo(type, &typoutput, &typIsVarlena);
+				str = OidOutputFunctionCall(typoutput, value);
+
+				initStringInfo(&buf);
+				for (char *c = str; *c; c++)
+				{
+					switch (*c)
+					{
+						case '\\':
+							appendStringInfoString(&buf, "\\\\");
+							break;
+						case '\t':
+							appendStringInfoString(&buf, "\\t");
+							break;
+						case '\n':
+							appendStringInfoString(&buf, "\\n");
+							break;
+						case '\r':
+							appendStringInfoString(&buf, "\\r");
+							break;
+						default:
+							appendStringInfoChar(&buf, *c);
+					}
+				}
+				pfree(str);
+				return buf.data;
+			}
+		default:
+			{
+				Oid			typoutput;
+				bool		typIsVarlena;
+
+				getTypeOutputInfo(type, &typoutput, &typIsVarlena);
+				return OidOutputFunctionCall(typoutput, value);
+			}
+	}
 }
 
 #define USE_ISO_DATES			1
@@ -5,12 +5,17 @@
 #include <string.h>
 #include <assert.h>
 
+#include <sys/socket.h>
 #include <uuid/uuid.h>
+#include <zlib.h>
 #include <http.h>
 #include <internal.h>
 
 #define DATABASE_HEADER "X-ClickHouse-Database"
 
+/* Request bodies smaller than this are sent uncompressed. */
+#define CH_HTTP_COMPRESS_MIN 8192
+
 static char curl_error_buffer[CURL_ERROR_SIZE];
 static bool curl_error_happened = false;
 static long curl_verbose = 0;
@@ -18,6 +23,21 @@ static void *curl_progressfunc = NULL;
 static bool curl_initialized = false;
 static char ch_query_id_prefix[5];
 
+/*
+ * The DNS cache, TLS sessions and open connections are shared by all http
+ * connections of the process, so that a new pooled connection, or the
+ * connection to another database on the same server, reuses them rather
+ * than resolving the host and doing a full TLS handshake again. libcurl
+ * reuses an open connection regardless of the socket options or HTTP
+ * version it was opened with, so connections with different transport
+ * flags get shares of their own, see share_for().
+ */
+static CURLSH *curl_shares[CH_HTTP_KEEPALIVE + CH_HTTP_HTTP2 + 1];
+
+/* transfers made by the process, and the connections they opened */
+static long curl_transfers = 0;
+static long curl_connects = 0;
+
 void
 ch_http_init(int verbose, uint32_t query_id_prefix)
 {
@@ -31,25 +51,94 @@ ch_http_init(int verbose, uint32_t query_id_prefix)
 	}
 }
 
+/*
+ * Returns the share of the transfers of connections with the given transport
+ * flags, or NULL if it can't be made.
+ */
+static CURLSH *
+share_for(int flags)
+{
+	CURLSH	  **share = &curl_shares[flags & (CH_HTTP_KEEPALIVE | CH_HTTP_HTTP2)];
+
+	if (*share == NULL && (*share = curl_share_init()) != NULL)
+	{
+		curl_share_setopt(*share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		curl_share_setopt(*share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+		curl_share_setopt(*share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+	}
+
+	return *share;
+}
+
+/*
+ * Returns the number of transfers the process has completed, and the number
+ * of new connections they had to open. The rest reused a connection.
+ */
+void
+ch_http_transfer_stats(long *transfers, long *connects)
+{
+	*transfers = curl_transfers;
+	*connects = curl_connects;
+}
+
 void
 ch_http_set_progress_func(void *progressfunc)
 {
 	curl_progressfunc = progressfunc;
 }
 
+/*
+ * Appends len bytes to the response buffer. Returns false if out of memory.
+ */
+bool
+ch_http_response_append(ch_http_response_t * resp, const char *data, size_t len)
+{
+	/* Grow the buffer geometrically to avoid a copy per chunk. */
+	if (resp->datasize + len + 1 > resp->bufsize)
+	{
+		size_t		newsize = resp->bufsize ? resp->bufsize : 16384;
+		char	   *buf;
+
+		while (newsize < resp->datasize + len + 1)
+			newsize *= 2;
+
+		buf = realloc(resp->data, newsize);
+		if (buf == NULL)
+			return false;
+
+		resp->data = buf;
+		resp->bufsize = newsize;
+	}
+
+	memcpy(&(resp->data[resp->datasize]), data, len);
+	resp->datasize += len;
+	resp->data[resp->datasize] = 0;
+
+	return true;
+}
+
 static size_t write_data(void *contents, size_t size, size_t nmemb, void *userp)
 {
 	size_t		realsize = size * nmemb;
 	ch_http_response_t *res = userp;
 
-	if (res->data == NULL)
-		res->data = malloc(realsize + 1);
-	else
-		res->data = realloc(res->data, res->datasize + realsize + 1);
+	if (res->http_status == 0)
+	{
+		curl_easy_getinfo(res->curl, CURLINFO_RESPONSE_CODE, &res->http_status);
+		curl_easy_getinfo(res->curl, CURLINFO_PRETRANSFER_TIME, &res->pretransfer_time);
+	}
 
-	memcpy(&(res->data[res->datasize]), contents, realsize);
-	res->datasize += realsize;
-	res->data[res->datasize] = 0;
+	/* Leave the data with curl until the reader has consumed the buffer. */
+	if (res->limit && res->datasize >= res->limit)
+	{
+		res->paused = true;
+		return CURL_WRITEFUNC_PAUSE;
+	}
+
+	if (!ch_http_response_append(res, contents, realsize))
+		return 0;				/* makes curl fail the transfer */
 
 	return realsize;
 }
@@ -58,29 +147,59 @@ static size_t write_data(void *contents, size_t size, size_t nmemb, void *userp)
 #define CLICKHOUSE_TLS_PORT 8443
 #define HTTP_TLS_PORT 443
 
+/*
+ * Creates a connection to the server at base_url, as built by
+ * ch_http_connection(). Takes ownership of base_url, which must have been
+ * allocated with malloc. flags is a mask of CH_HTTP_KEEPALIVE and
+ * CH_HTTP_HTTP2.
+ */
 ch_http_connection_t *
-ch_http_connection(ch_connection_details * details)
+ch_http_connection_url(char *base_url, const char *dbname,
+					   const char *compression, int flags)
 {
-	int			n;
-	char	   *connstring = NULL;
-	size_t		len = 20;		/* all symbols from url string + some extra */
-	char	   *host = details->host,
-			   *username = details->username,
-			   *password = details->password;
-	int			port = details->port;
-
-	curl_error_happened = false;
 	ch_http_connection_t *conn = calloc(sizeof(ch_http_connection_t), 1);
 
+	curl_error_happened = false;
 	if (!conn)
 		goto cleanup;
 
-	conn->curl = curl_easy_init();
-	if (!conn->curl)
+	conn->multi = curl_multi_init();
+	if (!conn->multi)
 		goto cleanup;
 
-	conn->dbname = details->dbname ? strdup(details->dbname) : NULL;
+	conn->base_url = base_url;
+	conn->dbname = dbname ? strdup(dbname) : NULL;
+	conn->compression = compression ? strdup(compression) : NULL;
+	conn->flags = flags;
+	conn->http_version = CURL_HTTP_VERSION_NONE;
+	conn->keepalive = -1;
 
+	/* Let concurrent transfers share one HTTP/2 connection */
+	if (flags & CH_HTTP_HTTP2)
+		curl_multi_setopt(conn->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+	return conn;
+
+cleanup:
+	snprintf(curl_error_buffer, CURL_ERROR_SIZE, "OOM");
+	curl_error_happened = true;
+	free(base_url);
+	if (conn)
+		free(conn);
+
+	return NULL;
+}
+
+ch_http_connection_t *
+ch_http_connection(ch_connection_details * details)
+{
+	int			n;
+	char	   *connstring = NULL;
+	size_t		len = 20;		/* all symbols from url string + some extra */
+	char	   *host = details->host,
+			   *username = details->username,
+			   *password = details->password;
+	int			port = details->port;
 
 	if (!host || !*host)
 		host = "localhost";
@@ -92,13 +211,13 @@ ch_http_connection(ch_connection_details * details)
 
 	if (username)
 	{
-		username = curl_easy_escape(conn->curl, username, 0);
+		username = curl_easy_escape(NULL, username, 0);
 		len += strlen(username);
 	}
 
 	if (password)
 	{
-		password = curl_easy_escape(conn->curl, password, 0);
+		password = curl_easy_escape(NULL, password, 0);
 		len += strlen(password);
 	}
 
@@ -125,9 +244,10 @@ ch_http_connection(ch_connection_details * details)
 	if (n < 0)
 		goto cleanup;
 
-	conn->base_url = connstring;
-
-	return conn;
+	return ch_http_connection_url(connstring, details->dbname,
+								  details->compression,
+								  (details->keepalive ? CH_HTTP_KEEPALIVE : 0) |
+								  (details->http2 ? CH_HTTP_HTTP2 : 0));
 
 cleanup:
 	snprintf(curl_error_buffer, CURL_ERROR_SIZE, "OOM");
@@ -135,12 +255,35 @@ cleanup:
 	if (connstring)
 		free(connstring);
 
-	if (conn)
-		free(conn);
-
 	return NULL;
 }
 
+/*
+ * Returns the URL, database, content encoding and flags of a connection,
+ * from which ch_http_connection_url() makes an equivalent connection.
+ */
+void
+ch_http_connection_info(ch_http_connection_t * conn, const char **base_url,
+						const char **dbname, const char **compression,
+						int *flags)
+{
+	*base_url = conn->base_url;
+	*dbname = conn->dbname;
+	*compression = conn->compression;
+	*flags = conn->flags;
+}
+
+/*
+ * Limits the number of connections to the server that transfers of conn
+ * open at a time. Transfers beyond the limit wait for a connection to be
+ * free.
+ */
+void
+ch_http_set_max_connections(ch_http_connection_t * conn, long max)
+{
+	curl_multi_setopt(conn->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, max);
+}
+
 static void
 set_query_id(ch_http_response_t * resp)
 {
@@ -150,28 +293,421 @@ set_query_id(ch_http_response_t * resp)
 	uuid_unparse(id, resp->query_id);
 }
 
-ch_http_response_t *
-ch_http_simple_query(ch_http_connection_t * conn, const ch_query * query)
+/*
+ * Hands the easy handle of a transfer back to the connection, keeping one
+ * around for the next query.
+ */
+static void
+release_handle(ch_http_connection_t * conn, CURL * curl)
+{
+	if (conn->idle == NULL)
+	{
+		curl_easy_reset(curl);
+		conn->idle = curl;
+	}
+	else
+		curl_easy_cleanup(curl);
+}
+
+/*
+ * Detaches a response from its connection, aborting the transfer if it is
+ * still running.
+ */
+static void
+detach_response(ch_http_response_t * resp)
+{
+	ch_http_connection_t *conn = resp->conn;
+	ch_http_response_t **prev;
+
+	if (resp->curl == NULL)
+		return;
+
+	for (prev = &conn->responses; *prev; prev = &(*prev)->next)
+	{
+		if (*prev == resp)
+		{
+			*prev = resp->next;
+			break;
+		}
+	}
+
+	curl_multi_remove_handle(conn->multi, resp->curl);
+	release_handle(conn, resp->curl);
+	if (resp->headers)
+		curl_slist_free_all(resp->headers);
+	if (resp->body)
+		free(resp->body);
+	if (resp->upload)
+		free(resp->upload);
+	if (resp->upload_zs)
+	{
+		deflateEnd(resp->upload_zs);
+		free(resp->upload_zs);
+	}
+
+	resp->curl = NULL;
+	resp->headers = NULL;
+	resp->body = NULL;
+	resp->upload = NULL;
+	resp->upload_size = resp->upload_pos = 0;
+	resp->upload_zs = NULL;
+	resp->done = true;
+}
+
+/*
+ * Records the HTTP version a finished transfer used on its connection, and
+ * whether TCP keepalive is on for the socket, which libcurl keeps open for
+ * the next transfer.
+ */
+static void
+record_transport(ch_http_connection_t * conn, CURL * curl)
+{
+	curl_socket_t sock;
+	int			on;
+	socklen_t	len = sizeof(on);
+
+#if LIBCURL_VERSION_NUM >= 0x073200
+	long		version;
+
+	if (curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &version) == CURLE_OK)
+		conn->http_version = version;
+#endif
+	if (curl_easy_getinfo(curl, CURLINFO_ACTIVESOCKET, &sock) == CURLE_OK &&
+		sock != CURL_SOCKET_BAD &&
+		getsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &on, &len) == 0)
+		conn->keepalive = on != 0;
+}
+
+/*
+ * Returns the HTTP version, as a CURL_HTTP_VERSION_* value, of the last
+ * transfer of a connection to finish, and 1 if TCP keepalive was on for its
+ * socket, 0 if off, or -1 if unknown. The version is
+ * CURL_HTTP_VERSION_NONE until a transfer has finished.
+ */
+void
+ch_http_transport(ch_http_connection_t * conn, long *http_version,
+				  int *keepalive)
+{
+	*http_version = conn->http_version;
+	*keepalive = conn->keepalive;
+}
+
+/*
+ * Records the outcome of a finished transfer.
+ */
+static void
+transfer_done(ch_http_response_t * resp, CURLcode errcode)
+{
+	if (errcode == CURLE_ABORTED_BY_CALLBACK)
+		resp->http_status = 418;	/* I'm teapot */
+	else if (errcode != CURLE_OK)
+	{
+		const char *error = resp->errbuffer[0] ? resp->errbuffer : curl_easy_strerror(errcode);
+		curl_off_t	sent = 0;
+
+		resp->http_status = 419;	/* illegal http status */
+
+		/*
+		 * The server never got the request if curl couldn't connect or send
+		 * it, or timed out before sending anything.
+		 */
+		if (errcode == CURLE_OPERATION_TIMEDOUT)
+			resp->unsent = curl_easy_getinfo(resp->curl, CURLINFO_SIZE_UPLOAD_T,
+											 &sent) == CURLE_OK && sent == 0;
+		else
+			resp->unsent = (errcode == CURLE_COULDNT_RESOLVE_HOST ||
+							errcode == CURLE_COULDNT_CONNECT ||
+							errcode == CURLE_SSL_CONNECT_ERROR ||
+							errcode == CURLE_SEND_ERROR);
+		if (resp->data)
+			free(resp->data);
+		resp->data = strdup(error);
+		resp->datasize = strlen(error);
+		resp->bufsize = resp->datasize + 1;
+	}
+	else
+	{
+		long		connects;
+
+		if (curl_easy_getinfo(resp->curl, CURLINFO_NUM_CONNECTS, &connects) == CURLE_OK)
+			curl_connects += connects;
+		curl_transfers++;
+		if (resp->conn != NULL)
+			record_transport(resp->conn, resp->curl);
+
+		errcode = curl_easy_getinfo(resp->curl, CURLINFO_PRETRANSFER_TIME,
+									&resp->pretransfer_time);
+		if (errcode != CURLE_OK)
+			resp->pretransfer_time = 0;
+
+		errcode = curl_easy_getinfo(resp->curl, CURLINFO_TOTAL_TIME, &resp->total_time);
+		if (errcode != CURLE_OK)
+			resp->total_time = 0;
+
+		/*
+		 * All good with request, but we need http status to make sure query
+		 * went ok
+		 */
+		curl_easy_getinfo(resp->curl, CURLINFO_RESPONSE_CODE, &resp->http_status);
+		if (curl_verbose && resp->http_status != 200)
+			fprintf(stderr, "%s", resp->data);
+	}
+
+	detach_response(resp);
+}
+
+/*
+ * Runs all transfers of the connection for a while, waiting up to
+ * timeout_ms for network activity, and completes those that have finished.
+ * Transfers share the connection cache of the process, so they reuse open
+ * connections to the server.
+ */
+static void
+run_transfers(ch_http_connection_t * conn, int timeout_ms)
+{
+	int			running;
+	int			left;
+	CURLMsg    *msg;
+
+	curl_multi_perform(conn->multi, &running);
+	while ((msg = curl_multi_info_read(conn->multi, &left)) != NULL)
+	{
+		ch_http_response_t *resp = NULL;
+		CURLcode	errcode = msg->data.result;
+
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &resp);
+		transfer_done(resp, errcode);
+	}
+
+	if (timeout_ms > 0 && running > 0)
+		curl_multi_poll(conn->multi, NULL, 0, timeout_ms, NULL);
+}
+
+/*
+ * Compresses size bytes of data into a gzip stream allocated with malloc,
+ * storing its size in *outsize. Returns NULL if zlib fails.
+ */
+static char *
+gzip_body(const char *data, size_t size, size_t *outsize)
+{
+	z_stream	zs;
+	char	   *out;
+	size_t		bound;
+
+	memset(&zs, 0, sizeof(zs));
+	/* 15 window bits, plus 16 for a gzip header rather than a zlib one */
+	if (deflateInit2(&zs, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8,
+					 Z_DEFAULT_STRATEGY) != Z_OK)
+		return NULL;
+
+	bound = deflateBound(&zs, size);
+	out = malloc(bound);
+	if (out == NULL)
+	{
+		deflateEnd(&zs);
+		return NULL;
+	}
+
+	zs.next_in = (Bytef *) data;
+	zs.avail_in = size;
+	zs.next_out = (Bytef *) out;
+	zs.avail_out = bound;
+	if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+	{
+		deflateEnd(&zs);
+		free(out);
+		return NULL;
+	}
+
+	*outsize = zs.total_out;
+	deflateEnd(&zs);
+	return out;
+}
+
+/*
+ * Hands curl the next piece of a streamed request body, pausing the upload
+ * until ch_http_insert_write() provides the next chunk.
+ */
+static size_t
+read_data(char *buffer, size_t size, size_t nitems, void *userp)
+{
+	ch_http_response_t *resp = userp;
+	size_t		n = resp->upload_size - resp->upload_pos;
+
+	if (n == 0)
+	{
+		if (resp->upload_eof)
+			return 0;
+
+		resp->upload_paused = true;
+		return CURL_READFUNC_PAUSE;
+	}
+
+	if (n > size * nitems)
+		n = size * nitems;
+
+	memcpy(buffer, resp->upload + resp->upload_pos, n);
+	resp->upload_pos += n;
+	return n;
+}
+
+/*
+ * Makes room for at least size bytes in the upload buffer.
+ */
+static bool
+upload_reserve(ch_http_response_t * resp, size_t size)
+{
+	char	   *upload;
+
+	if (size <= resp->upload_alloc)
+		return true;
+
+	upload = realloc(resp->upload, size);
+	if (upload == NULL)
+		return false;
+
+	resp->upload = upload;
+	resp->upload_alloc = size;
+	return true;
+}
+
+/*
+ * Replaces the chunk in the upload buffer, which curl must have sent in full,
+ * with len bytes of data, gzipped if the body is compressed. finish ends the
+ * gzip stream.
+ */
+static bool
+upload_fill(ch_http_response_t * resp, const char *data, size_t len, bool finish)
+{
+	z_stream   *zs = resp->upload_zs;
+
+	resp->upload_pos = 0;
+	resp->upload_size = 0;
+
+	if (zs == NULL)
+	{
+		if (len == 0)
+			return true;
+		if (!upload_reserve(resp, len))
+			return false;
+
+		memcpy(resp->upload, data, len);
+		resp->upload_size = len;
+		return true;
+	}
+
+	zs->next_in = (Bytef *) data;
+	zs->avail_in = len;
+	for (;;)
+	{
+		int			rc;
+
+		if (resp->upload_size == resp->upload_alloc &&
+			!upload_reserve(resp, resp->upload_alloc ? resp->upload_alloc * 2 : 65536))
+			return false;
+
+		zs->next_out = (Bytef *) resp->upload + resp->upload_size;
+		zs->avail_out = resp->upload_alloc - resp->upload_size;
+		rc = deflate(zs, finish ? Z_FINISH : Z_NO_FLUSH);
+		resp->upload_size = (char *) zs->next_out - resp->upload;
+
+		if (rc == Z_STREAM_END)
+			break;
+		if (rc != Z_OK && rc != Z_BUF_ERROR)
+			return false;
+		if (!finish && zs->avail_in == 0 && zs->avail_out > 0)
+			break;
+	}
+
+	return true;
+}
+
+/*
+ * Sets up the transfer to stream its body, starting with the SQL of the
+ * query. Returns false if out of memory.
+ */
+static bool
+upload_init(ch_http_response_t * resp, const ch_query * query)
+{
+	CURL	   *curl = resp->curl;
+
+	if (resp->conn->compression)
+	{
+		z_stream   *zs = calloc(sizeof(z_stream), 1);
+
+		if (zs == NULL)
+			return false;
+
+		/* 15 window bits, plus 16 for a gzip header rather than a zlib one */
+		if (deflateInit2(zs, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8,
+						 Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			free(zs);
+			return false;
+		}
+
+		resp->upload_zs = zs;
+		resp->headers = curl_slist_append(resp->headers, "Content-Encoding: gzip");
+	}
+
+	/* The size of the body is unknown, so send it in chunks. */
+	resp->headers = curl_slist_append(resp->headers, "Transfer-Encoding: chunked");
+	curl_easy_setopt(curl, CURLOPT_POST, 1L);
+	curl_easy_setopt(curl, CURLOPT_READFUNCTION, read_data);
+	curl_easy_setopt(curl, CURLOPT_READDATA, resp);
+
+	return upload_fill(resp, query->sql, strlen(query->sql), false);
+}
+
+/*
+ * Starts executing the query and returns a response that receives the
+ * result while the transfer runs. The transfer pauses whenever limit bytes
+ * wait in the response buffer; zero means no limit. Without a limit the
+ * caller runs the transfer to the end, so the SQL is sent without copying.
+ * With upload the SQL only starts the body, which the caller streams
+ * through ch_http_insert_write().
+ */
+static ch_http_response_t *
+start_query(ch_http_connection_t * conn, const ch_query * query, size_t limit,
+			bool upload)
 {
+	bool		ok = true;
 	char	   *url;
-	CURLcode	errcode;
-	static char errbuffer[CURL_ERROR_SIZE];
-	struct curl_slist *headers = NULL;
-	CURLU	   *cu = curl_url();
+	CURL	   *curl;
+	CURLSH	   *share;
+	CURLU	   *cu;
 	ListCell   *lc;
 	DefElem    *setting;
 	char	   *buf = NULL;
 
+	assert(conn && conn->multi);
+
+	if (conn->idle)
+	{
+		curl = conn->idle;
+		conn->idle = NULL;
+	}
+	else if ((curl = curl_easy_init()) == NULL)
+		return NULL;
+
 	ch_http_response_t *resp = calloc(sizeof(ch_http_response_t), 1);
 
 	if (resp == NULL)
+	{
+		release_handle(conn, curl);
 		return NULL;
+	}
 
 	set_query_id(resp);
-
-	assert(conn && conn->curl);
+	resp->curl = curl;
+	resp->conn = conn;
+	resp->limit = limit;
 
 	/* Construct the base URL with the query ID. */
+	cu = curl_url();
 	curl_url_set(cu, CURLUPART_URL, conn->base_url, 0);
 	buf = psprintf("query_id=%s", resp->query_id);
 	curl_url_set(cu, CURLUPART_QUERY, buf, CURLU_APPENDQUERY | CURLU_URLENCODE);
@@ -185,72 +721,480 @@ ch_http_simple_query(ch_http_connection_t * conn, const ch_query * query)
 		curl_url_set(cu, CURLUPART_QUERY, buf, CURLU_APPENDQUERY | CURLU_URLENCODE);
 		pfree(buf);
 	}
+
+	/*
+	 * Have the server compress the result. curl decodes the response before
+	 * handing it to write_data(), so readers stream plain data as usual.
+	 */
+	if (conn->compression)
+		curl_url_set(cu, CURLUPART_QUERY, "enable_http_compression=1",
+					 CURLU_APPENDQUERY | CURLU_URLENCODE);
+
+	/* Ask for a binary result unless the query names its own format. */
+	if (query->format == CH_FORMAT_ROWBINARY)
+		curl_url_set(cu, CURLUPART_QUERY,
+					 "default_format=RowBinaryWithNamesAndTypes",
+					 CURLU_APPENDQUERY | CURLU_URLENCODE);
+
+	/* Append the value of each query parameter, \N for NULL. */
+	for (int i = 0; i < query->num_params; i++)
+	{
+		const char *value = query->param_values[i];
+
+		buf = psprintf("param_p%d=%s", i + 1, value ? value : "\\N");
+		curl_url_set(cu, CURLUPART_QUERY, buf, CURLU_APPENDQUERY | CURLU_URLENCODE);
+		pfree(buf);
+	}
 	curl_url_get(cu, CURLUPART_URL, &url, 0);
 	curl_url_cleanup(cu);
 
 	/* constant */
-	errbuffer[0] = '\0';
-	curl_easy_reset(conn->curl);
-	curl_easy_setopt(conn->curl, CURLOPT_WRITEFUNCTION, write_data);
-	curl_easy_setopt(conn->curl, CURLOPT_ERRORBUFFER, errbuffer);
-	curl_easy_setopt(conn->curl, CURLOPT_PATH_AS_IS, 1L);
-	curl_easy_setopt(conn->curl, CURLOPT_URL, url);
-	curl_easy_setopt(conn->curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, resp->errbuffer);
+	curl_easy_setopt(curl, CURLOPT_PATH_AS_IS, 1L);
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	curl_free(url);
+	share = share_for(conn->flags);
+	if (share)
+		curl_easy_setopt(curl, CURLOPT_SHARE, share);
+	if (conn->flags & CH_HTTP_KEEPALIVE)
+		curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+
+	/*
+	 * HTTP/2 is negotiated over TLS only, falling back to HTTP/1.1 for plain
+	 * connections and servers that don't offer it. A transfer waits for a
+	 * connection being set up to tell whether it can multiplex on it, rather
+	 * than opening another one. Without the option, libcurl picks the
+	 * version.
+	 */
+	if (conn->flags & CH_HTTP_HTTP2)
+	{
+		curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+		curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+	}
 
 	/* variable */
-	curl_easy_setopt(conn->curl, CURLOPT_WRITEDATA, resp);
-	curl_easy_setopt(conn->curl, CURLOPT_POSTFIELDS, query->sql);
-	curl_easy_setopt(conn->curl, CURLOPT_VERBOSE, curl_verbose);
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, resp);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, resp);
+	resp->bodysize = strlen(query->sql);
+	if (conn->compression)
+		curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, conn->compression);
+
+	if (upload)
+		ok = upload_init(resp, query);
+	else if (conn->compression)
+	{
+		/*
+		 * Large bodies go out gzipped; ClickHouse decodes any request
+		 * Content-Encoding it supports.
+		 */
+		if (resp->bodysize >= CH_HTTP_COMPRESS_MIN)
+		{
+			size_t		zsize;
+
+			resp->body = gzip_body(query->sql, resp->bodysize, &zsize);
+			if (resp->body)
+			{
+				resp->bodysize = zsize;
+				resp->headers = curl_slist_append(resp->headers,
+												  "Content-Encoding: gzip");
+			}
+		}
+	}
+	if (resp->body)
+	{
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) resp->bodysize);
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, resp->body);
+	}
+	else if (!upload)
+	{
+		if (limit)
+			curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, query->sql);
+		else
+			curl_easy_setopt(curl, CURLOPT_POSTFIELDS, query->sql);
+	}
+	curl_easy_setopt(curl, CURLOPT_VERBOSE, curl_verbose);
 	if (curl_progressfunc)
 	{
-		curl_easy_setopt(conn->curl, CURLOPT_NOPROGRESS, 0L);
-		curl_easy_setopt(conn->curl, CURLOPT_XFERINFOFUNCTION, curl_progressfunc);
-		curl_easy_setopt(conn->curl, CURLOPT_XFERINFODATA, conn);
+		curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+		curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, curl_progressfunc);
+		curl_easy_setopt(curl, CURLOPT_XFERINFODATA, conn);
 	}
 	else
-		curl_easy_setopt(conn->curl, CURLOPT_NOPROGRESS, 1L);
+		curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
 	if (conn->dbname)
 	{
-		headers = curl_slist_append(headers, psprintf("%s: %s", DATABASE_HEADER, conn->dbname));
-		curl_easy_setopt(conn->curl, CURLOPT_HTTPHEADER, headers);
+		buf = psprintf("%s: %s", DATABASE_HEADER, conn->dbname);
+		resp->headers = curl_slist_append(resp->headers, buf);
+		pfree(buf);
 	}
+	if (resp->headers)
+		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, resp->headers);
 
 	curl_error_happened = false;
-	errcode = curl_easy_perform(conn->curl);
-	curl_free(url);
-	if (headers)
-		curl_slist_free_all(headers);
+	resp->next = conn->responses;
+	conn->responses = resp;
+	if (!ok)
+		transfer_done(resp, CURLE_OUT_OF_MEMORY);
+	else if (curl_multi_add_handle(conn->multi, curl) != CURLM_OK)
+		transfer_done(resp, CURLE_FAILED_INIT);
+
+	return resp;
+}
 
+#define TRANSFER_POLL_INTERVAL 100	/* ms */
 
-	if (errcode == CURLE_ABORTED_BY_CALLBACK)
+/*
+ * Runs the transfer until the response buffer holds at least want bytes, or
+ * the transfer is done. The buffer limit grows if needed to fit want.
+ */
+void
+ch_http_response_wait(ch_http_response_t * resp, size_t want)
+{
+	if (resp->limit && want > resp->limit)
+		resp->limit = want;
+
+	while (!resp->done && resp->datasize < want)
 	{
-		resp->http_status = 418;	/* I'm teapot */
-		return resp;
+		if (resp->fill)
+		{
+			resp->fill(resp);
+			continue;
+		}
+
+		if (resp->paused)
+		{
+			/* curl may deliver the pending data right away */
+			ch_http_response_resume(resp);
+			continue;
+		}
+
+		run_transfers(resp->conn, TRANSFER_POLL_INTERVAL);
 	}
-	else if (errcode != CURLE_OK)
+}
+
+/*
+ * Lets a transfer paused by a full response buffer deliver more data.
+ */
+void
+ch_http_response_resume(ch_http_response_t * resp)
+{
+	if (resp->paused && resp->curl)
 	{
-		resp->http_status = 419;	/* illegal http status */
-		resp->data = strdup(errbuffer);
-		resp->datasize = strlen(errbuffer);
-		return resp;
+		resp->paused = false;
+		curl_easy_pause(resp->curl, CURLPAUSE_CONT);
 	}
+}
 
-	errcode = curl_easy_getinfo(conn->curl, CURLINFO_PRETRANSFER_TIME,
-								&resp->pretransfer_time);
-	if (errcode != CURLE_OK)
-		resp->pretransfer_time = 0;
+/*
+ * Discards the first n bytes of the response buffer, making room for more
+ * of the result.
+ */
+void
+ch_http_response_consume(ch_http_response_t * resp, size_t n)
+{
+	assert(n <= resp->datasize);
+	if (n == 0)
+		return;
 
-	errcode = curl_easy_getinfo(conn->curl, CURLINFO_TOTAL_TIME, &resp->total_time);
-	if (errcode != CURLE_OK)
-		resp->total_time = 0;
+	resp->datasize -= n;
+	memmove(resp->data, resp->data + n, resp->datasize);
+	resp->data[resp->datasize] = 0;
+}
+
+/*
+ * Reads the rest of the result into the response buffer.
+ */
+void
+ch_http_response_read_all(ch_http_response_t * resp)
+{
+	resp->limit = 0;
+	ch_http_response_wait(resp, SIZE_MAX);
+}
+
+/*
+ * Sends the query and returns without waiting for the response, so that
+ * the server executes it while the caller does other work. The transfer
+ * runs until the request has been sent, then the result streams into the
+ * response buffer as it is consumed once ch_http_response_await() returns.
+ */
+ch_http_response_t *
+ch_http_start_query(ch_http_connection_t * conn, const ch_query * query)
+{
+	ch_http_response_t *resp = start_query(conn, query, CH_HTTP_STREAM_BUFFER, false);
+	curl_off_t	sent = 0;
+
+	if (resp == NULL)
+		return NULL;
+
+	while (!resp->done && resp->datasize == 0 && sent < (curl_off_t) resp->bodysize)
+	{
+		run_transfers(conn, TRANSFER_POLL_INTERVAL);
+		if (resp->curl)
+			curl_easy_getinfo(resp->curl, CURLINFO_SIZE_UPLOAD_T, &sent);
+	}
+
+	return resp;
+}
+
+/*
+ * Sends the query like ch_http_start_query(), but returns as soon as the
+ * transfer has started. The caller runs it with ch_http_run(), so that one
+ * process can drive the transfers of many queries at once.
+ */
+ch_http_response_t *
+ch_http_begin_query(ch_http_connection_t * conn, const ch_query * query)
+{
+	ch_http_response_t *resp = start_query(conn, query, CH_HTTP_STREAM_BUFFER, false);
+
+	if (resp != NULL && !resp->done)
+		run_transfers(conn, 0);
+
+	return resp;
+}
+
+/*
+ * Runs all transfers of the connection without waiting, and adds the
+ * sockets they wait on to the nsockets of sockets, which has room for
+ * maxsockets, merging transfers that share a socket. Returns how long curl
+ * wants to wait for them at most in milliseconds, or -1 for no limit. A
+ * transfer that has no socket yet, while it resolves the host or connects,
+ * limits that to CH_HTTP_CONNECT_POLL_MS.
+ */
+long
+ch_http_run(ch_http_connection_t * conn, ch_http_socket * sockets,
+			int *nsockets, int maxsockets)
+{
+	long		timeout = -1;
+	bool		connecting = false;
+
+	run_transfers(conn, 0);
+
+	for (ch_http_response_t * resp = conn->responses; resp != NULL; resp = resp->next)
+	{
+		curl_socket_t sock = CURL_SOCKET_BAD;
+		curl_off_t	sent = 0;
+		bool		write;
+		int			i;
+
+		/* a paused transfer waits for its reader, not for the server */
+		if (resp->done || resp->paused)
+			continue;
+
+		if (curl_easy_getinfo(resp->curl, CURLINFO_ACTIVESOCKET, &sock) != CURLE_OK
+			|| sock == CURL_SOCKET_BAD)
+		{
+			connecting = true;
+			continue;
+		}
+
+		curl_easy_getinfo(resp->curl, CURLINFO_SIZE_UPLOAD_T, &sent);
+		write = (size_t) sent < resp->bodysize ||
+			resp->upload_pos < resp->upload_size;
+
+		for (i = 0; i < *nsockets; i++)
+		{
+			if (sockets[i].fd == (int) sock)
+				break;
+		}
+		if (i == *nsockets)
+		{
+			if (*nsockets == maxsockets)
+			{
+				connecting = true;
+				continue;
+			}
+			sockets[i].fd = (int) sock;
+			sockets[i].write = false;
+			(*nsockets)++;
+		}
+		sockets[i].write |= write;
+	}
+
+	if (curl_multi_timeout(conn->multi, &timeout) != CURLM_OK)
+		timeout = -1;
+	if (connecting && (timeout < 0 || timeout > CH_HTTP_CONNECT_POLL_MS))
+		timeout = CH_HTTP_CONNECT_POLL_MS;
+
+	return timeout;
+}
+
+/*
+ * Lets curl send the rest of the current upload chunk.
+ */
+static void
+upload_resume(ch_http_response_t * resp)
+{
+	if (resp->upload_paused && resp->curl)
+	{
+		resp->upload_paused = false;
+		curl_easy_pause(resp->curl, CURLPAUSE_CONT);
+	}
+}
+
+/*
+ * Runs the transfer until curl has sent the current upload chunk, or the
+ * transfer is done.
+ */
+static void
+upload_drain(ch_http_response_t * resp)
+{
+	while (!resp->done && resp->upload_pos < resp->upload_size)
+	{
+		upload_resume(resp);
+		run_transfers(resp->conn, TRANSFER_POLL_INTERVAL);
+	}
+}
+
+/*
+ * Starts an INSERT whose data follows the SQL of the query in the request
+ * body, streamed in chunks by ch_http_insert_write() while the caller is
+ * still producing rows. Call ch_http_insert_finish() to end the body and
+ * wait for the response.
+ */
+ch_http_response_t *
+ch_http_start_insert(ch_http_connection_t * conn, const ch_query * query)
+{
+	ch_http_response_t *resp = start_query(conn, query, 0, true);
+
+	if (resp != NULL && !resp->done)
+		run_transfers(conn, 0);
+
+	return resp;
+}
+
+/*
+ * Hands the next chunk of INSERT data to the request, once curl has sent
+ * the previous one, and lets the transfer run without waiting. The data is
+ * copied, so the caller may reuse its buffer right away. Returns false if
+ * the transfer has ended, typically because the server rejected the INSERT;
+ * ch_http_insert_finish() then collects the response.
+ */
+bool
+ch_http_insert_write(ch_http_response_t * resp, const char *data, size_t len)
+{
+	upload_drain(resp);
+	if (resp->done)
+		return false;
+
+	if (!upload_fill(resp, data, len, false))
+	{
+		transfer_done(resp, CURLE_OUT_OF_MEMORY);
+		return false;
+	}
+
+	upload_resume(resp);
+	run_transfers(resp->conn, 0);
+	return !resp->done;
+}
+
+/*
+ * Ends the body of an INSERT and reads the response.
+ */
+void
+ch_http_insert_finish(ch_http_response_t * resp)
+{
+	upload_drain(resp);
+	if (!resp->done)
+	{
+		if (!upload_fill(resp, NULL, 0, true))
+		{
+			transfer_done(resp, CURLE_OUT_OF_MEMORY);
+			return;
+		}
+
+		resp->upload_eof = true;
+		upload_drain(resp);
+		upload_resume(resp);
+	}
+
+	ch_http_response_read_all(resp);
+}
+
+/*
+ * Waits for the response to a started query to arrive. Responses with an
+ * error status are read in full.
+ */
+void
+ch_http_response_await(ch_http_response_t * resp)
+{
+	ch_http_response_wait(resp, 1);
+	if (resp->http_status != 200)
+		ch_http_response_read_all(resp);
+}
+
+/*
+ * Starts executing the query and waits for the response to arrive, then
+ * returns while the rest of the result streams into the response buffer
+ * as it is consumed. Responses with an error status are read in full.
+ */
+ch_http_response_t *
+ch_http_stream_query(ch_http_connection_t * conn, const ch_query * query)
+{
+	ch_http_response_t *resp = start_query(conn, query, CH_HTTP_STREAM_BUFFER, false);
+
+	if (resp != NULL)
+		ch_http_response_await(resp);
+
+	return resp;
+}
+
+/*
+ * Returns the socket to wait on until the response buffer holds more of the
+ * result past offset, or -1 if it can be read now, if the transfer has
+ * finished or needs to run right away, or if it has no socket yet. With
+ * lines, buffered data counts only up to the end of its last complete line.
+ *
+ * Under HTTP/2 the socket may carry other transfers too, so it can become
+ * readable without more of this result having arrived.
+ */
+int
+ch_http_response_socket(ch_http_response_t * resp, size_t offset, bool lines)
+{
+	ch_http_connection_t *conn = resp->conn;
+	curl_socket_t sock = CURL_SOCKET_BAD;
+	long		timeout = -1;
 
 	/*
-	 * All good with request, but we need http status to make sure query went
-	 * ok
+	 * A response from the multiplexer arrives through a shm_mq, which sets
+	 * the latch rather than making a socket readable, so it has nothing an
+	 * async Append could wait on.
 	 */
-	curl_easy_getinfo(conn->curl, CURLINFO_RESPONSE_CODE, &resp->http_status);
-	if (curl_verbose && resp->http_status != 200)
-		fprintf(stderr, "%s", resp->data);
+	if (resp->fill)
+		return -1;
+
+	if (!resp->done && !resp->paused)
+		run_transfers(conn, 0);
+
+	if (resp->done || resp->paused)
+		return -1;
+
+	if (offset < resp->datasize &&
+		(!lines || memchr(resp->data + offset, '\n',
+						  resp->datasize - offset) != NULL))
+		return -1;
+
+	if (curl_multi_timeout(conn->multi, &timeout) != CURLM_OK || timeout == 0)
+		return -1;
+
+	if (curl_easy_getinfo(resp->curl, CURLINFO_ACTIVESOCKET, &sock) != CURLE_OK
+		|| sock == CURL_SOCKET_BAD)
+		return -1;
+
+	return (int) sock;
+}
+
+/*
+ * Executes the query and reads the entire result.
+ */
+ch_http_response_t *
+ch_http_simple_query(ch_http_connection_t * conn, const ch_query * query)
+{
+	ch_http_response_t *resp = start_query(conn, query, 0, false);
+
+	if (resp != NULL)
+		ch_http_response_read_all(resp);
 
 	return resp;
 }
@@ -258,10 +1202,22 @@ ch_http_simple_query(ch_http_connection_t * conn, const ch_query * query)
 void
 ch_http_close(ch_http_connection_t * conn)
 {
+	while (conn->responses)
+	{
+		ch_http_response_t *resp = conn->responses;
+
+		detach_response(resp);
+		resp->conn = NULL;
+	}
+
 	free(conn->base_url);
 	if (conn->dbname)
 		free(conn->dbname);
-	curl_easy_cleanup(conn->curl);
+	if (conn->compression)
+		free(conn->compression);
+	if (conn->idle)
+		curl_easy_cleanup(conn->idle);
+	curl_multi_cleanup(conn->multi);
 }
 
 char	   *
@@ -276,6 +1232,10 @@ ch_http_last_error(void)
 void
 ch_http_response_free(ch_http_response_t * resp)
 {
+	detach_response(resp);
+	if (resp->release)
+		resp->release(resp);
+
 	if (resp->data)
 		free(resp->data);
 
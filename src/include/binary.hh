@@ -17,6 +17,7 @@ extern "C"
 		size_t		blocks_count;
 		char	   *error;
 		bool		success;
+		bool		unsent;		/* the query failed before it was sent */
 	}			ch_binary_response_t;
 
 	typedef struct
@@ -61,23 +62,36 @@ extern "C"
 		void	   *conversion_states;
 		char	   *table_name;
 
-		Datum	   *values;
+		Datum	   *values;		/* batch_size values per column */
 		bool	   *nulls;
+		int			batch_size;
 		bool		success;
 
+		int			max_block_rows; /* send block after this many rows */
+		int			max_block_bytes;	/* ...or this many bytes */
+		size_t		block_rows;
+		size_t		block_bytes;
+
 		ch_binary_connection_t *conn;
 	}			ch_binary_insert_state;
 
 	extern ch_binary_connection_t * ch_binary_connect(ch_connection_details * details, char **error);
 	extern void ch_binary_close(ch_binary_connection_t * conn);
 	extern ch_binary_response_t * ch_binary_simple_query(ch_binary_connection_t * conn,
-														 const ch_query * query, bool (*check_cancel) (void));
+														 const ch_query * query, size_t max_blocks,
+														 bool (*check_cancel) (void));
+	extern ch_binary_response_t * ch_binary_start_query(ch_binary_connection_t * conn,
+														const ch_query * query, size_t max_blocks,
+														bool (*check_cancel) (void));
+	extern void ch_binary_response_await(ch_binary_response_t * resp);
 	extern void ch_binary_response_free(ch_binary_response_t * resp);
 
 /* reading */
 	void		ch_binary_read_state_init(ch_binary_read_state_t * state, ch_binary_response_t * resp);
 	void		ch_binary_read_state_free(ch_binary_read_state_t * state);
 	bool		ch_binary_read_row(ch_binary_read_state_t * state);
+	int			ch_binary_response_socket(ch_binary_response_t * resp,
+										  ch_binary_read_state_t * state);
 	Datum		ch_binary_convert_datum(void *state, Datum val);
 	void	   *ch_binary_init_convert_state(Datum val, Oid intype, Oid outtype);
 	void		ch_binary_free_convert_state(void *);
@@ -86,11 +100,12 @@ extern "C"
 	void		ch_binary_prepare_insert(void *conn, const ch_query * query,
 										 ch_binary_insert_state * state);
 	void		ch_binary_insert_columns(ch_binary_insert_state * state);
-	void		ch_binary_column_append_data(ch_binary_insert_state * state, size_t colidx);
+	void		ch_binary_column_append_data(ch_binary_insert_state * state, size_t colidx,
+											 size_t nrows);
 	void	   *ch_binary_make_tuple_map(TupleDesc indesc, TupleDesc outdesc);
 	void		ch_binary_insert_state_free(void *c);
 	void		ch_binary_do_output_convertion(ch_binary_insert_state * insert_state,
-											   TupleTableSlot * slot);
+											   TupleTableSlot * slot, size_t row);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,15 @@
+#ifndef CLICKHOUSE_DECIMAL_H
+#define CLICKHOUSE_DECIMAL_H
+
+#include "postgres.h"
+#include "utils/numeric.h"
+
+/* 32-bit limbs of the largest Decimal, Decimal256 */
+#define CH_DECIMAL_MAX_LIMBS 8
+
+Datum		ch_decimal_to_numeric(const uint32 *limbs, int nlimbs, bool is_signed,
+								  int scale);
+void		ch_decimal_from_numeric(Numeric num, int precision, int scale,
+									uint32 *limbs, int nlimbs);
+
+#endif							/* CLICKHOUSE_DECIMAL_H */
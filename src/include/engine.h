@@ -13,15 +13,40 @@ typedef struct
 	char	   *username;
 	char	   *password;
 	char	   *dbname;
+	char	   *compression;	/* http content encoding or binary block
+								 * compression method, NULL for none */
+	bool		keepalive;		/* enable TCP keepalive */
+	bool		http2;			/* negotiate HTTP/2 (http driver) */
+	bool		ping;			/* ping before each query (binary driver) */
+	int			connect_timeout;	/* seconds, 0 for the driver default */
+	int			send_timeout;	/* seconds, 0 for the driver default */
+	int			receive_timeout;	/* seconds, 0 for the driver default */
 }			ch_connection_details;
 
 /*
- * ch_query an SQL query to execute on ClickHouse.
+ * ch_format is the format in which the http driver receives query results:
+ * TabSeparated text, or RowBinaryWithNamesAndTypes decoded by rowbinary.c.
+ * The binary driver ignores it.
+ */
+typedef enum
+{
+	CH_FORMAT_TSV,
+	CH_FORMAT_ROWBINARY
+}			ch_format;
+
+/*
+ * ch_query an SQL query to execute on ClickHouse. The SQL may refer to
+ * num_params query parameters named p1, p2, etc., whose values are in
+ * param_values, NULL for SQL NULL. format selects the result format of the
+ * http driver.
  */
 typedef struct
 {
 	const char	   *sql;
 	const List	   *settings;
+	int				num_params;
+	const char	  **param_values;
+	ch_format		format;
 }			ch_query;
 
 #define new_query(sql) {sql, chfdw_parse_options(ch_session_settings, true, false)}
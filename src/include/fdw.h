@@ -24,6 +24,7 @@
 #include "optimizer/optimizer.h"
 #include "nodes/pathnodes.h"
 #include "access/heapam.h"
+#include "datatype/timestamp.h"
 #include "engine.h"
 
 #if PG_VERSION_NUM < 150000
@@ -43,26 +44,38 @@ typedef struct ch_cursor
 	double		request_time;
 	double		total_time;
 	size_t		columns_count;
-	uintptr_t  *conversion_states;	/* for binary */
+	uintptr_t  *conversion_states;	/* for binary and RowBinary */
+	void	   *rowbinary;		/* RowBinary decoder for http, or NULL */
+
+	/* query sent by begin_query, its response not yet checked */
+	bool		pending;
+	ch_query	request;		/* the query, valid while pending */
 }			ch_cursor;
 
 typedef void (*disconnect_method) (void *conn);
 typedef void (*check_conn_method) (const char *password, UserMapping * user);
 typedef ch_cursor * (*simple_query_method) (void *conn, const ch_query *query);
+typedef ch_cursor * (*begin_query_method) (void *conn, const ch_query *query);
+typedef pgsocket (*cursor_socket_method) (ch_cursor * cursor);
 typedef void (*simple_insert_method) (void *conn, const ch_query *query);
 typedef void **(*cursor_fetch_row_method) (ch_cursor * cursor, List * attrs,
 										   TupleDesc tupdesc, Datum * values, bool *nulls);
 typedef void *(*prepare_insert_method) (void *conn, ResultRelInfo *, List *,
 										const ch_query *, char *);
 typedef void (*insert_tuple_method) (void *state, TupleTableSlot * slot);
+typedef void (*insert_tuples_method) (void *state, TupleTableSlot * *slots,
+									  int nslots);
 
 typedef struct
 {
 	disconnect_method disconnect;
 	simple_query_method simple_query;
+	begin_query_method begin_query;
+	cursor_socket_method cursor_socket;
 	cursor_fetch_row_method fetch_row;
 	prepare_insert_method prepare_insert;
 	insert_tuple_method insert_tuple;
+	insert_tuples_method insert_tuples;
 }			libclickhouse_methods;
 
 typedef struct
@@ -70,13 +83,21 @@ typedef struct
 	libclickhouse_methods *methods;
 	void	   *conn;
 	bool		is_binary;
+	ch_format	format;			/* result format of scans */
 }			ch_connection;
 
 ch_connection_details *connstring_parse(const char *connstring);
 ch_connection chfdw_http_connect(ch_connection_details * details);
 ch_connection chfdw_binary_connect(ch_connection_details * details);
 text	   *chfdw_http_fetch_raw_data(ch_cursor * cursor);
+void		chfdw_http_transfer_stats(long *requests, long *connects);
+char	   *chfdw_http_transport(void *conn);
 List	   *chfdw_construct_create_tables(ImportForeignSchemaStmt * stmt, ForeignServer * server);
+char	  **chfdw_fetch_string_row(ch_connection conn, const char *sql,
+								   int ncolumns);
+bool		chfdw_fetch_remote_estimate(ch_connection conn, const char *sql,
+										double *rows, double *table_rows,
+										double *bytes);
 
 typedef enum
 {
@@ -85,6 +106,43 @@ typedef enum
 	CH_AGGREGATING_MERGE_TREE
 }			CHRemoteTableEngine;
 
+/* How ANALYZE samples a foreign table, see the analyze_sampling option */
+typedef enum
+{
+	CH_ANALYZE_SAMPLE_OFF,		/* fetch the whole table */
+	CH_ANALYZE_SAMPLE_AUTO,		/* SAMPLE if the table has a sampling key */
+	CH_ANALYZE_SAMPLE_RANDOM,	/* ORDER BY rand() LIMIT targrows */
+	CH_ANALYZE_SAMPLE_SAMPLE	/* SAMPLE clause */
+}			ChAnalyzeSampling;
+
+/* How a server with several hosts picks one, see the load_balance option */
+typedef enum
+{
+	CH_LOAD_BALANCE_IN_ORDER,	/* the first one that is up */
+	CH_LOAD_BALANCE_ROUND_ROBIN,	/* each in turn */
+	CH_LOAD_BALANCE_RANDOM,		/* any one */
+	CH_LOAD_BALANCE_LEAST_LATENCY	/* the fastest to connect to */
+}			ChLoadBalance;
+
+/* Statistics of a remote table, see stats.c */
+#define CH_STATS_MAX_COLUMNS 64
+#define CH_STATS_UNIQ_ROWS 1000000
+
+typedef struct ChColumnStats
+{
+	char		name[NAMEDATALEN];	/* remote column name */
+	double		bytes;			/* uncompressed size in active parts */
+	double		ndistinct;		/* distinct values, or minus their ratio to
+								 * rows like pg_statistic, 0 if unknown */
+}			ChColumnStats;
+
+typedef struct ChTableStats
+{
+	double		rows;			/* rows in active parts */
+	int			ncolumns;
+	ChColumnStats columns[CH_STATS_MAX_COLUMNS];
+}			ChTableStats;
+
 /*
  * FDW-specific planner information kept in RelOptInfo.fdw_private for a
  * postgres_fdw foreign table. For a baserel, this struct is created by
@@ -133,8 +191,13 @@ typedef struct CHFdwRelationInfo
 	Cost		rel_startup_cost;
 	Cost		rel_total_cost;
 
+	/* True means rows and widths are estimated from ClickHouse statistics */
+	bool		remote_sizes;
+
 	/* Options extracted from catalogs. */
 	bool		use_remote_estimate;
+	bool		use_cached_estimate;	/* size scans from stats.c */
+	bool		async_capable;
 	Cost		fdw_startup_cost;
 	Cost		fdw_tuple_cost;
 	List	   *shippable_extensions;	/* OIDs of whitelisted extensions */
@@ -183,6 +246,10 @@ typedef struct CHFdwRelationInfo
 	/* Custom */
 	CHRemoteTableEngine ch_table_engine;
 	char		ch_table_sign_field[NAMEDATALEN];
+
+	/* Parallel scan: quoted remote columns hashed to split the table */
+	char	   *parallel_key;
+	int			parallel_workers;	/* -1 means max_parallel_workers_per_gather */
 }			CHFdwRelationInfo;
 
 /* in fdw.c */
@@ -194,12 +261,54 @@ extern Expr * chfdw_find_em_expr_for_rel(EquivalenceClass * ec, RelOptInfo * rel
 
 /* in connection.c */
 extern ch_connection chfdw_get_connection(UserMapping * user);
+extern void chfdw_release_connection(ch_connection conn);
+extern bool chfdw_connection_failed(ch_connection conn);
+extern char *chfdw_connection_host(ch_connection conn);
 extern void chfdw_exec_query(ch_connection conn, const char *query);
 extern void chfdw_report_error(int elevel, ch_connection conn,
 							   bool clear, const char *sql);
 
+/* in stats.c */
+extern void chfdw_stats_init(void);
+extern bool chfdw_stats_lookup(Relation rel, ChTableStats * stats);
+
+/* in mux.c */
+struct ch_http_connection_t;
+struct ch_http_response_t;
+extern void chfdw_mux_init(void);
+extern struct ch_http_response_t *chfdw_mux_start_query(struct ch_http_connection_t *conn,
+														const ch_query * query);
+
+/* in resultcache.c */
+extern void chfdw_result_cache_init(void);
+extern Size chfdw_result_cache_max_size(void);
+extern char *chfdw_result_cache_get(const char *key, Size keylen, Size *len);
+extern void chfdw_result_cache_put(const char *key, Size keylen,
+								   const char *data, Size len, int ttl);
+
+/* in pglink.c */
+extern void chfdw_fetch_table_stats(ch_connection conn, Relation rel,
+									ChTableStats * stats);
+
 /* in option.c */
 extern char *ch_session_settings;
+extern int	ch_binary_buffer_blocks;
+extern int	ch_insert_block_rows;
+extern int	ch_insert_block_bytes;
+extern int	ch_stats_cache_size;
+extern int	ch_stats_cache_ttl;
+extern int	ch_mux_connections;
+extern int	ch_result_cache_size;
+extern void chfdw_get_insert_block_limits(Oid relid, int *rows, int *bytes);
+extern int	chfdw_get_insert_batch_size(Oid relid);
+extern ChAnalyzeSampling chfdw_get_analyze_sampling(Oid relid);
+extern int	chfdw_get_result_cache_ttl(Oid relid);
+extern ch_format chfdw_get_format(List * options);
+extern ChLoadBalance chfdw_get_load_balance(List * options);
+extern void chfdw_get_connection_options(List * options,
+										 ch_connection_details * details);
+extern void chfdw_get_pool_options(List * options, int *size,
+								   int *idle_timeout);
 extern void
 			chfdw_extract_options(List * defelems, char **driver, char **host, int *port,
 								  char **dbname, char **username, char **password);
@@ -217,12 +326,28 @@ extern bool chfdw_is_foreign_expr(PlannerInfo * root,
 extern char *chfdw_deparse_insert_sql(StringInfo buf, RangeTblEntry * rte,
 									  Index rtindex, Relation rel,
 									  List * targetAttrs);
+extern void chfdw_deparse_estimate_sql(StringInfo buf, Relation rel,
+									   Bitmapset * attrs_used,
+									   const char *sql);
+extern void chfdw_deparse_analyze_info_sql(StringInfo buf, Relation rel);
+extern void chfdw_deparse_analyze_count_sql(StringInfo buf, Relation rel);
+extern void chfdw_deparse_table_stats_sql(StringInfo buf, Relation rel);
+extern void chfdw_deparse_uniq_sql(StringInfo buf, Relation rel,
+								   List * columns, int limit);
+extern void chfdw_get_remote_relation_name(Relation rel, char **dbname,
+										   const char **relname);
+extern char *chfdw_get_remote_column_name(Relation rel, int attnum);
+extern void chfdw_deparse_analyze_sql(StringInfo buf, Relation rel,
+									  ChAnalyzeSampling method, int targrows,
+									  List * *retrieved_attrs);
 extern List * chfdw_build_tlist_to_deparse(RelOptInfo * foreignrel);
 extern void chfdw_deparse_select_stmt_for_rel(StringInfo buf, PlannerInfo * root, RelOptInfo * rel,
 											  List * tlist, List * remote_conds, List * pathkeys,
 											  bool has_final_sort, bool has_limit, bool is_subquery,
 											  List * *retrieved_attrs, List * *params_list);
 extern const char *chfdw_get_jointype_name(JoinType jointype);
+extern const char *chfdw_param_type_name(Oid type);
+extern char *chfdw_format_param_value(Oid type, Datum value);
 
 /* in shippable.c */
 extern bool chfdw_is_builtin(Oid objectId);
@@ -236,14 +361,36 @@ typedef struct ConnCacheKey
 	Oid			userid;
 }			ConnCacheKey;
 
-typedef struct ConnCacheEntry
+/*
+ * Each backend keeps a pool of up to pool_size connections per user mapping,
+ * so that concurrent scans and inserts don't share a connection.
+ */
+#define CH_POOL_MAX_SIZE 32
+#define CH_POOL_DEFAULT_SIZE 4
+#define CH_POOL_DEFAULT_IDLE_TIMEOUT 60
+
+/* Size of the "host:port" keys of the hosts of a server */
+#define CH_HOST_KEY_LEN 256
+
+typedef struct ConnPoolSlot
 {
-	ConnCacheKey key;			/* hash key (must be first) */
 	ch_connection gate;			/* connection to foreign server, or NULL */
 	/* Remaining fields are invalid when conn is NULL: */
+	int			users;			/* scans and inserts using the connection */
 	bool		invalidated;	/* true if reconnect is pending */
+	TimestampTz idle_since;		/* when the last user released it */
+	int			nhosts;			/* number of hosts of the server */
+	char		host[CH_HOST_KEY_LEN];	/* "host:port" connected to */
+}			ConnPoolSlot;
+
+typedef struct ConnCacheEntry
+{
+	ConnCacheKey key;			/* hash key (must be first) */
+	int			pool_size;		/* most connections to open */
+	int			idle_timeout;	/* seconds before closing idle connections */
 	uint32		server_hashvalue;	/* hash value of foreign server OID */
 	uint32		mapping_hashvalue;	/* hash value of user mapping OID */
+	ConnPoolSlot slots[CH_POOL_MAX_SIZE];
 }			ConnCacheEntry;
 
 /* Custom behavior types */
@@ -6,16 +6,67 @@
 #include "lib/stringinfo.h"
 #include "engine.h"
 
+#include <curl/curl.h>
+
+/* Bytes of a streamed result buffered ahead of the reader */
+#define CH_HTTP_STREAM_BUFFER (1024 * 1024)
+
+/* Longest ch_http_run() lets a transfer connect unwatched */
+#define CH_HTTP_CONNECT_POLL_MS 10
+
+/* Transport flags of a connection */
+#define CH_HTTP_KEEPALIVE	0x01	/* enable TCP keepalive */
+#define CH_HTTP_HTTP2		0x02	/* negotiate HTTP/2 over TLS */
+
 typedef struct ch_http_connection_t ch_http_connection_t;
-typedef struct ch_http_response_t
+typedef struct ch_http_response_t ch_http_response_t;
+
+/* A socket that transfers wait on, see ch_http_run() */
+typedef struct ch_http_socket
+{
+	int			fd;
+	bool		write;			/* a transfer waits to send */
+}			ch_http_socket;
+struct ch_http_response_t
 {
 	char	   *data;
 	size_t		datasize;
 	long		http_status;
+	bool		unsent;			/* failed before the server got the request */
 	char		query_id[37];
 	double		pretransfer_time;
 	double		total_time;
-}			ch_http_response_t;
+
+	/* transfer state */
+	size_t		bufsize;		/* allocated size of data */
+	size_t		limit;			/* pause the transfer at this datasize */
+	bool		paused;
+	bool		done;			/* the transfer has finished */
+	CURL	   *curl;
+	struct curl_slist *headers;
+	char	   *body;			/* compressed request body, if any */
+	size_t		bodysize;		/* size of the request body as sent */
+
+	/* request body streamed by ch_http_insert_write() */
+	char	   *upload;			/* chunk being sent */
+	size_t		upload_size;	/* bytes in the chunk */
+	size_t		upload_alloc;	/* allocated size of upload */
+	size_t		upload_pos;		/* bytes of the chunk sent so far */
+	bool		upload_eof;		/* the last chunk has been handed over */
+	bool		upload_paused;	/* curl waits for the next chunk */
+	void	   *upload_zs;		/* z_stream gzipping the body, if any */
+	char		errbuffer[CURL_ERROR_SIZE];
+	ch_http_connection_t *conn;
+	ch_http_response_t *next;	/* other running transfers of conn */
+
+	/*
+	 * A response received from the multiplexer, see mux.c, has no conn.
+	 * fill waits for more of it, release frees its source.
+	 */
+	void		(*fill) (ch_http_response_t * resp);
+	void		(*release) (ch_http_response_t * resp);
+	void	   *fill_arg;
+};
 
 typedef enum
 {
@@ -26,33 +77,76 @@ typedef enum
 
 typedef struct
 {
-	char	   *data;
-	size_t		buflen;
+	ch_http_response_t *resp;
 	size_t		curpos;
-	size_t		maxpos;
-	char	   *val;
+	size_t		line_end;		/* line feed ending the current row */
+	bool		in_line;		/* line_end is known */
+	bool		line_eof;		/* the row isn't terminated by a line feed */
+	char	   *val;			/* last field, points into resp->data */
 	bool		done;
 }			ch_http_read_state;
 
+/*
+ * Size of the chunks in which INSERT data is handed to a running request.
+ * One chunk is being filled while the previous one is being sent.
+ */
+#define CH_HTTP_INSERT_CHUNK (1024 * 1024)
+
 typedef struct
 {
-	StringInfoData sql;
+	StringInfoData sql;			/* rows of the chunk being filled */
 	char	   *sql_begin;		/* beginning part of constructed sql */
 	List	   *target_attrs;	/* list of target attribute numbers */
 	int			p_nums;			/* number of parameters to transmit */
+	int			max_block_rows; /* send query after this many rows */
+	int			max_block_bytes;	/* ...or this many bytes */
+	int			block_rows;
+	size_t		block_bytes;	/* bytes handed to resp so far */
 	ch_http_connection_t *conn;
+	struct ch_rowbinary_type **columns; /* RowBinary encoders, or NULL for
+										 * TabSeparated */
+	Oid		   *valtypes;		/* base types of the inserted values */
+	ch_http_response_t *resp;	/* INSERT request receiving the block */
+	MemoryContextCallback callback; /* aborts resp on error */
 }			ch_http_insert_state;
 
 void		ch_http_init(int verbose, uint32_t query_id_prefix);
 void		ch_http_set_progress_func(void *progressfunc);
+void		ch_http_transfer_stats(long *transfers, long *connects);
+void		ch_http_transport(ch_http_connection_t * conn, long *http_version,
+							  int *keepalive);
 ch_http_connection_t *ch_http_connection(ch_connection_details * details);
+ch_http_connection_t *ch_http_connection_url(char *base_url, const char *dbname,
+											 const char *compression, int flags);
+void		ch_http_connection_info(ch_http_connection_t * conn, const char **base_url,
+									const char **dbname, const char **compression,
+									int *flags);
+void		ch_http_set_max_connections(ch_http_connection_t * conn, long max);
 void		ch_http_close(ch_http_connection_t * conn);
 ch_http_response_t *ch_http_simple_query(ch_http_connection_t * conn, const ch_query *query);
+ch_http_response_t *ch_http_stream_query(ch_http_connection_t * conn, const ch_query *query);
+ch_http_response_t *ch_http_start_query(ch_http_connection_t * conn, const ch_query *query);
+ch_http_response_t *ch_http_begin_query(ch_http_connection_t * conn, const ch_query *query);
+long		ch_http_run(ch_http_connection_t * conn, ch_http_socket * sockets,
+						int *nsockets, int maxsockets);
+ch_http_response_t *ch_http_start_insert(ch_http_connection_t * conn, const ch_query *query);
+bool		ch_http_insert_write(ch_http_response_t * resp, const char *data, size_t len);
+void		ch_http_insert_finish(ch_http_response_t * resp);
 char	   *ch_http_last_error(void);
 
 /* read */
-void		ch_http_read_state_init(ch_http_read_state * state, char *data, size_t datalen);
+void		ch_http_response_await(ch_http_response_t * resp);
+int			ch_http_response_socket(ch_http_response_t * resp, size_t offset,
+									bool lines);
+void		ch_http_response_wait(ch_http_response_t * resp, size_t want);
+void		ch_http_response_consume(ch_http_response_t * resp, size_t n);
+void		ch_http_response_resume(ch_http_response_t * resp);
+bool		ch_http_response_append(ch_http_response_t * resp, const char *data, size_t len);
+void		ch_http_response_read_all(ch_http_response_t * resp);
+void		ch_http_read_state_init(ch_http_read_state * state, ch_http_response_t * resp);
 void		ch_http_read_state_free(ch_http_read_state * state);
+bool		ch_http_read_eof(ch_http_read_state * state);
+bool		ch_http_read_ensure(ch_http_read_state * state, size_t n);
 int			ch_http_read_next(ch_http_read_state * state);
 void		ch_http_response_free(ch_http_response_t * resp);
 
@@ -5,9 +5,15 @@
 
 typedef struct ch_http_connection_t
 {
-	CURL	   *curl;
+	CURLM	   *multi;			/* runs the transfers, caches connections */
+	CURL	   *idle;			/* easy handle kept for the next transfer */
+	struct ch_http_response_t *responses;	/* running transfers */
 	char	   *dbname;
 	char	   *base_url;
+	char	   *compression;	/* content encoding to accept, or NULL */
+	int			flags;			/* CH_HTTP_KEEPALIVE, CH_HTTP_HTTP2 */
+	long		http_version;	/* of the last transfer, see record_transport() */
+	int			keepalive;		/* SO_KEEPALIVE of its socket, -1 if unknown */
 }			ch_http_connection_t;
 
 typedef struct ch_binary_connection_t
@@ -15,6 +21,7 @@ typedef struct ch_binary_connection_t
 	void	   *client;
 	void	   *options;
 	char	   *error;
+	void	   *stream;			/* SELECT result still being read, if any */
 }			ch_binary_connection_t;
 
 /*
@@ -0,0 +1,35 @@
+#ifndef CLICKHOUSE_ROWBINARY_H
+#define CLICKHOUSE_ROWBINARY_H
+
+#include "postgres.h"
+#include "http.h"
+
+typedef struct ch_rowbinary_type ch_rowbinary_type;
+
+/*
+ * State for decoding a result in the RowBinaryWithNamesAndTypes format
+ * from an http response. Values are decoded into the same Datums the binary
+ * driver returns, so that the conversions in convert.c apply to both.
+ */
+typedef struct
+{
+	ch_http_read_state *read;	/* the response being decoded */
+	bool		header_read;	/* column names and types have been read */
+	bool		truncated;		/* the response ended in the middle of a row */
+
+	size_t		columns_count;
+	ch_rowbinary_type **columns;	/* decoders by column */
+	Oid		   *coltypes;		/* type of the values of each column */
+	Datum	   *values;			/* values of the current row */
+	bool	   *nulls;
+}			ch_rowbinary_state;
+
+void		ch_rowbinary_init(ch_rowbinary_state * state, ch_http_read_state * read);
+bool		ch_rowbinary_read_header(ch_rowbinary_state * state);
+bool		ch_rowbinary_read_row(ch_rowbinary_state * state);
+
+bool		ch_rowbinary_can_write(const ch_rowbinary_type * type, Oid valtype);
+void		ch_rowbinary_write_value(StringInfo buf, const ch_rowbinary_type * type,
+									 Datum val, Oid valtype, bool isnull);
+
+#endif							/* CLICKHOUSE_ROWBINARY_H */
@@ -0,0 +1,861 @@
+/*-------------------------------------------------------------------------
+ *
+ * mux.c
+ *		  Connection multiplexer of the http driver
+ *
+ * Every backend opens its own connections to ClickHouse, so hundreds of
+ * client connections mean hundreds of ClickHouse connections, each paying
+ * for its own TCP and TLS handshakes. When pg_clickhouse is loaded via
+ * shared_preload_libraries and pg_clickhouse.multiplexer_connections is set,
+ * a background worker instead runs the queries of the http driver for all
+ * backends, over at most that many connections per server and user.
+ *
+ * A backend hands a query to the worker in a dynamic shared memory segment
+ * holding the request and a shm_mq, and posts the segment in a queue in
+ * shared memory. The worker sends the query, and streams the response back
+ * through the shm_mq as it arrives: a header with the HTTP status, the raw
+ * result in chunks, and a trailer with the final status. The backend reads
+ * it into an ordinary http response, so the TSV and RowBinary parsers work
+ * unchanged. If the worker isn't running or its queue is full, the backend
+ * runs the query itself. INSERTs always use the backend's own connections.
+ *
+ * Copyright (c) 2025, ClickHouse, Inc.
+ *
+ * IDENTIFICATION
+ *		  github.com/clickhouse/pg_clickhouse/src/mux.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "nodes/makefuncs.h"
+#include "nodes/value.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/dsm.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "tcop/tcopprot.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+
+#include "fdw.h"
+#include "http.h"
+
+/* Identifies the segments of multiplexer requests */
+#define CH_MUX_MAGIC 0x43484d58
+
+#define CH_MUX_KEY_REQUEST 1
+#define CH_MUX_KEY_QUEUE 2
+
+/* Requests waiting for the worker to pick them up */
+#define CH_MUX_QUEUE_LENGTH 128
+
+/* Size of the shm_mq of each request, and the most data per message */
+#define CH_MUX_QUEUE_SIZE (256 * 1024)
+#define CH_MUX_CHUNK (64 * 1024)
+
+/* Longest the worker or a backend sleeps before checking on the other */
+#define CH_MUX_NAPTIME_MS 1000L
+
+/* Message types sent by the worker, followed by their payload */
+#define CH_MUX_MSG_HEADER 'H'	/* ChMuxStatus, once the status is known */
+#define CH_MUX_MSG_DATA 'D'		/* the next part of the response */
+#define CH_MUX_MSG_END 'E'		/* ChMuxStatus, after all data */
+
+#if PG_VERSION_NUM >= 150000
+#define shm_mq_sendv_compat(mqh, iov, iovcnt, nowait) \
+	shm_mq_sendv(mqh, iov, iovcnt, nowait, true)
+#else
+#define shm_mq_sendv_compat(mqh, iov, iovcnt, nowait) \
+	shm_mq_sendv(mqh, iov, iovcnt, nowait)
+#endif
+
+#if PG_VERSION_NUM >= 170000
+#define CreateWaitEventSetCompat(nevents) CreateWaitEventSet(NULL, nevents)
+#else
+#define CreateWaitEventSetCompat(nevents) \
+	CreateWaitEventSet(CurrentMemoryContext, nevents)
+#endif
+
+typedef struct ChMuxShared
+{
+	slock_t		mutex;			/* protects the fields below */
+	int			pid;			/* pid of the worker, 0 if not running */
+	PGPROC	   *proc;			/* its PGPROC, to set its latch */
+	int			npending;
+	dsm_handle	pending[CH_MUX_QUEUE_LENGTH];
+}			ChMuxShared;
+
+/*
+ * Request as serialized in the segment: the connection URL, database and
+ * content encoding, the SQL, nsettings pairs of names and values, and
+ * nparams parameter values. Each string is NUL-terminated; the database,
+ * encoding and parameter values are preceded by a byte that is 0 for NULL.
+ */
+typedef struct ChMuxRequest
+{
+	int			format;
+	int			flags;			/* transport flags of the connection */
+	int			nsettings;
+	int			nparams;
+	Size		len;
+	char		data[FLEXIBLE_ARRAY_MEMBER];
+}			ChMuxRequest;
+
+typedef struct ChMuxStatus
+{
+	long		http_status;
+	bool		unsent;
+	char		query_id[37];
+	double		pretransfer_time;
+	double		total_time;
+}			ChMuxStatus;
+
+/* A request being received by a backend */
+typedef struct ChMuxReceiver
+{
+	dsm_segment *seg;
+	shm_mq_handle *mqh;
+	int			worker_pid;		/* worker when the request was posted */
+}			ChMuxReceiver;
+
+/* A connection of the worker, shared by requests for the same server */
+typedef struct ChMuxConn
+{
+	char	   *key;			/* URL, database and encoding */
+	ch_http_connection_t *http;
+	struct ChMuxConn *next;
+}			ChMuxConn;
+
+/* A request being run by the worker */
+typedef struct ChMuxSession
+{
+	dsm_segment *seg;			/* NULL for a KILL QUERY the worker sent */
+	shm_mq_handle *mqh;
+	ChMuxConn  *conn;
+	ch_http_response_t *resp;
+	bool		header_sent;
+	char		msgtype;		/* message being sent, 0 for none */
+	ChMuxStatus status;			/* payload of a header or trailer */
+	Size		msglen;			/* size of the data being sent */
+	struct ChMuxSession *next;
+}			ChMuxSession;
+
+static ChMuxShared * mux_shared = NULL;
+static MemoryContext mux_loop_cxt = NULL;	/* reset by each worker loop */
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+PGDLLEXPORT void chfdw_mux_worker_main(Datum main_arg);
+
+static void mux_shmem_request(void);
+static void mux_shmem_startup(void);
+static void mux_fill(ch_http_response_t * resp);
+static void mux_release(ch_http_response_t * resp);
+static void mux_worker_exit(int code, Datum arg);
+static ChMuxSession * mux_worker_attach(dsm_handle handle, ChMuxConn * *conns);
+static bool mux_worker_pump(ChMuxSession * session, bool *progress);
+static void mux_worker_wait(ch_http_socket * sockets, int nsockets,
+							long timeout);
+
+/*
+ * Set up the multiplexer. Called by _PG_init(); does nothing unless
+ * pg_clickhouse is being preloaded and the multiplexer is enabled.
+ */
+void
+chfdw_mux_init(void)
+{
+	BackgroundWorker worker;
+
+	if (!process_shared_preload_libraries_in_progress ||
+		ch_mux_connections <= 0)
+		return;
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = mux_shmem_request;
+#else
+	mux_shmem_request();
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = mux_shmem_startup;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = 10;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_clickhouse");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "chfdw_mux_worker_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_clickhouse multiplexer");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pg_clickhouse multiplexer");
+	RegisterBackgroundWorker(&worker);
+}
+
+static void
+mux_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(MAXALIGN(sizeof(ChMuxShared)));
+}
+
+static void
+mux_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	mux_shared = ShmemInitStruct("pg_clickhouse multiplexer",
+								 sizeof(ChMuxShared), &found);
+	if (!found)
+	{
+		SpinLockInit(&mux_shared->mutex);
+		mux_shared->pid = 0;
+		mux_shared->proc = NULL;
+		mux_shared->npending = 0;
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Append a string, or NULL if nullable, to a serialized request.
+ */
+static void
+mux_append_string(StringInfo buf, const char *str, bool nullable)
+{
+	if (nullable)
+		appendStringInfoChar(buf, str != NULL);
+	if (str != NULL)
+		appendBinaryStringInfo(buf, str, strlen(str) + 1);
+}
+
+/*
+ * Read a string appended by mux_append_string() and advance *pos past it.
+ */
+static char *
+mux_read_string(char **pos, bool nullable)
+{
+	char	   *str = *pos;
+
+	if (nullable)
+	{
+		(*pos)++;
+		if (*str == 0)
+			return NULL;
+		str++;
+	}
+
+	*pos = str + strlen(str) + 1;
+	return str;
+}
+
+/*
+ * Has the worker run the query on behalf of the connection, and return a
+ * response that receives the result from it. Returns NULL if the worker
+ * isn't running or has too many requests waiting, in which case the caller
+ * runs the query itself.
+ */
+ch_http_response_t *
+chfdw_mux_start_query(ch_http_connection_t * conn, const ch_query * query)
+{
+	StringInfoData buf;
+	const char *base_url,
+			   *dbname,
+			   *compression;
+	int			flags;
+	shm_toc_estimator e;
+	Size		size;
+	dsm_segment *seg;
+	shm_toc    *toc;
+	ChMuxRequest *req;
+	shm_mq	   *mq;
+	ChMuxReceiver *recv;
+	ch_http_response_t *resp;
+	PGPROC	   *worker = NULL;
+	int			worker_pid = 0;
+	ListCell   *lc;
+
+	if (mux_shared == NULL || mux_shared->pid == 0)
+		return NULL;
+
+	resp = calloc(sizeof(ch_http_response_t), 1);
+	if (resp == NULL)
+		return NULL;
+
+	initStringInfo(&buf);
+	ch_http_connection_info(conn, &base_url, &dbname, &compression, &flags);
+	mux_append_string(&buf, base_url, false);
+	mux_append_string(&buf, dbname, true);
+	mux_append_string(&buf, compression, true);
+	mux_append_string(&buf, query->sql, false);
+	foreach(lc, (List *) query->settings)
+	{
+		DefElem    *setting = (DefElem *) lfirst(lc);
+
+		mux_append_string(&buf, setting->defname, false);
+		mux_append_string(&buf, strVal(setting->arg), false);
+	}
+	for (int i = 0; i < query->num_params; i++)
+		mux_append_string(&buf, query->param_values[i], true);
+
+	shm_toc_initialize_estimator(&e);
+	shm_toc_estimate_chunk(&e, offsetof(ChMuxRequest, data) + buf.len);
+	shm_toc_estimate_chunk(&e, CH_MUX_QUEUE_SIZE);
+	shm_toc_estimate_keys(&e, 2);
+	size = shm_toc_estimate(&e);
+
+	/* the cursor, not the resource owner, decides when to detach */
+	seg = dsm_create(size, 0);
+	dsm_pin_mapping(seg);
+	toc = shm_toc_create(CH_MUX_MAGIC, dsm_segment_address(seg), size);
+
+	req = shm_toc_allocate(toc, offsetof(ChMuxRequest, data) + buf.len);
+	req->format = query->format;
+	req->flags = flags;
+	req->nsettings = list_length((List *) query->settings);
+	req->nparams = query->num_params;
+	req->len = buf.len;
+	memcpy(req->data, buf.data, buf.len);
+	shm_toc_insert(toc, CH_MUX_KEY_REQUEST, req);
+	pfree(buf.data);
+
+	mq = shm_mq_create(shm_toc_allocate(toc, CH_MUX_QUEUE_SIZE),
+					   CH_MUX_QUEUE_SIZE);
+	shm_toc_insert(toc, CH_MUX_KEY_QUEUE, mq);
+	shm_mq_set_receiver(mq, MyProc);
+
+	SpinLockAcquire(&mux_shared->mutex);
+	if (mux_shared->pid != 0 && mux_shared->npending < CH_MUX_QUEUE_LENGTH)
+	{
+		mux_shared->pending[mux_shared->npending++] = dsm_segment_handle(seg);
+		worker = mux_shared->proc;
+		worker_pid = mux_shared->pid;
+	}
+	SpinLockRelease(&mux_shared->mutex);
+
+	if (worker == NULL)
+	{
+		dsm_detach(seg);
+		free(resp);
+		return NULL;
+	}
+	SetLatch(&worker->procLatch);
+
+	recv = MemoryContextAlloc(TopMemoryContext, sizeof(ChMuxReceiver));
+	recv->seg = seg;
+	recv->worker_pid = worker_pid;
+	recv->mqh = shm_mq_attach(mq, seg, NULL);
+
+	resp->fill = mux_fill;
+	resp->release = mux_release;
+	resp->fill_arg = recv;
+	return resp;
+}
+
+/*
+ * Fail a response whose worker went away.
+ */
+static void
+mux_lost(ch_http_response_t * resp)
+{
+	const char *error = "lost connection to the pg_clickhouse multiplexer";
+
+	resp->http_status = 419;	/* illegal http status */
+	resp->datasize = 0;
+	if (!ch_http_response_append(resp, error, strlen(error)))
+		elog(ERROR, "out of memory");
+	resp->done = true;
+}
+
+/*
+ * Wait for the next message from the worker and add it to the response.
+ */
+static void
+mux_fill(ch_http_response_t * resp)
+{
+	ChMuxReceiver *recv = resp->fill_arg;
+	ChMuxStatus status;
+	Size		nbytes;
+	void	   *data;
+	char	   *msg;
+
+	for (;;)
+	{
+		shm_mq_result res = shm_mq_receive(recv->mqh, &nbytes, &data, true);
+
+		if (res == SHM_MQ_SUCCESS)
+			break;
+		if (res == SHM_MQ_DETACHED)
+		{
+			mux_lost(resp);
+			return;
+		}
+
+		/* a worker that exits before attaching never detaches */
+		if (shm_mq_get_sender(shm_mq_get_queue(recv->mqh)) == NULL &&
+			mux_shared->pid != recv->worker_pid)
+		{
+			mux_lost(resp);
+			return;
+		}
+
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 CH_MUX_NAPTIME_MS,
+						 PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	msg = data;
+	switch (msg[0])
+	{
+		case CH_MUX_MSG_DATA:
+			if (!ch_http_response_append(resp, msg + 1, nbytes - 1))
+				elog(ERROR, "out of memory");
+			break;
+		case CH_MUX_MSG_HEADER:
+		case CH_MUX_MSG_END:
+			if (nbytes != 1 + sizeof(ChMuxStatus))
+				elog(ERROR, "pg_clickhouse: invalid message from the multiplexer");
+			memcpy(&status, msg + 1, sizeof(ChMuxStatus));
+			resp->http_status = status.http_status;
+			resp->unsent = status.unsent;
+			memcpy(resp->query_id, status.query_id, sizeof(resp->query_id));
+			resp->pretransfer_time = status.pretransfer_time;
+			resp->total_time = status.total_time;
+			if (msg[0] == CH_MUX_MSG_END)
+				resp->done = true;
+			break;
+		default:
+			elog(ERROR, "pg_clickhouse: invalid message from the multiplexer");
+	}
+}
+
+/*
+ * Detach from the request, which tells the worker to abandon it.
+ */
+static void
+mux_release(ch_http_response_t * resp)
+{
+	ChMuxReceiver *recv = resp->fill_arg;
+
+	shm_mq_detach(recv->mqh);
+	dsm_detach(recv->seg);
+	pfree(recv);
+	resp->fill_arg = NULL;
+}
+
+static void
+mux_worker_exit(int code, Datum arg)
+{
+	SpinLockAcquire(&mux_shared->mutex);
+	mux_shared->pid = 0;
+	mux_shared->proc = NULL;
+	SpinLockRelease(&mux_shared->mutex);
+}
+
+/*
+ * Stop the query of a request the backend gave up on, and forget the
+ * request.
+ */
+static void
+mux_worker_drop(ChMuxSession * session, ChMuxSession * *sessions)
+{
+	if (session->seg != NULL && !session->resp->done && session->conn != NULL)
+	{
+		ch_query	kill = {
+			psprintf("KILL QUERY WHERE query_id='%s' ASYNC",
+					 session->resp->query_id)
+		};
+		ch_http_response_t *resp = ch_http_begin_query(session->conn->http, &kill);
+
+		pfree((char *) kill.sql);
+		if (resp != NULL)
+		{
+			ChMuxSession *killer = palloc0(sizeof(ChMuxSession));
+
+			killer->conn = session->conn;
+			killer->resp = resp;
+			killer->next = *sessions;
+			*sessions = killer;
+		}
+	}
+
+	ch_http_response_free(session->resp);
+	if (session->seg != NULL)
+	{
+		shm_mq_detach(session->mqh);
+		dsm_detach(session->seg);
+	}
+	pfree(session);
+}
+
+/*
+ * Main loop of the multiplexer.
+ */
+void
+chfdw_mux_worker_main(Datum main_arg)
+{
+	ChMuxConn  *conns = NULL;
+	ChMuxSession *sessions = NULL;
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	ch_http_init(0, (uint32_t) MyProcPid);
+	CurrentResourceOwner = ResourceOwnerCreate(NULL, "pg_clickhouse multiplexer");
+	mux_loop_cxt = AllocSetContextCreate(TopMemoryContext,
+										 "pg_clickhouse multiplexer loop",
+										 ALLOCSET_DEFAULT_SIZES);
+
+	SpinLockAcquire(&mux_shared->mutex);
+	mux_shared->pid = MyProcPid;
+	mux_shared->proc = MyProc;
+	SpinLockRelease(&mux_shared->mutex);
+	before_shmem_exit(mux_worker_exit, (Datum) 0);
+
+	for (;;)
+	{
+		dsm_handle	pending[CH_MUX_QUEUE_LENGTH];
+		int			npending;
+		ChMuxSession **prev;
+		ChMuxConn  *conn;
+		ch_http_socket *sockets;
+		int			nsockets = 0;
+		int			maxsockets = 0;
+		long		timeout = CH_MUX_NAPTIME_MS;
+		bool		progress = false;
+
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+		MemoryContextReset(mux_loop_cxt);
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		SpinLockAcquire(&mux_shared->mutex);
+		npending = mux_shared->npending;
+		memcpy(pending, mux_shared->pending, sizeof(dsm_handle) * npending);
+		mux_shared->npending = 0;
+		SpinLockRelease(&mux_shared->mutex);
+
+		for (int i = 0; i < npending; i++)
+		{
+			ChMuxSession *session = mux_worker_attach(pending[i], &conns);
+
+			if (session != NULL)
+			{
+				session->next = sessions;
+				sessions = session;
+			}
+		}
+
+		/*
+		 * Receive what has arrived, and note what to wait for next. Each
+		 * request runs one transfer, which uses at most one socket.
+		 */
+		for (ChMuxSession * session = sessions; session != NULL; session = session->next)
+			maxsockets++;
+		sockets = MemoryContextAlloc(mux_loop_cxt,
+									 Max(maxsockets, 1) * sizeof(ch_http_socket));
+		for (conn = conns; conn != NULL; conn = conn->next)
+		{
+			long		conntimeout = ch_http_run(conn->http, sockets,
+												  &nsockets, maxsockets);
+
+			if (conntimeout >= 0 && conntimeout < timeout)
+				timeout = conntimeout;
+		}
+
+		/* Pass it on to the backends, dropping finished requests */
+		prev = &sessions;
+		while (*prev != NULL)
+		{
+			ChMuxSession *session = *prev;
+
+			if (mux_worker_pump(session, &progress))
+				prev = &session->next;
+			else
+			{
+				*prev = session->next;
+				mux_worker_drop(session, &sessions);
+				progress = true;
+			}
+		}
+
+		/* More may be ready right away after progress */
+		if (!progress && timeout != 0)
+			mux_worker_wait(sockets, nsockets, timeout);
+	}
+}
+
+/*
+ * Find or make the connection for a server.
+ */
+static ChMuxConn *
+mux_worker_conn(ChMuxConn * *conns, char *base_url, const char *dbname,
+				const char *compression, int flags)
+{
+	ChMuxConn  *conn;
+	char	   *key = psprintf("%s\n%s\n%s\n%d", base_url,
+							   dbname ? dbname : "",
+							   compression ? compression : "", flags);
+
+	for (conn = *conns; conn != NULL; conn = conn->next)
+	{
+		if (strcmp(conn->key, key) == 0)
+		{
+			pfree(key);
+			return conn;
+		}
+	}
+
+	conn = palloc0(sizeof(ChMuxConn));
+	conn->key = key;
+	conn->http = ch_http_connection_url(strdup(base_url), dbname, compression,
+										flags);
+	if (conn->http == NULL)
+	{
+		pfree(key);
+		pfree(conn);
+		return NULL;
+	}
+
+	ch_http_set_max_connections(conn->http, ch_mux_connections);
+	conn->next = *conns;
+	*conns = conn;
+
+	elog(DEBUG1, "pg_clickhouse multiplexer: new connection %p", conn->http);
+	return conn;
+}
+
+/*
+ * Attach to a request posted by a backend and start its query. Returns NULL
+ * if the backend has given up on it already.
+ */
+static ChMuxSession *
+mux_worker_attach(dsm_handle handle, ChMuxConn * *conns)
+{
+	dsm_segment *seg = dsm_attach(handle);
+	shm_toc    *toc;
+	ChMuxRequest *req;
+	shm_mq	   *mq;
+	ChMuxSession *session;
+	char	   *pos;
+	char	   *base_url;
+	char	   *dbname;
+	char	   *compression;
+	ch_query	query = {0};
+	List	   *settings = NIL;
+	const char **params = NULL;
+	MemoryContext oldcxt;
+
+	if (seg == NULL)
+		return NULL;
+	dsm_pin_mapping(seg);
+
+	toc = shm_toc_attach(CH_MUX_MAGIC, dsm_segment_address(seg));
+	if (toc == NULL ||
+		(req = shm_toc_lookup(toc, CH_MUX_KEY_REQUEST, true)) == NULL ||
+		(mq = shm_toc_lookup(toc, CH_MUX_KEY_QUEUE, true)) == NULL)
+	{
+		dsm_detach(seg);
+		return NULL;
+	}
+
+	shm_mq_set_sender(mq, MyProc);
+	session = palloc0(sizeof(ChMuxSession));
+	session->seg = seg;
+	session->mqh = shm_mq_attach(mq, seg, NULL);
+
+	pos = req->data;
+	base_url = mux_read_string(&pos, false);
+	dbname = mux_read_string(&pos, true);
+	compression = mux_read_string(&pos, true);
+	session->conn = mux_worker_conn(conns, base_url, dbname, compression,
+									req->flags);
+
+	/* the query is only needed until the transfer has started */
+	oldcxt = MemoryContextSwitchTo(mux_loop_cxt);
+	query.sql = mux_read_string(&pos, false);
+	for (int i = 0; i < req->nsettings; i++)
+	{
+		char	   *name = mux_read_string(&pos, false);
+		char	   *value = mux_read_string(&pos, false);
+
+		settings = lappend(settings, makeDefElem(name, (Node *) makeString(value), -1));
+	}
+	if (req->nparams > 0)
+	{
+		params = palloc(sizeof(char *) * req->nparams);
+		for (int i = 0; i < req->nparams; i++)
+			params[i] = mux_read_string(&pos, true);
+	}
+	query.settings = settings;
+	query.num_params = req->nparams;
+	query.param_values = params;
+	query.format = req->format;
+
+	if (session->conn != NULL)
+		session->resp = ch_http_begin_query(session->conn->http, &query);
+	MemoryContextSwitchTo(oldcxt);
+
+	if (session->resp == NULL)
+	{
+		/* report the failure like a failed transfer */
+		const char *error = ch_http_last_error();
+
+		session->resp = calloc(sizeof(ch_http_response_t), 1);
+		if (session->resp == NULL)
+			elog(ERROR, "out of memory");
+		session->resp->http_status = 419;
+		session->resp->done = true;
+		error = error ? error : "out of memory";
+		ch_http_response_append(session->resp, error, strlen(error));
+	}
+
+	return session;
+}
+
+/*
+ * Send the backend of a request as much of the response as its queue takes,
+ * setting *progress if anything was sent. Returns false once the whole
+ * response has been sent, or the backend has detached.
+ */
+static bool
+mux_worker_pump(ChMuxSession * session, bool *progress)
+{
+	ch_http_response_t *resp = session->resp;
+
+	/* KILL QUERY sent by the worker itself */
+	if (session->seg == NULL)
+		return !resp->done;
+
+	for (;;)
+	{
+		shm_mq_iovec iov[2];
+		shm_mq_result res;
+
+		if (session->msgtype == 0)
+		{
+			if (!session->header_sent)
+			{
+				if (resp->http_status == 0 && !resp->done)
+					break;
+				session->msgtype = CH_MUX_MSG_HEADER;
+			}
+			else if (resp->datasize > 0)
+			{
+				session->msgtype = CH_MUX_MSG_DATA;
+				session->msglen = Min(resp->datasize, CH_MUX_CHUNK);
+			}
+			else if (resp->done)
+				session->msgtype = CH_MUX_MSG_END;
+			else
+			{
+				/* the buffer is empty, let curl deliver more */
+				if (resp->paused)
+				{
+					ch_http_response_resume(resp);
+					*progress = true;
+				}
+				break;
+			}
+
+			if (session->msgtype != CH_MUX_MSG_DATA)
+			{
+				session->status.http_status = resp->http_status;
+				session->status.unsent = resp->unsent;
+				memcpy(session->status.query_id, resp->query_id,
+					   sizeof(session->status.query_id));
+				session->status.pretransfer_time = resp->pretransfer_time;
+				session->status.total_time = resp->total_time;
+			}
+		}
+
+		/* a message that would block must be sent again with the same data */
+		iov[0].data = &session->msgtype;
+		iov[0].len = 1;
+		if (session->msgtype == CH_MUX_MSG_DATA)
+		{
+			iov[1].data = resp->data;
+			iov[1].len = session->msglen;
+		}
+		else
+		{
+			iov[1].data = (char *) &session->status;
+			iov[1].len = sizeof(ChMuxStatus);
+		}
+
+		res = shm_mq_sendv_compat(session->mqh, iov, 2, true);
+		if (res == SHM_MQ_WOULD_BLOCK)
+			break;
+		if (res == SHM_MQ_DETACHED)
+			return false;
+
+		*progress = true;
+		switch (session->msgtype)
+		{
+			case CH_MUX_MSG_HEADER:
+				session->header_sent = true;
+				break;
+			case CH_MUX_MSG_DATA:
+				ch_http_response_consume(resp, session->msglen);
+				break;
+			case CH_MUX_MSG_END:
+				return false;
+		}
+		session->msgtype = 0;
+	}
+
+	return true;
+}
+
+/*
+ * Wait for one of the sockets of the transfers, or for a backend to post a
+ * request or read from its queue.
+ */
+static void
+mux_worker_wait(ch_http_socket * sockets, int nsockets, long timeout)
+{
+	MemoryContext oldcxt = MemoryContextSwitchTo(mux_loop_cxt);
+	WaitEventSet *set;
+	WaitEvent	event;
+
+	set = CreateWaitEventSetCompat(2 + nsockets);
+	AddWaitEventToSet(set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+	AddWaitEventToSet(set, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET, NULL, NULL);
+	for (int i = 0; i < nsockets; i++)
+		AddWaitEventToSet(set,
+						  WL_SOCKET_READABLE |
+						  (sockets[i].write ? WL_SOCKET_WRITEABLE : 0),
+						  sockets[i].fd, NULL, NULL);
+
+	(void) WaitEventSetWait(set, timeout, &event, 1, PG_WAIT_EXTENSION);
+	FreeWaitEventSet(set);
+	MemoryContextSwitchTo(oldcxt);
+}
@@ -67,6 +67,13 @@ static const ChFdwOption ch_options[] =
  * GUC parameters
  */
 char	   *ch_session_settings = NULL;
+int			ch_binary_buffer_blocks = 4;
+int			ch_insert_block_rows = 1048576;
+int			ch_insert_block_bytes = 256 * 1024 * 1024;
+int			ch_stats_cache_size = 256;
+int			ch_stats_cache_ttl = 300;
+int			ch_mux_connections = 0;
+int			ch_result_cache_size = 0;
 
 /*
  * Helper functions
@@ -74,6 +81,11 @@ char	   *ch_session_settings = NULL;
 static void InitChFdwOptions(void);
 static bool is_valid_option(const char *keyword, Oid context);
 static bool is_ch_option(const char *keyword);
+static int	get_int_option(DefElem * def, int max, int flags);
+static ChAnalyzeSampling get_analyze_sampling_option(DefElem * def);
+static ch_format get_format_option(DefElem * def);
+static ChLoadBalance get_load_balance_option(DefElem * def);
+static char *get_compression_option(DefElem * def);
 
 /*
  * Validate the generic options given to a FOREIGN DATA WRAPPER, SERVER,
@@ -124,6 +136,67 @@ clickhouse_fdw_validator(PG_FUNCTION_ARGS)
 					 errhint("Valid options in this context are: %s",
 							 buf.data)));
 		}
+
+		if (strcmp(def->defname, "async_capable") == 0 ||
+			strcmp(def->defname, "use_remote_estimate") == 0 ||
+			strcmp(def->defname, "use_cached_estimate") == 0 ||
+			strcmp(def->defname, "keepalive") == 0 ||
+			strcmp(def->defname, "http2") == 0 ||
+			strcmp(def->defname, "ping_before_query") == 0)
+		{
+			/* defGetBoolean raises an error for invalid values */
+			(void) defGetBoolean(def);
+		}
+		else if (strcmp(def->defname, "parallel_key") == 0)
+		{
+			char	   *val = defGetString(def);
+			List	   *names;
+
+			/* the columns are checked when a scan is planned */
+			if (!SplitIdentifierString(pstrdup(val), ',', &names) || names == NIL)
+				ereport(ERROR,
+						(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+						 errmsg("invalid value for option \"%s\": \"%s\"",
+								def->defname, val),
+						 errhint("Value must be a comma-separated list of column names.")));
+		}
+		else if (strcmp(def->defname, "parallel_workers") == 0)
+			(void) get_int_option(def, 1024, 0);
+		else if (strcmp(def->defname, "insert_block_rows") == 0 ||
+				 strcmp(def->defname, "connect_timeout") == 0 ||
+				 strcmp(def->defname, "send_timeout") == 0 ||
+				 strcmp(def->defname, "receive_timeout") == 0)
+			(void) get_int_option(def, INT_MAX, 0);
+		else if (strcmp(def->defname, "pool_idle_timeout") == 0)
+			(void) get_int_option(def, INT_MAX / 1000, 0);
+		else if (strcmp(def->defname, "result_cache_ttl") == 0)
+			(void) get_int_option(def, INT_MAX, GUC_UNIT_S);
+		else if (strcmp(def->defname, "insert_block_bytes") == 0)
+			(void) get_int_option(def, INT_MAX, GUC_UNIT_BYTE);
+		else if (strcmp(def->defname, "pool_size") == 0)
+		{
+			if (get_int_option(def, CH_POOL_MAX_SIZE, 0) < 1)
+				ereport(ERROR,
+						(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+						 errmsg("\"%s\" must be an integer value greater than zero",
+								def->defname)));
+		}
+		else if (strcmp(def->defname, "batch_size") == 0)
+		{
+			if (get_int_option(def, INT_MAX, 0) < 1)
+				ereport(ERROR,
+						(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+						 errmsg("\"%s\" must be an integer value greater than zero",
+								def->defname)));
+		}
+		else if (strcmp(def->defname, "analyze_sampling") == 0)
+			(void) get_analyze_sampling_option(def);
+		else if (strcmp(def->defname, "format") == 0)
+			(void) get_format_option(def);
+		else if (strcmp(def->defname, "load_balance") == 0)
+			(void) get_load_balance_option(def);
+		else if (strcmp(def->defname, "compression") == 0)
+			(void) get_compression_option(def);
 	}
 
 	PG_RETURN_VOID();
@@ -145,7 +218,36 @@ InitChFdwOptions(void)
 		{"database", ForeignTableRelationId, false},
 		{"table_name", ForeignTableRelationId, false},
 		{"engine", ForeignTableRelationId, false},
+		{"parallel_key", ForeignTableRelationId, false},
+		{"parallel_workers", ForeignTableRelationId, false},
 		{"driver", ForeignServerRelationId, false},
+		{"format", ForeignServerRelationId, false},
+		{"compression", ForeignServerRelationId, false},
+		{"keepalive", ForeignServerRelationId, false},
+		{"http2", ForeignServerRelationId, false},
+		{"ping_before_query", ForeignServerRelationId, false},
+		{"connect_timeout", ForeignServerRelationId, false},
+		{"send_timeout", ForeignServerRelationId, false},
+		{"receive_timeout", ForeignServerRelationId, false},
+		{"pool_size", ForeignServerRelationId, false},
+		{"pool_idle_timeout", ForeignServerRelationId, false},
+		{"load_balance", ForeignServerRelationId, false},
+		{"async_capable", ForeignServerRelationId, false},
+		{"async_capable", ForeignTableRelationId, false},
+		{"use_remote_estimate", ForeignServerRelationId, false},
+		{"use_remote_estimate", ForeignTableRelationId, false},
+		{"use_cached_estimate", ForeignServerRelationId, false},
+		{"use_cached_estimate", ForeignTableRelationId, false},
+		{"analyze_sampling", ForeignServerRelationId, false},
+		{"analyze_sampling", ForeignTableRelationId, false},
+		{"insert_block_rows", ForeignServerRelationId, false},
+		{"insert_block_rows", ForeignTableRelationId, false},
+		{"insert_block_bytes", ForeignServerRelationId, false},
+		{"insert_block_bytes", ForeignTableRelationId, false},
+		{"batch_size", ForeignServerRelationId, false},
+		{"batch_size", ForeignTableRelationId, false},
+		{"result_cache_ttl", ForeignServerRelationId, false},
+		{"result_cache_ttl", ForeignTableRelationId, false},
 		{"aggregatefunction", AttributeRelationId, false},
 		{"simpleaggregatefunction", AttributeRelationId, false},
 		{"column_name", AttributeRelationId, false},
@@ -210,6 +312,338 @@ InitChFdwOptions(void)
 	popt++;
 }
 
+/*
+ * Returns the value of an integer option, raising an error unless it is
+ * between 0 and max. flags may name a GUC unit, such as GUC_UNIT_BYTE, to
+ * accept values like '64MB'.
+ */
+static int
+get_int_option(DefElem * def, int max, int flags)
+{
+	char	   *val = defGetString(def);
+	const char *hint = NULL;
+	int			result;
+
+	if (!parse_int(val, &result, flags, &hint) || result < 0 || result > max)
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+				 errmsg("invalid value for option \"%s\": \"%s\"",
+						def->defname, val),
+				 hint ? errhint("%s", _(hint)) :
+				 errhint("Value must be an integer between 0 and %d.", max)));
+
+	return result;
+}
+
+/*
+ * Get the number of rows and bytes after which an insert into the foreign
+ * table sends a block to ClickHouse, from the insert_block_rows and
+ * insert_block_bytes options of the table or else its server, or else the
+ * runtime parameters of the same names. Zero means no limit.
+ */
+void
+chfdw_get_insert_block_limits(Oid relid, int *rows, int *bytes)
+{
+	ForeignTable *table = GetForeignTable(relid);
+	ForeignServer *server = GetForeignServer(table->serverid);
+	List	   *options = list_concat(list_copy(server->options), table->options);
+	ListCell   *lc;
+
+	*rows = ch_insert_block_rows;
+	*bytes = ch_insert_block_bytes;
+
+	/* table options come last, overriding server options */
+	foreach(lc, options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "insert_block_rows") == 0)
+			*rows = get_int_option(def, INT_MAX, 0);
+		else if (strcmp(def->defname, "insert_block_bytes") == 0)
+			*bytes = get_int_option(def, INT_MAX, GUC_UNIT_BYTE);
+	}
+}
+
+/*
+ * Get the number of rows PostgreSQL passes to a single batch insert into the
+ * foreign table, from the batch_size option of the table or else its server.
+ * Defaults to 1, meaning rows are inserted one at a time.
+ */
+int
+chfdw_get_insert_batch_size(Oid relid)
+{
+	ForeignTable *table = GetForeignTable(relid);
+	ForeignServer *server = GetForeignServer(table->serverid);
+	List	   *options = list_concat(list_copy(server->options), table->options);
+	ListCell   *lc;
+	int			batch_size = 1;
+
+	/* table options come last, overriding server options */
+	foreach(lc, options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "batch_size") == 0)
+			batch_size = get_int_option(def, INT_MAX, 0);
+	}
+
+	return batch_size;
+}
+
+/*
+ * Parse the value of an analyze_sampling option.
+ */
+static ChAnalyzeSampling
+get_analyze_sampling_option(DefElem * def)
+{
+	char	   *val = defGetString(def);
+
+	if (pg_strcasecmp(val, "off") == 0)
+		return CH_ANALYZE_SAMPLE_OFF;
+	else if (pg_strcasecmp(val, "auto") == 0)
+		return CH_ANALYZE_SAMPLE_AUTO;
+	else if (pg_strcasecmp(val, "random") == 0)
+		return CH_ANALYZE_SAMPLE_RANDOM;
+	else if (pg_strcasecmp(val, "sample") == 0)
+		return CH_ANALYZE_SAMPLE_SAMPLE;
+
+	ereport(ERROR,
+			(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+			 errmsg("invalid value for option \"%s\": \"%s\"",
+					def->defname, val),
+			 errhint("Valid values are \"off\", \"auto\", \"random\" and \"sample\".")));
+	return CH_ANALYZE_SAMPLE_AUTO;	/* keep compiler quiet */
+}
+
+/*
+ * Get the method ANALYZE uses to sample the foreign table, from the
+ * analyze_sampling option of the table or else its server. Defaults to auto.
+ */
+ChAnalyzeSampling
+chfdw_get_analyze_sampling(Oid relid)
+{
+	ForeignTable *table = GetForeignTable(relid);
+	ForeignServer *server = GetForeignServer(table->serverid);
+	List	   *options = list_concat(list_copy(server->options), table->options);
+	ListCell   *lc;
+	ChAnalyzeSampling method = CH_ANALYZE_SAMPLE_AUTO;
+
+	/* table options come last, overriding server options */
+	foreach(lc, options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "analyze_sampling") == 0)
+			method = get_analyze_sampling_option(def);
+	}
+
+	return method;
+}
+
+/*
+ * Get the seconds for which scans of the foreign table keep their results
+ * in the shared result cache, from the result_cache_ttl option of the table
+ * or else its server. Defaults to 0, not caching.
+ */
+int
+chfdw_get_result_cache_ttl(Oid relid)
+{
+	ForeignTable *table = GetForeignTable(relid);
+	ForeignServer *server = GetForeignServer(table->serverid);
+	List	   *options = list_concat(list_copy(server->options), table->options);
+	ListCell   *lc;
+	int			ttl = 0;
+
+	/* table options come last, overriding server options */
+	foreach(lc, options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "result_cache_ttl") == 0)
+			ttl = get_int_option(def, INT_MAX, GUC_UNIT_S);
+	}
+
+	return ttl;
+}
+
+/*
+ * Parse the value of a format option.
+ */
+static ch_format
+get_format_option(DefElem * def)
+{
+	char	   *val = defGetString(def);
+
+	if (pg_strcasecmp(val, "tsv") == 0)
+		return CH_FORMAT_TSV;
+	else if (pg_strcasecmp(val, "rowbinary") == 0)
+		return CH_FORMAT_ROWBINARY;
+
+	ereport(ERROR,
+			(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+			 errmsg("invalid value for option \"%s\": \"%s\"",
+					def->defname, val),
+			 errhint("Valid values are \"tsv\" and \"rowbinary\".")));
+	return CH_FORMAT_TSV;		/* keep compiler quiet */
+}
+
+/*
+ * Get the format in which the http driver fetches the results of scans from
+ * the format option among the options of a server. Defaults to tsv.
+ */
+ch_format
+chfdw_get_format(List * options)
+{
+	ListCell   *lc;
+	ch_format	format = CH_FORMAT_TSV;
+
+	foreach(lc, options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "format") == 0)
+			format = get_format_option(def);
+	}
+
+	return format;
+}
+
+/*
+ * Parse the value of a load_balance option.
+ */
+static ChLoadBalance
+get_load_balance_option(DefElem * def)
+{
+	char	   *val = defGetString(def);
+
+	if (pg_strcasecmp(val, "in_order") == 0)
+		return CH_LOAD_BALANCE_IN_ORDER;
+	else if (pg_strcasecmp(val, "round_robin") == 0)
+		return CH_LOAD_BALANCE_ROUND_ROBIN;
+	else if (pg_strcasecmp(val, "random") == 0)
+		return CH_LOAD_BALANCE_RANDOM;
+	else if (pg_strcasecmp(val, "least_latency") == 0)
+		return CH_LOAD_BALANCE_LEAST_LATENCY;
+
+	ereport(ERROR,
+			(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+			 errmsg("invalid value for option \"%s\": \"%s\"",
+					def->defname, val),
+			 errhint("Valid values are \"in_order\", \"round_robin\", \"random\" and \"least_latency\".")));
+	return CH_LOAD_BALANCE_IN_ORDER;	/* keep compiler quiet */
+}
+
+/*
+ * Get the order in which connections try the hosts of a server from its
+ * load_balance option. Defaults to in_order.
+ */
+ChLoadBalance
+chfdw_get_load_balance(List * options)
+{
+	ListCell   *lc;
+	ChLoadBalance policy = CH_LOAD_BALANCE_IN_ORDER;
+
+	foreach(lc, options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "load_balance") == 0)
+			policy = get_load_balance_option(def);
+	}
+
+	return policy;
+}
+
+/*
+ * Parse the value of a compression option, returning the HTTP content
+ * encoding or binary block compression method it names, or NULL for none.
+ * Whether the driver of the server supports it is checked on connect.
+ */
+static char *
+get_compression_option(DefElem * def)
+{
+	static const char *const encodings[] = {"gzip", "deflate", "br", "zstd", "lz4", NULL};
+	char	   *val = defGetString(def);
+
+	if (pg_strcasecmp(val, "none") == 0)
+		return NULL;
+
+	for (int i = 0; encodings[i]; i++)
+	{
+		if (pg_strcasecmp(val, encodings[i]) == 0)
+			return (char *) encodings[i];
+	}
+
+	ereport(ERROR,
+			(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+			 errmsg("invalid value for option \"%s\": \"%s\"",
+					def->defname, val),
+			 errhint("Valid values are \"none\", \"gzip\", \"deflate\", \"br\", \"zstd\" and \"lz4\".")));
+	return NULL;				/* keep compiler quiet */
+}
+
+/*
+ * Fill in the compression, keepalive, HTTP/2, ping and timeout settings of
+ * the connection details from the options of a server.
+ */
+void
+chfdw_get_connection_options(List * options, ch_connection_details * details)
+{
+	ListCell   *lc;
+
+	details->compression = NULL;
+	details->keepalive = false;
+	details->http2 = false;
+	details->ping = true;
+	details->connect_timeout = 0;
+	details->send_timeout = 0;
+	details->receive_timeout = 0;
+
+	foreach(lc, options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "compression") == 0)
+			details->compression = get_compression_option(def);
+		else if (strcmp(def->defname, "keepalive") == 0)
+			details->keepalive = defGetBoolean(def);
+		else if (strcmp(def->defname, "http2") == 0)
+			details->http2 = defGetBoolean(def);
+		else if (strcmp(def->defname, "ping_before_query") == 0)
+			details->ping = defGetBoolean(def);
+		else if (strcmp(def->defname, "connect_timeout") == 0)
+			details->connect_timeout = get_int_option(def, INT_MAX, 0);
+		else if (strcmp(def->defname, "send_timeout") == 0)
+			details->send_timeout = get_int_option(def, INT_MAX, 0);
+		else if (strcmp(def->defname, "receive_timeout") == 0)
+			details->receive_timeout = get_int_option(def, INT_MAX, 0);
+	}
+}
+
+/*
+ * Get the most connections a backend keeps open to a server for one user
+ * mapping, and the seconds after which idle connections beyond the first
+ * are closed, 0 to keep them open.
+ */
+void
+chfdw_get_pool_options(List * options, int *size, int *idle_timeout)
+{
+	ListCell   *lc;
+
+	*size = CH_POOL_DEFAULT_SIZE;
+	*idle_timeout = CH_POOL_DEFAULT_IDLE_TIMEOUT;
+
+	foreach(lc, options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "pool_size") == 0)
+			*size = get_int_option(def, CH_POOL_MAX_SIZE, 0);
+		else if (strcmp(def->defname, "pool_idle_timeout") == 0)
+			*idle_timeout = get_int_option(def, INT_MAX / 1000, 0);
+	}
+}
+
 /*
  * Check whether the given option is one of the valid clickhouse_fdw options.
  * context is the Oid of the catalog holding the object the option is for.
@@ -526,7 +960,123 @@ _PG_init(void)
 							   NULL,
 							   NULL);
 
+	/*
+	 * Maximum number of result blocks the binary engine reads ahead of the
+	 * scan. Zero reads the entire result before returning the first row.
+	 */
+	DefineCustomIntVariable("pg_clickhouse.binary_buffer_blocks",
+							"Sets the number of result blocks the binary driver buffers per query.",
+							"Zero buffers the entire result.",
+							&ch_binary_buffer_blocks,
+							4,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	/*
+	 * Number of rows and bytes after which an INSERT sends a block to
+	 * ClickHouse, bounding the memory an INSERT of any size needs.
+	 */
+	DefineCustomIntVariable("pg_clickhouse.insert_block_rows",
+							"Sets the number of rows after which an INSERT sends a block.",
+							"Zero means no limit.",
+							&ch_insert_block_rows,
+							1048576,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_clickhouse.insert_block_bytes",
+							"Sets the size after which an INSERT sends a block.",
+							"Zero means no limit.",
+							&ch_insert_block_bytes,
+							256 * 1024 * 1024,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_BYTE,
+							NULL,
+							NULL,
+							NULL);
+
+	/*
+	 * Number of remote tables whose statistics are cached in shared memory
+	 * when pg_clickhouse is preloaded. Zero disables the cache.
+	 */
+	DefineCustomIntVariable("pg_clickhouse.stats_cache_size",
+							"Sets the number of ClickHouse tables whose statistics are cached in shared memory.",
+							"Requires pg_clickhouse in shared_preload_libraries. Zero disables the cache.",
+							&ch_stats_cache_size,
+							256,
+							0,
+							1024 * 1024,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	/* Age after which the stats worker refreshes cached statistics. */
+	DefineCustomIntVariable("pg_clickhouse.stats_cache_ttl",
+							"Sets the time after which cached ClickHouse table statistics are refreshed.",
+							NULL,
+							&ch_stats_cache_ttl,
+							300,
+							1,
+							INT_MAX / 10,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	/*
+	 * Connections per server that the multiplexer worker opens to run the
+	 * queries of all backends. Zero disables the worker.
+	 */
+	DefineCustomIntVariable("pg_clickhouse.multiplexer_connections",
+							"Sets the number of connections per ClickHouse server the multiplexer uses for all backends.",
+							"Requires pg_clickhouse in shared_preload_libraries. Zero disables the multiplexer.",
+							&ch_mux_connections,
+							0,
+							0,
+							1024,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	/*
+	 * Shared memory for the results of scans of tables with the
+	 * result_cache_ttl option. Zero disables the cache.
+	 */
+	DefineCustomIntVariable("pg_clickhouse.result_cache_size",
+							"Sets the amount of shared memory used to cache the results of remote queries.",
+							"Requires pg_clickhouse in shared_preload_libraries. Zero disables the cache.",
+							&ch_result_cache_size,
+							0,
+							0,
+							INT_MAX,
+							PGC_POSTMASTER,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
 #if PG_VERSION_NUM >= 150000
 	MarkGUCPrefixReserved("pg_clickhouse");
 #endif
+
+	chfdw_stats_init();
+	chfdw_mux_init();
+	chfdw_result_cache_init();
 }
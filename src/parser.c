@@ -4,96 +4,277 @@
 #include <string.h>
 #include <assert.h>
 #include <curl/curl.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #include <http.h>
 #include <internal.h>
+#include "port/pg_bitutils.h"
 
 void
-ch_http_read_state_init(ch_http_read_state * state, char *data, size_t datalen)
+ch_http_read_state_init(ch_http_read_state * state, ch_http_response_t * resp)
 {
-	state->data = datalen > 0 ? data : NULL;
-	state->maxpos = datalen - 1;
-	state->buflen = 1024;
-	state->val = malloc(state->buflen);
+	state->resp = resp;
+	state->curpos = 0;
+	state->line_end = 0;
+	state->in_line = false;
+	state->line_eof = false;
+	state->val = NULL;
 	state->done = false;
 }
 
 void
 ch_http_read_state_free(ch_http_read_state * state)
 {
-	free(state->val);
+	/* the values point into the response buffer */
+	state->val = NULL;
 }
 
-int
-ch_http_read_next(ch_http_read_state * state)
+/*
+ * Discards the data read so far and waits for more of the response. Returns
+ * false if the transfer has finished, so that no more data will arrive.
+ */
+static bool
+read_more(ch_http_read_state * state)
 {
-	size_t		pos = state->curpos,
-				len = 0;
-	char	   *data = state->data;
+	ch_http_response_t *resp = state->resp;
+
+	if (resp->done)
+		return false;
+
+	ch_http_response_consume(resp, state->curpos);
+	state->curpos = 0;
+	ch_http_response_wait(resp, resp->datasize + 1);
+	return true;
+}
+
+/*
+ * Waits until at least n bytes past the read position are buffered. Returns
+ * false if the response ends before that.
+ */
+bool
+ch_http_read_ensure(ch_http_read_state * state, size_t n)
+{
+	while (state->resp->datasize - state->curpos < n)
+	{
+		if (!read_more(state))
+			return false;
+	}
 
-	state->val[0] = '\0';
+	return true;
+}
+
+/*
+ * Returns true when all rows of the response have been read.
+ */
+bool
+ch_http_read_eof(ch_http_read_state * state)
+{
 	if (state->done)
-		return CH_EOF;
+		return true;
+
+	while (state->curpos >= state->resp->datasize)
+	{
+		if (!read_more(state))
+		{
+			state->done = true;
+			break;
+		}
+	}
+
+	return state->done;
+}
+
+/*
+ * Returns the position of the first tab or backslash in data[pos..end), or
+ * end if there is none. Most fields contain neither, so the bytes are
+ * compared 32 or 16 at a time where the compiler targets AVX2 or SSE2.
+ */
+static size_t
+find_special(const char *data, size_t pos, size_t end)
+{
+#ifdef __AVX2__
+	const __m256i tab32 = _mm256_set1_epi8('\t');
+	const __m256i bs32 = _mm256_set1_epi8('\\');
+#endif
+#ifdef __SSE2__
+	const __m128i tab16 = _mm_set1_epi8('\t');
+	const __m128i bs16 = _mm_set1_epi8('\\');
+#endif
+
+#ifdef __AVX2__
+	while (pos + 32 <= end)
+	{
+		__m256i		v = _mm256_loadu_si256((const __m256i *) (data + pos));
+		uint32		mask = (uint32) _mm256_movemask_epi8(
+														 _mm256_or_si256(_mm256_cmpeq_epi8(v, tab32),
+																		 _mm256_cmpeq_epi8(v, bs32)));
+
+		if (mask != 0)
+			return pos + pg_rightmost_one_pos32(mask);
+		pos += 32;
+	}
+#endif
+#ifdef __SSE2__
+	while (pos + 16 <= end)
+	{
+		__m128i		v = _mm_loadu_si128((const __m128i *) (data + pos));
+		uint32		mask = (uint32) _mm_movemask_epi8(
+													  _mm_or_si128(_mm_cmpeq_epi8(v, tab16),
+																   _mm_cmpeq_epi8(v, bs16)));
+
+		if (mask != 0)
+			return pos + pg_rightmost_one_pos32(mask);
+		pos += 16;
+	}
+#endif
+
+	for (; pos < end; pos++)
+	{
+		if (data[pos] == '\t' || data[pos] == '\\')
+			break;
+	}
+
+	return pos;
+}
+
+/*
+ * Makes sure the whole line starting at the read position is buffered and
+ * remembers where it ends. Fields never contain a raw line feed, so fields
+ * can then be split in place without the buffer moving under them.
+ */
+static void
+find_line(ch_http_read_state * state)
+{
+	ch_http_response_t *resp = state->resp;
+	size_t		scanned = state->curpos;
 
-	while (pos < state->maxpos && data[pos] != '\t' && data[pos] != '\n')
+	for (;;)
 	{
-		if (data[pos] == '\\')
+		char	   *nl = NULL;
+
+		if (scanned < resp->datasize)
+			nl = memchr(resp->data + scanned, '\n', resp->datasize - scanned);
+
+		if (nl != NULL)
 		{
-			/* unescape some sequences */
-			switch (data[pos + 1])
-			{
-				case '\\':
-					state->val[len] = '\\';
-					break;
-				case '\'':
-					state->val[len] = '\'';
-					break;
-				case 'n':
-					state->val[len] = '\n';
-					break;
-				case 't':
-					state->val[len] = '\t';
-					break;
-				case '0':
-					state->val[len] = '\0';
-					break;
-				case 'r':
-					state->val[len] = '\r';
-					break;
-				case 'b':
-					state->val[len] = '\b';
-					break;
-				case 'f':
-					state->val[len] = '\f';
-					break;
-				default:
-					goto copy;
-			}
-			len++;
-			pos += 2;
+			state->line_end = nl - resp->data;
+			state->line_eof = false;
+			break;
 		}
-		else
-	copy:
-			state->val[len++] = data[pos++];
 
-		/* extend the value size if needed */
-		if (len == state->buflen)
+		/* read_more moves the unread data to the start of the buffer */
+		scanned = resp->datasize - state->curpos;
+		if (!read_more(state))
 		{
-			state->buflen *= 2;
-			state->val = realloc(state->val, state->buflen);
+			state->line_end = resp->datasize;
+			state->line_eof = true;
+			break;
 		}
 	}
 
-	state->val[len] = '\0';
-	state->curpos = pos + 1;
+	state->in_line = true;
+}
 
-	if (data[pos] == '\t')
-		return CH_CONT;
+/*
+ * Reads the next field of a TSV response into state->val. The field is
+ * terminated and unescaped in place, so state->val points into the response
+ * buffer and stays valid only until the next row is read.
+ */
+int
+ch_http_read_next(ch_http_read_state * state)
+{
+	static char empty[1] = "";
+	ch_http_response_t *resp = state->resp;
+	size_t		start,
+				end,
+				pos,
+				len;
+	char	   *data;
+
+	state->val = empty;
+	if (state->done)
+		return CH_EOF;
 
-	assert(data[pos] == '\n');
-	int			res = pos < state->maxpos ? CH_EOL : CH_EOF;
+	if (!state->in_line)
+		find_line(state);
 
-	state->done = (res == CH_EOF);
+	/* nothing was received at all */
+	if (resp->data == NULL)
+	{
+		state->done = true;
+		return CH_EOF;
+	}
+
+	data = resp->data;
+	start = state->curpos;
+	end = state->line_end;
+	pos = find_special(data, start, end);
+	len = pos;
+
+	/* unescape some sequences, the value only gets shorter */
+	while (pos < end && data[pos] == '\\')
+	{
+		size_t		next;
+		char		c = (pos + 1 < end) ? data[pos + 1] : '\0';
+
+		pos += 2;
+		switch (c)
+		{
+			case '\\':
+			case '\'':
+				break;
+			case 'n':
+				c = '\n';
+				break;
+			case 't':
+				c = '\t';
+				break;
+			case '0':
+				c = '\0';
+				break;
+			case 'r':
+				c = '\r';
+				break;
+			case 'b':
+				c = '\b';
+				break;
+			case 'f':
+				c = '\f';
+				break;
+			default:
+				/* keep the backslash of unknown sequences, such as \N */
+				c = '\\';
+				pos--;
+				break;
+		}
+		data[len++] = c;
+
+		next = find_special(data, pos, end);
+		memmove(data + len, data + pos, next - pos);
+		len += next - pos;
+		pos = next;
+	}
+
+	data[len] = '\0';
+	state->val = data + start;
+
+	/* The response ended without a line feed. */
+	if (pos >= end && state->line_eof)
+	{
+		state->curpos = pos;
+		state->done = true;
+		return CH_EOF;
+	}
+
+	state->curpos = pos + 1;
+	if (pos < end)
+		return CH_CONT;
 
-	return res;
+	state->in_line = false;
+	return CH_EOL;
 }
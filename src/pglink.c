@@ -3,6 +3,7 @@
 #include "access/htup_details.h"
 #include "access/tupdesc.h"
 #include "catalog/pg_type_d.h"
+#include "common/shortest_dec.h"
 #include "funcapi.h"
 #include "mb/pg_wchar.h"
 #include "miscadmin.h"
@@ -11,6 +12,7 @@
 #include "utils/builtins.h"
 #include "utils/fmgroids.h"
 #include "utils/lsyscache.h"
+#include "utils/rel.h"
 #include "utils/syscache.h"
 #include "utils/timestamp.h"
 #include "utils/typcache.h"
@@ -19,7 +21,9 @@
 #include "fdw.h"
 #include "http.h"
 #include "binary.hh"
+#include "rowbinary.h"
 
+#include <math.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -28,41 +32,56 @@ static bool initialized = false;
 
 static void http_disconnect(void *conn);
 static ch_cursor * http_simple_query(void *conn, const ch_query * query);
+static ch_cursor * http_begin_query(void *conn, const ch_query * query);
+static pgsocket http_cursor_socket(ch_cursor * cursor);
 static void http_simple_insert(void *conn, const ch_query * query);
 static void http_cursor_free(void *);
 static void **http_fetch_row(ch_cursor *, List *, TupleDesc, Datum *, bool *);
 static void *http_prepare_insert(void *, ResultRelInfo *, List *, const ch_query *, char *);
 static void http_insert_tuple(void *, TupleTableSlot *);
+static void http_insert_tuples(void *, TupleTableSlot * *, int);
 
 static libclickhouse_methods http_methods =
 {
 	.disconnect = http_disconnect,
 		.simple_query = http_simple_query,
+		.begin_query = http_begin_query,
+		.cursor_socket = http_cursor_socket,
 		.fetch_row = http_fetch_row,
 		.prepare_insert = http_prepare_insert,
-		.insert_tuple = http_insert_tuple
+		.insert_tuple = http_insert_tuple,
+		.insert_tuples = http_insert_tuples
 };
 
 static void binary_disconnect(void *conn);
 static ch_cursor * binary_simple_query(void *conn, const ch_query * query);
+static ch_cursor * binary_begin_query(void *conn, const ch_query * query);
+static pgsocket binary_cursor_socket(ch_cursor * cursor);
 static void binary_cursor_free(void *cursor);
 
 /* static void binary_simple_insert(void *conn, const char *query); */
 static void **binary_fetch_row(ch_cursor * cursor, List * attrs, TupleDesc tupdesc,
 							   Datum * values, bool *nulls);
 static void binary_insert_tuple(void *, TupleTableSlot * slot);
+static void binary_insert_tuples(void *, TupleTableSlot * *slots, int nslots);
 static void *binary_prepare_insert(void *, ResultRelInfo *, List *,
 								   const ch_query * query, char *table_name);
 
 static size_t escape_string(char *to, const char *from, size_t length);
+static void convert_row(ch_cursor * cursor, List * attrs, TupleDesc tupdesc,
+						Oid * coltypes, Datum * invalues, bool *innulls,
+						Datum * values, bool *nulls);
 
 static libclickhouse_methods binary_methods =
 {
 	.disconnect = binary_disconnect,
 		.simple_query = binary_simple_query,
+		.begin_query = binary_begin_query,
+		.cursor_socket = binary_cursor_socket,
 		.fetch_row = binary_fetch_row,
 		.prepare_insert = binary_prepare_insert,
-		.insert_tuple = binary_insert_tuple
+		.insert_tuple = binary_insert_tuple,
+		.insert_tuples = binary_insert_tuples
 };
 
 static int
@@ -112,6 +131,7 @@ chfdw_http_connect(ch_connection_details * details)
 	res.conn = conn;
 	res.methods = &http_methods;
 	res.is_binary = false;
+	res.format = CH_FORMAT_TSV;
 	return res;
 }
 
@@ -154,59 +174,83 @@ kill_query(void *conn, const char *query_id)
 		ch_http_response_free(resp);
 }
 
-static ch_cursor *
-http_simple_query(void *conn, const ch_query * query)
+/*
+ * Raises the error of a failed response. The response is freed unless it
+ * belongs to a cursor, which frees it on cleanup.
+ */
+static void
+http_report_error(void *conn, ch_http_response_t * resp, const char *sql,
+				  bool free_resp)
 {
-	int			attempts = 0;
-	MemoryContext tempcxt,
-				oldcxt;
-	ch_cursor  *cursor;
-	ch_http_response_t *resp;
+	char	   *error = pnstrdup(resp->data, resp->datasize);
+	long		status = resp->http_status;
+	bool		unsent = resp->unsent;
 
-	ch_http_set_progress_func(http_progress_callback);
-
-again:
-	resp = ch_http_simple_query(conn, query);
-	if (resp == NULL)
-		elog(ERROR, "out of memory");
-
-	attempts++;
-	if (resp->http_status == 419)
-	{
-		char	   *error = pnstrdup(resp->data, resp->datasize);
+	if (status == 418 && conn != NULL)
+		kill_query(conn, resp->query_id);
 
+	if (free_resp)
 		ch_http_response_free(resp);
 
-		if (attempts < 3)
-			goto again;
-
+	if (status == 419)
 		ereport(ERROR,
-				(errcode(ERRCODE_SQLCLIENT_UNABLE_TO_ESTABLISH_SQLCONNECTION),
+				(errcode(unsent ? ERRCODE_SQLCLIENT_UNABLE_TO_ESTABLISH_SQLCONNECTION :
+						 ERRCODE_CONNECTION_FAILURE),
 				 errmsg("pg_clickhouse: communication error: %s", error)));
-	}
-	else if (resp->http_status == 418)
-	{
-		kill_query(conn, resp->query_id);
-		ch_http_response_free(resp);
-
+	else if (status == 418)
 		ereport(ERROR,
 				(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
 				 errmsg("pg_clickhouse: query was aborted")));
-	}
-	else if (resp->http_status != 200)
-	{
-		char	   *error = pnstrdup(resp->data, resp->datasize);
-		long		status = resp->http_status;
 
-		ch_http_response_free(resp);
+	ereport(ERROR, (
+					errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+					errmsg("pg_clickhouse: %s", format_error(error)),
+					status < 404 ? 0 : errdetail_internal("Remote Query: %.64000s", sql),
+					errcontext("HTTP status code: %li", status)
+					));
+}
+
+/*
+ * Copies a query, with its settings and parameter values, into the current
+ * memory context, so that a cursor can send it again once the caller's copy
+ * is gone.
+ */
+static void
+copy_query(ch_query * dst, const ch_query * src)
+{
+	*dst = *src;
+	dst->sql = pstrdup(src->sql);
+	dst->settings = copyObject(src->settings);
+	if (src->num_params > 0)
+	{
+		const char **values = palloc(src->num_params * sizeof(char *));
 
-		ereport(ERROR, (
-						errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
-						errmsg("pg_clickhouse: %s", format_error(error)),
-						status < 404 ? 0 : errdetail_internal("Remote Query: %.64000s", query->sql),
-						errcontext("HTTP status code: %li", status)
-						));
+		for (int i = 0; i < src->num_params; i++)
+			values[i] = src->param_values[i] ? pstrdup(src->param_values[i]) : NULL;
+		dst->param_values = values;
 	}
+}
+
+/*
+ * Sends the query and returns a cursor for its result without waiting for
+ * the response. The response is checked by the first fetch.
+ */
+static ch_cursor *
+http_begin_query(void *conn, const ch_query * query)
+{
+	MemoryContext tempcxt,
+				oldcxt;
+	ch_cursor  *cursor;
+	ch_http_response_t *resp;
+
+	ch_http_set_progress_func(http_progress_callback);
+
+	/* Let the multiplexer run the query if it's running. */
+	resp = chfdw_mux_start_query(conn, query);
+	if (resp == NULL)
+		resp = ch_http_start_query(conn, query);
+	if (resp == NULL)
+		elog(ERROR, "out of memory");
 
 	/*
 	 * we could not control properly deallocation of libclickhouse memory, so
@@ -220,9 +264,14 @@ again:
 	cursor->query_response = resp;
 	cursor->read_state = palloc0(sizeof(ch_http_read_state));
 	cursor->query = pstrdup(query->sql);
-	cursor->request_time = resp->pretransfer_time * 1000;
-	cursor->total_time = resp->total_time * 1000;
-	ch_http_read_state_init(cursor->read_state, resp->data, resp->datasize);
+	cursor->pending = true;
+	copy_query(&cursor->request, query);
+	ch_http_read_state_init(cursor->read_state, resp);
+	if (query->format == CH_FORMAT_ROWBINARY)
+	{
+		cursor->rowbinary = palloc(sizeof(ch_rowbinary_state));
+		ch_rowbinary_init(cursor->rowbinary, cursor->read_state);
+	}
 
 	cursor->memcxt = tempcxt;
 	cursor->callback.func = http_cursor_free;
@@ -233,11 +282,82 @@ again:
 	return cursor;
 }
 
+/*
+ * Waits for the response to the query of a cursor and checks it, retrying
+ * the query when it could not be sent.
+ */
 static void
-http_simple_insert(void *conn, const ch_query * query)
+http_await_cursor(ch_cursor * cursor)
+{
+	int			attempts = 0;
+	ch_http_response_t *resp = cursor->query_response;
+
+	for (;;)
+	{
+		ch_http_connection_t *conn = resp->conn;
+
+		ch_http_response_await(resp);
+		attempts++;
+		if (resp->http_status != 419 || !resp->unsent || attempts >= 3 ||
+			conn == NULL)
+			break;
+
+		/* Start over, freeing the failed response only once replaced. */
+		cursor->query_response = ch_http_start_query(conn, &cursor->request);
+		if (cursor->query_response == NULL)
+		{
+			cursor->query_response = resp;
+			break;
+		}
+
+		ch_http_read_state_free(cursor->read_state);
+		ch_http_response_free(resp);
+		resp = cursor->query_response;
+		ch_http_read_state_init(cursor->read_state, resp);
+	}
+
+	cursor->pending = false;
+	if (resp->http_status != 200)
+		http_report_error(resp->conn, resp, cursor->query, false);
+
+	cursor->request_time = resp->pretransfer_time * 1000;
+	cursor->total_time = resp->total_time * 1000;
+}
+
+static ch_cursor *
+http_simple_query(void *conn, const ch_query * query)
+{
+	ch_cursor  *cursor = http_begin_query(conn, query);
+
+	http_await_cursor(cursor);
+	return cursor;
+}
+
+/*
+ * Returns the socket to wait on before the next row of the cursor can be
+ * fetched without blocking, or PGINVALID_SOCKET if it can be fetched now.
+ */
+static pgsocket
+http_cursor_socket(ch_cursor * cursor)
 {
-	ch_http_response_t *resp = ch_http_simple_query(conn, query);
+	ch_http_read_state *state = cursor->read_state;
+	int			fd;
+
+	if (state->done)
+		return PGINVALID_SOCKET;
 
+	fd = ch_http_response_socket(cursor->query_response, state->curpos,
+								 cursor->rowbinary == NULL);
+	return fd < 0 ? PGINVALID_SOCKET : fd;
+}
+
+/*
+ * Raises an error unless the INSERT got a successful response, then frees
+ * the response.
+ */
+static void
+http_check_insert(void *conn, ch_http_response_t * resp, const char *sql)
+{
 	if (resp == NULL)
 	{
 		char	   *error = ch_http_last_error();
@@ -251,23 +371,17 @@ http_simple_insert(void *conn, const ch_query * query)
 	}
 
 	if (resp->http_status != 200)
-	{
-		char	   *error = pnstrdup(resp->data, resp->datasize);
-		long		status = resp->http_status;
-
-		ch_http_response_free(resp);
-
-		ereport(ERROR, (
-						errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
-						errmsg("pg_clickhouse: %s", format_error(error)),
-						status < 404 ? 0 : errdetail_internal("Remote Query: %.64000s", query->sql),
-						errcontext("HTTP status code: %li", status)
-						));
-	}
+		http_report_error(conn, resp, sql, true);
 
 	ch_http_response_free(resp);
 }
 
+static void
+http_simple_insert(void *conn, const ch_query * query)
+{
+	http_check_insert(conn, ch_http_simple_query(conn, query), query->sql);
+}
+
 static void
 http_cursor_free(void *c)
 {
@@ -277,6 +391,66 @@ http_cursor_free(void *c)
 	ch_http_response_free(cursor->query_response);
 }
 
+/*
+ * Decodes the next row of a RowBinary result and converts it to the types of
+ * tupdesc like the binary driver does.
+ */
+static void **
+http_fetch_rowbinary(ch_cursor * cursor, List * attrs, TupleDesc tupdesc,
+					 Datum * values, bool *nulls)
+{
+	ch_rowbinary_state *state = cursor->rowbinary;
+	ch_http_response_t *resp = cursor->query_response;
+	size_t		attcount = list_length(attrs);
+	bool		have_row = false;
+
+	Assert(tupdesc);
+
+	if (!state->header_read)
+	{
+		MemoryContext oldcxt = MemoryContextSwitchTo(cursor->memcxt);
+
+		if (ch_rowbinary_read_header(state))
+			cursor->conversion_states = palloc0(sizeof(uintptr_t) *
+												state->columns_count);
+		cursor->columns_count = state->columns_count;
+		MemoryContextSwitchTo(oldcxt);
+	}
+
+	if (state->header_read)
+		have_row = ch_rowbinary_read_row(state);
+
+	/* the transfer failed while streaming the result */
+	if (resp->http_status != 200)
+		http_report_error(resp->conn, resp, cursor->query, false);
+
+	if (state->truncated)
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_ERROR),
+				 errmsg("pg_clickhouse: unexpected end of RowBinary result")));
+
+	if (!have_row)
+		return NULL;
+
+	/* SELECT NULL */
+	if (attcount == 0)
+		return (void **) state->values;
+
+	if (attcount != state->columns_count)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg_internal("pg_clickhouse: columns mismatch"),
+				 errdetail("Number of returned columns (%lu) does not match "
+						   "expected column count (%lu).",
+						   state->columns_count, attcount)));
+	}
+
+	convert_row(cursor, attrs, tupdesc, state->coltypes, state->values,
+				state->nulls, values, nulls);
+	return (void **) state->values;
+}
+
 static void **
 http_fetch_row(ch_cursor * cursor, List * attrs, TupleDesc tupdesc, Datum * v, bool *n)
 {
@@ -287,25 +461,38 @@ http_fetch_row(ch_cursor * cursor, List * attrs, TupleDesc tupdesc, Datum * v, b
 		/* SELECT NULL */
 		attcount = 1;
 
+	if (cursor->pending)
+		http_await_cursor(cursor);
+
+	if (cursor->rowbinary)
+		return http_fetch_rowbinary(cursor, attrs, tupdesc, v, n);
+
 	ch_http_read_state *state = cursor->read_state;
+	ch_http_response_t *resp = cursor->query_response;
 
 	/* all rows or empty table */
-	if (state->done || state->data == NULL)
-		return NULL;
+	if (ch_http_read_eof(state))
+		goto done;
 
 	char	  **values = palloc(attcount * sizeof(char *));
 
+	/*
+	 * The values point into the response buffer, so they are only valid
+	 * until the next row is fetched or another query runs on the connection.
+	 */
 	for (int i = 0; i < attcount; i++)
 	{
 		rc = ch_http_read_next(state);
 		if (state->val[0] == '\\' && state->val[1] == 'N')
 			values[i] = NULL;
-		else if (state->val[0] != '\0')
-			values[i] = pstrdup(state->val);
 		else
-			values[i] = "";
+			values[i] = state->val;
 	}
 
+	/* the transfer failed while streaming the result */
+	if (resp->done && resp->http_status != 200)
+		http_report_error(resp->conn, resp, cursor->query, false);
+
 	if (attcount > 0 && rc != CH_EOL && rc != CH_EOF)
 	{
 		ereport(ERROR,
@@ -316,17 +503,73 @@ http_fetch_row(ch_cursor * cursor, List * attrs, TupleDesc tupdesc, Datum * v, b
 	}
 
 	return (void **) values;
+
+done:
+	if (resp->http_status != 200)
+		http_report_error(resp->conn, resp, cursor->query, false);
+
+	return NULL;
 }
 
 text	   *
 chfdw_http_fetch_raw_data(ch_cursor * cursor)
 {
-	ch_http_read_state *state = cursor->read_state;
+	ch_http_response_t *resp = cursor->query_response;
+
+	ch_http_response_read_all(resp);
+	if (resp->http_status != 200)
+		http_report_error(resp->conn, resp, cursor->query, false);
 
-	if (state->data == NULL)
+	if (resp->datasize == 0)
 		return NULL;
 
-	return cstring_to_text_with_len(state->data, state->maxpos + 1);
+	return cstring_to_text_with_len(resp->data, resp->datasize);
+}
+
+/*
+ * Get the number of http requests the backend has made, and the new
+ * connections they opened.
+ */
+void
+chfdw_http_transfer_stats(long *requests, long *connects)
+{
+	ch_http_transfer_stats(requests, connects);
+}
+
+/*
+ * Describes the transport the last finished transfer of an http connection
+ * used, such as "HTTP/1.1, TCP keepalive", or returns NULL if none has
+ * finished.
+ */
+char *
+chfdw_http_transport(void *conn)
+{
+	long		version;
+	int			keepalive;
+	const char *name;
+
+	ch_http_transport(conn, &version, &keepalive);
+	switch (version)
+	{
+		case CURL_HTTP_VERSION_1_0:
+			name = "HTTP/1.0";
+			break;
+		case CURL_HTTP_VERSION_1_1:
+			name = "HTTP/1.1";
+			break;
+		case CURL_HTTP_VERSION_2_0:
+			name = "HTTP/2";
+			break;
+#if LIBCURL_VERSION_NUM >= 0x074200
+		case CURL_HTTP_VERSION_3:
+			name = "HTTP/3";
+			break;
+#endif
+		default:
+			return NULL;
+	}
+
+	return psprintf("%s%s", name, keepalive > 0 ? ", TCP keepalive" : "");
 }
 
 /*
@@ -341,8 +584,23 @@ extend_insert_query(ch_http_insert_state * state, TupleTableSlot * slot)
 #endif
 	bool		first = true;
 
-	if (state->sql.len == 0)
-		appendStringInfoString(&state->sql, state->sql_begin);
+	if (state->columns != NULL)
+	{
+		int			i = 0;
+		ListCell   *lc;
+
+		/* write each value straight into its column, no separators */
+		foreach(lc, state->target_attrs)
+		{
+			bool		isnull;
+			Datum		value = slot_getattr(slot, lfirst_int(lc), &isnull);
+
+			ch_rowbinary_write_value(&state->sql, state->columns[i],
+									 value, state->valtypes[i], isnull);
+			i++;
+		}
+		return;
+	}
 
 	/* get following parameters from slot */
 	if (slot != NULL && state->target_attrs != NIL)
@@ -383,10 +641,25 @@ extend_insert_query(ch_http_insert_state * state, TupleTableSlot * slot)
 					appendStringInfo(&state->sql, INT64_FORMAT, DatumGetInt64(value));
 					break;
 				case FLOAT4OID:
-					appendStringInfo(&state->sql, "%f", DatumGetFloat4(value));
-					break;
 				case FLOAT8OID:
-					appendStringInfo(&state->sql, "%f", DatumGetFloat8(value));
+					{
+						/* the shortest text that reads back exactly */
+						char		buf[FLOAT8_SHORTEST_DECIMAL_LEN];
+						float8		f = type == FLOAT4OID ? DatumGetFloat4(value)
+							: DatumGetFloat8(value);
+
+						if (isnan(f) || isinf(f))
+							appendStringInfoString(&state->sql,
+												   isnan(f) ? "nan" : f > 0 ? "inf" : "-inf");
+						else
+						{
+							if (type == FLOAT4OID)
+								float4_to_shortest_decimal_buf(DatumGetFloat4(value), buf);
+							else
+								float8_to_shortest_decimal_buf(f, buf);
+							appendStringInfoString(&state->sql, buf);
+						}
+					}
 					break;
 				case NUMERICOID:
 					{
@@ -463,6 +736,78 @@ extend_insert_query(ch_http_insert_state * state, TupleTableSlot * slot)
 	}
 }
 
+/*
+ * Aborts the INSERT request still running when the statement fails.
+ */
+static void
+http_insert_state_free(void *s)
+{
+	ch_http_insert_state *state = s;
+
+	if (state->resp)
+		ch_http_response_free(state->resp);
+	state->resp = NULL;
+}
+
+/*
+ * Sets up RowBinary encoders for the inserted columns, from the types that
+ * ClickHouse reports for them in the header of an empty result. Leaves
+ * state->columns NULL to fall back on TabSeparated if some value can't be
+ * written in RowBinary.
+ */
+static void
+http_prepare_rowbinary(ch_http_insert_state * state, Relation rel,
+					   const ch_query * query, const char *table_name)
+{
+	const char *prefix = "INSERT INTO ";
+	const char *cols;
+	size_t		len;
+	ch_query	probe;
+	ch_cursor  *cursor;
+	ch_rowbinary_state *rb;
+	ListCell   *lc;
+	int			i = 0;
+
+	/* the column list follows the table name, see chfdw_deparse_insert_sql() */
+	len = strlen(prefix) + strlen(table_name);
+	if (state->target_attrs == NIL || strncmp(query->sql, prefix, strlen(prefix)) != 0 ||
+		strncmp(query->sql + strlen(prefix), table_name, strlen(table_name)) != 0 ||
+		query->sql[len] != '(')
+		return;
+	cols = query->sql + len;
+
+	probe = new_query(psprintf("SELECT %.*s FROM %s LIMIT 0",
+							   (int) strlen(cols) - 2, cols + 1, table_name));
+	probe.format = CH_FORMAT_ROWBINARY;
+	cursor = http_simple_query(state->conn, &probe);
+	rb = cursor->rowbinary;
+	if (!ch_rowbinary_read_header(rb) ||
+		rb->columns_count != list_length(state->target_attrs))
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_ERROR),
+				 errmsg("pg_clickhouse: could not get the column types of %s",
+						table_name)));
+
+	state->columns = palloc(sizeof(ch_rowbinary_type *) * rb->columns_count);
+	state->valtypes = palloc(sizeof(Oid) * rb->columns_count);
+	foreach(lc, state->target_attrs)
+	{
+		Form_pg_attribute attr = TupleDescAttr(RelationGetDescr(rel),
+											   lfirst_int(lc) - 1);
+
+		state->columns[i] = rb->columns[i];
+		state->valtypes[i] = getBaseType(attr->atttypid);
+		if (!ch_rowbinary_can_write(state->columns[i], state->valtypes[i]))
+		{
+			state->columns = NULL;
+			break;
+		}
+		i++;
+	}
+
+	MemoryContextDelete(cursor->memcxt);
+}
+
 static void *
 http_prepare_insert(void *conn, ResultRelInfo * rri, List * target_attrs,
 					const ch_query * query, char *table_name)
@@ -470,33 +815,111 @@ http_prepare_insert(void *conn, ResultRelInfo * rri, List * target_attrs,
 	ch_http_insert_state *state = palloc0(sizeof(ch_http_insert_state));
 
 	initStringInfo(&state->sql);
-	state->sql_begin = psprintf("%s FORMAT TSV\n", query->sql);
 	state->target_attrs = target_attrs;
-	state->p_nums = list_length(state->target_attrs);
 	state->conn = conn;
+	if (query->format == CH_FORMAT_ROWBINARY && table_name != NULL)
+		http_prepare_rowbinary(state, rri->ri_RelationDesc, query, table_name);
+	state->sql_begin = psprintf("%s FORMAT %s\n", query->sql,
+								state->columns ? "RowBinary" : "TSV");
+	state->p_nums = list_length(state->target_attrs);
+	chfdw_get_insert_block_limits(RelationGetRelid(rri->ri_RelationDesc),
+								  &state->max_block_rows,
+								  &state->max_block_bytes);
+	state->callback.func = http_insert_state_free;
+	state->callback.arg = state;
+	MemoryContextRegisterResetCallback(CurrentMemoryContext, &state->callback);
 
 	return state;
 }
 
+/*
+ * Ends the INSERT request of the current block and checks its response.
+ */
 static void
-http_insert_tuple(void *istate, TupleTableSlot * slot)
+http_finish_insert(ch_http_insert_state * state)
+{
+	ch_http_response_t *resp = state->resp;
+
+	state->resp = NULL;
+	state->block_rows = 0;
+	state->block_bytes = 0;
+	ch_http_insert_finish(resp);
+	http_check_insert(state->conn, resp, state->sql_begin);
+}
+
+/*
+ * Hands the rows collected so far to the INSERT request of the current
+ * block, starting the request if needed. The request streams them to
+ * ClickHouse while more rows are collected.
+ */
+static void
+http_send_insert(ch_http_insert_state * state)
+{
+	if (state->resp == NULL)
+	{
+		ch_query	query = new_query(state->sql_begin);
+
+		state->resp = ch_http_start_insert(state->conn, &query);
+		if (state->resp == NULL)
+			http_check_insert(state->conn, NULL, state->sql_begin);
+	}
+
+	state->block_bytes += state->sql.len;
+	if (!ch_http_insert_write(state->resp, state->sql.data, state->sql.len))
+	{
+		/* the server ended the request early, report its error */
+		http_finish_insert(state);
+		ereport(ERROR,
+				(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+				 errmsg("pg_clickhouse: INSERT ended before all rows were sent")));
+	}
+	resetStringInfo(&state->sql);
+}
+
+static void
+http_insert_tuples(void *istate, TupleTableSlot * *slots, int nslots)
 {
 	ch_http_insert_state *state = istate;
 
-	extend_insert_query(state, slot);
+	for (int i = 0; i < nslots; i++)
+		extend_insert_query(state, slots[i]);
+	state->block_rows += nslots;
+
+	if (state->sql.len >= CH_HTTP_INSERT_CHUNK)
+		http_send_insert(state);
 
-	if ((slot == NULL && state->sql.len > 0)
-		|| state->sql.len > (MaxAllocSize / 2 /* 512MB */ ))
+	if ((state->max_block_rows > 0
+		 && state->block_rows >= state->max_block_rows)
+		|| (state->max_block_bytes > 0
+			&& state->block_bytes + state->sql.len >= state->max_block_bytes))
 	{
-		ch_query	query = new_query(state->sql.data);
+		if (state->sql.len > 0)
+			http_send_insert(state);
+		http_finish_insert(state);
+	}
+}
 
-		http_simple_insert(state->conn, &query);
-		resetStringInfo(&state->sql);
+static void
+http_insert_tuple(void *istate, TupleTableSlot * slot)
+{
+	ch_http_insert_state *state = istate;
+
+	if (slot)
+		http_insert_tuples(state, &slot, 1);
+	else
+	{
+		if (state->sql.len > 0)
+			http_send_insert(state);
+		if (state->resp)
+			http_finish_insert(state);
 	}
 }
 
 /*** BINARY PROTOCOL ***/
 
+/* Maximum number of rows converted before appending them to a block */
+#define BINARY_MAX_INSERT_BATCH 10000
+
 ch_connection
 chfdw_binary_connect(ch_connection_details * details)
 {
@@ -519,6 +942,7 @@ chfdw_binary_connect(ch_connection_details * details)
 	res.conn = conn;
 	res.methods = &binary_methods;
 	res.is_binary = true;
+	res.format = CH_FORMAT_TSV;
 	return res;
 }
 
@@ -529,27 +953,41 @@ binary_disconnect(void *conn)
 		ch_binary_close((ch_binary_connection_t *) conn);
 }
 
+/*
+ * Raises the error of a failed binary response, freeing it.
+ */
+static void
+binary_report_error(ch_binary_response_t * resp, const char *sql)
+{
+	char	   *error = pstrdup(resp->error);
+	bool		unsent = resp->unsent;
+
+	ch_binary_response_free(resp);
+	ereport(ERROR, (
+					errcode(unsent ? ERRCODE_SQLCLIENT_UNABLE_TO_ESTABLISH_SQLCONNECTION :
+							ERRCODE_SQL_ROUTINE_EXCEPTION),
+					errmsg("pg_clickhouse: %s", error),
+					errdetail_internal("Remote Query: %.64000s", sql)
+					));
+}
+
+/*
+ * Sends the query and returns a cursor for its result without waiting for
+ * the response. The response is checked by the first fetch.
+ */
 static ch_cursor *
-binary_simple_query(void *conn, const ch_query * query)
+binary_begin_query(void *conn, const ch_query * query)
 {
 	MemoryContext tempcxt,
 				oldcxt;
 	ch_cursor  *cursor;
-	ch_binary_read_state_t *state;
 
-	ch_binary_response_t *resp = ch_binary_simple_query(conn, query, &is_canceled);
+	ch_binary_response_t *resp = ch_binary_start_query(conn, query,
+													   ch_binary_buffer_blocks,
+													   &is_canceled);
 
 	if (!resp->success)
-	{
-		char	   *error = pstrdup(resp->error);
-
-		ch_binary_response_free(resp);
-		ereport(ERROR, (
-						errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
-						errmsg("pg_clickhouse: %s", error),
-						errdetail_internal("Remote Query: %.64000s", query->sql)
-						));
-	}
+		binary_report_error(resp, query->sql);
 
 	tempcxt = AllocSetContextCreate(PortalContext, "pg_clickhouse cursor",
 									ALLOCSET_DEFAULT_SIZES);
@@ -557,12 +995,10 @@ binary_simple_query(void *conn, const ch_query * query)
 	oldcxt = MemoryContextSwitchTo(tempcxt);
 	cursor = palloc0(sizeof(ch_cursor));
 	cursor->query_response = resp;
-	state = (ch_binary_read_state_t *) palloc0(sizeof(ch_binary_read_state_t));
 	cursor->query = pstrdup(query->sql);
-	cursor->read_state = state;
-	cursor->columns_count = resp->columns_count;
-	ch_binary_read_state_init(cursor->read_state, resp);
-	cursor->conversion_states = palloc0(sizeof(uintptr_t) * cursor->columns_count);
+	cursor->read_state = palloc0(sizeof(ch_binary_read_state_t));
+	cursor->pending = true;
+	copy_query(&cursor->request, query);
 
 	cursor->memcxt = tempcxt;
 	cursor->callback.func = binary_cursor_free;
@@ -570,6 +1006,35 @@ binary_simple_query(void *conn, const ch_query * query)
 	MemoryContextRegisterResetCallback(tempcxt, &cursor->callback);
 	MemoryContextSwitchTo(oldcxt);
 
+	return cursor;
+}
+
+/*
+ * Waits for the header of the result of a cursor and sets up reading it.
+ */
+static void
+binary_await_cursor(ch_cursor * cursor)
+{
+	ch_binary_response_t *resp = cursor->query_response;
+	ch_binary_read_state_t *state = cursor->read_state;
+
+	cursor->pending = false;
+	ch_binary_response_await(resp);
+	if (!resp->success)
+	{
+		/* report a canceled query like Postgres does */
+		CHECK_FOR_INTERRUPTS();
+
+		/* the cursor must not free the response again */
+		cursor->query_response = NULL;
+		binary_report_error(resp, cursor->query);
+	}
+
+	ch_binary_read_state_init(state, resp);
+	cursor->conversion_states = MemoryContextAllocZero(cursor->memcxt,
+													   sizeof(uintptr_t) * resp->columns_count);
+	cursor->columns_count = resp->columns_count;
+
 	if (state->error)
 	{
 		ereport(ERROR,
@@ -577,24 +1042,123 @@ binary_simple_query(void *conn, const ch_query * query)
 				 errmsg("pg_clickhouse: could not initialize read state: %s",
 						state->error)));
 	}
+}
 
+static ch_cursor *
+binary_simple_query(void *conn, const ch_query * query)
+{
+	ch_cursor  *cursor = binary_begin_query(conn, query);
+
+	binary_await_cursor(cursor);
 	return cursor;
 }
 
+/*
+ * Returns the descriptor to wait on before the next row of the cursor can be
+ * fetched without blocking, or PGINVALID_SOCKET if it can be fetched now.
+ */
+static pgsocket
+binary_cursor_socket(ch_cursor * cursor)
+{
+	int			fd;
+
+	if (cursor->query_response == NULL)
+		return PGINVALID_SOCKET;
+
+	fd = ch_binary_response_socket(cursor->query_response,
+								   cursor->pending ? NULL : cursor->read_state);
+	return fd < 0 ? PGINVALID_SOCKET : fd;
+}
+
+/*
+ * Converts a row of values decoded by the binary driver or from a RowBinary
+ * result to the types of the attributes of tupdesc. The conversion of each
+ * column is set up from its first value.
+ */
+static void
+convert_row(ch_cursor * cursor, List * attrs, TupleDesc tupdesc,
+			Oid * coltypes, Datum * invalues, bool *innulls,
+			Datum * values, bool *nulls)
+{
+	ListCell   *lc;
+	size_t		j = 0;
+
+	Assert(values && nulls);
+
+	foreach(lc, attrs)
+	{
+		int			i = lfirst_int(lc);
+		bool		isnull = innulls[j];
+		intptr_t	convstate;
+
+		if (isnull)
+			values[i - 1] = (Datum) 0;
+		else
+		{
+	again:
+			convstate = cursor->conversion_states[j];
+			switch (convstate)
+			{
+				case 0:
+					{
+						MemoryContext old_mcxt;
+
+						Oid			outtype = TupleDescAttr(tupdesc, i - 1)->atttypid;
+						void	   *s;
+
+						/*
+						 * now we're should be in temporary memory context, so
+						 * make sure conversion states outlive it.
+						 */
+						old_mcxt = MemoryContextSwitchTo(cursor->memcxt);
+						s = ch_binary_init_convert_state(invalues[j],
+														 coltypes[j], outtype);
+						MemoryContextSwitchTo(old_mcxt);
+
+						if (s == NULL)
+							/* no conversion but state is initalized */
+							cursor->conversion_states[j] = 1;
+						else
+							cursor->conversion_states[j] = (uintptr_t) s;
+						goto again;
+					}
+				case 1:
+					/* no conversion */
+					values[i - 1] = invalues[j];
+					break;
+				default:
+					values[i - 1] = ch_binary_convert_datum((void *) convstate,
+															invalues[j]);
+			}
+		}
+
+		nulls[i - 1] = isnull;
+		j++;
+	}
+}
+
 static void **
 binary_fetch_row(ch_cursor * cursor, List * attrs, TupleDesc tupdesc,
 				 Datum * values, bool *nulls)
 {
-	ListCell   *lc;
 	ch_binary_read_state_t *state = cursor->read_state;
-	bool		have_data = ch_binary_read_row(state);
+	bool		have_data;
 	size_t		attcount = list_length(attrs);
 
+	if (cursor->pending)
+		binary_await_cursor(cursor);
+
+	have_data = ch_binary_read_row(state);
+
 	if (state->error)
+	{
+		/* report a canceled query like Postgres does */
+		CHECK_FOR_INTERRUPTS();
 		ereport(ERROR,
 				(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
 				 errmsg("pg_clickhouse: error while reading row: %s",
 						state->error)));
+	}
 
 	if (!have_data)
 		return NULL;
@@ -621,64 +1185,8 @@ binary_fetch_row(ch_cursor * cursor, List * attrs, TupleDesc tupdesc,
 	}
 
 	if (tupdesc)
-	{
-		size_t		j = 0;
-
-		Assert(values && nulls);
-
-		foreach(lc, attrs)
-		{
-			int			i = lfirst_int(lc);
-			bool		isnull = state->nulls[j];
-			intptr_t	convstate;
-
-
-			if (isnull)
-				values[i - 1] = (Datum) 0;
-			else
-			{
-		again:
-				convstate = cursor->conversion_states[j];
-				switch (convstate)
-				{
-					case 0:
-						{
-							MemoryContext old_mcxt;
-
-							Oid			outtype = TupleDescAttr(tupdesc, i - 1)->atttypid;
-							void	   *s;
-
-							/*
-							 * now we're should be in temporary memory
-							 * context, so make sure conversion states outlive
-							 * it.
-							 */
-							old_mcxt = MemoryContextSwitchTo(cursor->memcxt);
-							s = ch_binary_init_convert_state(state->values[j],
-															 state->coltypes[j], outtype);
-							MemoryContextSwitchTo(old_mcxt);
-
-							if (s == NULL)
-								/* no conversion but state is initalized */
-								cursor->conversion_states[j] = 1;
-							else
-								cursor->conversion_states[j] = (uintptr_t) s;
-							goto again;
-						}
-					case 1:
-						/* no conversion */
-						values[i - 1] = state->values[j];
-						break;
-					default:
-						values[i - 1] = ch_binary_convert_datum((void *) convstate,
-																state->values[j]);
-				}
-			}
-
-			nulls[i - 1] = isnull;
-			j++;
-		}
-	}
+		convert_row(cursor, attrs, tupdesc, state->coltypes, state->values,
+					state->nulls, values, nulls);
 
 ok:
 	return (void **) state->values;
@@ -696,7 +1204,8 @@ binary_cursor_free(void *c)
 	}
 
 	ch_binary_read_state_free(cursor->read_state);
-	ch_binary_response_free(cursor->query_response);
+	if (cursor->query_response)
+		ch_binary_response_free(cursor->query_response);
 }
 
 static void *
@@ -721,21 +1230,62 @@ binary_prepare_insert(void *conn, ResultRelInfo * rri, List * target_attrs,
 	state->callback.arg = state;
 	state->conn = conn;
 	state->table_name = pstrdup(table_name);
+	chfdw_get_insert_block_limits(RelationGetRelid(rri->ri_RelationDesc),
+								  &state->max_block_rows,
+								  &state->max_block_bytes);
 	MemoryContextRegisterResetCallback(tempcxt, &state->callback);
 
 	/* time for c++ stuff */
 	ch_binary_prepare_insert(conn, query, state);
 
-	/* buffers */
-	state->values = (Datum *) palloc0(sizeof(Datum) * state->len);
-	state->nulls = (bool *) palloc0(sizeof(bool) * state->len);
+	/*
+	 * Buffers for a batch of rows, stored by column. Larger batches are
+	 * appended in chunks of this size.
+	 */
+	state->batch_size = Min(chfdw_get_insert_batch_size(RelationGetRelid(rri->ri_RelationDesc)),
+							BINARY_MAX_INSERT_BATCH);
+	state->values = (Datum *) palloc0(sizeof(Datum) * state->len * state->batch_size);
+	state->nulls = (bool *) palloc0(sizeof(bool) * state->len * state->batch_size);
 	MemoryContextSwitchTo(oldcxt);
 
 	return state;
 }
 
+/*
+ * Approximate the number of bytes the converted values of a row add to an
+ * insert block.
+ */
+static size_t
+binary_insert_row_size(ch_binary_insert_state * state, size_t row)
+{
+	size_t		size = 0;
+
+	for (size_t i = 0; i < state->outdesc->natts; i++)
+	{
+		Form_pg_attribute attr = TupleDescAttr(state->outdesc, i);
+		Datum		val = state->values[i * state->batch_size + row];
+
+		if (state->nulls[i * state->batch_size + row])
+			size += 1;
+		else if (attr->atttypid == ANYARRAYOID)
+			size += ((ch_binary_array_t *) DatumGetPointer(val))->len * sizeof(Datum);
+		else if (attr->attlen > 0)
+			size += attr->attlen;
+		else if (attr->attlen == -1)
+			size += VARSIZE_ANY_EXHDR(DatumGetPointer(val));
+		else
+			size += strlen(DatumGetCString(val));
+	}
+
+	return size;
+}
+
+/*
+ * Append a batch of rows to the insert block, converting them all first so
+ * that each column is appended in a single pass.
+ */
 static void
-binary_insert_tuple(void *istate, TupleTableSlot * slot)
+binary_insert_tuples(void *istate, TupleTableSlot * *slots, int nslots)
 {
 	ch_binary_insert_state *state = istate;
 
@@ -745,21 +1295,47 @@ binary_insert_tuple(void *istate, TupleTableSlot * slot)
 
 		old_mcxt = MemoryContextSwitchTo(state->memcxt);
 		state->conversion_states = ch_binary_make_tuple_map(
-															slot->tts_tupleDescriptor, state->outdesc);
+															slots[0]->tts_tupleDescriptor, state->outdesc);
 		MemoryContextSwitchTo(old_mcxt);
 	}
 
-	if (slot)
+	for (int offset = 0; offset < nslots; offset += state->batch_size)
 	{
-		ch_binary_do_output_convertion(state, slot);
+		size_t		nrows = Min(nslots - offset, state->batch_size);
+
+		for (size_t row = 0; row < nrows; row++)
+		{
+			ch_binary_do_output_convertion(state, slots[offset + row], row);
+			state->block_bytes += binary_insert_row_size(state, row);
+		}
 
 		for (size_t i = 0; i < state->outdesc->natts; i++)
-			ch_binary_column_append_data(state, i);
+			ch_binary_column_append_data(state, i, nrows);
+
+		state->block_rows += nrows;
+
+		/* Send the block once it reaches either limit */
+		if ((state->max_block_rows > 0
+			 && state->block_rows >= state->max_block_rows)
+			|| (state->max_block_bytes > 0
+				&& state->block_bytes >= state->max_block_bytes))
+		{
+			ch_binary_insert_columns(state);
+			state->block_rows = 0;
+			state->block_bytes = 0;
+		}
 	}
-	else
-	{
+}
+
+static void
+binary_insert_tuple(void *istate, TupleTableSlot * slot)
+{
+	ch_binary_insert_state *state = istate;
+
+	if (slot)
+		binary_insert_tuples(state, &slot, 1);
+	else if (state->block_rows > 0)
 		ch_binary_insert_columns(state);
-	}
 }
 
 /*
@@ -815,13 +1391,17 @@ static char *str_types_map[][2] = {
 	{NULL, NULL},
 };
 
+/*
+ * Copies a value fetched by fetch_row, so that it outlives the row. The http
+ * driver returns values pointing into the response buffer.
+ */
 static char *
 readstr(ch_connection conn, char *val)
 {
 	if (conn.is_binary)
 		return TextDatumGetCString(PointerGetDatum(val));
 	else
-		return val;
+		return val ? pstrdup(val) : NULL;
 }
 
 static char *
@@ -1062,9 +1642,152 @@ chfdw_construct_create_tables(ImportForeignSchemaStmt * stmt, ForeignServer * se
 	}
 
 	MemoryContextDelete(cursor->memcxt);
+	chfdw_release_connection(conn);
+	return result;
+}
+
+/*
+ * Run a query returning a single row of ncolumns strings, and return them as
+ * palloc'd C strings, or NULL if the query returned no rows.
+ */
+char	  **
+chfdw_fetch_string_row(ch_connection conn, const char *sql, int ncolumns)
+{
+	ch_cursor  *cursor;
+	ch_query	query = new_query(sql);
+	List	   *attrs = NIL;
+	char	  **row_values;
+	char	  **result = NULL;
+	int			i;
+
+	for (i = 1; i <= ncolumns; i++)
+		attrs = lappend_int(attrs, i);
+
+	cursor = conn.methods->simple_query(conn.conn, &query);
+	row_values = (char **) conn.methods->fetch_row(cursor, attrs,
+												   NULL, NULL, NULL);
+	if (row_values != NULL)
+	{
+		result = palloc0(sizeof(char *) * ncolumns);
+		for (i = 0; i < ncolumns; i++)
+		{
+			if (row_values[i] != NULL)
+				result[i] = pstrdup(readstr(conn, row_values[i]));
+		}
+	}
+	MemoryContextDelete(cursor->memcxt);
+	list_free(attrs);
+
 	return result;
 }
 
+/*
+ * Fetch the statistics of a remote table cached by stats.c: the row count and
+ * column sizes from system tables, and the number of distinct values of each
+ * column counted by uniq() in the first CH_STATS_UNIQ_ROWS rows.
+ */
+void
+chfdw_fetch_table_stats(ch_connection conn, Relation rel, ChTableStats * stats)
+{
+	ch_cursor  *cursor;
+	ch_query	query = new_query(NULL);
+	StringInfoData sql;
+	List	   *attrs = list_make4_int(1, 2, 3, 4);
+	List	   *columns = NIL;
+	List	   *indexes = NIL;
+	char	  **row_values;
+
+	memset(stats, 0, sizeof(ChTableStats));
+
+	initStringInfo(&sql);
+	chfdw_deparse_table_stats_sql(&sql, rel);
+	query.sql = sql.data;
+	cursor = conn.methods->simple_query(conn.conn, &query);
+
+	while (stats->ncolumns < CH_STATS_MAX_COLUMNS &&
+		   (row_values = (char **) conn.methods->fetch_row(cursor, attrs,
+														   NULL, NULL, NULL)) != NULL)
+	{
+		ChColumnStats *col = &stats->columns[stats->ncolumns];
+		char	   *type = readstr(conn, row_values[1]);
+
+		strlcpy(col->name, readstr(conn, row_values[0]), NAMEDATALEN);
+		col->bytes = strtod(readstr(conn, row_values[2]), NULL);
+		stats->rows = strtod(readstr(conn, row_values[3]), NULL);
+
+		/* uniq() can't count aggregate function states */
+		if (strstr(type, "AggregateFunction") == NULL)
+		{
+			columns = lappend(columns, makeString(col->name));
+			indexes = lappend_int(indexes, stats->ncolumns);
+		}
+		stats->ncolumns++;
+	}
+	MemoryContextDelete(cursor->memcxt);
+
+	if (columns != NIL)
+	{
+		char	  **uniq;
+		double		nrows;
+		ListCell   *lc;
+		int			i = 1;
+
+		resetStringInfo(&sql);
+		chfdw_deparse_uniq_sql(&sql, rel, columns, CH_STATS_UNIQ_ROWS);
+		uniq = chfdw_fetch_string_row(conn, sql.data, list_length(columns) + 1);
+		if (uniq == NULL || uniq[0] == NULL)
+			return;
+
+		nrows = strtod(uniq[0], NULL);
+		foreach(lc, indexes)
+		{
+			ChColumnStats *col = &stats->columns[lfirst_int(lc)];
+			double		ndistinct = uniq[i] ? strtod(uniq[i], NULL) : 0;
+
+			/*
+			 * Like ANALYZE, assume that the number of distinct values grows
+			 * with the table if they are over a tenth of a partial read.
+			 */
+			if (nrows < CH_STATS_UNIQ_ROWS || ndistinct <= 0.1 * nrows)
+				col->ndistinct = ndistinct;
+			else
+				col->ndistinct = -(ndistinct / nrows);
+			i++;
+		}
+	}
+}
+
+/*
+ * Run a query built by chfdw_deparse_estimate_sql and parse its results.
+ * Returns false if ClickHouse could not estimate the query, which happens for
+ * engines outside of the MergeTree family. table_rows and bytes are zero when
+ * system tables know nothing about the table.
+ */
+bool
+chfdw_fetch_remote_estimate(ch_connection conn, const char *sql,
+							double *rows, double *table_rows, double *bytes)
+{
+	char	  **row_values = chfdw_fetch_string_row(conn, sql, 4);
+	double		values[4] = {0};
+	int			i;
+
+	if (row_values != NULL)
+	{
+		for (i = 0; i < 4; i++)
+		{
+			if (row_values[i] != NULL)
+				values[i] = strtod(row_values[i], NULL);
+		}
+	}
+
+	*rows = values[1];
+	*table_rows = values[2];
+	*bytes = values[3];
+
+	/* count() of EXPLAIN ESTIMATE rows, one per estimated table */
+	return values[0] > 0;
+}
+
 
 /*
  * Escaping arbitrary strings to get valid SQL literal strings.
@@ -0,0 +1,412 @@
+/*-------------------------------------------------------------------------
+ *
+ * resultcache.c
+ *		  Shared cache of remote query results for pg_clickhouse
+ *
+ * Dashboards send the same queries over and over, often from many backends
+ * at once. When pg_clickhouse is loaded via shared_preload_libraries and
+ * pg_clickhouse.result_cache_size is set, scans of foreign tables with the
+ * result_cache_ttl option store their results in shared memory, and
+ * identical scans return them until they expire, without asking ClickHouse.
+ *
+ * The scan builds the key, from the remote SQL, its parameters and
+ * settings, the user mapping and the local row type, and serializes the
+ * rows; this module only stores opaque bytes. The memory is split into
+ * fixed-size blocks, and an entry holds a chain of them with its key and
+ * data. Entries are found by a 128-bit hash of the key, and the stored key
+ * is compared as well, so a collision is a miss. When the blocks run out,
+ * the least recently used entries are evicted. A single entry may take up
+ * at most a quarter of the cache.
+ *
+ * Results of up to a quarter of the cache take a while to copy, so the lock
+ * is only held to find or reserve an entry and its blocks. The copy is made
+ * after releasing it, with the entry pinned so that it is neither evicted
+ * nor replaced meanwhile. An entry being stored stays invisible to lookups
+ * until its data is complete.
+ *
+ * Copyright (c) 2025, ClickHouse, Inc.
+ *
+ * IDENTIFICATION
+ *		  github.com/clickhouse/pg_clickhouse/src/resultcache.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "common/hashfn.h"
+#include "lib/ilist.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/hsearch.h"
+#include "utils/timestamp.h"
+
+#include "fdw.h"
+
+/* Size of the blocks the cache memory is split into */
+#define CH_RC_BLOCK_SIZE 8192
+
+typedef struct ChResultCacheKey
+{
+	uint64		hash[2];		/* two hashes of the key with different seeds */
+}			ChResultCacheKey;
+
+typedef struct ChResultCacheEntry
+{
+	ChResultCacheKey key;		/* hash key, must be first */
+	dlist_node	lru;			/* position in the LRU list */
+	TimestampTz expires_at;
+	Size		keylen;			/* bytes of the key, stored first */
+	Size		datalen;		/* bytes of data, stored after the key */
+	int			first_block;
+	int			nblocks;
+	int			pins;			/* backends copying to or from the blocks */
+	bool		ready;			/* the data is complete, see above */
+}			ChResultCacheEntry;
+
+typedef struct ChResultCacheShared
+{
+	LWLock	   *lock;			/* protects everything below and the blocks */
+	int			nblocks;		/* number of blocks in the cache */
+	int			nfree;			/* number of blocks in the free list */
+	int			free_block;		/* first free block, -1 if none */
+	dlist_head	lru;			/* entries, most recently used first */
+	int			next_block[FLEXIBLE_ARRAY_MEMBER];	/* next block of each
+													 * chain, -1 at the end */
+}			ChResultCacheShared;
+
+static ChResultCacheShared * rc_shared = NULL;
+static char *rc_blocks = NULL;
+static HTAB * rc_hash = NULL;
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static void rc_shmem_request(void);
+static void rc_shmem_startup(void);
+static int	rc_nblocks(void);
+static void rc_make_key(const char *key, Size keylen, ChResultCacheKey * hkey);
+static void rc_remove(ChResultCacheEntry * entry);
+static void rc_copy(int *block, Size *pos, char *dst, const char *src,
+					Size len);
+
+/*
+ * Set up the shared result cache. Called by _PG_init(); does nothing unless
+ * pg_clickhouse is being preloaded and the cache is enabled.
+ */
+void
+chfdw_result_cache_init(void)
+{
+	if (!process_shared_preload_libraries_in_progress || rc_nblocks() < 4)
+		return;
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = rc_shmem_request;
+#else
+	rc_shmem_request();
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = rc_shmem_startup;
+}
+
+static int
+rc_nblocks(void)
+{
+	return (int) ((Size) ch_result_cache_size * 1024 / CH_RC_BLOCK_SIZE);
+}
+
+static Size
+rc_shared_size(void)
+{
+	return add_size(offsetof(ChResultCacheShared, next_block),
+					mul_size(rc_nblocks(), sizeof(int)));
+}
+
+static void
+rc_shmem_request(void)
+{
+	Size		size;
+
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	size = MAXALIGN(rc_shared_size());
+	size = add_size(size, mul_size(rc_nblocks(), CH_RC_BLOCK_SIZE));
+	size = add_size(size, hash_estimate_size(rc_nblocks(),
+											 sizeof(ChResultCacheEntry)));
+	RequestAddinShmemSpace(size);
+	RequestNamedLWLockTranche("pg_clickhouse result cache", 1);
+}
+
+static void
+rc_shmem_startup(void)
+{
+	HASHCTL		ctl;
+	bool		found;
+	int			nblocks = rc_nblocks();
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	rc_shared = ShmemInitStruct("pg_clickhouse result cache",
+								rc_shared_size(), &found);
+	if (!found)
+	{
+		rc_shared->lock = &(GetNamedLWLockTranche("pg_clickhouse result cache"))->lock;
+		rc_shared->nblocks = nblocks;
+		rc_shared->nfree = nblocks;
+		rc_shared->free_block = 0;
+		dlist_init(&rc_shared->lru);
+		for (int i = 0; i < nblocks; i++)
+			rc_shared->next_block[i] = i + 1 < nblocks ? i + 1 : -1;
+	}
+
+	rc_blocks = ShmemInitStruct("pg_clickhouse result cache blocks",
+								mul_size(nblocks, CH_RC_BLOCK_SIZE), &found);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(ChResultCacheKey);
+	ctl.entrysize = sizeof(ChResultCacheEntry);
+	rc_hash = ShmemInitHash("pg_clickhouse result cache hash",
+							nblocks, nblocks,
+							&ctl, HASH_ELEM | HASH_BLOBS);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Returns the size of the largest result the cache stores, or 0 if the
+ * cache is disabled.
+ */
+Size
+chfdw_result_cache_max_size(void)
+{
+	if (rc_shared == NULL)
+		return 0;
+
+	return (Size) (rc_shared->nblocks / 4) * CH_RC_BLOCK_SIZE;
+}
+
+static void
+rc_make_key(const char *key, Size keylen, ChResultCacheKey * hkey)
+{
+	hkey->hash[0] = hash_bytes_extended((const unsigned char *) key, keylen, 0);
+	hkey->hash[1] = hash_bytes_extended((const unsigned char *) key, keylen,
+										UINT64CONST(0x9e3779b97f4a7c15));
+}
+
+/*
+ * Free the blocks of an entry and remove it. Caller must hold the lock
+ * exclusively, and the entry must not be pinned.
+ */
+static void
+rc_remove(ChResultCacheEntry * entry)
+{
+	int			last = entry->first_block;
+
+	while (rc_shared->next_block[last] != -1)
+		last = rc_shared->next_block[last];
+
+	rc_shared->next_block[last] = rc_shared->free_block;
+	rc_shared->free_block = entry->first_block;
+	rc_shared->nfree += entry->nblocks;
+
+	dlist_delete(&entry->lru);
+	hash_search(rc_hash, &entry->key, HASH_REMOVE, NULL);
+}
+
+/*
+ * Copy len bytes between the block chain position *block, *pos and a local
+ * buffer, advancing the position. Copies from src into the blocks if given,
+ * or else from the blocks into dst.
+ */
+static void
+rc_copy(int *block, Size *pos, char *dst, const char *src, Size len)
+{
+	while (len > 0)
+	{
+		char	   *data;
+		Size		n;
+
+		if (*pos == CH_RC_BLOCK_SIZE)
+		{
+			*block = rc_shared->next_block[*block];
+			*pos = 0;
+		}
+
+		data = rc_blocks + (Size) *block * CH_RC_BLOCK_SIZE + *pos;
+		n = Min(len, CH_RC_BLOCK_SIZE - *pos);
+		if (src)
+		{
+			memcpy(data, src, n);
+			src += n;
+		}
+		else
+		{
+			memcpy(dst, data, n);
+			dst += n;
+		}
+		*pos += n;
+		len -= n;
+	}
+}
+
+/*
+ * Look up the result stored under key. Returns a palloc'd copy of it,
+ * storing its size in *len, or NULL if it isn't cached or has expired.
+ */
+char *
+chfdw_result_cache_get(const char *key, Size keylen, Size *len)
+{
+	ChResultCacheKey hkey;
+	ChResultCacheEntry *entry;
+	char	   *stored_key;
+	char	   *data;
+	int			block;
+	Size		pos = 0;
+
+	if (rc_shared == NULL)
+		return NULL;
+
+	rc_make_key(key, keylen, &hkey);
+
+	LWLockAcquire(rc_shared->lock, LW_EXCLUSIVE);
+
+	entry = hash_search(rc_hash, &hkey, HASH_FIND, NULL);
+	if (entry != NULL && !entry->ready)
+		entry = NULL;
+	else if (entry != NULL && entry->expires_at <= GetCurrentTimestamp())
+	{
+		if (entry->pins == 0)
+			rc_remove(entry);
+		entry = NULL;
+	}
+
+	if (entry == NULL || entry->keylen != keylen)
+	{
+		LWLockRelease(rc_shared->lock);
+		return NULL;
+	}
+
+	/* Allocate before pinning, so that an error can't leave a pin behind */
+	stored_key = palloc(keylen);
+	data = palloc(Max(entry->datalen, 1));
+	*len = entry->datalen;
+	block = entry->first_block;
+	dlist_move_head(&rc_shared->lru, &entry->lru);
+	entry->pins++;
+
+	LWLockRelease(rc_shared->lock);
+
+	rc_copy(&block, &pos, stored_key, NULL, keylen);
+	rc_copy(&block, &pos, data, NULL, *len);
+
+	LWLockAcquire(rc_shared->lock, LW_EXCLUSIVE);
+	entry->pins--;
+	LWLockRelease(rc_shared->lock);
+
+	/* Another key with the same hashes */
+	if (memcmp(stored_key, key, keylen) != 0)
+	{
+		pfree(data);
+		data = NULL;
+	}
+	pfree(stored_key);
+
+	return data;
+}
+
+/*
+ * Store len bytes of data under key for ttl seconds, replacing any result
+ * stored under it and evicting the least recently used results to make room.
+ * Does nothing if the result is larger than chfdw_result_cache_max_size(),
+ * or if the result stored under key is pinned, or if pinned results take up
+ * the room needed.
+ */
+void
+chfdw_result_cache_put(const char *key, Size keylen, const char *data,
+					   Size len, int ttl)
+{
+	ChResultCacheKey hkey;
+	ChResultCacheEntry *entry;
+	dlist_node *node;
+	int			nblocks;
+	int			block;
+	Size		pos = 0;
+
+	if (rc_shared == NULL || keylen + len > chfdw_result_cache_max_size())
+		return;
+
+	nblocks = (int) ((keylen + len + CH_RC_BLOCK_SIZE - 1) / CH_RC_BLOCK_SIZE);
+	rc_make_key(key, keylen, &hkey);
+
+	LWLockAcquire(rc_shared->lock, LW_EXCLUSIVE);
+
+	/* Another backend is storing or reading the result */
+	entry = hash_search(rc_hash, &hkey, HASH_FIND, NULL);
+	if (entry != NULL && entry->pins > 0)
+	{
+		LWLockRelease(rc_shared->lock);
+		return;
+	}
+	if (entry != NULL)
+		rc_remove(entry);
+
+	/* Evict from the tail of the LRU list, skipping pinned entries */
+	node = rc_shared->lru.head.prev;
+	while (rc_shared->nfree < nblocks && node != &rc_shared->lru.head)
+	{
+		ChResultCacheEntry *victim = dlist_container(ChResultCacheEntry, lru, node);
+
+		node = node->prev;
+		if (victim->pins == 0)
+			rc_remove(victim);
+	}
+
+	/* HASH_ENTER_NULL returns NULL if the hash table is out of memory */
+	entry = NULL;
+	if (rc_shared->nfree >= nblocks)
+		entry = hash_search(rc_hash, &hkey, HASH_ENTER_NULL, NULL);
+	if (entry == NULL)
+	{
+		LWLockRelease(rc_shared->lock);
+		return;
+	}
+
+	/* Take the blocks off the free list */
+	entry->first_block = block = rc_shared->free_block;
+	for (int i = 1; i < nblocks; i++)
+		block = rc_shared->next_block[block];
+	rc_shared->free_block = rc_shared->next_block[block];
+	rc_shared->next_block[block] = -1;
+	rc_shared->nfree -= nblocks;
+
+	entry->nblocks = nblocks;
+	entry->keylen = keylen;
+	entry->datalen = len;
+	entry->pins = 1;
+	entry->ready = false;
+
+	LWLockRelease(rc_shared->lock);
+
+	block = entry->first_block;
+	rc_copy(&block, &pos, NULL, key, keylen);
+	rc_copy(&block, &pos, NULL, data, len);
+
+	/* Publish the entry; it joins the LRU list only now, see rc_remove() */
+	LWLockAcquire(rc_shared->lock, LW_EXCLUSIVE);
+	entry->pins = 0;
+	entry->ready = true;
+	entry->expires_at = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+													(int64) ttl * 1000);
+	dlist_push_head(&rc_shared->lru, &entry->lru);
+	LWLockRelease(rc_shared->lock);
+}
@@ -0,0 +1,1337 @@
+/*-------------------------------------------------------------------------
+ *
+ * rowbinary.c
+ *		  RowBinary encoding of results and inserts of the http driver
+ *
+ * The result starts with the number of columns, their names and their
+ * ClickHouse type names, followed by the values of each row in column order,
+ * little-endian and without separators. The type names are parsed into
+ * decoders once, then each value is read straight into the Datum the binary
+ * driver returns for the same type, so that the conversions of convert.c
+ * apply unchanged.
+ *
+ * Inserts use the same type descriptions the other way around, writing each
+ * Datum as the value of its ClickHouse column without formatting it as text.
+ *
+ * Copyright (c) 2025, ClickHouse, Inc.
+ *
+ * IDENTIFICATION
+ *		  github.com/clickhouse/pg_clickhouse/src/rowbinary.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <sys/socket.h>
+
+#include "catalog/pg_type_d.h"
+#include "common/int.h"
+#include "nodes/pg_list.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/date.h"
+#include "utils/inet.h"
+#include "utils/lsyscache.h"
+#include "utils/numeric.h"
+#include "utils/timestamp.h"
+#include "utils/uuid.h"
+
+#include "binary.hh"
+#include "decimal.h"
+#include "rowbinary.h"
+
+typedef enum
+{
+	RB_INT,
+	RB_UINT,
+	RB_FLOAT32,
+	RB_FLOAT64,
+	RB_DECIMAL,
+	RB_STRING,
+	RB_FIXED_STRING,
+	RB_ENUM,
+	RB_DATE,
+	RB_DATE32,
+	RB_DATETIME,
+	RB_DATETIME64,
+	RB_UUID,
+	RB_IPV4,
+	RB_IPV6,
+	RB_NOTHING,
+	RB_NULLABLE,
+	RB_ARRAY,
+	RB_TUPLE
+}			ch_rowbinary_kind;
+
+struct ch_rowbinary_type
+{
+	ch_rowbinary_kind kind;
+	Oid			pgtype;			/* type of the decoded values */
+	int			size;			/* bytes of fixed size values */
+	int			precision;		/* Decimal precision */
+	int			scale;			/* Decimal scale, DateTime64 precision */
+	int			nitems;			/* nested types of Nullable, Array, Tuple */
+	ch_rowbinary_type **items;
+	Oid			array_type;		/* for Array, the array of the item type */
+	int			nenum;			/* Enum names by value */
+	int		   *enum_values;
+	char	  **enum_names;
+};
+
+/* Types without arguments */
+static const struct
+{
+	const char *name;
+	ch_rowbinary_kind kind;
+	Oid			pgtype;
+	int			size;
+}			simple_types[] =
+{
+	{"Int8", RB_INT, INT2OID, 1},
+	{"Int16", RB_INT, INT2OID, 2},
+	{"Int32", RB_INT, INT4OID, 4},
+	{"Int64", RB_INT, INT8OID, 8},
+	{"Int128", RB_INT, NUMERICOID, 16},
+	{"Int256", RB_INT, NUMERICOID, 32},
+	{"UInt8", RB_UINT, INT2OID, 1},
+	{"Bool", RB_UINT, INT2OID, 1},
+	{"UInt16", RB_UINT, INT4OID, 2},
+	{"UInt32", RB_UINT, INT8OID, 4},
+	{"UInt64", RB_UINT, INT8OID, 8},
+	{"UInt128", RB_UINT, NUMERICOID, 16},
+	{"UInt256", RB_UINT, NUMERICOID, 32},
+	{"Float32", RB_FLOAT32, FLOAT4OID, 4},
+	{"Float64", RB_FLOAT64, FLOAT8OID, 8},
+	{"String", RB_STRING, TEXTOID, 0},
+	{"Date", RB_DATE, DATEOID, 2},
+	{"Date32", RB_DATE32, DATEOID, 4},
+	{"DateTime", RB_DATETIME, TIMESTAMPOID, 4},
+	{"UUID", RB_UUID, UUIDOID, 16},
+	{"IPv4", RB_IPV4, INETOID, 4},
+	{"IPv6", RB_IPV6, INETOID, 16},
+	{"Nothing", RB_NOTHING, TEXTOID, 0},
+	{NULL}
+};
+
+/* Microseconds between the Unix and Postgres epochs */
+#define UNIX_EPOCH_USECS \
+	((int64) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * USECS_PER_DAY)
+
+static ch_rowbinary_type * parse_type(const char *typname);
+
+static void
+unsupported_type(const char *typname)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+			 errmsg("pg_clickhouse: unsupported type %s in RowBinary result",
+					typname),
+			 errhint("Set the server option \"format\" to \"tsv\" to fetch this result as text.")));
+}
+
+/*
+ * Returns a copy of len bytes of s without leading and trailing spaces.
+ */
+static char *
+trim_arg(const char *s, size_t len)
+{
+	while (len > 0 && isspace((unsigned char) *s))
+	{
+		s++;
+		len--;
+	}
+	while (len > 0 && isspace((unsigned char) s[len - 1]))
+		len--;
+
+	return pnstrdup(s, len);
+}
+
+/*
+ * Splits the arguments of a type, the text between its outer parentheses,
+ * at the commas outside of nested parentheses and quotes.
+ */
+static List *
+split_type_args(const char *args, size_t len)
+{
+	List	   *res = NIL;
+	int			depth = 0;
+	bool		quoted = false;
+	size_t		start = 0;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		char		c = args[i];
+
+		if (quoted)
+		{
+			if (c == '\\')
+				i++;
+			else if (c == '\'')
+				quoted = false;
+		}
+		else if (c == '\'')
+			quoted = true;
+		else if (c == '(')
+			depth++;
+		else if (c == ')')
+			depth--;
+		else if (c == ',' && depth == 0)
+		{
+			res = lappend(res, trim_arg(args + start, i - start));
+			start = i + 1;
+		}
+	}
+
+	return lappend(res, trim_arg(args + start, len - start));
+}
+
+/*
+ * Parses an integer argument of a type.
+ */
+static int
+type_int_arg(const char *typname, List *args, int n)
+{
+	char	   *end;
+	long		val;
+
+	if (list_length(args) <= n)
+		unsupported_type(typname);
+
+	val = strtol((char *) list_nth(args, n), &end, 10);
+	if (*end != '\0' || val < 0 || val > INT_MAX)
+		unsupported_type(typname);
+
+	return (int) val;
+}
+
+/*
+ * Parses the 'name' = value pairs of an Enum type.
+ */
+static void
+parse_enum(ch_rowbinary_type * type, const char *typname, List *args)
+{
+	ListCell   *lc;
+	int			i = 0;
+
+	type->nenum = list_length(args);
+	type->enum_values = palloc(sizeof(int) * type->nenum);
+	type->enum_names = palloc(sizeof(char *) * type->nenum);
+
+	foreach(lc, args)
+	{
+		const char *arg = (char *) lfirst(lc);
+		StringInfoData name;
+		const char *p = arg;
+
+		if (*p++ != '\'')
+			unsupported_type(typname);
+
+		initStringInfo(&name);
+		while (*p && *p != '\'')
+		{
+			if (*p == '\\' && p[1])
+				p++;
+			appendStringInfoChar(&name, *p++);
+		}
+		if (*p++ != '\'')
+			unsupported_type(typname);
+
+		while (isspace((unsigned char) *p) || *p == '=')
+			p++;
+
+		type->enum_names[i] = name.data;
+		type->enum_values[i] = atoi(p);
+		i++;
+	}
+}
+
+/*
+ * Parses a ClickHouse type name into a decoder for its values.
+ */
+static ch_rowbinary_type *
+parse_type(const char *typname)
+{
+	ch_rowbinary_type *type = palloc0(sizeof(ch_rowbinary_type));
+	const char *paren = strchr(typname, '(');
+	char	   *name;
+	List	   *args = NIL;
+	ListCell   *lc;
+
+	if (paren)
+	{
+		const char *end = strrchr(typname, ')');
+
+		if (end == NULL || end < paren)
+			unsupported_type(typname);
+
+		name = trim_arg(typname, paren - typname);
+		args = split_type_args(paren + 1, end - paren - 1);
+	}
+	else
+		name = trim_arg(typname, strlen(typname));
+
+	if (args == NIL)
+	{
+		for (int i = 0; simple_types[i].name; i++)
+		{
+			if (strcmp(name, simple_types[i].name) == 0)
+			{
+				type->kind = simple_types[i].kind;
+				type->pgtype = simple_types[i].pgtype;
+				type->size = simple_types[i].size;
+				return type;
+			}
+		}
+		unsupported_type(typname);
+	}
+
+	if (strcmp(name, "LowCardinality") == 0)
+		return parse_type((char *) linitial(args));
+	else if (strcmp(name, "SimpleAggregateFunction") == 0 &&
+			 list_length(args) == 2)
+		return parse_type((char *) lsecond(args));
+	else if (strcmp(name, "Nullable") == 0)
+	{
+		type->kind = RB_NULLABLE;
+		type->nitems = 1;
+		type->items = palloc(sizeof(ch_rowbinary_type *));
+		type->items[0] = parse_type((char *) linitial(args));
+		type->pgtype = type->items[0]->pgtype;
+	}
+	else if (strcmp(name, "Array") == 0)
+	{
+		type->kind = RB_ARRAY;
+		type->nitems = 1;
+		type->items = palloc(sizeof(ch_rowbinary_type *));
+		type->items[0] = parse_type((char *) linitial(args));
+		type->pgtype = ANYARRAYOID;
+		type->array_type = get_array_type(type->items[0]->pgtype);
+		if (type->array_type == InvalidOid)
+			unsupported_type(typname);
+	}
+	else if (strcmp(name, "Tuple") == 0)
+	{
+		int			i = 0;
+
+		type->kind = RB_TUPLE;
+		type->pgtype = RECORDOID;
+		type->nitems = list_length(args);
+		type->items = palloc(sizeof(ch_rowbinary_type *) * type->nitems);
+		foreach(lc, args)
+		{
+			char	   *item = (char *) lfirst(lc);
+			char	   *space = strchr(item, ' ');
+			char	   *itemparen = strchr(item, '(');
+
+			/* skip the name of an element of a named tuple */
+			if (space && (itemparen == NULL || space < itemparen))
+				item = space + 1;
+
+			type->items[i++] = parse_type(item);
+		}
+	}
+	else if (strcmp(name, "Decimal") == 0)
+	{
+		type->kind = RB_DECIMAL;
+		type->pgtype = NUMERICOID;
+		type->precision = type_int_arg(typname, args, 0);
+		type->scale = type_int_arg(typname, args, 1);
+		type->size = type->precision <= 9 ? 4 : type->precision <= 18 ? 8 :
+			type->precision <= 38 ? 16 : 32;
+	}
+	else if (strncmp(name, "Decimal", 7) == 0)
+	{
+		type->kind = RB_DECIMAL;
+		type->pgtype = NUMERICOID;
+		type->scale = type_int_arg(typname, args, 0);
+		type->size = atoi(name + 7) / 8;
+		if (type->size != 4 && type->size != 8 && type->size != 16 &&
+			type->size != 32)
+			unsupported_type(typname);
+		type->precision = type->size == 4 ? 9 : type->size == 8 ? 18 :
+			type->size == 16 ? 38 : 76;
+	}
+	else if (strcmp(name, "FixedString") == 0)
+	{
+		type->kind = RB_FIXED_STRING;
+		type->pgtype = TEXTOID;
+		type->size = type_int_arg(typname, args, 0);
+	}
+	else if (strcmp(name, "Enum8") == 0 || strcmp(name, "Enum16") == 0)
+	{
+		type->kind = RB_ENUM;
+		type->pgtype = TEXTOID;
+		type->size = name[4] == '8' ? 1 : 2;
+		parse_enum(type, typname, args);
+	}
+	else if (strcmp(name, "DateTime") == 0)
+	{
+		/* the time zone only affects text output */
+		type->kind = RB_DATETIME;
+		type->pgtype = TIMESTAMPOID;
+		type->size = 4;
+	}
+	else if (strcmp(name, "DateTime64") == 0)
+	{
+		type->kind = RB_DATETIME64;
+		type->pgtype = TIMESTAMPOID;
+		type->size = 8;
+		type->scale = type_int_arg(typname, args, 0);
+		if (type->scale > 18)
+			unsupported_type(typname);
+	}
+	else
+		unsupported_type(typname);
+
+	return type;
+}
+
+/*
+ * Waits until n more bytes of the result are buffered. Marks the result as
+ * truncated and returns false if it ends before that.
+ */
+static inline bool
+need(ch_rowbinary_state * state, size_t n)
+{
+	if (ch_http_read_ensure(state->read, n))
+		return true;
+
+	state->truncated = true;
+	return false;
+}
+
+/*
+ * Points *p at the next n bytes of the result and moves past them.
+ */
+static inline bool
+read_bytes(ch_rowbinary_state * state, size_t n, const unsigned char **p)
+{
+	if (!need(state, n))
+		return false;
+
+	*p = (const unsigned char *) state->read->resp->data + state->read->curpos;
+	state->read->curpos += n;
+	return true;
+}
+
+static bool
+read_varint(ch_rowbinary_state * state, uint64 *res)
+{
+	uint64		val = 0;
+
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		const unsigned char *p;
+
+		if (!read_bytes(state, 1, &p))
+			return false;
+
+		val |= (uint64) (*p & 0x7f) << shift;
+		if ((*p & 0x80) == 0)
+		{
+			*res = val;
+			return true;
+		}
+	}
+
+	ereport(ERROR,
+			(errcode(ERRCODE_FDW_ERROR),
+			 errmsg("pg_clickhouse: invalid length in RowBinary result")));
+	return false;
+}
+
+static bool
+read_string(ch_rowbinary_state * state, const unsigned char **p, size_t *len)
+{
+	uint64		n;
+
+	if (!read_varint(state, &n))
+		return false;
+
+	*len = n;
+	return read_bytes(state, n, p);
+}
+
+/*
+ * Reads an unsigned little-endian integer of size bytes.
+ */
+static inline uint64
+get_uint(const unsigned char *p, int size)
+{
+	uint64		val = 0;
+
+	for (int i = size - 1; i >= 0; i--)
+		val = (val << 8) | p[i];
+
+	return val;
+}
+
+static inline int64
+get_int(const unsigned char *p, int size)
+{
+	uint64		val = get_uint(p, size);
+	int			shift = 64 - 8 * size;
+
+	/* sign-extend */
+	return shift ? (int64) (val << shift) >> shift : (int64) val;
+}
+
+/*
+ * Converts a little-endian integer of size bytes with scale digits after the
+ * point to a numeric.
+ */
+static Datum
+get_decimal(const unsigned char *p, int size, bool is_signed, int scale)
+{
+	uint32		limbs[CH_DECIMAL_MAX_LIMBS];
+	int			nlimbs = size / 4;
+
+	for (int i = 0; i < nlimbs; i++)
+		limbs[i] = (uint32) get_uint(p + 4 * i, 4);
+
+	return ch_decimal_to_numeric(limbs, nlimbs, is_signed, scale);
+}
+
+static inline Datum
+int_datum(Oid pgtype, int64 val)
+{
+	switch (pgtype)
+	{
+		case INT2OID:
+			return Int16GetDatum((int16) val);
+		case INT4OID:
+			return Int32GetDatum((int32) val);
+		default:
+			return Int64GetDatum(val);
+	}
+}
+
+/*
+ * Returns the text of a String or FixedString value up to its first zero
+ * byte, which Postgres text can't hold.
+ */
+static inline Datum
+text_datum(const unsigned char *p, size_t len)
+{
+	return PointerGetDatum(cstring_to_text_with_len((const char *) p,
+													strnlen((const char *) p, len)));
+}
+
+/*
+ * Reads the next value of the given type. Like the binary driver, returns
+ * zero dates and times as NULL.
+ */
+static bool
+read_value(ch_rowbinary_state * state, ch_rowbinary_type * type,
+		   Datum * val, bool *isnull)
+{
+	const unsigned char *p;
+	size_t		len;
+	char		buf[INET6_ADDRSTRLEN];
+
+	*val = (Datum) 0;
+	*isnull = false;
+
+	switch (type->kind)
+	{
+		case RB_NULLABLE:
+			if (!read_bytes(state, 1, &p))
+				return false;
+			if (*p)
+			{
+				*isnull = true;
+				return true;
+			}
+			return read_value(state, type->items[0], val, isnull);
+
+		case RB_NOTHING:
+			*isnull = true;
+			break;
+
+		case RB_INT:
+			if (!read_bytes(state, type->size, &p))
+				return false;
+			if (type->size > 8)
+				*val = get_decimal(p, type->size, true, 0);
+			else
+				*val = int_datum(type->pgtype, get_int(p, type->size));
+			break;
+
+		case RB_UINT:
+			if (!read_bytes(state, type->size, &p))
+				return false;
+			if (type->size > 8)
+				*val = get_decimal(p, type->size, false, 0);
+			else
+			{
+				uint64		u = get_uint(p, type->size);
+
+				/* XXX Consider using, e.g., https://pgxn.org/dist/uint128. */
+				if (u > PG_INT64_MAX)
+					ereport(ERROR,
+							(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+							 errmsg("value " UINT64_FORMAT " is out of range of bigint",
+									u)));
+				*val = int_datum(type->pgtype, (int64) u);
+			}
+			break;
+
+		case RB_FLOAT32:
+			{
+				uint32		bits;
+				float4		f;
+
+				if (!read_bytes(state, 4, &p))
+					return false;
+				bits = (uint32) get_uint(p, 4);
+				memcpy(&f, &bits, sizeof(f));
+				*val = Float4GetDatum(f);
+			}
+			break;
+
+		case RB_FLOAT64:
+			{
+				uint64		bits;
+				float8		f;
+
+				if (!read_bytes(state, 8, &p))
+					return false;
+				bits = get_uint(p, 8);
+				memcpy(&f, &bits, sizeof(f));
+				*val = Float8GetDatum(f);
+			}
+			break;
+
+		case RB_DECIMAL:
+			if (!read_bytes(state, type->size, &p))
+				return false;
+			*val = get_decimal(p, type->size, true, type->scale);
+			break;
+
+		case RB_STRING:
+			if (!read_string(state, &p, &len))
+				return false;
+			*val = text_datum(p, len);
+			break;
+
+		case RB_FIXED_STRING:
+			if (!read_bytes(state, type->size, &p))
+				return false;
+			*val = text_datum(p, type->size);
+			break;
+
+		case RB_ENUM:
+			{
+				int			v;
+
+				if (!read_bytes(state, type->size, &p))
+					return false;
+				v = (int) get_int(p, type->size);
+				for (int i = 0; i < type->nenum; i++)
+				{
+					if (type->enum_values[i] == v)
+					{
+						*val = CStringGetTextDatum(type->enum_names[i]);
+						return true;
+					}
+				}
+				*val = CStringGetTextDatum(psprintf("%d", v));
+			}
+			break;
+
+		case RB_DATE:
+		case RB_DATE32:
+			{
+				int64		days;
+
+				if (!read_bytes(state, type->size, &p))
+					return false;
+				days = type->kind == RB_DATE ? (int64) get_uint(p, 2) : get_int(p, 4);
+				if (days == 0 && type->kind == RB_DATE)
+					*isnull = true;
+				else
+					*val = TimestampGetDatum(days * USECS_PER_DAY - UNIX_EPOCH_USECS);
+			}
+			break;
+
+		case RB_DATETIME:
+			{
+				int64		secs;
+
+				if (!read_bytes(state, 4, &p))
+					return false;
+				secs = (int64) get_uint(p, 4);
+				if (secs == 0)
+					*isnull = true;
+				else
+					*val = TimestampGetDatum(secs * USECS_PER_SEC - UNIX_EPOCH_USECS);
+			}
+			break;
+
+		case RB_DATETIME64:
+			{
+				int64		ticks;
+				int64		usecs;
+
+				if (!read_bytes(state, 8, &p))
+					return false;
+				ticks = get_int(p, 8);
+				if (ticks == 0)
+				{
+					*isnull = true;
+					break;
+				}
+
+				usecs = ticks;
+				for (int i = type->scale; i < 6; i++)
+					usecs *= 10;
+				for (int i = 6; i < type->scale; i++)
+					usecs /= 10;
+				*val = TimestampGetDatum(usecs - UNIX_EPOCH_USECS);
+			}
+			break;
+
+		case RB_UUID:
+			{
+				pg_uuid_t  *uuid = palloc(sizeof(pg_uuid_t));
+
+				/* two little-endian halves, the most significant first */
+				if (!read_bytes(state, 16, &p))
+					return false;
+				for (int i = 0; i < 8; i++)
+				{
+					uuid->data[i] = p[7 - i];
+					uuid->data[8 + i] = p[15 - i];
+				}
+				*val = UUIDPGetDatum(uuid);
+			}
+			break;
+
+		case RB_IPV4:
+			{
+				uint32		addr;
+
+				if (!read_bytes(state, 4, &p))
+					return false;
+				addr = (uint32) get_uint(p, 4);
+				snprintf(buf, sizeof(buf), "%u.%u.%u.%u", addr >> 24,
+						 (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff);
+				*val = DirectFunctionCall1(inet_in, CStringGetDatum(buf));
+			}
+			break;
+
+		case RB_IPV6:
+			{
+				unsigned char addr[16];
+
+				if (!read_bytes(state, 16, &p))
+					return false;
+				memcpy(addr, p, sizeof(addr));
+				inet_ntop(AF_INET6, addr, buf, sizeof(buf));
+				*val = DirectFunctionCall1(inet_in, CStringGetDatum(buf));
+			}
+			break;
+
+		case RB_ARRAY:
+			{
+				ch_binary_array_t *arr = palloc(sizeof(ch_binary_array_t));
+				uint64		n;
+
+				if (!read_varint(state, &n))
+					return false;
+
+				arr->len = n;
+				arr->item_type = type->items[0]->pgtype;
+				arr->array_type = type->array_type;
+				arr->datums = NULL;
+				arr->nulls = NULL;
+				if (n > 0)
+				{
+					arr->datums = palloc(sizeof(Datum) * n);
+					arr->nulls = palloc(sizeof(bool) * n);
+					for (uint64 i = 0; i < n; i++)
+					{
+						if (!read_value(state, type->items[0], &arr->datums[i],
+										&arr->nulls[i]))
+							return false;
+					}
+				}
+				*val = PointerGetDatum(arr);
+			}
+			break;
+
+		case RB_TUPLE:
+			{
+				ch_binary_tuple_t *tup = palloc(sizeof(ch_binary_tuple_t));
+
+				tup->len = type->nitems;
+				tup->datums = palloc(sizeof(Datum) * type->nitems);
+				tup->nulls = palloc(sizeof(bool) * type->nitems);
+				tup->types = palloc(sizeof(Oid) * type->nitems);
+				for (int i = 0; i < type->nitems; i++)
+				{
+					tup->types[i] = type->items[i]->pgtype;
+					if (!read_value(state, type->items[i], &tup->datums[i],
+									&tup->nulls[i]))
+						return false;
+				}
+				*val = PointerGetDatum(tup);
+			}
+			break;
+	}
+
+	return true;
+}
+
+void
+ch_rowbinary_init(ch_rowbinary_state * state, ch_http_read_state * read)
+{
+	memset(state, 0, sizeof(ch_rowbinary_state));
+	state->read = read;
+}
+
+/*
+ * Reads the column names and types that start the result and sets up their
+ * decoders in the current memory context. Returns false if the result is
+ * empty or truncated.
+ */
+bool
+ch_rowbinary_read_header(ch_rowbinary_state * state)
+{
+	uint64		ncolumns;
+	const unsigned char *p;
+	size_t		len;
+
+	if (ch_http_read_eof(state->read) || !read_varint(state, &ncolumns))
+		return false;
+
+	/* the names are not needed, the columns are in the order of the query */
+	for (uint64 i = 0; i < ncolumns; i++)
+	{
+		if (!read_string(state, &p, &len))
+			return false;
+	}
+
+	state->columns = palloc(sizeof(ch_rowbinary_type *) * ncolumns);
+	state->coltypes = palloc(sizeof(Oid) * ncolumns);
+	state->values = palloc(sizeof(Datum) * ncolumns);
+	state->nulls = palloc(sizeof(bool) * ncolumns);
+	for (uint64 i = 0; i < ncolumns; i++)
+	{
+		if (!read_string(state, &p, &len))
+			return false;
+
+		state->columns[i] = parse_type(pnstrdup((const char *) p, len));
+		state->coltypes[i] = state->columns[i]->pgtype;
+	}
+
+	state->columns_count = ncolumns;
+	state->header_read = true;
+	return true;
+}
+
+/*
+ * Decodes the next row into values and nulls. Returns false at the end of the
+ * result, or if it is truncated.
+ */
+bool
+ch_rowbinary_read_row(ch_rowbinary_state * state)
+{
+	Assert(state->header_read);
+
+	if (ch_http_read_eof(state->read))
+		return false;
+
+	for (size_t i = 0; i < state->columns_count; i++)
+	{
+		if (!read_value(state, state->columns[i], &state->values[i],
+						&state->nulls[i]))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Appends an unsigned integer of size bytes, little-endian.
+ */
+static inline void
+put_uint(StringInfo buf, uint64 val, int size)
+{
+	char		bytes[8];
+
+	for (int i = 0; i < size; i++)
+	{
+		bytes[i] = (char) (val & 0xff);
+		val >>= 8;
+	}
+	appendBinaryStringInfo(buf, bytes, size);
+}
+
+static inline void
+put_varint(StringInfo buf, uint64 val)
+{
+	while (val >= 0x80)
+	{
+		appendStringInfoChar(buf, (char) (val | 0x80));
+		val >>= 7;
+	}
+	appendStringInfoChar(buf, (char) val);
+}
+
+static inline void
+put_zeros(StringInfo buf, int n)
+{
+	enlargeStringInfo(buf, n);
+	memset(buf->data + buf->len, 0, n);
+	buf->len += n;
+	buf->data[buf->len] = '\0';
+}
+
+static inline bool
+is_int_type(Oid valtype)
+{
+	return valtype == BOOLOID || valtype == INT2OID || valtype == INT4OID ||
+		valtype == INT8OID;
+}
+
+static inline bool
+is_text_type(Oid valtype)
+{
+	return valtype == TEXTOID || valtype == VARCHAROID || valtype == BPCHAROID;
+}
+
+static inline bool
+is_time_type(Oid valtype)
+{
+	return valtype == DATEOID || valtype == TIMESTAMPOID ||
+		valtype == TIMESTAMPTZOID;
+}
+
+static inline int64
+int_value(Datum val, Oid valtype)
+{
+	switch (valtype)
+	{
+		case BOOLOID:
+			return DatumGetBool(val);
+		case INT2OID:
+			return DatumGetInt16(val);
+		case INT4OID:
+			return DatumGetInt32(val);
+		default:
+			return DatumGetInt64(val);
+	}
+}
+
+/*
+ * Returns the value of a date or timestamp in microseconds since the Unix
+ * epoch. Like the binary driver, timestamps without time zone count as UTC.
+ */
+static int64
+time_value(Datum val, Oid valtype)
+{
+	if (valtype == DATEOID)
+	{
+		DateADT		date = DatumGetDateADT(val);
+
+		if (DATE_NOT_FINITE(date))
+			ereport(ERROR,
+					(errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+					 errmsg("pg_clickhouse: cannot insert infinite date")));
+		return (int64) date * USECS_PER_DAY + UNIX_EPOCH_USECS;
+	}
+
+	if (TIMESTAMP_NOT_FINITE(DatumGetTimestamp(val)))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+				 errmsg("pg_clickhouse: cannot insert infinite timestamp")));
+	return DatumGetTimestamp(val) + UNIX_EPOCH_USECS;
+}
+
+static inline int64
+floor_div(int64 a, int64 b)
+{
+	return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+static void
+out_of_range(const char *typname)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+			 errmsg("pg_clickhouse: value out of range for ClickHouse type %s",
+					typname)));
+}
+
+/*
+ * Appends a numeric as a Decimal of type, rounding off any digits past its
+ * scale.
+ */
+static void
+put_decimal(StringInfo buf, Datum val, const ch_rowbinary_type * type)
+{
+	uint32		limbs[CH_DECIMAL_MAX_LIMBS];
+	int			nlimbs = type->size / 4;
+
+	ch_decimal_from_numeric(DatumGetNumeric(val), type->precision,
+							type->scale, limbs, nlimbs);
+	for (int i = 0; i < nlimbs; i++)
+		put_uint(buf, limbs[i], 4);
+}
+
+/*
+ * Appends an integer as a value of an Int or UInt type.
+ */
+static void
+put_int(StringInfo buf, const ch_rowbinary_type * type, int64 val)
+{
+	bool		is_signed = type->kind == RB_INT;
+	int			bits = type->size * 8;
+
+	if (!is_signed && val < 0)
+		out_of_range(psprintf("UInt%d", bits));
+	if (bits < 64 && (is_signed
+					  ? (val < -((int64) 1 << (bits - 1)) || val >= ((int64) 1 << (bits - 1)))
+					  : val >= ((int64) 1 << bits)))
+		out_of_range(psprintf("%sInt%d", is_signed ? "" : "U", bits));
+
+	put_uint(buf, (uint64) val, Min(type->size, 8));
+
+	/* sign-extend into the wide integers */
+	if (type->size > 8)
+	{
+		enlargeStringInfo(buf, type->size - 8);
+		memset(buf->data + buf->len, val < 0 ? 0xff : 0, type->size - 8);
+		buf->len += type->size - 8;
+		buf->data[buf->len] = '\0';
+	}
+}
+
+/*
+ * Appends a value as a String or FixedString. Text is written as is, other
+ * types as formatted by their output function, like in TabSeparated.
+ */
+static void
+put_string(StringInfo buf, const ch_rowbinary_type * type, Datum val, Oid valtype)
+{
+	const char *data;
+	size_t		len;
+
+	if (is_text_type(valtype))
+	{
+		struct varlena *v = pg_detoast_datum_packed((struct varlena *) DatumGetPointer(val));
+
+		data = VARDATA_ANY(v);
+		len = VARSIZE_ANY_EXHDR(v);
+	}
+	else
+	{
+		Oid			typoutput;
+		bool		isvarlena;
+
+		getTypeOutputInfo(valtype, &typoutput, &isvarlena);
+		data = OidOutputFunctionCall(typoutput, val);
+		len = strlen(data);
+	}
+
+	if (type->kind == RB_FIXED_STRING)
+	{
+		if (len > type->size)
+			ereport(ERROR,
+					(errcode(ERRCODE_STRING_DATA_RIGHT_TRUNCATION),
+					 errmsg("pg_clickhouse: value too long for ClickHouse type FixedString(%d)",
+							type->size)));
+		appendBinaryStringInfo(buf, data, len);
+		put_zeros(buf, type->size - len);
+	}
+	else
+	{
+		put_varint(buf, len);
+		appendBinaryStringInfo(buf, data, len);
+	}
+}
+
+/*
+ * Appends the default value of a type, written for NULL in a column that is
+ * not Nullable.
+ */
+static void
+put_default(StringInfo buf, const ch_rowbinary_type * type)
+{
+	switch (type->kind)
+	{
+		case RB_NULLABLE:
+			appendStringInfoChar(buf, 1);
+			break;
+		case RB_STRING:
+		case RB_ARRAY:
+			put_varint(buf, 0);
+			break;
+		case RB_ENUM:
+			put_uint(buf, (uint64) type->enum_values[0], type->size);
+			break;
+		case RB_TUPLE:
+			for (int i = 0; i < type->nitems; i++)
+				put_default(buf, type->items[i]);
+			break;
+		default:
+			put_zeros(buf, type->size);
+			break;
+	}
+}
+
+/*
+ * Returns whether values of the Postgres type valtype can be written as
+ * values of the given ClickHouse type. Other combinations need the
+ * TabSeparated format, which lets ClickHouse parse the values.
+ */
+bool
+ch_rowbinary_can_write(const ch_rowbinary_type * type, Oid valtype)
+{
+	switch (type->kind)
+	{
+		case RB_NULLABLE:
+			return ch_rowbinary_can_write(type->items[0], valtype);
+		case RB_INT:
+		case RB_UINT:
+			return is_int_type(valtype);
+		case RB_FLOAT32:
+		case RB_FLOAT64:
+			return is_int_type(valtype) || valtype == FLOAT4OID ||
+				valtype == FLOAT8OID || valtype == NUMERICOID;
+		case RB_DECIMAL:
+			return is_int_type(valtype) || valtype == NUMERICOID;
+		case RB_STRING:
+		case RB_FIXED_STRING:
+			return valtype != RECORDOID && get_element_type(valtype) == InvalidOid;
+		case RB_ENUM:
+			return is_text_type(valtype);
+		case RB_DATE:
+		case RB_DATE32:
+		case RB_DATETIME:
+		case RB_DATETIME64:
+			return is_time_type(valtype);
+		case RB_UUID:
+			return valtype == UUIDOID;
+		case RB_IPV4:
+		case RB_IPV6:
+			return valtype == INETOID;
+		case RB_ARRAY:
+			{
+				Oid			elemtype = get_element_type(valtype);
+
+				return elemtype != InvalidOid &&
+					ch_rowbinary_can_write(type->items[0], getBaseType(elemtype));
+			}
+		default:
+			return false;
+	}
+}
+
+/*
+ * Appends the RowBinary encoding of a value of the Postgres type valtype as
+ * a value of the given ClickHouse type, which ch_rowbinary_can_write() must
+ * have accepted. NULL in a column that is not Nullable becomes the default
+ * value of the column, like \N in TabSeparated input.
+ */
+void
+ch_rowbinary_write_value(StringInfo buf, const ch_rowbinary_type * type,
+						 Datum val, Oid valtype, bool isnull)
+{
+	if (type->kind == RB_NULLABLE)
+	{
+		appendStringInfoChar(buf, isnull ? 1 : 0);
+		if (isnull)
+			return;
+		type = type->items[0];
+	}
+	else if (isnull)
+	{
+		put_default(buf, type);
+		return;
+	}
+
+	switch (type->kind)
+	{
+		case RB_INT:
+		case RB_UINT:
+			put_int(buf, type, int_value(val, valtype));
+			break;
+
+		case RB_FLOAT32:
+		case RB_FLOAT64:
+			{
+				float8		d;
+
+				if (valtype == FLOAT4OID)
+					d = DatumGetFloat4(val);
+				else if (valtype == FLOAT8OID)
+					d = DatumGetFloat8(val);
+				else if (valtype == NUMERICOID)
+					d = DatumGetFloat8(DirectFunctionCall1(numeric_float8, val));
+				else
+					d = (float8) int_value(val, valtype);
+
+				if (type->kind == RB_FLOAT32)
+				{
+					float4		f = (float4) d;
+					uint32		bits;
+
+					memcpy(&bits, &f, sizeof(bits));
+					put_uint(buf, bits, 4);
+				}
+				else
+				{
+					uint64		bits;
+
+					memcpy(&bits, &d, sizeof(bits));
+					put_uint(buf, bits, 8);
+				}
+			}
+			break;
+
+		case RB_DECIMAL:
+			if (valtype != NUMERICOID)
+				val = DirectFunctionCall1(int8_numeric,
+										  Int64GetDatum(int_value(val, valtype)));
+			put_decimal(buf, val, type);
+			break;
+
+		case RB_STRING:
+		case RB_FIXED_STRING:
+			put_string(buf, type, val, valtype);
+			break;
+
+		case RB_ENUM:
+			{
+				char	   *name = TextDatumGetCString(val);
+
+				for (int i = 0; i < type->nenum; i++)
+				{
+					if (strcmp(type->enum_names[i], name) == 0)
+					{
+						put_uint(buf, (uint64) type->enum_values[i], type->size);
+						pfree(name);
+						return;
+					}
+				}
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+						 errmsg("pg_clickhouse: invalid value \"%s\" for ClickHouse Enum",
+								name)));
+			}
+			break;
+
+		case RB_DATE:
+		case RB_DATE32:
+			{
+				int64		days = floor_div(time_value(val, valtype), USECS_PER_DAY);
+
+				if (type->kind == RB_DATE ? (days < 0 || days > PG_UINT16_MAX)
+					: (days < PG_INT32_MIN || days > PG_INT32_MAX))
+					out_of_range(type->kind == RB_DATE ? "Date" : "Date32");
+				put_uint(buf, (uint64) days, type->size);
+			}
+			break;
+
+		case RB_DATETIME:
+			{
+				int64		secs = floor_div(time_value(val, valtype), USECS_PER_SEC);
+
+				if (secs < 0 || secs > PG_UINT32_MAX)
+					out_of_range("DateTime");
+				put_uint(buf, (uint64) secs, 4);
+			}
+			break;
+
+		case RB_DATETIME64:
+			{
+				int64		ticks = time_value(val, valtype);
+
+				for (int i = type->scale; i < 6; i++)
+					ticks = floor_div(ticks, 10);
+				for (int i = 6; i < type->scale; i++)
+				{
+					if (pg_mul_s64_overflow(ticks, 10, &ticks))
+						out_of_range("DateTime64");
+				}
+				put_uint(buf, (uint64) ticks, 8);
+			}
+			break;
+
+		case RB_UUID:
+			{
+				pg_uuid_t  *uuid = DatumGetUUIDP(val);
+				char		bytes[16];
+
+				/* two little-endian halves, the most significant first */
+				for (int i = 0; i < 8; i++)
+				{
+					bytes[i] = uuid->data[7 - i];
+					bytes[8 + i] = uuid->data[15 - i];
+				}
+				appendBinaryStringInfo(buf, bytes, sizeof(bytes));
+			}
+			break;
+
+		case RB_IPV4:
+		case RB_IPV6:
+			{
+				inet	   *ip = DatumGetInetPP(val);
+				unsigned char *addr = ip_addr(ip);
+
+				if (ip_family(ip) == PGSQL_AF_INET && type->kind == RB_IPV4)
+					put_uint(buf, ((uint32) addr[0] << 24) | ((uint32) addr[1] << 16) |
+							 ((uint32) addr[2] << 8) | addr[3], 4);
+				else if (ip_family(ip) == PGSQL_AF_INET)
+				{
+					/* an IPv4-mapped IPv6 address */
+					put_zeros(buf, 10);
+					appendBinaryStringInfo(buf, "\xff\xff", 2);
+					appendBinaryStringInfo(buf, (char *) addr, 4);
+				}
+				else if (type->kind == RB_IPV6)
+					appendBinaryStringInfo(buf, (char *) addr, 16);
+				else
+					ereport(ERROR,
+							(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+							 errmsg("pg_clickhouse: cannot insert an IPv6 address into an IPv4 column")));
+			}
+			break;
+
+		case RB_ARRAY:
+			{
+				ArrayType  *arr = DatumGetArrayTypeP(val);
+				Oid			elemtype = ARR_ELEMTYPE(arr);
+				int16		typlen;
+				bool		typbyval;
+				char		typalign;
+				Datum	   *elems;
+				bool	   *nulls;
+				int			nelems;
+
+				if (ARR_NDIM(arr) > 1)
+					ereport(ERROR,
+							(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							 errmsg("pg_clickhouse: cannot insert multidimensional arrays in RowBinary format")));
+
+				get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+				deconstruct_array(arr, elemtype, typlen, typbyval, typalign,
+								  &elems, &nulls, &nelems);
+				elemtype = getBaseType(elemtype);
+
+				put_varint(buf, nelems);
+				for (int i = 0; i < nelems; i++)
+					ch_rowbinary_write_value(buf, type->items[0], elems[i],
+											 elemtype, nulls[i]);
+			}
+			break;
+
+		default:
+			elog(ERROR, "pg_clickhouse: cannot write RowBinary values of type %d",
+				 type->kind);
+	}
+}
@@ -0,0 +1,590 @@
+/*-------------------------------------------------------------------------
+ *
+ * stats.c
+ *		  Shared cache of remote table statistics for pg_clickhouse
+ *
+ * The planner needs the size of ClickHouse tables, but fetching it while
+ * planning adds a round trip per foreign table to every query. When
+ * pg_clickhouse is loaded via shared_preload_libraries, this module keeps the
+ * row counts, column sizes and distinct values of remote tables in shared
+ * memory, keyed by database, server and remote table name.
+ *
+ * Backends only read the cache. A table missing from it is added as an empty
+ * entry and planned without statistics; a background worker per database
+ * fills new entries, refreshes entries older than
+ * pg_clickhouse.stats_cache_ttl and evicts entries no backend has used for
+ * ten times that long. The worker exits once its database has no entries.
+ *
+ * Copyright (c) 2025, ClickHouse, Inc.
+ *
+ * IDENTIFICATION
+ *		  github.com/clickhouse/pg_clickhouse/src/stats.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/table.h"
+#include "access/xact.h"
+#include "catalog/pg_class.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "tcop/tcopprot.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+
+#include "fdw.h"
+
+/* Maximum number of databases with a stats worker at a time */
+#define CH_STATS_MAX_WORKERS 8
+
+/* How often a stats worker looks for entries to fill or refresh */
+#define CH_STATS_NAPTIME_MS 1000L
+
+/* How long a claimed worker slot may wait for its worker to take it over */
+#define CH_STATS_START_TIMEOUT_MS 60000L
+
+typedef struct ChStatsKey
+{
+	Oid			dbid;			/* database of the foreign table */
+	Oid			serverid;		/* foreign server of the table */
+	char		database[NAMEDATALEN];	/* remote database */
+	char		table[NAMEDATALEN]; /* remote table */
+}			ChStatsKey;
+
+typedef struct ChStatsEntry
+{
+	ChStatsKey	key;			/* hash key, must be first */
+	Oid			relid;			/* foreign table to refresh the entry for */
+	bool		valid;			/* has stats been fetched successfully? */
+	TimestampTz fetched_at;		/* last fetch attempt, 0 if never */
+	TimestampTz used_at;		/* last lookup by a backend */
+	ChTableStats stats;
+}			ChStatsEntry;
+
+typedef struct ChStatsWorkerSlot
+{
+	Oid			dbid;			/* database of the worker, or InvalidOid */
+	int			pid;			/* pid of the worker, 0 while starting */
+	uint64		generation;		/* bumped by each claim of the slot */
+	TimestampTz claimed_at;		/* when a backend claimed the slot */
+}			ChStatsWorkerSlot;
+
+typedef struct ChStatsShared
+{
+	LWLock	   *lock;			/* protects the hash table and workers */
+	uint64		generation;		/* of the last claimed worker slot */
+	ChStatsWorkerSlot workers[CH_STATS_MAX_WORKERS];
+}			ChStatsShared;
+
+static ChStatsShared * stats_shared = NULL;
+static HTAB * stats_hash = NULL;
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+PGDLLEXPORT void chfdw_stats_worker_main(Datum main_arg);
+
+static void stats_shmem_request(void);
+static void stats_shmem_startup(void);
+static Size stats_shmem_size(void);
+static void stats_make_key(Relation rel, ChStatsKey * key);
+static int	stats_claim_worker_slot(Oid dbid);
+static void stats_release_worker_slot(Oid dbid, int pid);
+static void stats_start_worker(int slot, uint64 generation);
+static void stats_worker_exit(int code, Datum arg);
+static bool stats_worker_refresh(Oid dbid);
+static void stats_refresh_entry(ChStatsKey * key, Oid relid);
+
+/*
+ * Set up the shared statistics cache. Called by _PG_init(); does nothing
+ * unless pg_clickhouse is being preloaded and the cache is enabled.
+ */
+void
+chfdw_stats_init(void)
+{
+	if (!process_shared_preload_libraries_in_progress ||
+		ch_stats_cache_size <= 0)
+		return;
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = stats_shmem_request;
+#else
+	stats_shmem_request();
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = stats_shmem_startup;
+}
+
+static Size
+stats_shmem_size(void)
+{
+	return add_size(MAXALIGN(sizeof(ChStatsShared)),
+					hash_estimate_size(ch_stats_cache_size,
+									   sizeof(ChStatsEntry)));
+}
+
+static void
+stats_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(stats_shmem_size());
+	RequestNamedLWLockTranche("pg_clickhouse", 1);
+}
+
+static void
+stats_shmem_startup(void)
+{
+	HASHCTL		ctl;
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	stats_shared = ShmemInitStruct("pg_clickhouse stats",
+								   sizeof(ChStatsShared), &found);
+	if (!found)
+	{
+		int			i;
+
+		stats_shared->lock = &(GetNamedLWLockTranche("pg_clickhouse"))->lock;
+		stats_shared->generation = 0;
+		for (i = 0; i < CH_STATS_MAX_WORKERS; i++)
+		{
+			stats_shared->workers[i].dbid = InvalidOid;
+			stats_shared->workers[i].pid = 0;
+			stats_shared->workers[i].generation = 0;
+			stats_shared->workers[i].claimed_at = 0;
+		}
+	}
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(ChStatsKey);
+	ctl.entrysize = sizeof(ChStatsEntry);
+	stats_hash = ShmemInitHash("pg_clickhouse stats hash",
+							   ch_stats_cache_size, ch_stats_cache_size,
+							   &ctl, HASH_ELEM | HASH_BLOBS);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Build the hash key of a foreign table.
+ */
+static void
+stats_make_key(Relation rel, ChStatsKey * key)
+{
+	const char *relname;
+	char	   *dbname;
+
+	memset(key, 0, sizeof(ChStatsKey));
+	chfdw_get_remote_relation_name(rel, &dbname, &relname);
+
+	key->dbid = MyDatabaseId;
+	key->serverid = GetForeignTable(RelationGetRelid(rel))->serverid;
+	strlcpy(key->database, dbname, NAMEDATALEN);
+	strlcpy(key->table, relname, NAMEDATALEN);
+}
+
+/*
+ * Copy the cached statistics of a foreign table into stats and return true,
+ * or return false if they aren't cached yet. In that case the table is added
+ * to the cache for a stats worker to fill in, starting one if needed.
+ *
+ * Planning only reads the cache, under a shared lock. The lock is taken
+ * exclusively to add an entry, to record that the table is still in use
+ * once per pg_clickhouse.stats_cache_ttl, or to claim a worker slot.
+ */
+bool
+chfdw_stats_lookup(Relation rel, ChTableStats * stats)
+{
+	ChStatsKey	key;
+	ChStatsEntry *entry;
+	TimestampTz now;
+	bool		found;
+	bool		valid = false;
+	int			worker_slot = -1;
+	uint64		generation = 0;
+
+	if (stats_hash == NULL)
+		return false;
+
+	stats_make_key(rel, &key);
+	now = GetCurrentTimestamp();
+
+	LWLockAcquire(stats_shared->lock, LW_SHARED);
+
+	entry = hash_search(stats_hash, &key, HASH_FIND, NULL);
+	if (entry != NULL && entry->valid &&
+		entry->relid == RelationGetRelid(rel) &&
+		entry->used_at >= now - (int64) ch_stats_cache_ttl * USECS_PER_SEC)
+	{
+		memcpy(stats, &entry->stats, sizeof(ChTableStats));
+		LWLockRelease(stats_shared->lock);
+		return true;
+	}
+
+	LWLockRelease(stats_shared->lock);
+	LWLockAcquire(stats_shared->lock, LW_EXCLUSIVE);
+
+	/* HASH_ENTER_NULL returns NULL once the cache is full */
+	entry = hash_search(stats_hash, &key, HASH_ENTER_NULL, &found);
+	if (entry != NULL)
+	{
+		if (!found)
+		{
+			entry->valid = false;
+			entry->fetched_at = 0;
+		}
+
+		entry->relid = RelationGetRelid(rel);
+		entry->used_at = now;
+		if (entry->valid)
+		{
+			memcpy(stats, &entry->stats, sizeof(ChTableStats));
+			valid = true;
+		}
+		else
+		{
+			/* Make sure a worker will fill it in */
+			worker_slot = stats_claim_worker_slot(MyDatabaseId);
+			if (worker_slot >= 0)
+				generation = stats_shared->workers[worker_slot].generation;
+		}
+	}
+
+	LWLockRelease(stats_shared->lock);
+
+	if (worker_slot >= 0)
+		stats_start_worker(worker_slot, generation);
+
+	return valid;
+}
+
+/*
+ * Reserve a worker slot for a database, unless it already has one. Returns
+ * the slot the caller should start the worker for, or -1. A slot whose
+ * worker never took it over is claimed again after a while. Caller must
+ * hold the lock exclusively.
+ */
+static int
+stats_claim_worker_slot(Oid dbid)
+{
+	TimestampTz now = GetCurrentTimestamp();
+	int			free_slot = -1;
+	int			i;
+
+	for (i = 0; i < CH_STATS_MAX_WORKERS; i++)
+	{
+		ChStatsWorkerSlot *slot = &stats_shared->workers[i];
+
+		if (slot->dbid == dbid && slot->pid == 0 &&
+			TimestampDifferenceExceeds(slot->claimed_at, now,
+									   CH_STATS_START_TIMEOUT_MS))
+		{
+			free_slot = i;
+			break;
+		}
+		if (slot->dbid == dbid)
+			return -1;
+		if (free_slot < 0 && !OidIsValid(slot->dbid))
+			free_slot = i;
+	}
+
+	if (free_slot < 0)
+		return -1;
+
+	stats_shared->workers[free_slot].dbid = dbid;
+	stats_shared->workers[free_slot].pid = 0;
+	stats_shared->workers[free_slot].generation = ++stats_shared->generation;
+	stats_shared->workers[free_slot].claimed_at = now;
+	return free_slot;
+}
+
+/*
+ * Release the worker slot of a database held by the worker with the given
+ * pid. Caller must hold the lock exclusively.
+ */
+static void
+stats_release_worker_slot(Oid dbid, int pid)
+{
+	int			i;
+
+	for (i = 0; i < CH_STATS_MAX_WORKERS; i++)
+	{
+		if (stats_shared->workers[i].dbid == dbid &&
+			stats_shared->workers[i].pid == pid)
+		{
+			stats_shared->workers[i].dbid = InvalidOid;
+			stats_shared->workers[i].pid = 0;
+		}
+	}
+}
+
+/*
+ * Start the stats worker for the current database, whose slot the caller
+ * has claimed, and wait for it to start. If it can't be registered or stops
+ * before taking over the slot, release the slot, so that a later lookup
+ * tries again rather than the database waiting for a worker forever.
+ */
+static void
+stats_start_worker(int slot, uint64 generation)
+{
+	BackgroundWorker worker;
+	BackgroundWorkerHandle *handle;
+	BgwHandleStatus status = BGWH_STOPPED;
+	pid_t		pid;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_clickhouse");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "chfdw_stats_worker_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN,
+			 "pg_clickhouse stats worker for database %u", MyDatabaseId);
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pg_clickhouse stats worker");
+	worker.bgw_main_arg = ObjectIdGetDatum(MyDatabaseId);
+	worker.bgw_notify_pid = MyProcPid;
+
+	if (RegisterDynamicBackgroundWorker(&worker, &handle))
+		status = WaitForBackgroundWorkerStartup(handle, &pid);
+	else
+		ereport(DEBUG1,
+				(errmsg("pg_clickhouse: could not start stats worker"),
+				 errhint("You might need to increase \"max_worker_processes\".")));
+
+	if (status == BGWH_STARTED)
+		return;
+
+	/* Unless the worker took it over and someone claimed it since */
+	LWLockAcquire(stats_shared->lock, LW_EXCLUSIVE);
+	if (stats_shared->workers[slot].dbid == MyDatabaseId &&
+		stats_shared->workers[slot].pid == 0 &&
+		stats_shared->workers[slot].generation == generation)
+	{
+		stats_shared->workers[slot].dbid = InvalidOid;
+		stats_shared->workers[slot].generation = 0;
+	}
+	LWLockRelease(stats_shared->lock);
+}
+
+static void
+stats_worker_exit(int code, Datum arg)
+{
+	LWLockAcquire(stats_shared->lock, LW_EXCLUSIVE);
+	stats_release_worker_slot(DatumGetObjectId(arg), MyProcPid);
+	LWLockRelease(stats_shared->lock);
+}
+
+/*
+ * Main loop of the stats worker of a database.
+ */
+void
+chfdw_stats_worker_main(Datum main_arg)
+{
+	Oid			dbid = DatumGetObjectId(main_arg);
+	int			i;
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	/* Take over the slot claimed by the backend that started us */
+	LWLockAcquire(stats_shared->lock, LW_EXCLUSIVE);
+	for (i = 0; i < CH_STATS_MAX_WORKERS; i++)
+	{
+		if (stats_shared->workers[i].dbid == dbid &&
+			stats_shared->workers[i].pid == 0)
+			stats_shared->workers[i].pid = MyProcPid;
+	}
+	LWLockRelease(stats_shared->lock);
+
+	before_shmem_exit(stats_worker_exit, ObjectIdGetDatum(dbid));
+	BackgroundWorkerInitializeConnectionByOid(dbid, InvalidOid, 0);
+
+	for (;;)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		if (!stats_worker_refresh(dbid))
+			break;
+
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 CH_STATS_NAPTIME_MS,
+						 PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+	}
+
+	proc_exit(0);
+}
+
+/*
+ * Evict unused entries of a database and fill or refresh stale ones. Returns
+ * false, having released the worker slot, if the database has no entries
+ * left.
+ */
+static bool
+stats_worker_refresh(Oid dbid)
+{
+	HASH_SEQ_STATUS status;
+	ChStatsEntry *entry;
+	TimestampTz now = GetCurrentTimestamp();
+	int64		ttl = (int64) ch_stats_cache_ttl * USECS_PER_SEC;
+	int			nentries = 0;
+	int			nstale = 0;
+	ChStatsKey *stale;
+	Oid		   *relids;
+	int			i;
+
+	stale = palloc(sizeof(ChStatsKey) * ch_stats_cache_size);
+	relids = palloc(sizeof(Oid) * ch_stats_cache_size);
+
+	LWLockAcquire(stats_shared->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&status, stats_hash);
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		if (entry->key.dbid != dbid)
+			continue;
+
+		if (entry->used_at < now - 10 * ttl)
+		{
+			/* Removing the current entry is safe during a scan */
+			hash_search(stats_hash, &entry->key, HASH_REMOVE, NULL);
+			continue;
+		}
+
+		nentries++;
+		if (entry->fetched_at == 0 || entry->fetched_at < now - ttl)
+		{
+			stale[nstale] = entry->key;
+			relids[nstale] = entry->relid;
+			nstale++;
+		}
+	}
+
+	if (nentries == 0)
+		stats_release_worker_slot(dbid, MyProcPid);
+
+	LWLockRelease(stats_shared->lock);
+
+	for (i = 0; i < nstale; i++)
+	{
+		CHECK_FOR_INTERRUPTS();
+		stats_refresh_entry(&stale[i], relids[i]);
+	}
+
+	pfree(stale);
+	pfree(relids);
+
+	return nentries > 0;
+}
+
+/*
+ * Fetch the statistics of an entry from ClickHouse. Entries whose foreign
+ * table is gone, or now points at another remote table, are removed.
+ */
+static void
+stats_refresh_entry(ChStatsKey * key, Oid relid)
+{
+	MemoryContext oldcxt = CurrentMemoryContext;
+	ChTableStats stats;
+	ChStatsEntry *entry;
+	volatile bool fetched = false;
+	volatile bool gone = false;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "fetching ClickHouse table statistics");
+
+	PG_TRY();
+	{
+		Relation	rel = try_table_open(relid, AccessShareLock);
+
+		if (rel == NULL || rel->rd_rel->relkind != RELKIND_FOREIGN_TABLE)
+			gone = true;
+		else
+		{
+			ChStatsKey	current;
+
+			stats_make_key(rel, &current);
+			if (memcmp(&current, key, sizeof(ChStatsKey)) != 0)
+				gone = true;
+			else
+			{
+				ForeignTable *table = GetForeignTable(relid);
+				UserMapping *user = GetUserMapping(rel->rd_rel->relowner,
+												   table->serverid);
+				ch_connection conn = chfdw_get_connection(user);
+
+				chfdw_fetch_table_stats(conn, rel, &stats);
+				chfdw_release_connection(conn);
+				fetched = true;
+			}
+		}
+
+		if (rel != NULL)
+			table_close(rel, AccessShareLock);
+
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+	}
+	PG_CATCH();
+	{
+		/* Report the error and try again after the TTL */
+		MemoryContextSwitchTo(oldcxt);
+		EmitErrorReport();
+		FlushErrorState();
+		AbortCurrentTransaction();
+	}
+	PG_END_TRY();
+
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	LWLockAcquire(stats_shared->lock, LW_EXCLUSIVE);
+	entry = hash_search(stats_hash, key, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		if (gone)
+			hash_search(stats_hash, key, HASH_REMOVE, NULL);
+		else
+		{
+			if (fetched)
+			{
+				memcpy(&entry->stats, &stats, sizeof(ChTableStats));
+				entry->valid = true;
+			}
+			entry->fetched_at = GetCurrentTimestamp();
+		}
+	}
+	LWLockRelease(stats_shared->lock);
+}
@@ -0,0 +1,98 @@
+CREATE SERVER mux_loopback FOREIGN DATA WRAPPER clickhouse_fdw OPTIONS(dbname 'mux_test', driver 'http');
+CREATE USER MAPPING FOR CURRENT_USER SERVER mux_loopback;
+
+SELECT clickhouse_raw_query('DROP DATABASE IF EXISTS mux_test');
+SELECT clickhouse_raw_query('CREATE DATABASE mux_test');
+SELECT clickhouse_raw_query('CREATE TABLE mux_test.numbers (n UInt64) ENGINE = MergeTree ORDER BY n');
+SELECT clickhouse_raw_query('INSERT INTO mux_test.numbers SELECT number FROM numbers(1000)');
+SELECT clickhouse_raw_query('CREATE TABLE mux_test.inserted (n UInt64) ENGINE = MergeTree ORDER BY n');
+SELECT clickhouse_raw_query($$
+    CREATE VIEW mux_test.endless AS
+    SELECT number AS n, repeat('x', 100000) AS s
+      FROM system.numbers WHERE sleepEachRow(0.01) = 0;
+$$);
+
+-- The queries of this test, labeled by their log_comment setting, and the
+-- KILL QUERY statements run since it started.
+SELECT clickhouse_raw_query('CREATE TABLE mux_test.started (t DateTime64(6)) ENGINE = Memory');
+SELECT clickhouse_raw_query('INSERT INTO mux_test.started SELECT now64(6)');
+SELECT clickhouse_raw_query('SYSTEM FLUSH LOGS');
+SELECT clickhouse_raw_query($$
+    CREATE VIEW mux_test.log AS
+    SELECT log_comment AS label, toString(type) AS type,
+           toString(query_kind) AS kind, query_id, port
+      FROM system.query_log
+     WHERE log_comment != '' AND has(databases, 'mux_test')
+       AND event_time_microseconds >= (SELECT min(t) FROM mux_test.started);
+$$);
+SELECT clickhouse_raw_query($$
+    CREATE VIEW mux_test.kills AS
+    SELECT query
+      FROM system.query_log
+     WHERE type = 'QueryFinish' AND query LIKE 'KILL QUERY %'
+       AND event_time_microseconds >= (SELECT min(t) FROM mux_test.started);
+$$);
+
+CREATE FOREIGN TABLE mux_numbers (n bigint) SERVER mux_loopback OPTIONS (table_name 'numbers');
+CREATE FOREIGN TABLE mux_inserted (n bigint) SERVER mux_loopback OPTIONS (table_name 'inserted');
+CREATE FOREIGN TABLE mux_endless (n bigint, s text) SERVER mux_loopback OPTIONS (table_name 'endless');
+CREATE FOREIGN TABLE mux_log (label text, type text, kind text, query_id text, port int) SERVER mux_loopback OPTIONS (table_name 'log');
+CREATE FOREIGN TABLE mux_kills (query text) SERVER mux_loopback OPTIONS (table_name 'kills');
+
+-- Run a query until it returns true, for up to 10 seconds.
+CREATE FUNCTION wait_for(query text) RETURNS boolean
+    LANGUAGE plpgsql AS $$
+DECLARE
+    done boolean;
+BEGIN
+    FOR i IN 1..100 LOOP
+        PERFORM clickhouse_raw_query('SYSTEM FLUSH LOGS');
+        EXECUTE query INTO done;
+        EXIT WHEN done;
+        PERFORM pg_sleep(0.1);
+    END LOOP;
+    RETURN done;
+END
+$$;
+
+SHOW pg_clickhouse.multiplexer_connections;
+SELECT wait_for($$
+    SELECT count(*) = 1 FROM pg_stat_activity
+     WHERE backend_type = 'pg_clickhouse multiplexer'
+$$);
+
+-- The scans of two backends share the one connection of the worker, while
+-- each backend inserts over a connection of its own.
+SET pg_clickhouse.session_settings = 'log_comment mux';
+SELECT count(*), sum(n) FROM mux_numbers WHERE random() >= 0;
+INSERT INTO mux_inserted SELECT generate_series(1, 10);
+\c -
+SET pg_clickhouse.session_settings = 'log_comment mux';
+SELECT count(*), sum(n) FROM mux_numbers WHERE random() >= 0;
+INSERT INTO mux_inserted SELECT generate_series(1, 10);
+RESET pg_clickhouse.session_settings;
+SELECT clickhouse_raw_query('SYSTEM FLUSH LOGS');
+SELECT kind, count(*) AS queries, count(DISTINCT port) AS connections
+  FROM mux_log WHERE label = 'mux' AND type = 'QueryFinish'
+ GROUP BY kind ORDER BY kind;
+
+-- Canceling a scan has the worker kill its query.
+SET pg_clickhouse.session_settings = 'log_comment mux_cancel, max_block_size 1';
+SET statement_timeout = '1s';
+SELECT count(*) FROM mux_endless WHERE random() >= 0;
+RESET statement_timeout;
+RESET pg_clickhouse.session_settings;
+SELECT wait_for($$
+    SELECT count(*) > 0 FROM mux_log
+     WHERE label = 'mux_cancel' AND type = 'ExceptionWhileProcessing'
+$$);
+SELECT wait_for($$
+    SELECT count(*) > 0 FROM mux_kills k JOIN mux_log l
+        ON k.query = format('KILL QUERY WHERE query_id=%L ASYNC', l.query_id)
+     WHERE l.label = 'mux_cancel'
+$$);
+
+SELECT clickhouse_raw_query('DROP DATABASE mux_test');
+DROP FUNCTION wait_for(text);
+DROP USER MAPPING FOR CURRENT_USER SERVER mux_loopback;
+DROP SERVER mux_loopback CASCADE;
@@ -0,0 +1,56 @@
+CREATE SERVER rc_loopback FOREIGN DATA WRAPPER clickhouse_fdw OPTIONS(dbname 'rc_test', driver 'binary');
+CREATE USER MAPPING FOR CURRENT_USER SERVER rc_loopback;
+
+SELECT clickhouse_raw_query('DROP DATABASE IF EXISTS rc_test');
+SELECT clickhouse_raw_query('CREATE DATABASE rc_test');
+SELECT clickhouse_raw_query('CREATE TABLE rc_test.t (n UInt64) ENGINE = MergeTree ORDER BY n');
+SELECT clickhouse_raw_query('INSERT INTO rc_test.t SELECT number FROM numbers(100)');
+SELECT clickhouse_raw_query('CREATE TABLE rc_test.big (n UInt64) ENGINE = MergeTree ORDER BY n');
+SELECT clickhouse_raw_query('INSERT INTO rc_test.big SELECT number FROM numbers(100000)');
+
+CREATE FOREIGN TABLE rc_cached (n bigint) SERVER rc_loopback OPTIONS (table_name 't', result_cache_ttl '5s');
+CREATE FOREIGN TABLE rc_uncached (n bigint) SERVER rc_loopback OPTIONS (table_name 't');
+CREATE FOREIGN TABLE rc_big (n bigint) SERVER rc_loopback OPTIONS (table_name 'big', result_cache_ttl '5s');
+
+-- Show how often the scans of a query were answered by the cache.
+CREATE FUNCTION cache_hits(query text) RETURNS SETOF text
+    LANGUAGE plpgsql AS $$
+DECLARE
+    line text;
+BEGIN
+    FOR line IN EXECUTE 'EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF) ' || query LOOP
+        IF line ~ 'Result Cache Hits' THEN
+            RETURN NEXT trim(line);
+        END IF;
+    END LOOP;
+END
+$$;
+
+-- 1MB of 8kB blocks, so results of up to 256kB are cached.
+SHOW pg_clickhouse.result_cache_size;
+SELECT count(*), sum(n) FROM rc_cached;
+SELECT count(*) FROM rc_big WHERE random() >= 0;
+
+-- Change the data behind the cache. Scans of rc_cached return the cached
+-- result, in this backend and in others, until it expires.
+SELECT clickhouse_raw_query('INSERT INTO rc_test.t SELECT number FROM numbers(100, 100)');
+SELECT clickhouse_raw_query('INSERT INTO rc_test.big SELECT number FROM numbers(100000, 1)');
+SELECT count(*), sum(n) FROM rc_cached;
+SELECT count(*), sum(n) FROM rc_uncached;
+\c -
+SELECT count(*), sum(n) FROM rc_cached;
+SELECT cache_hits('SELECT count(*), sum(n) FROM rc_cached');
+
+-- The result of rc_big is too large to cache.
+SELECT count(*) FROM rc_big WHERE random() >= 0;
+SELECT cache_hits('SELECT count(*) FROM rc_big WHERE random() >= 0');
+
+-- Once the result expires, the scan queries ClickHouse again.
+SELECT pg_sleep(5.5);
+SELECT count(*), sum(n) FROM rc_cached;
+SELECT cache_hits('SELECT count(*), sum(n) FROM rc_cached');
+
+SELECT clickhouse_raw_query('DROP DATABASE rc_test');
+DROP FUNCTION cache_hits(text);
+DROP USER MAPPING FOR CURRENT_USER SERVER rc_loopback;
+DROP SERVER rc_loopback CASCADE;
@@ -0,0 +1,65 @@
+CREATE SERVER stats_loopback FOREIGN DATA WRAPPER clickhouse_fdw OPTIONS(dbname 'stats_test', driver 'binary', use_cached_estimate 'true');
+CREATE USER MAPPING FOR CURRENT_USER SERVER stats_loopback;
+
+SELECT clickhouse_raw_query('DROP DATABASE IF EXISTS stats_test');
+SELECT clickhouse_raw_query('CREATE DATABASE stats_test');
+SELECT clickhouse_raw_query('CREATE TABLE stats_test.a (n UInt64) ENGINE = MergeTree ORDER BY n');
+SELECT clickhouse_raw_query('CREATE TABLE stats_test.b (n UInt64) ENGINE = MergeTree ORDER BY n');
+SELECT clickhouse_raw_query('INSERT INTO stats_test.a SELECT number FROM numbers(12345)');
+SELECT clickhouse_raw_query('INSERT INTO stats_test.b SELECT number FROM numbers(6789)');
+
+CREATE FOREIGN TABLE stats_a (n bigint) SERVER stats_loopback OPTIONS (table_name 'a');
+CREATE FOREIGN TABLE stats_b (n bigint) SERVER stats_loopback OPTIONS (table_name 'b');
+CREATE FOREIGN TABLE stats_a2 (n bigint) SERVER stats_loopback OPTIONS (table_name 'a');
+
+-- The number of rows the planner expects a query to return.
+CREATE FUNCTION plan_rows(query text) RETURNS bigint
+    LANGUAGE plpgsql AS $$
+DECLARE
+    plan json;
+BEGIN
+    EXECUTE 'EXPLAIN (FORMAT JSON) ' || query INTO plan;
+    RETURN plan->0->'Plan'->>'Plan Rows';
+END
+$$;
+
+-- Plan a query until its estimate is expected, for up to 30 seconds.
+CREATE FUNCTION wait_rows(query text, expected bigint) RETURNS bigint
+    LANGUAGE plpgsql AS $$
+DECLARE
+    rows bigint;
+BEGIN
+    FOR i IN 1..300 LOOP
+        rows := plan_rows(query);
+        EXIT WHEN rows = expected;
+        PERFORM pg_sleep(0.1);
+    END LOOP;
+    RETURN rows;
+END
+$$;
+
+SHOW pg_clickhouse.stats_cache_size;
+
+-- A table missing from the cache is planned without statistics, and a
+-- worker for the database fetches them.
+SELECT plan_rows('SELECT * FROM stats_a');
+SELECT wait_rows('SELECT * FROM stats_a', 12345);
+SELECT backend_type FROM pg_stat_activity
+ WHERE datname = current_database() AND backend_type LIKE 'pg_clickhouse%';
+
+-- Each remote table has its own entry.
+SELECT wait_rows('SELECT * FROM stats_b', 6789);
+SELECT plan_rows('SELECT * FROM stats_a');
+
+-- Foreign tables of the same remote table share it.
+SELECT plan_rows('SELECT * FROM stats_a2');
+
+-- The worker refreshes entries older than pg_clickhouse.stats_cache_ttl.
+SELECT clickhouse_raw_query('INSERT INTO stats_test.a SELECT number FROM numbers(1000)');
+SELECT wait_rows('SELECT * FROM stats_a', 13345);
+
+SELECT clickhouse_raw_query('DROP DATABASE stats_test');
+DROP FUNCTION wait_rows(text, bigint);
+DROP FUNCTION plan_rows(text);
+DROP USER MAPPING FOR CURRENT_USER SERVER stats_loopback;
+DROP SERVER stats_loopback CASCADE;
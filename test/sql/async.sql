@@ -0,0 +1,57 @@
+CREATE SERVER async_bin_loopback FOREIGN DATA WRAPPER clickhouse_fdw OPTIONS(dbname 'async_test', driver 'binary', async_capable 'true');
+CREATE SERVER async_http_loopback FOREIGN DATA WRAPPER clickhouse_fdw OPTIONS(dbname 'async_test', driver 'http', async_capable 'true');
+CREATE USER MAPPING FOR CURRENT_USER SERVER async_bin_loopback;
+CREATE USER MAPPING FOR CURRENT_USER SERVER async_http_loopback;
+
+SELECT clickhouse_raw_query('DROP DATABASE IF EXISTS async_test');
+SELECT clickhouse_raw_query('CREATE DATABASE async_test');
+SELECT clickhouse_raw_query('CREATE TABLE async_test.a (n Int32) ENGINE = MergeTree ORDER BY n');
+SELECT clickhouse_raw_query('CREATE TABLE async_test.b (n Int32) ENGINE = MergeTree ORDER BY n');
+SELECT clickhouse_raw_query('INSERT INTO async_test.a SELECT number FROM numbers(1000)');
+SELECT clickhouse_raw_query('INSERT INTO async_test.b SELECT number FROM numbers(1000, 1000)');
+
+CREATE FOREIGN TABLE bin_a (n int) SERVER async_bin_loopback OPTIONS (table_name 'a');
+CREATE FOREIGN TABLE bin_b (n int) SERVER async_bin_loopback OPTIONS (table_name 'b');
+CREATE FOREIGN TABLE http_a (n int) SERVER async_http_loopback OPTIONS (table_name 'a');
+CREATE FOREIGN TABLE http_b (n int) SERVER async_http_loopback OPTIONS (table_name 'b');
+
+EXPLAIN (VERBOSE, COSTS OFF)
+SELECT n FROM bin_a UNION ALL SELECT n FROM bin_b;
+SELECT count(*), sum(n) FROM (SELECT n FROM bin_a UNION ALL SELECT n FROM bin_b) t;
+SELECT n FROM (SELECT n FROM bin_a UNION ALL SELECT n FROM bin_b) t WHERE n % 500 = 0 ORDER BY n;
+
+-- Stop before all results have been read, then query again.
+SELECT count(*) FROM (SELECT n FROM bin_a UNION ALL SELECT n FROM bin_b LIMIT 10) t;
+SELECT count(*), sum(n) FROM (SELECT n FROM bin_a UNION ALL SELECT n FROM bin_b) t;
+
+EXPLAIN (VERBOSE, COSTS OFF)
+SELECT n FROM http_a UNION ALL SELECT n FROM http_b;
+SELECT count(*), sum(n) FROM (SELECT n FROM http_a UNION ALL SELECT n FROM http_b) t;
+SELECT n FROM (SELECT n FROM http_a UNION ALL SELECT n FROM http_b) t WHERE n % 500 = 0 ORDER BY n;
+
+-- Stop before all results have been read, then query again.
+SELECT count(*) FROM (SELECT n FROM http_a UNION ALL SELECT n FROM http_b LIMIT 10) t;
+SELECT count(*), sum(n) FROM (SELECT n FROM http_a UNION ALL SELECT n FROM http_b) t;
+
+-- Both drivers under one Append.
+SELECT count(*), sum(n) FROM (SELECT n FROM bin_a UNION ALL SELECT n FROM http_b) t;
+
+-- The table option overrides the server option.
+ALTER FOREIGN TABLE bin_b OPTIONS (ADD async_capable 'false');
+EXPLAIN (VERBOSE, COSTS OFF)
+SELECT n FROM bin_a UNION ALL SELECT n FROM bin_b;
+SELECT count(*), sum(n) FROM (SELECT n FROM bin_a UNION ALL SELECT n FROM bin_b) t;
+
+-- Rows that arrive in many pieces are only produced once complete.
+SELECT clickhouse_raw_query('CREATE TABLE async_test.w (n Int32, s String) ENGINE = MergeTree ORDER BY n');
+SELECT clickhouse_raw_query('INSERT INTO async_test.w SELECT number, repeat(''x'', 200000) FROM numbers(20)');
+CREATE FOREIGN TABLE bin_w (n int, s text) SERVER async_bin_loopback OPTIONS (table_name 'w');
+CREATE FOREIGN TABLE http_w (n int, s text) SERVER async_http_loopback OPTIONS (table_name 'w');
+SELECT count(*), sum(n), sum(length(s)) FROM (SELECT n, s FROM http_w UNION ALL SELECT n, s FROM http_w) t;
+SELECT count(*), sum(n), sum(length(s)) FROM (SELECT n, s FROM http_w UNION ALL SELECT n, s FROM bin_w) t;
+
+SELECT clickhouse_raw_query('DROP DATABASE async_test');
+DROP USER MAPPING FOR CURRENT_USER SERVER async_bin_loopback;
+DROP USER MAPPING FOR CURRENT_USER SERVER async_http_loopback;
+DROP SERVER async_bin_loopback CASCADE;
+DROP SERVER async_http_loopback CASCADE;
@@ -0,0 +1,230 @@
+CREATE SERVER connections_http_loopback FOREIGN DATA WRAPPER clickhouse_fdw OPTIONS(dbname 'connections_test', driver 'http', compression 'gzip');
+CREATE SERVER connections_bin_loopback FOREIGN DATA WRAPPER clickhouse_fdw OPTIONS(dbname 'connections_test', driver 'binary', compression 'lz4', ping_before_query 'false');
+CREATE SERVER connections_log FOREIGN DATA WRAPPER clickhouse_fdw OPTIONS(dbname 'connections_test', driver 'http');
+CREATE USER MAPPING FOR CURRENT_USER SERVER connections_http_loopback;
+CREATE USER MAPPING FOR CURRENT_USER SERVER connections_bin_loopback;
+CREATE USER MAPPING FOR CURRENT_USER SERVER connections_log;
+
+SELECT clickhouse_raw_query('DROP DATABASE IF EXISTS connections_test');
+SELECT clickhouse_raw_query('CREATE DATABASE connections_test');
+SELECT clickhouse_raw_query($$
+    CREATE TABLE connections_test.text (n UInt32, s String)
+    ENGINE = MergeTree ORDER BY n;
+$$);
+SELECT clickhouse_raw_query($$
+    INSERT INTO connections_test.text SELECT number, repeat(toString(number % 10), 1000) FROM numbers(1000);
+$$);
+SELECT clickhouse_raw_query('CREATE TABLE connections_test.inserted (id Int32, s String) ENGINE = MergeTree ORDER BY id');
+
+-- The queries of this test, labeled by their log_comment setting.
+SELECT clickhouse_raw_query('CREATE TABLE connections_test.started (t DateTime64(6)) ENGINE = Memory');
+SELECT clickhouse_raw_query('INSERT INTO connections_test.started SELECT now64(6)');
+SELECT clickhouse_raw_query('SYSTEM FLUSH LOGS');
+SELECT clickhouse_raw_query($$
+    CREATE VIEW connections_test.log AS
+    SELECT log_comment AS label, toString(query_kind) AS kind,
+           Settings['enable_http_compression'] AS http_compression,
+           ProfileEvents['NetworkSendBytes'] AS sent,
+           ProfileEvents['NetworkReceiveBytes'] AS received,
+           port
+      FROM system.query_log
+     WHERE type = 'QueryFinish' AND log_comment != ''
+       AND has(databases, 'connections_test')
+       AND event_time_microseconds >= (SELECT min(t) FROM connections_test.started);
+$$);
+CREATE FOREIGN TABLE remote_log (
+    label text, kind text, http_compression text, sent bigint, received bigint, port int
+) SERVER connections_log OPTIONS (table_name 'log');
+
+CREATE FOREIGN TABLE http_text (n int, s text) SERVER connections_http_loopback OPTIONS (table_name 'text');
+CREATE FOREIGN TABLE http_inserted (id int, s text) SERVER connections_http_loopback OPTIONS (table_name 'inserted');
+CREATE FOREIGN TABLE bin_text (n int, s text) SERVER connections_bin_loopback OPTIONS (table_name 'text');
+CREATE FOREIGN TABLE bin_inserted (id int, s text) SERVER connections_bin_loopback OPTIONS (table_name 'inserted');
+
+-- Compress http results and INSERT data, or not.
+SET pg_clickhouse.session_settings = 'log_comment http_gzip';
+SELECT count(*), sum(length(s)) FROM http_text WHERE random() >= 0;
+INSERT INTO http_inserted SELECT i, repeat('x', 1000) FROM generate_series(1, 1000) i;
+ALTER SERVER connections_http_loopback OPTIONS (SET compression 'deflate');
+SET pg_clickhouse.session_settings = 'log_comment http_deflate';
+SELECT count(*), sum(length(s)) FROM http_text WHERE random() >= 0;
+INSERT INTO http_inserted SELECT i, repeat('x', 1000) FROM generate_series(1, 1000) i;
+ALTER SERVER connections_http_loopback OPTIONS (SET compression 'none');
+SET pg_clickhouse.session_settings = 'log_comment http_none';
+SELECT count(*), sum(length(s)) FROM http_text WHERE random() >= 0;
+INSERT INTO http_inserted SELECT i, repeat('x', 1000) FROM generate_series(1, 1000) i;
+RESET pg_clickhouse.session_settings;
+SELECT clickhouse_raw_query('SYSTEM FLUSH LOGS');
+SELECT label, kind, max(http_compression) AS http_compression,
+       max(CASE kind WHEN 'Select' THEN sent ELSE received END) < 100000 AS compressed
+  FROM remote_log WHERE label LIKE 'http_%' GROUP BY label, kind ORDER BY label, kind;
+SELECT count(*), sum(length(s)) FROM http_inserted;
+SELECT clickhouse_raw_query('TRUNCATE TABLE connections_test.inserted');
+ALTER SERVER connections_http_loopback OPTIONS (SET compression 'lz4');
+SELECT count(*) FROM http_text;
+ALTER SERVER connections_http_loopback OPTIONS (SET compression 'snappy');
+ALTER SERVER connections_http_loopback OPTIONS (SET compression 'gzip');
+
+-- Compress binary blocks, or not.
+SET pg_clickhouse.session_settings = 'log_comment bin_lz4';
+SELECT count(*), sum(length(s)) FROM bin_text WHERE random() >= 0;
+INSERT INTO bin_inserted SELECT i, repeat('x', 1000) FROM generate_series(1, 1000) i;
+ALTER SERVER connections_bin_loopback OPTIONS (SET compression 'zstd');
+SET pg_clickhouse.session_settings = 'log_comment bin_zstd';
+SELECT count(*), sum(length(s)) FROM bin_text WHERE random() >= 0;
+INSERT INTO bin_inserted SELECT i, repeat('x', 1000) FROM generate_series(1, 1000) i;
+ALTER SERVER connections_bin_loopback OPTIONS (SET compression 'none');
+SET pg_clickhouse.session_settings = 'log_comment bin_none';
+SELECT count(*), sum(length(s)) FROM bin_text WHERE random() >= 0;
+INSERT INTO bin_inserted SELECT i, repeat('x', 1000) FROM generate_series(1, 1000) i;
+RESET pg_clickhouse.session_settings;
+SELECT clickhouse_raw_query('SYSTEM FLUSH LOGS');
+SELECT label, kind, max(http_compression) AS http_compression,
+       max(CASE kind WHEN 'Select' THEN sent ELSE received END) < 100000 AS compressed
+  FROM remote_log WHERE label LIKE 'bin_%' GROUP BY label, kind ORDER BY label, kind;
+SELECT count(*), sum(length(s)) FROM bin_inserted;
+SELECT clickhouse_raw_query('TRUNCATE TABLE connections_test.inserted');
+ALTER SERVER connections_bin_loopback OPTIONS (SET compression 'gzip');
+SELECT count(*) FROM bin_text;
+ALTER SERVER connections_bin_loopback OPTIONS (SET compression 'lz4');
+
+-- Set keepalive and timeouts.
+ALTER SERVER connections_bin_loopback OPTIONS (ADD keepalive 'true', ADD connect_timeout '10', ADD send_timeout '60', ADD receive_timeout '60');
+SELECT count(*), sum(length(s)) FROM bin_text WHERE random() >= 0;
+ALTER SERVER connections_bin_loopback OPTIONS (SET connect_timeout '-1');
+ALTER SERVER connections_bin_loopback OPTIONS (SET keepalive 'maybe');
+ALTER SERVER connections_bin_loopback OPTIONS (SET ping_before_query 'maybe');
+ALTER SERVER connections_bin_loopback OPTIONS (DROP keepalive, DROP connect_timeout, DROP send_timeout, DROP receive_timeout);
+
+-- Run the two scans of a join on connections of their own, then reuse them.
+SET enable_hashjoin = off;
+SET enable_nestloop = off;
+ALTER SERVER connections_bin_loopback OPTIONS (ADD pool_size '2');
+SET pg_clickhouse.session_settings = 'log_comment pool_2';
+SELECT count(*), sum(length(a.s))
+  FROM bin_text a JOIN bin_text b ON a.n = b.n
+ WHERE a.n + random() >= 0 AND b.n + random() >= 0;
+SELECT count(*), sum(length(a.s))
+  FROM bin_text a JOIN bin_text b ON a.n = b.n
+ WHERE a.n + random() >= 0 AND b.n + random() >= 0;
+-- Share a single connection.
+ALTER SERVER connections_bin_loopback OPTIONS (SET pool_size '1');
+SET pg_clickhouse.session_settings = 'log_comment pool_1';
+SELECT count(*), sum(length(a.s))
+  FROM bin_text a JOIN bin_text b ON a.n = b.n
+ WHERE a.n + random() >= 0 AND b.n + random() >= 0;
+SELECT count(*), sum(length(a.s))
+  FROM bin_text a JOIN bin_text b ON a.n = b.n
+ WHERE a.n + random() >= 0 AND b.n + random() >= 0;
+-- Close one of two connections left idle, keeping the other.
+ALTER SERVER connections_bin_loopback OPTIONS (SET pool_size '2', ADD pool_idle_timeout '1');
+SET pg_clickhouse.session_settings = 'log_comment pool_idle';
+SELECT count(*), sum(length(a.s))
+  FROM bin_text a JOIN bin_text b ON a.n = b.n
+ WHERE a.n + random() >= 0 AND b.n + random() >= 0;
+SELECT pg_sleep(1.5);
+SELECT count(*), sum(length(a.s))
+  FROM bin_text a JOIN bin_text b ON a.n = b.n
+ WHERE a.n + random() >= 0 AND b.n + random() >= 0;
+RESET pg_clickhouse.session_settings;
+RESET enable_hashjoin;
+RESET enable_nestloop;
+ALTER SERVER connections_bin_loopback OPTIONS (DROP pool_size, DROP pool_idle_timeout);
+SELECT clickhouse_raw_query('SYSTEM FLUSH LOGS');
+SELECT label, count(*) AS queries, count(DISTINCT port) AS connections
+  FROM remote_log WHERE label LIKE 'pool_%' GROUP BY label ORDER BY label;
+ALTER SERVER connections_http_loopback OPTIONS (ADD pool_size '0');
+ALTER SERVER connections_http_loopback OPTIONS (ADD pool_size '33');
+ALTER SERVER connections_http_loopback OPTIONS (ADD pool_idle_timeout '-1');
+
+-- The multiplexer starts with the server only.
+SHOW pg_clickhouse.multiplexer_connections;
+SET pg_clickhouse.multiplexer_connections = 2;
+
+-- Show how the scans of a query reached their server.
+CREATE FUNCTION explain_remote(query text, pattern text) RETURNS SETOF text
+    LANGUAGE plpgsql AS $$
+DECLARE
+    line text;
+BEGIN
+    FOR line IN EXECUTE 'EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF) ' || query LOOP
+        IF line ~ pattern THEN
+            RETURN NEXT trim(line);
+        END IF;
+    END LOOP;
+END
+$$;
+
+-- Fail over from a host that refuses connections.
+ALTER SERVER connections_http_loopback OPTIONS (ADD host '127.0.0.1:1, localhost:8123');
+SELECT count(*), sum(length(s)) FROM http_text WHERE random() >= 0;
+SELECT explain_remote('SELECT * FROM http_text', 'Remote Host');
+INSERT INTO http_inserted SELECT i, repeat('x', 1000) FROM generate_series(1, 1000) i;
+SELECT count(*), sum(length(s)) FROM http_inserted;
+SELECT clickhouse_raw_query('TRUNCATE TABLE connections_test.inserted');
+ALTER SERVER connections_http_loopback OPTIONS (ADD load_balance 'round_robin');
+SELECT explain_remote('SELECT * FROM http_text', 'Remote Host');
+ALTER SERVER connections_http_loopback OPTIONS (DROP load_balance);
+ALTER SERVER connections_http_loopback OPTIONS (ADD load_balance 'random');
+SELECT explain_remote('SELECT * FROM http_text', 'Remote Host');
+ALTER SERVER connections_http_loopback OPTIONS (DROP load_balance);
+ALTER SERVER connections_http_loopback OPTIONS (ADD load_balance 'least_latency');
+SELECT explain_remote('SELECT * FROM http_text', 'Remote Host');
+ALTER SERVER connections_http_loopback OPTIONS (DROP load_balance);
+ALTER SERVER connections_http_loopback OPTIONS (SET host '[::1]:1,localhost');
+SELECT explain_remote('SELECT * FROM http_text', 'Remote Host');
+ALTER SERVER connections_http_loopback OPTIONS (DROP host);
+
+-- Fail over from a host that refuses connections.
+ALTER SERVER connections_bin_loopback OPTIONS (ADD host '127.0.0.1:1, localhost:9000');
+SELECT count(*), sum(length(s)) FROM bin_text WHERE random() >= 0;
+SELECT explain_remote('SELECT * FROM bin_text', 'Remote Host');
+INSERT INTO bin_inserted SELECT i, repeat('x', 1000) FROM generate_series(1, 1000) i;
+SELECT count(*), sum(length(s)) FROM bin_inserted;
+SELECT clickhouse_raw_query('TRUNCATE TABLE connections_test.inserted');
+ALTER SERVER connections_bin_loopback OPTIONS (ADD load_balance 'round_robin');
+SELECT explain_remote('SELECT * FROM bin_text', 'Remote Host');
+ALTER SERVER connections_bin_loopback OPTIONS (DROP load_balance);
+ALTER SERVER connections_bin_loopback OPTIONS (ADD load_balance 'random');
+SELECT explain_remote('SELECT * FROM bin_text', 'Remote Host');
+ALTER SERVER connections_bin_loopback OPTIONS (DROP load_balance);
+ALTER SERVER connections_bin_loopback OPTIONS (ADD load_balance 'least_latency');
+SELECT explain_remote('SELECT * FROM bin_text', 'Remote Host');
+ALTER SERVER connections_bin_loopback OPTIONS (DROP load_balance);
+ALTER SERVER connections_bin_loopback OPTIONS (SET host '[::1]:1,localhost');
+SELECT explain_remote('SELECT * FROM bin_text', 'Remote Host');
+ALTER SERVER connections_bin_loopback OPTIONS (DROP host);
+ALTER SERVER connections_http_loopback OPTIONS (ADD load_balance 'fastest');
+
+-- Report the protocol the http driver negotiated and the socket options in effect.
+SELECT explain_remote('SELECT * FROM http_text', 'Remote Transport');
+SELECT explain_remote('SELECT * FROM bin_text', 'Remote Transport');
+ALTER SERVER connections_http_loopback OPTIONS (ADD keepalive 'true');
+SELECT explain_remote('SELECT * FROM http_text', 'Remote Transport');
+ALTER SERVER connections_bin_loopback OPTIONS (ADD keepalive 'true');
+SELECT explain_remote('SELECT * FROM bin_text', 'Remote Transport');
+-- HTTP/2 needs TLS, so plain http stays on HTTP/1.1.
+ALTER SERVER connections_http_loopback OPTIONS (ADD http2 'true');
+SELECT explain_remote('SELECT * FROM http_text', 'Remote Transport');
+SELECT count(*), sum(length(s)) FROM http_text WHERE random() >= 0;
+ALTER SERVER connections_http_loopback OPTIONS (DROP http2, DROP keepalive);
+ALTER SERVER connections_bin_loopback OPTIONS (DROP keepalive);
+SELECT explain_remote('SELECT * FROM http_text', 'Remote Transport');
+ALTER SERVER connections_http_loopback OPTIONS (ADD http2 'maybe');
+DROP FUNCTION explain_remote(text, text);
+
+-- Results are cached only with pg_clickhouse preloaded, see test/preload.
+SHOW pg_clickhouse.result_cache_size;
+SET pg_clickhouse.result_cache_size = '1MB';
+ALTER FOREIGN TABLE http_text OPTIONS (ADD result_cache_ttl '10s');
+SELECT count(*), sum(length(s)) FROM http_text WHERE random() >= 0;
+ALTER FOREIGN TABLE http_text OPTIONS (DROP result_cache_ttl);
+ALTER FOREIGN TABLE http_text OPTIONS (ADD result_cache_ttl '-1');
+
+SELECT clickhouse_raw_query('DROP DATABASE connections_test');
+DROP USER MAPPING FOR CURRENT_USER SERVER connections_http_loopback;
+DROP USER MAPPING FOR CURRENT_USER SERVER connections_bin_loopback;
+DROP USER MAPPING FOR CURRENT_USER SERVER connections_log;
+DROP SERVER connections_http_loopback CASCADE;
+DROP SERVER connections_bin_loopback CASCADE;
+DROP SERVER connections_log CASCADE;
@@ -39,8 +39,74 @@ INSERT INTO dec_http.decimals VALUES
 SELECT * FROM dec_bin.decimals ORDER BY id;
 SELECT * FROM dec_http.decimals ORDER BY id;
 
+-- Read and write Decimals in RowBinary too.
+CREATE SERVER rowbinary_decimal_loopback FOREIGN DATA WRAPPER clickhouse_fdw OPTIONS(dbname 'decimal_test', driver 'http', format 'rowbinary');
+CREATE USER MAPPING FOR CURRENT_USER SERVER rowbinary_decimal_loopback;
+CREATE SCHEMA dec_rb;
+CREATE FOREIGN TABLE dec_rb.decimals (id int, dec numeric, dec32 numeric, dec64 numeric, dec128 numeric)
+    SERVER rowbinary_decimal_loopback OPTIONS (table_name 'decimals');
+SELECT * FROM dec_rb.decimals ORDER BY id;
+
+-- Round to the scale of the column, half away from zero.
+SELECT clickhouse_raw_query($$
+    CREATE TABLE decimal_test.rounding (
+        id     Int32,
+        dec32  Decimal32(2),
+        dec64  Decimal64(4),
+        dec128 Decimal128(10)
+    ) ENGINE = MergeTree ORDER BY id;
+$$);
+CREATE FOREIGN TABLE dec_bin.rounding (id int, dec32 numeric, dec64 numeric, dec128 numeric)
+    SERVER binary_decimal_loopback OPTIONS (table_name 'rounding');
+CREATE FOREIGN TABLE dec_rb.rounding (id int, dec32 numeric, dec64 numeric, dec128 numeric)
+    SERVER rowbinary_decimal_loopback OPTIONS (table_name 'rounding');
+INSERT INTO dec_bin.rounding VALUES
+    (1, 1.005, 0.00005, 1.23456789015),
+    (2, -1.005, -0.00005, -1.23456789015),
+    (3, -0.004, 0.00004, 0.00000000004);
+INSERT INTO dec_rb.rounding VALUES
+    (4, 1.005, 0.00005, 1.23456789015),
+    (5, -1.005, -0.00005, -1.23456789015),
+    (6, -0.004, 0.00004, 0.00000000004);
+SELECT * FROM dec_bin.rounding ORDER BY id;
+SELECT * FROM dec_rb.rounding ORDER BY id;
+INSERT INTO dec_bin.rounding VALUES (7, 10000000, 0, 0);
+INSERT INTO dec_bin.rounding VALUES (7, -10000000, 0, 0);
+INSERT INTO dec_bin.rounding VALUES (7, 9999999.995, 0, 0);
+INSERT INTO dec_bin.rounding VALUES (7, 0, 100000000000000, 0);
+INSERT INTO dec_bin.rounding VALUES (7, 'NaN', 0, 0);
+INSERT INTO dec_rb.rounding VALUES (7, 10000000, 0, 0);
+INSERT INTO dec_rb.rounding VALUES (7, -10000000, 0, 0);
+INSERT INTO dec_rb.rounding VALUES (7, 9999999.995, 0, 0);
+INSERT INTO dec_rb.rounding VALUES (7, 0, 100000000000000, 0);
+INSERT INTO dec_rb.rounding VALUES (7, 'NaN', 0, 0);
+
+-- Decimal256 needs the http driver.
+SELECT clickhouse_raw_query($$
+    CREATE TABLE decimal_test.wide (id Int32, dec256 Decimal256(20))
+    ENGINE = MergeTree ORDER BY id;
+$$);
+SELECT clickhouse_raw_query($$
+    INSERT INTO decimal_test.wide VALUES
+        (1, '12345678901234567890123456789012345678901234567890.12345678901234567891'),
+        (2, '-12345678901234567890123456789012345678901234567890.12345678901234567891');
+$$);
+CREATE FOREIGN TABLE dec_rb.wide (id int, dec256 numeric)
+    SERVER rowbinary_decimal_loopback OPTIONS (table_name 'wide');
+CREATE FOREIGN TABLE dec_http.wide (id int, dec256 numeric)
+    SERVER http_decimal_loopback OPTIONS (table_name 'wide');
+INSERT INTO dec_rb.wide VALUES
+    (3, 0.00000000000000000001),
+    (4, -99999999999999999999999999999999999999999999999999999999.99999999999999999999),
+    (5, 0.000000000000000000005);
+SELECT * FROM dec_rb.wide ORDER BY id;
+SELECT * FROM dec_http.wide ORDER BY id;
+INSERT INTO dec_rb.wide VALUES (6, 1e56);
+
 SELECT clickhouse_raw_query('DROP DATABASE decimal_test');
 DROP USER MAPPING FOR CURRENT_USER SERVER binary_decimal_loopback;
 DROP USER MAPPING FOR CURRENT_USER SERVER http_decimal_loopback;
+DROP USER MAPPING FOR CURRENT_USER SERVER rowbinary_decimal_loopback;
 DROP SERVER binary_decimal_loopback CASCADE;
 DROP SERVER http_decimal_loopback CASCADE;
+DROP SERVER rowbinary_decimal_loopback CASCADE;
@@ -0,0 +1,97 @@
+CREATE SERVER estimates_loopback FOREIGN DATA WRAPPER clickhouse_fdw OPTIONS(dbname 'estimates_test', driver 'binary');
+CREATE USER MAPPING FOR CURRENT_USER SERVER estimates_loopback;
+
+SELECT clickhouse_raw_query('DROP DATABASE IF EXISTS estimates_test');
+SELECT clickhouse_raw_query('CREATE DATABASE estimates_test');
+SELECT clickhouse_raw_query($$
+    CREATE TABLE estimates_test.numbers (n UInt64, s String)
+    ENGINE = MergeTree ORDER BY n;
+$$);
+SELECT clickhouse_raw_query($$
+    INSERT INTO estimates_test.numbers SELECT number, toString(number) FROM numbers(10000);
+$$);
+SELECT clickhouse_raw_query($$
+    CREATE TABLE estimates_test.sampled (n UInt32, s String)
+    ENGINE = MergeTree ORDER BY intHash32(n) SAMPLE BY intHash32(n);
+$$);
+SELECT clickhouse_raw_query($$
+    INSERT INTO estimates_test.sampled SELECT number, toString(number) FROM numbers(100000);
+$$);
+SELECT clickhouse_raw_query($$
+    CREATE VIEW estimates_test.numbers_view AS SELECT * FROM estimates_test.numbers;
+$$);
+
+CREATE FOREIGN TABLE est_numbers (
+    n bigint,
+    s text
+) SERVER estimates_loopback OPTIONS (table_name 'numbers');
+CREATE FOREIGN TABLE est_sampled (
+    n bigint,
+    s text
+) SERVER estimates_loopback OPTIONS (table_name 'sampled');
+CREATE FOREIGN TABLE est_view (
+    n bigint,
+    s text
+) SERVER estimates_loopback OPTIONS (table_name 'numbers_view');
+
+-- The number of rows the planner expects a query to return.
+CREATE FUNCTION plan_rows(query text) RETURNS bigint
+    LANGUAGE plpgsql AS $$
+DECLARE
+    plan json;
+BEGIN
+    EXECUTE 'EXPLAIN (FORMAT JSON) ' || query INTO plan;
+    RETURN plan->0->'Plan'->>'Plan Rows';
+END
+$$;
+
+-- Size scans from EXPLAIN ESTIMATE and system.parts.
+ALTER FOREIGN TABLE est_numbers OPTIONS (ADD use_remote_estimate 'true');
+SELECT plan_rows('SELECT * FROM est_numbers');
+-- Only the first granule holds matching rows.
+SELECT plan_rows('SELECT * FROM est_numbers WHERE n < 100');
+-- Conditions the primary key can't prune are estimated locally.
+SELECT plan_rows('SELECT * FROM est_numbers WHERE s = ''17''');
+SELECT count(*), sum(n) FROM est_numbers;
+
+-- The server option applies to its tables.
+ALTER FOREIGN TABLE est_numbers OPTIONS (DROP use_remote_estimate);
+ALTER SERVER estimates_loopback OPTIONS (ADD use_remote_estimate 'true');
+SELECT plan_rows('SELECT * FROM est_numbers');
+ALTER SERVER estimates_loopback OPTIONS (DROP use_remote_estimate);
+ALTER FOREIGN TABLE est_numbers OPTIONS (ADD use_remote_estimate 'maybe');
+
+-- Tables that fit in the sample are read whole.
+ANALYZE est_numbers;
+SELECT reltuples FROM pg_class WHERE relname = 'est_numbers';
+SELECT attname, null_frac, n_distinct FROM pg_stats WHERE tablename = 'est_numbers' ORDER BY attname;
+SELECT plan_rows('SELECT * FROM est_numbers');
+SELECT plan_rows('SELECT * FROM est_numbers WHERE s = ''17''');
+
+-- Larger tables are sampled in ClickHouse.
+ANALYZE est_sampled;
+SELECT reltuples FROM pg_class WHERE relname = 'est_sampled';
+ALTER FOREIGN TABLE est_sampled OPTIONS (ADD analyze_sampling 'random');
+ANALYZE est_sampled;
+SELECT reltuples FROM pg_class WHERE relname = 'est_sampled';
+ALTER FOREIGN TABLE est_sampled OPTIONS (SET analyze_sampling 'off');
+ANALYZE est_sampled;
+SELECT reltuples FROM pg_class WHERE relname = 'est_sampled';
+ALTER FOREIGN TABLE est_sampled OPTIONS (SET analyze_sampling 'sometimes');
+
+-- Views don't report their size, so their rows are counted.
+ANALYZE est_view;
+SELECT reltuples FROM pg_class WHERE relname = 'est_view';
+
+-- Without cached statistics the local ones are used.
+ALTER FOREIGN TABLE est_numbers OPTIONS (ADD use_cached_estimate 'true');
+SELECT plan_rows('SELECT * FROM est_numbers');
+SELECT count(*), sum(n) FROM est_numbers;
+ALTER FOREIGN TABLE est_numbers OPTIONS (SET use_cached_estimate 'maybe');
+ALTER SERVER estimates_loopback OPTIONS (ADD use_cached_estimate 'false');
+SELECT count(*), sum(n) FROM est_numbers;
+
+SELECT clickhouse_raw_query('DROP DATABASE estimates_test');
+DROP FUNCTION plan_rows(text);
+DROP USER MAPPING FOR CURRENT_USER SERVER estimates_loopback;
+DROP SERVER estimates_loopback CASCADE;
@@ -0,0 +1,156 @@
+CREATE SERVER inserts_bin_loopback FOREIGN DATA WRAPPER clickhouse_fdw OPTIONS(dbname 'inserts_test', driver 'binary');
+CREATE SERVER inserts_http_loopback FOREIGN DATA WRAPPER clickhouse_fdw OPTIONS(dbname 'inserts_test', driver 'http');
+CREATE USER MAPPING FOR CURRENT_USER SERVER inserts_bin_loopback;
+CREATE USER MAPPING FOR CURRENT_USER SERVER inserts_http_loopback;
+
+SELECT clickhouse_raw_query('DROP DATABASE IF EXISTS inserts_test');
+SELECT clickhouse_raw_query('CREATE DATABASE inserts_test');
+SELECT clickhouse_raw_query('CREATE TABLE inserts_test.rows (id Int32, s String) ENGINE = MergeTree ORDER BY id');
+SELECT clickhouse_raw_query('CREATE TABLE inserts_test.arrays (id Int32, a Array(Int32)) ENGINE = MergeTree ORDER BY id');
+SELECT clickhouse_raw_query($$
+    CREATE TABLE inserts_test.types (
+        id   Int32,
+        i16  Nullable(Int16),
+        i64  Int64,
+        f32  Float32,
+        f64  Nullable(Float64),
+        b    Bool,
+        d    Date,
+        ts   DateTime64(6),
+        str  Nullable(String),
+        u    UUID,
+        dec  Decimal(12, 4),
+        arr  Array(Nullable(Int32))
+    ) ENGINE = MergeTree ORDER BY id;
+$$);
+
+CREATE FOREIGN TABLE bin_rows (id int, s text) SERVER inserts_bin_loopback OPTIONS (table_name 'rows');
+CREATE FOREIGN TABLE http_rows (id int, s text) SERVER inserts_http_loopback OPTIONS (table_name 'rows');
+CREATE FOREIGN TABLE bin_arrays (id int, a int[]) SERVER inserts_bin_loopback OPTIONS (table_name 'arrays');
+CREATE FOREIGN TABLE http_types (
+    id   int,
+    i16  smallint,
+    i64  bigint,
+    f32  real,
+    f64  double precision,
+    b    boolean,
+    d    date,
+    ts   timestamp,
+    str  text,
+    u    uuid,
+    dec  numeric(12, 4),
+    arr  int[]
+) SERVER inserts_http_loopback OPTIONS (table_name 'types');
+
+-- Send a block every few rows.
+ALTER FOREIGN TABLE bin_rows OPTIONS (ADD insert_block_rows '7');
+INSERT INTO bin_rows SELECT i, 'row ' || i FROM generate_series(1, 1000) i;
+SELECT count(*), sum(id), count(DISTINCT s) FROM bin_rows;
+SELECT clickhouse_raw_query('TRUNCATE TABLE inserts_test.rows');
+
+-- Send a block every few bytes.
+ALTER FOREIGN TABLE bin_rows OPTIONS (DROP insert_block_rows, ADD insert_block_bytes '100');
+INSERT INTO bin_rows SELECT i, 'row ' || i FROM generate_series(1, 1000) i;
+SELECT count(*), sum(id), count(DISTINCT s) FROM bin_rows;
+SELECT clickhouse_raw_query('TRUNCATE TABLE inserts_test.rows');
+
+-- The runtime parameters apply without options.
+ALTER FOREIGN TABLE bin_rows OPTIONS (DROP insert_block_bytes);
+SET pg_clickhouse.insert_block_rows = 3;
+INSERT INTO bin_rows SELECT i, 'row ' || i FROM generate_series(1, 100) i;
+SELECT count(*), sum(id), count(DISTINCT s) FROM bin_rows;
+RESET pg_clickhouse.insert_block_rows;
+SELECT clickhouse_raw_query('TRUNCATE TABLE inserts_test.rows');
+
+-- Send a block every few rows.
+ALTER FOREIGN TABLE http_rows OPTIONS (ADD insert_block_rows '7');
+INSERT INTO http_rows SELECT i, 'row ' || i FROM generate_series(1, 1000) i;
+SELECT count(*), sum(id), count(DISTINCT s) FROM http_rows;
+SELECT clickhouse_raw_query('TRUNCATE TABLE inserts_test.rows');
+
+-- Send a block every few bytes.
+ALTER FOREIGN TABLE http_rows OPTIONS (DROP insert_block_rows, ADD insert_block_bytes '100');
+INSERT INTO http_rows SELECT i, 'row ' || i FROM generate_series(1, 1000) i;
+SELECT count(*), sum(id), count(DISTINCT s) FROM http_rows;
+SELECT clickhouse_raw_query('TRUNCATE TABLE inserts_test.rows');
+
+-- The runtime parameters apply without options.
+ALTER FOREIGN TABLE http_rows OPTIONS (DROP insert_block_bytes);
+SET pg_clickhouse.insert_block_rows = 3;
+INSERT INTO http_rows SELECT i, 'row ' || i FROM generate_series(1, 100) i;
+SELECT count(*), sum(id), count(DISTINCT s) FROM http_rows;
+RESET pg_clickhouse.insert_block_rows;
+SELECT clickhouse_raw_query('TRUNCATE TABLE inserts_test.rows');
+
+-- The server option applies to its tables.
+ALTER SERVER inserts_bin_loopback OPTIONS (ADD insert_block_rows '10');
+INSERT INTO bin_rows SELECT i, 'row ' || i FROM generate_series(1, 95) i;
+SELECT count(*), sum(id), count(DISTINCT s) FROM bin_rows;
+ALTER SERVER inserts_bin_loopback OPTIONS (DROP insert_block_rows);
+SELECT clickhouse_raw_query('TRUNCATE TABLE inserts_test.rows');
+
+-- Arrays count towards the block size.
+ALTER FOREIGN TABLE bin_arrays OPTIONS (ADD insert_block_bytes '200');
+INSERT INTO bin_arrays SELECT i, array_fill(i, ARRAY[i % 5]) FROM generate_series(1, 100) i;
+SELECT count(*), sum(cardinality(a)) FROM bin_arrays WHERE random() >= 0;
+
+ALTER FOREIGN TABLE bin_rows OPTIONS (ADD insert_block_rows '-1');
+ALTER FOREIGN TABLE bin_rows OPTIONS (ADD insert_block_bytes '-1');
+
+-- Pass rows to pg_clickhouse in batches.
+ALTER FOREIGN TABLE bin_rows OPTIONS (ADD batch_size '50');
+INSERT INTO bin_rows SELECT i, 'row ' || i FROM generate_series(1, 1000) i;
+SELECT count(*), sum(id), count(DISTINCT s) FROM bin_rows;
+ALTER FOREIGN TABLE bin_rows OPTIONS (ADD insert_block_rows '30');
+SELECT clickhouse_raw_query('TRUNCATE TABLE inserts_test.rows');
+INSERT INTO bin_rows SELECT i, 'row ' || i FROM generate_series(1, 1000) i;
+SELECT count(*), sum(id), count(DISTINCT s) FROM bin_rows;
+ALTER FOREIGN TABLE bin_rows OPTIONS (DROP batch_size, DROP insert_block_rows);
+SELECT clickhouse_raw_query('TRUNCATE TABLE inserts_test.rows');
+
+-- Pass rows to pg_clickhouse in batches.
+ALTER FOREIGN TABLE http_rows OPTIONS (ADD batch_size '50');
+INSERT INTO http_rows SELECT i, 'row ' || i FROM generate_series(1, 1000) i;
+SELECT count(*), sum(id), count(DISTINCT s) FROM http_rows;
+ALTER FOREIGN TABLE http_rows OPTIONS (ADD insert_block_rows '30');
+SELECT clickhouse_raw_query('TRUNCATE TABLE inserts_test.rows');
+INSERT INTO http_rows SELECT i, 'row ' || i FROM generate_series(1, 1000) i;
+SELECT count(*), sum(id), count(DISTINCT s) FROM http_rows;
+ALTER FOREIGN TABLE http_rows OPTIONS (DROP batch_size, DROP insert_block_rows);
+SELECT clickhouse_raw_query('TRUNCATE TABLE inserts_test.rows');
+
+ALTER SERVER inserts_bin_loopback OPTIONS (ADD batch_size '20');
+INSERT INTO bin_rows SELECT i, 'row ' || i FROM generate_series(1, 45) i;
+SELECT count(*), sum(id), count(DISTINCT s) FROM bin_rows;
+ALTER SERVER inserts_bin_loopback OPTIONS (DROP batch_size);
+SELECT clickhouse_raw_query('TRUNCATE TABLE inserts_test.rows');
+ALTER FOREIGN TABLE bin_rows OPTIONS (ADD batch_size '0');
+
+-- Stream a large INSERT in one request.
+ALTER FOREIGN TABLE http_rows OPTIONS (ADD insert_block_rows '0', ADD insert_block_bytes '0');
+INSERT INTO http_rows SELECT i, 'row ' || i FROM generate_series(1, 300000) i;
+SELECT count(*), sum(id), count(DISTINCT s) FROM http_rows;
+ALTER FOREIGN TABLE http_rows OPTIONS (DROP insert_block_rows, DROP insert_block_bytes);
+SELECT clickhouse_raw_query('TRUNCATE TABLE inserts_test.rows');
+
+-- Send INSERT data as RowBinary.
+ALTER SERVER inserts_http_loopback OPTIONS (ADD format 'rowbinary');
+INSERT INTO http_rows SELECT i, 'row ' || i FROM generate_series(1, 1000) i;
+SELECT count(*), sum(id), count(DISTINCT s) FROM http_rows;
+SELECT clickhouse_raw_query('TRUNCATE TABLE inserts_test.rows');
+INSERT INTO http_types VALUES
+    (1, 1, 9223372036854775807, 1.5, 2.25, true, '2025-01-01',
+     '2025-01-01 12:34:56.789012', 'back\slash', 'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11',
+     12345678.1234, '{1,NULL,3}'),
+    (2, NULL, -9223372036854775808, NULL, NULL, false, '2149-06-06',
+     '1970-01-01 00:00:00', NULL, '00000000-0000-0000-0000-000000000000',
+     -0.5, '{}');
+SELECT * FROM http_types ORDER BY id;
+INSERT INTO http_types (id, i64, d) VALUES (3, 0, '1960-01-01');
+ALTER SERVER inserts_http_loopback OPTIONS (DROP format);
+
+SELECT clickhouse_raw_query('DROP DATABASE inserts_test');
+DROP USER MAPPING FOR CURRENT_USER SERVER inserts_bin_loopback;
+DROP USER MAPPING FOR CURRENT_USER SERVER inserts_http_loopback;
+DROP SERVER inserts_bin_loopback CASCADE;
+DROP SERVER inserts_http_loopback CASCADE;
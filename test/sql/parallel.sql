@@ -0,0 +1,89 @@
+CREATE SERVER parallel_loopback FOREIGN DATA WRAPPER clickhouse_fdw OPTIONS(dbname 'parallel_test', driver 'binary');
+CREATE USER MAPPING FOR CURRENT_USER SERVER parallel_loopback;
+
+SELECT clickhouse_raw_query('DROP DATABASE IF EXISTS parallel_test');
+SELECT clickhouse_raw_query('CREATE DATABASE parallel_test');
+SELECT clickhouse_raw_query($$
+    CREATE TABLE parallel_test.numbers (n UInt64, s String)
+    ENGINE = MergeTree ORDER BY n;
+$$);
+SELECT clickhouse_raw_query($$
+    INSERT INTO parallel_test.numbers SELECT number, toString(number) FROM numbers(10000);
+$$);
+
+CREATE FOREIGN TABLE par_numbers (
+    n bigint,
+    s text
+) SERVER parallel_loopback OPTIONS (table_name 'numbers', parallel_key 'n', parallel_workers '2');
+CREATE FOREIGN TABLE serial_numbers (
+    n bigint,
+    s text
+) SERVER parallel_loopback OPTIONS (table_name 'numbers');
+ALTER FOREIGN TABLE par_numbers OPTIONS (SET parallel_workers '-1');
+
+-- A filter that stays local, so that the scan isn't pushed down whole.
+CREATE FUNCTION par_keep(bigint) RETURNS bool
+    LANGUAGE plpgsql IMMUTABLE PARALLEL SAFE
+    AS $$ BEGIN RETURN $1 >= 0; END $$;
+
+-- The parts of a plan that are the same on all PostgreSQL versions.
+CREATE FUNCTION par_plan(query text) RETURNS SETOF text
+    LANGUAGE plpgsql AS $$
+DECLARE
+    line text;
+BEGIN
+    FOR line IN EXECUTE 'EXPLAIN (VERBOSE, COSTS OFF) ' || query LOOP
+        IF line ~ '(Gather|Workers Planned|Foreign Scan|Remote SQL|Remote Slices)' THEN
+            RETURN NEXT regexp_replace(line, '^\s*(->\s*)?', '');
+        END IF;
+    END LOOP;
+END
+$$;
+
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET max_parallel_workers_per_gather = 2;
+
+SELECT par_plan('SELECT count(*), sum(n), min(n), max(n) FROM par_numbers WHERE par_keep(n)');
+SELECT count(*), sum(n), min(n), max(n) FROM par_numbers WHERE par_keep(n);
+
+-- Plan fewer workers.
+ALTER FOREIGN TABLE par_numbers OPTIONS (SET parallel_workers '1');
+SELECT count(*), sum(n), min(n), max(n) FROM par_numbers WHERE par_keep(n);
+
+-- Launch no workers, so that the leader scans every slice.
+SET max_parallel_workers = 0;
+SELECT count(*), sum(n), min(n), max(n) FROM par_numbers WHERE par_keep(n);
+RESET max_parallel_workers;
+
+-- Tables without parallel_key are scanned by the leader only.
+SELECT par_plan('SELECT count(*) FROM serial_numbers WHERE par_keep(n)');
+
+-- Hash several columns, by their quoted remote names.
+ALTER FOREIGN TABLE par_numbers OPTIONS (SET parallel_key 'n, s');
+SELECT count(*), sum(n), min(n), max(n) FROM par_numbers WHERE par_keep(n);
+SELECT clickhouse_raw_query($$
+    CREATE TABLE parallel_test.odd (`Odd Key` UInt64) ENGINE = MergeTree ORDER BY `Odd Key`;
+$$);
+SELECT clickhouse_raw_query('INSERT INTO parallel_test.odd SELECT number FROM numbers(1000)');
+CREATE FOREIGN TABLE par_odd (
+    k bigint OPTIONS (column_name 'Odd Key')
+) SERVER parallel_loopback OPTIONS (table_name 'odd', parallel_key 'k');
+SELECT par_plan('SELECT count(*), sum(k) FROM par_odd WHERE par_keep(k)');
+SELECT count(*), sum(k) FROM par_odd WHERE par_keep(k);
+
+-- parallel_key names columns of the foreign table.
+ALTER FOREIGN TABLE par_numbers OPTIONS (SET parallel_key 'nope');
+SELECT count(*) FROM par_numbers WHERE par_keep(n);
+ALTER FOREIGN TABLE par_numbers OPTIONS (SET parallel_key 'n; DROP TABLE t');
+ALTER FOREIGN TABLE par_numbers OPTIONS (SET parallel_key '');
+
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+RESET max_parallel_workers_per_gather;
+
+SELECT clickhouse_raw_query('DROP DATABASE parallel_test');
+DROP FUNCTION par_keep(bigint);
+DROP FUNCTION par_plan(text);
+DROP USER MAPPING FOR CURRENT_USER SERVER parallel_loopback;
+DROP SERVER parallel_loopback CASCADE;
@@ -0,0 +1,125 @@
+SET datestyle = 'ISO';
+SET timezone = 'UTC';
+CREATE SERVER params_bin_loopback FOREIGN DATA WRAPPER clickhouse_fdw OPTIONS(dbname 'params_test', driver 'binary');
+CREATE SERVER params_http_loopback FOREIGN DATA WRAPPER clickhouse_fdw OPTIONS(dbname 'params_test', driver 'http');
+CREATE USER MAPPING FOR CURRENT_USER SERVER params_bin_loopback;
+CREATE USER MAPPING FOR CURRENT_USER SERVER params_http_loopback;
+
+SELECT clickhouse_raw_query('DROP DATABASE IF EXISTS params_test');
+SELECT clickhouse_raw_query('CREATE DATABASE params_test');
+SELECT clickhouse_raw_query($$
+    CREATE TABLE params_test.rows (
+        id   Int32,
+        s    String,
+        ts   DateTime64(6),
+        tstz DateTime64(6, 'UTC'),
+        d    Date
+    ) ENGINE = MergeTree ORDER BY id;
+$$);
+SELECT clickhouse_raw_query($$
+    INSERT INTO params_test.rows VALUES
+        (1, 'one', '2025-01-01 10:00:00.000001', '2025-01-01 10:00:00.000001', '2025-01-01'),
+        (2, 'two', '2025-01-01 10:00:00.000002', '2025-01-01 10:00:00.000002', '2025-01-02'),
+        (3, 'three', '2025-01-02 00:00:00', '2025-01-02 00:00:00', '2025-01-03'),
+        (4, 'a\tb', '2025-01-03 00:00:00', '2025-01-03 00:00:00', '2025-01-04');
+$$);
+
+CREATE FOREIGN TABLE p_rows (
+    id   int,
+    s    text,
+    ts   timestamp,
+    tstz timestamptz,
+    d    date
+) SERVER params_bin_loopback OPTIONS (table_name 'rows');
+CREATE TABLE p_keys (k int);
+INSERT INTO p_keys VALUES (1), (3), (3), (NULL), (5);
+
+-- The parts of a plan that are the same on all PostgreSQL versions.
+CREATE FUNCTION p_plan(query text) RETURNS SETOF text
+    LANGUAGE plpgsql AS $$
+DECLARE
+    line text;
+BEGIN
+    FOR line IN EXECUTE 'EXPLAIN (VERBOSE, COSTS OFF) ' || query LOOP
+        IF line ~ '(Filter|Remote SQL)' THEN
+            RETURN NEXT regexp_replace(line, '^\s*', '');
+        END IF;
+    END LOOP;
+END
+$$;
+
+-- Send the parameters of generic plans to ClickHouse.
+SET plan_cache_mode = force_generic_plan;
+PREPARE by_id(int) AS SELECT id, s FROM p_rows WHERE id = $1;
+PREPARE by_s(text) AS SELECT id FROM p_rows WHERE s = $1;
+PREPARE by_ts(timestamp) AS SELECT id FROM p_rows WHERE ts = $1;
+PREPARE by_tstz(timestamptz) AS SELECT id FROM p_rows WHERE tstz >= $1 ORDER BY id;
+PREPARE by_d(date) AS SELECT id FROM p_rows WHERE d = $1;
+PREPARE by_num(numeric) AS SELECT id FROM p_rows WHERE id = $1;
+
+SELECT p_plan('EXECUTE by_id(2)');
+EXECUTE by_id(2);
+EXECUTE by_id(5);
+
+SELECT p_plan('EXECUTE by_s(''three'')');
+EXECUTE by_s('three');
+EXECUTE by_s(E'a\tb');
+
+-- Timestamps keep their microseconds.
+SELECT p_plan('EXECUTE by_ts(''2025-01-01 10:00:00.000002'')');
+EXECUTE by_ts('2025-01-01 10:00:00.000002');
+SELECT p_plan('EXECUTE by_tstz(''2025-01-01 11:00:00.000002+01'')');
+EXECUTE by_tstz('2025-01-01 11:00:00.000002+01');
+EXECUTE by_d('2025-01-03');
+
+-- Parameters of other types stay local.
+SELECT p_plan('EXECUTE by_num(1)');
+EXECUTE by_num(1);
+
+-- Rescan for each outer row of a nested loop.
+SET enable_hashjoin = off;
+SET enable_mergejoin = off;
+SELECT k, s FROM p_keys JOIN p_rows ON id = k ORDER BY k;
+SELECT k, id FROM p_keys LEFT JOIN p_rows ON id = k ORDER BY k, id;
+RESET enable_hashjoin;
+RESET enable_mergejoin;
+
+-- Same with the http driver.
+ALTER FOREIGN TABLE p_rows SERVER params_http_loopback;
+
+SELECT p_plan('EXECUTE by_id(2)');
+EXECUTE by_id(2);
+EXECUTE by_id(5);
+
+SELECT p_plan('EXECUTE by_s(''three'')');
+EXECUTE by_s('three');
+EXECUTE by_s(E'a\tb');
+
+-- Timestamps keep their microseconds.
+SELECT p_plan('EXECUTE by_ts(''2025-01-01 10:00:00.000002'')');
+EXECUTE by_ts('2025-01-01 10:00:00.000002');
+SELECT p_plan('EXECUTE by_tstz(''2025-01-01 11:00:00.000002+01'')');
+EXECUTE by_tstz('2025-01-01 11:00:00.000002+01');
+EXECUTE by_d('2025-01-03');
+
+-- Parameters of other types stay local.
+SELECT p_plan('EXECUTE by_num(1)');
+EXECUTE by_num(1);
+
+-- Rescan for each outer row of a nested loop.
+SET enable_hashjoin = off;
+SET enable_mergejoin = off;
+SELECT k, s FROM p_keys JOIN p_rows ON id = k ORDER BY k;
+SELECT k, id FROM p_keys LEFT JOIN p_rows ON id = k ORDER BY k, id;
+RESET enable_hashjoin;
+RESET enable_mergejoin;
+
+DEALLOCATE ALL;
+RESET plan_cache_mode;
+SELECT clickhouse_raw_query('DROP DATABASE params_test');
+DROP TABLE p_keys;
+DROP FUNCTION p_plan(text);
+DROP USER MAPPING FOR CURRENT_USER SERVER params_bin_loopback;
+DROP USER MAPPING FOR CURRENT_USER SERVER params_http_loopback;
+DROP SERVER params_bin_loopback CASCADE;
+DROP SERVER params_http_loopback CASCADE;
@@ -0,0 +1,205 @@
+SET datestyle = 'ISO';
+CREATE SERVER streaming_bin_loopback FOREIGN DATA WRAPPER clickhouse_fdw OPTIONS(dbname 'streaming_test', driver 'binary');
+CREATE SERVER streaming_http_loopback FOREIGN DATA WRAPPER clickhouse_fdw OPTIONS(dbname 'streaming_test', driver 'http');
+CREATE SERVER streaming_rowbinary_loopback FOREIGN DATA WRAPPER clickhouse_fdw OPTIONS(dbname 'streaming_test', driver 'http', format 'rowbinary');
+CREATE USER MAPPING FOR CURRENT_USER SERVER streaming_bin_loopback;
+CREATE USER MAPPING FOR CURRENT_USER SERVER streaming_http_loopback;
+CREATE USER MAPPING FOR CURRENT_USER SERVER streaming_rowbinary_loopback;
+
+SELECT clickhouse_raw_query('DROP DATABASE IF EXISTS streaming_test');
+SELECT clickhouse_raw_query('CREATE DATABASE streaming_test');
+SELECT clickhouse_raw_query($$
+    CREATE TABLE streaming_test.numbers (n UInt64, s String)
+    ENGINE = MergeTree ORDER BY n;
+$$);
+SELECT clickhouse_raw_query($$
+    INSERT INTO streaming_test.numbers SELECT number, toString(number) FROM numbers(200000);
+$$);
+SELECT clickhouse_raw_query($$
+    CREATE TABLE streaming_test.types (
+        id  Int32,
+        i8  Nullable(Int8),
+        u16 UInt16,
+        f32 Float32,
+        f64 Nullable(Float64),
+        d   Date,
+        dt  DateTime,
+        str Nullable(String),
+        lc  LowCardinality(String),
+        arr Array(Int32)
+    ) ENGINE = MergeTree ORDER BY id;
+$$);
+SELECT clickhouse_raw_query($$
+    INSERT INTO streaming_test.types SELECT
+        number,
+        if(number % 3 = 0, NULL, toInt8(number % 100 - 50)),
+        number % 65536,
+        number / 4,
+        if(number % 5 = 0, NULL, number / 8),
+        toDate('2025-01-01') + number % 365,
+        toDateTime('2025-01-01 00:00:00', 'UTC') + number,
+        if(number % 7 = 0, NULL, concat('s', toString(number))),
+        concat('lc', toString(number % 10)),
+        range(number % 4)
+    FROM numbers(150000);
+$$);
+
+CREATE FOREIGN TABLE bin_numbers (
+    n bigint,
+    s text
+) SERVER streaming_bin_loopback OPTIONS (table_name 'numbers');
+CREATE FOREIGN TABLE http_numbers (
+    n bigint,
+    s text
+) SERVER streaming_http_loopback OPTIONS (table_name 'numbers');
+CREATE FOREIGN TABLE bin_types (
+    id  int,
+    i8  smallint,
+    u16 int,
+    f32 real,
+    f64 double precision,
+    d   date,
+    dt  timestamp,
+    str text,
+    lc  text,
+    arr int[]
+) SERVER streaming_bin_loopback OPTIONS (table_name 'types');
+CREATE FOREIGN TABLE rowbinary_numbers (
+    n bigint,
+    s text
+) SERVER streaming_rowbinary_loopback OPTIONS (table_name 'numbers');
+CREATE FOREIGN TABLE rowbinary_types (
+    id  int,
+    i8  smallint,
+    u16 int,
+    f32 real,
+    f64 double precision,
+    d   date,
+    dt  timestamp,
+    str text,
+    lc  text,
+    arr int[]
+) SERVER streaming_rowbinary_loopback OPTIONS (table_name 'types');
+
+-- The result spans many blocks; the volatile filter keeps the aggregates local.
+SELECT count(*), sum(n), count(DISTINCT s) FROM bin_numbers WHERE random() >= 0;
+
+-- Stop reading early, then run another query.
+SELECT n, s FROM bin_numbers WHERE random() >= 0 ORDER BY n LIMIT 3;
+SELECT count(*) FROM bin_numbers;
+
+-- Read two results of the same connection at once.
+SET enable_hashjoin = off;
+SET enable_nestloop = off;
+SELECT count(*), sum(a.n)
+  FROM bin_numbers a JOIN bin_numbers b ON a.n = b.n
+ WHERE a.n + random() >= 0 AND b.n + random() >= 0;
+RESET enable_hashjoin;
+RESET enable_nestloop;
+
+-- Buffer the whole result.
+SET pg_clickhouse.binary_buffer_blocks = 0;
+SELECT count(*), sum(n), count(DISTINCT s) FROM bin_numbers WHERE random() >= 0;
+RESET pg_clickhouse.binary_buffer_blocks;
+
+-- The result spans many blocks; the volatile filter keeps the aggregates local.
+SELECT count(*), sum(n), count(DISTINCT s) FROM http_numbers WHERE random() >= 0;
+
+-- Stop reading early, then run another query.
+SELECT n, s FROM http_numbers WHERE random() >= 0 ORDER BY n LIMIT 3;
+SELECT count(*) FROM http_numbers;
+
+-- Read two results of the same connection at once.
+SET enable_hashjoin = off;
+SET enable_nestloop = off;
+SELECT count(*), sum(a.n)
+  FROM http_numbers a JOIN http_numbers b ON a.n = b.n
+ WHERE a.n + random() >= 0 AND b.n + random() >= 0;
+RESET enable_hashjoin;
+RESET enable_nestloop;
+
+-- Convert every column type of many blocks.
+SELECT count(*), count(i8), sum(i8), sum(u16), sum(f32::float8), count(f64),
+       min(d), max(d), max(dt), count(str), count(DISTINCT lc),
+       sum(cardinality(arr))
+  FROM bin_types WHERE random() >= 0;
+SELECT * FROM bin_types WHERE random() >= 0 ORDER BY id LIMIT 4;
+
+-- The result spans many blocks; the volatile filter keeps the aggregates local.
+SELECT count(*), sum(n), count(DISTINCT s) FROM rowbinary_numbers WHERE random() >= 0;
+
+-- Stop reading early, then run another query.
+SELECT n, s FROM rowbinary_numbers WHERE random() >= 0 ORDER BY n LIMIT 3;
+SELECT count(*) FROM rowbinary_numbers;
+
+-- Read two results of the same connection at once.
+SET enable_hashjoin = off;
+SET enable_nestloop = off;
+SELECT count(*), sum(a.n)
+  FROM rowbinary_numbers a JOIN rowbinary_numbers b ON a.n = b.n
+ WHERE a.n + random() >= 0 AND b.n + random() >= 0;
+RESET enable_hashjoin;
+RESET enable_nestloop;
+
+-- Decode every column type from RowBinary.
+SELECT count(*), count(i8), sum(i8), sum(u16), sum(f32::float8), count(f64),
+       min(d), max(d), max(dt), count(str), count(DISTINCT lc),
+       sum(cardinality(arr))
+  FROM rowbinary_types WHERE random() >= 0;
+SELECT * FROM rowbinary_types WHERE random() >= 0 ORDER BY id LIMIT 4;
+ALTER SERVER streaming_rowbinary_loopback OPTIONS (SET format 'json');
+
+-- Unescape TSV fields, including fields longer than a vector.
+SELECT clickhouse_raw_query('CREATE TABLE streaming_test.escapes (id Int32, s Nullable(String)) ENGINE = MergeTree ORDER BY id');
+SELECT clickhouse_raw_query($$
+    INSERT INTO streaming_test.escapes VALUES
+        (1, ''), (2, NULL), (3, 'tab\there'), (4, 'line\nbreak'),
+        (5, 'back\\slash'), (6, '\\N'), (7, 'cr\rreturn'),
+        (8, repeat('x', 40) || '\t' || repeat('y', 40)),
+        (9, repeat('a\\b\t', 20));
+$$);
+CREATE TABLE expected_escapes (id int, s text);
+INSERT INTO expected_escapes VALUES
+    (1, ''), (2, NULL), (3, E'tab\there'), (4, E'line\nbreak'),
+    (5, E'back\\slash'), (6, E'\\N'), (7, E'cr\rreturn'),
+    (8, repeat('x', 40) || E'\t' || repeat('y', 40)),
+    (9, repeat(E'a\\b\t', 20));
+CREATE FOREIGN TABLE bin_escapes (id int, s text) SERVER streaming_bin_loopback OPTIONS (table_name 'escapes');
+SELECT id, e.s IS NOT DISTINCT FROM f.s AS same FROM expected_escapes e JOIN bin_escapes f USING (id) ORDER BY id;
+CREATE FOREIGN TABLE http_escapes (id int, s text) SERVER streaming_http_loopback OPTIONS (table_name 'escapes');
+SELECT id, e.s IS NOT DISTINCT FROM f.s AS same FROM expected_escapes e JOIN http_escapes f USING (id) ORDER BY id;
+CREATE FOREIGN TABLE rowbinary_escapes (id int, s text) SERVER streaming_rowbinary_loopback OPTIONS (table_name 'escapes');
+SELECT id, e.s IS NOT DISTINCT FROM f.s AS same FROM expected_escapes e JOIN rowbinary_escapes f USING (id) ORDER BY id;
+DROP FOREIGN TABLE bin_escapes, http_escapes, rowbinary_escapes;
+DROP TABLE expected_escapes;
+
+-- System columns come from the materialized tuple.
+SELECT tableoid::regclass, n, s FROM bin_numbers WHERE n < 3 ORDER BY n;
+SELECT count(*) FROM bin_numbers WHERE tableoid = 'bin_numbers'::regclass AND n % 1000 = 0;
+SELECT tableoid::regclass, n, s FROM http_numbers WHERE n < 3 ORDER BY n;
+SELECT count(*) FROM http_numbers WHERE tableoid = 'http_numbers'::regclass AND n % 1000 = 0;
+
+-- Cancel binary scans while blocks stream in, and while none come.
+SELECT clickhouse_raw_query($$
+    CREATE VIEW streaming_test.endless AS SELECT number AS n FROM system.numbers;
+$$);
+SELECT clickhouse_raw_query($$
+    CREATE VIEW streaming_test.slow AS SELECT sum(number) AS n FROM numbers(1000000000000);
+$$);
+CREATE FOREIGN TABLE bin_endless (n bigint) SERVER streaming_bin_loopback OPTIONS (table_name 'endless');
+CREATE FOREIGN TABLE bin_slow (n bigint) SERVER streaming_bin_loopback OPTIONS (table_name 'slow');
+SET statement_timeout = '1s';
+SELECT count(*) FROM bin_endless WHERE random() >= 0;
+SELECT n FROM bin_slow;
+RESET statement_timeout;
+-- The connection is ready for the next query.
+SELECT count(*), sum(n) FROM bin_numbers;
+DROP FOREIGN TABLE bin_endless, bin_slow;
+
+SELECT clickhouse_raw_query('DROP DATABASE streaming_test');
+DROP USER MAPPING FOR CURRENT_USER SERVER streaming_bin_loopback;
+DROP USER MAPPING FOR CURRENT_USER SERVER streaming_http_loopback;
+DROP USER MAPPING FOR CURRENT_USER SERVER streaming_rowbinary_loopback;
+DROP SERVER streaming_bin_loopback CASCADE;
+DROP SERVER streaming_http_loopback CASCADE;
+DROP SERVER streaming_rowbinary_loopback CASCADE;